@@ -1,4 +1,5 @@
 #include "application.h"
+#include "bvh_tuner.h"
 
 #include "dynamic_scene/ambient_light.h"
 #include "dynamic_scene/environment_light.h"
@@ -8,6 +9,12 @@
 #include "dynamic_scene/spot_light.h"
 #include "dynamic_scene/sphere.h"
 #include "dynamic_scene/mesh.h"
+#include "static_scene/object.h"
+#include "static_scene/instance.h"
+#include "misc/startup_profile.h"
+
+#include <memory>
+#include <unordered_map>
 
 using Collada::CameraInfo;
 using Collada::LightInfo;
@@ -18,6 +25,18 @@ using Collada::SphereInfo;
 
 namespace CGL {
 
+// Free the arrays of a polygon mesh that has been converted, leaving an
+// empty mesh behind.
+static void release_polymesh(PolymeshInfo& polymesh) {
+  vector<Vector3D>().swap(polymesh.vertices);
+  vector<Vector3D>().swap(polymesh.normals);
+  vector<Vector2D>().swap(polymesh.texcoords);
+  vector<size_t>().swap(polymesh.polygon_offsets);
+  vector<size_t>().swap(polymesh.vertex_indices);
+  vector<size_t>().swap(polymesh.normal_indices);
+  vector<size_t>().swap(polymesh.texcoord_indices);
+}
+
 Application::Application(AppConfig config, bool gl) {
   gl_window = gl;
   pathtracer = new PathTracer (
@@ -34,14 +53,41 @@ Application::Application(AppConfig config, bool gl) {
     config.pathtracer_direct_hemisphere_sample,
     config.pathtracer_filename,
     config.pathtracer_lensRadius,
-    config.pathtracer_focalDistance
+    config.pathtracer_focalDistance,
+    config.pathtracer_bvh_params,
+    config.pathtracer_device_bvh
   );
+  pathtracer->set_stats_file(config.pathtracer_stats_file);
+  pathtracer->set_cpu_accel(config.pathtracer_cpu_accel);
+  pathtracer->set_stream_trace(config.pathtracer_stream_trace);
+  pathtracer->set_cpu_render(config.pathtracer_cpu_render);
+  pathtracer->set_validate_device_bvh(config.pathtracer_validate_device_bvh);
   filename = config.pathtracer_filename;
+
+  scene = nullptr;
+  staticScene = nullptr;
+  // The device builds its BVH for every render, so there's nothing to cache.
+  cacheFile = config.pathtracer_device_bvh ? "" : config.pathtracer_cache_file;
+  bvhParams = config.pathtracer_bvh_params;
+  instancing = config.pathtracer_instancing;
+  // A render on the CPU needs the host scene the whole way through.
+  lean = config.pathtracer_lean && !gl && !config.pathtracer_cpu_render;
+  pathtracer->set_lean(lean);
+  // A device BVH has no build parameters to tune.
+  tuneBackend = config.pathtracer_device_bvh ? "" : config.pathtracer_tune_backend;
+  pathtracer->set_tuning(tuneBackend);
+  // The C++ traversals want different trees, so each keeps its own tuning.
+  tuningKey = tuneBackend == "cpu" && config.pathtracer_cpu_accel == "bvh4" ?
+              "cpu-bvh4" : tuneBackend;
+  hasCacheKey = false;
+  sceneCache = nullptr;
+  memset(&sceneView, 0, sizeof(sceneView));
 }
 
 Application::~Application() {
 
   delete pathtracer;
+  delete sceneCache;
 
 }
 
@@ -219,9 +265,25 @@ string Application::info() {
 
 void Application::load(SceneInfo* sceneInfo) {
 
+  Misc::StartupStage stage("scene load");
   vector<Collada::Node>& nodes = sceneInfo->nodes;
   vector<DynamicScene::SceneLight *> lights;
   vector<DynamicScene::SceneObject *> objects;
+  vector<StaticScene::SceneLight *> staticLights;
+  vector<StaticScene::SceneObject *> staticObjects;
+  bool render_only = !gl_window;
+
+  // Meshes that are drawn more than once are shared by their instances.
+  vector<size_t> group_of;
+  vector<size_t> group_sizes;
+  if (render_only && instancing) {
+    find_shared_meshes(nodes, group_of, group_sizes);
+  }
+  vector<std::shared_ptr<StaticScene::InstancedMesh>> shared(group_sizes.size());
+  size_t instances = 0;
+  // Polygon meshes of a render only scene are converted after the other
+  // nodes, all at once; these are their nodes and slots in staticObjects.
+  vector<std::pair<size_t, size_t>> meshes;
 
   // save camera position to update camera control later
   CameraInfo *c;
@@ -240,20 +302,41 @@ void Application::load(SceneInfo* sceneInfo) {
         c_pos = (transform * Vector4D(c_pos,1)).to3D();
         c_dir = (transform * Vector4D(c->view_dir,1)).to3D().unit();
         init_camera(*c, transform);
+        sceneView.has_camera = 1;
+        sceneView.h_fov = c->hFov;
+        sceneView.v_fov = c->vFov;
+        sceneView.n_clip = c->nClip;
+        sceneView.f_clip = c->fClip;
         break;
       case Collada::Instance::LIGHT:
       {
-        lights.push_back(
-          init_light(static_cast<LightInfo&>(*instance), transform));
+        DynamicScene::SceneLight *light =
+          init_light(static_cast<LightInfo&>(*instance), transform);
+        if (render_only && light) {
+          staticLights.push_back(light->get_static_light());
+          delete light;
+        } else {
+          lights.push_back(light);
+        }
         break;
       }
       case Collada::Instance::SPHERE:
-        objects.push_back(
-          init_sphere(static_cast<SphereInfo&>(*instance), transform));
+        if (render_only) {
+          staticObjects.push_back(
+            init_static_sphere(static_cast<SphereInfo&>(*instance), transform));
+        } else {
+          objects.push_back(
+            init_sphere(static_cast<SphereInfo&>(*instance), transform));
+        }
         break;
       case Collada::Instance::POLYMESH:
-        objects.push_back(
-          init_polymesh(static_cast<PolymeshInfo&>(*instance), transform));
+        if (render_only) {
+          meshes.push_back(std::make_pair(i, staticObjects.size()));
+          staticObjects.push_back(nullptr);
+        } else {
+          objects.push_back(
+            init_polymesh(static_cast<PolymeshInfo&>(*instance), transform));
+        }
         break;
       case Collada::Instance::MATERIAL:
         init_material(static_cast<MaterialInfo&>(*instance));
@@ -261,9 +344,152 @@ void Application::load(SceneInfo* sceneInfo) {
      }
   }
 
-  scene = new DynamicScene::Scene(objects, lights);
+  // A lean load frees the arrays of each polygon mesh as soon as all the
+  // nodes using it are converted, so that the scene is not held twice.
+  std::unordered_map<PolymeshInfo*, size_t> user_count_of;
+  vector<size_t> user_count(meshes.size());
+  vector<int> users;
+  if (lean) {
+    for (size_t m = 0; m < meshes.size(); m++) {
+      PolymeshInfo *polymesh = static_cast<PolymeshInfo*>(nodes[meshes[m].first].instance);
+      auto entry = user_count_of.emplace(polymesh, users.size());
+      if (entry.second) users.push_back(0);
+      user_count[m] = entry.first->second;
+      users[user_count[m]]++;
+    }
+  }
+  auto converted = [&](size_t m) {
+    if (!lean) return;
+    int left;
+    #pragma omp atomic capture
+    left = --users[user_count[m]];
+    if (left == 0) {
+      release_polymesh(static_cast<PolymeshInfo&>(*nodes[meshes[m].first].instance));
+    }
+  };
+
+  // Shared meshes are built one by one, as their BVH builds are parallel
+  // already; the meshes of single nodes are converted in parallel.
+  for (size_t m = 0; m < meshes.size(); m++) {
+    size_t node = meshes[m].first;
+    size_t group = group_of.empty() ? group_sizes.size() : group_of[node];
+    if (group < group_sizes.size() && group_sizes[group] > 1) {
+      if (!shared[group]) {
+        shared[group] = init_shared_mesh(
+            static_cast<PolymeshInfo&>(*nodes[node].instance));
+      }
+      staticObjects[meshes[m].second] = new StaticScene::InstanceObject(
+          shared[group], nodes[node].transform);
+      instances++;
+      converted(m);
+    }
+  }
+  #pragma omp parallel for schedule(dynamic, 1)
+  for (size_t m = 0; m < meshes.size(); m++) {
+    if (staticObjects[meshes[m].second]) continue;
+    Collada::Node& node = nodes[meshes[m].first];
+    staticObjects[meshes[m].second] = init_static_polymesh(
+        static_cast<PolymeshInfo&>(*node.instance), node.transform);
+    converted(m);
+  }
+  if (instances) {
+    size_t meshes = 0;
+    for (const auto& mesh : shared) meshes += mesh != nullptr;
+    cerr << "[PathTracer] Instancing " << meshes << " shared meshes "
+         << instances << " times" << endl;
+  }
+
+  BBox bbox;
+  if (render_only) {
+    staticScene = new StaticScene::Scene(staticObjects, staticLights);
+    for (StaticScene::SceneObject *obj : staticObjects) {
+      for (StaticScene::Primitive *p : obj->get_primitives()) {
+        bbox.expand(p->get_bbox());
+      }
+    }
+  } else {
+    scene = new DynamicScene::Scene(objects, lights);
+    bbox = scene->get_bbox();
+  }
+
+  for (int i = 0; i < 3; i++) {
+    sceneView.view_dir[i] = c_dir[i];
+    sceneView.bbox_min[i] = bbox.min[i];
+    sceneView.bbox_max[i] = bbox.max[i];
+  }
+  place_cameras(bbox, c_dir);
+
+  // set default draw styles for meshEdit -
+  if (scene) scene->set_draw_styles(&defaultStyle, &hoverStyle, &selectStyle);
+
+}
+
+bool Application::load_from_cache(const string& scene_path) {
+
+  if (cacheFile.empty()) return false;
+  Misc::StartupStage stage("cache open");
+  if (!SceneCache::hash_file(scene_path, &sceneHash)) return false;
+
+  // Parameters tuned in an earlier run are part of the key of the cache
+  // that run wrote.
+  string tuningFile = cacheFile + ".tuning";
+  if (!tuneBackend.empty() &&
+      StaticScene::BVHTuner::load(tuningFile, tuningKey, sceneHash, &bvhParams)) {
+    cerr << "[PathTracer] Using BVH parameters tuned for " << tuningKey
+         << " from " << tuningFile << endl;
+    pathtracer->set_bvh_params(bvhParams);
+    pathtracer->set_tuning("");
+    tuneBackend.clear();
+  }
+  cacheKey = SceneCache::make_key(sceneHash, bvhParams, instancing);
+  hasCacheKey = true;
+
+  sceneCache = new SceneCache();
+  if (!sceneCache->open(cacheFile, cacheKey)) {
+    cerr << "[PathTracer] No up to date scene cache in " << cacheFile << endl;
+    delete sceneCache;
+    sceneCache = nullptr;
+    return false;
+  }
+  cerr << "[PathTracer] Using scene cache " << cacheFile << ": "
+       << sceneCache->primitive_count() << " primitives, "
+       << sceneCache->bvh_count() << " BVH nodes" << endl;
+
+  sceneView = sceneCache->view();
+  if (sceneView.has_camera) {
+    CameraInfo cameraInfo;
+    cameraInfo.hFov = sceneView.h_fov;
+    cameraInfo.vFov = sceneView.v_fov;
+    cameraInfo.nClip = sceneView.n_clip;
+    cameraInfo.fClip = sceneView.f_clip;
+    init_camera(cameraInfo, Matrix4x4::identity());
+  }
+  BBox bbox;
+  if (sceneView.bbox_min[0] <= sceneView.bbox_max[0]) {
+    bbox = BBox(Vector3D(sceneView.bbox_min[0], sceneView.bbox_min[1],
+                         sceneView.bbox_min[2]),
+                Vector3D(sceneView.bbox_max[0], sceneView.bbox_max[1],
+                         sceneView.bbox_max[2]));
+  }
+  place_cameras(bbox, Vector3D(sceneView.view_dir[0], sceneView.view_dir[1],
+                               sceneView.view_dir[2]));
+  return true;
+
+}
+
+void Application::save_scene_cache() {
+  if (sceneCache || !hasCacheKey) return;
+  if (!tuneBackend.empty()) {
+    // Tuned in this run
+    bvhParams = pathtracer->get_bvh_params();
+    StaticScene::BVHTuner::save(cacheFile + ".tuning", tuningKey, sceneHash, bvhParams);
+    cacheKey = SceneCache::make_key(sceneHash, bvhParams, instancing);
+  }
+  pathtracer->save_scene_cache(cacheFile, cacheKey, sceneView);
+}
+
+void Application::place_cameras(const BBox& bbox, const Vector3D& c_dir) {
 
-  const BBox& bbox = scene->get_bbox();
   if (!bbox.empty()) {
 
     Vector3D target = bbox.centroid();
@@ -290,9 +516,6 @@ void Application::load(SceneInfo* sceneInfo) {
     set_scroll_rate();
   }
 
-  // set default draw styles for meshEdit -
-  scene->set_draw_styles(&defaultStyle, &hoverStyle, &selectStyle);
-
 }
 
 void Application::init_camera(CameraInfo& cameraInfo,
@@ -347,6 +570,69 @@ DynamicScene::SceneObject *Application::init_polymesh(
   return new DynamicScene::Mesh(polymesh, transform);
 }
 
+/**
+ * Same as init_sphere and init_polymesh, for scenes that are only rendered.
+ * They make the objects DynamicScene::Sphere::get_static_object and
+ * DynamicScene::Mesh::get_static_object would, with the same defaults.
+ */
+StaticScene::SceneObject *Application::init_static_sphere(
+    SphereInfo& sphere, const Matrix4x4& transform) {
+  const Vector3D& position = (transform * Vector4D(0, 0, 0, 1)).projectTo3D();
+  double scale = (transform * Vector4D(1, 0, 0, 0)).to3D().norm();
+  BSDF *bsdf = sphere.material ? sphere.material->bsdf
+                               : new DiffuseBSDF(Spectrum(0.5f,0.5f,0.5f));
+  return new StaticScene::SphereObject(position, sphere.radius * scale, bsdf);
+}
+
+StaticScene::SceneObject *Application::init_static_polymesh(
+    PolymeshInfo& polymesh, const Matrix4x4& transform) {
+  BSDF *bsdf = polymesh.material ? polymesh.material->bsdf
+                                 : new DiffuseBSDF(Spectrum(0.5f,0.5f,0.5f));
+  return new StaticScene::Mesh(polymesh, transform, bsdf);
+}
+
+std::shared_ptr<StaticScene::InstancedMesh> Application::init_shared_mesh(
+    PolymeshInfo& polymesh) {
+  // The instances share the default material too.
+  BSDF *bsdf = polymesh.material ? polymesh.material->bsdf
+                                 : new DiffuseBSDF(Spectrum(0.5f,0.5f,0.5f));
+  return std::make_shared<StaticScene::InstancedMesh>(polymesh, bsdf, bvhParams);
+}
+
+void Application::find_shared_meshes(const vector<Collada::Node>& nodes,
+                                     vector<size_t>& group_of,
+                                     vector<size_t>& group_sizes) {
+  // Polygon meshes are grouped by content and material; a node outside of
+  // any group is left past the end of group_sizes.
+  std::unordered_map<uint64_t, vector<size_t>> groups_by_hash;
+  vector<const PolymeshInfo*> first;
+  group_of.assign(nodes.size(), (size_t) -1);
+  group_sizes.clear();
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (nodes[i].instance->type != Collada::Instance::POLYMESH) continue;
+    const PolymeshInfo& polymesh = static_cast<const PolymeshInfo&>(*nodes[i].instance);
+    if (polymesh.polygon_offsets.empty()) continue;
+    uint64_t key = StaticScene::InstancedMesh::hash(polymesh) ^
+                   (uint64_t) (uintptr_t) polymesh.material;
+    vector<size_t>& candidates = groups_by_hash[key];
+    size_t group = first.size();
+    for (size_t g : candidates) {
+      if (first[g]->material == polymesh.material &&
+          StaticScene::InstancedMesh::same_geometry(*first[g], polymesh)) {
+        group = g;
+        break;
+      }
+    }
+    if (group == first.size()) {
+      candidates.push_back(group);
+      first.push_back(&polymesh);
+      group_sizes.push_back(0);
+    }
+    group_of[i] = group;
+    group_sizes[group]++;
+  }
+}
+
 void Application::set_scroll_rate() {
   scroll_rate = canonical_view_distance / 10;
 }
@@ -623,7 +909,16 @@ void Application::to_edit_mode() {
 void Application::set_up_pathtracer() {
   if (mode != EDIT_MODE) return;
   pathtracer->set_camera(&camera);
-  pathtracer->set_scene(scene->get_static_scene());
+  if (sceneCache) {
+    pathtracer->set_scene_cache(sceneCache);
+  } else if (staticScene) {
+    pathtracer->set_scene(staticScene);
+  } else if (pathtracer->can_set_scene()) {
+    // get_static_scene() moves the current static meshes in place, so only
+    // ask for it when the pathtracer takes it and refits its BVH; it may be
+    // rendering from them otherwise.
+    pathtracer->set_scene(scene->get_static_scene());
+  }
   pathtracer->set_frame_size(screenW, screenH);
 
 }
@@ -28,6 +28,7 @@
 
 // PathTracer
 #include "static_scene/scene.h"
+#include "static_scene/instance.h"
 #include "pathtracer.h"
 #include "image.h"
 
@@ -60,6 +61,16 @@ struct AppConfig {
     pathtracer_filename = "";
     pathtracer_lensRadius = 0.25;
     pathtracer_focalDistance = 4.7;
+    pathtracer_device_bvh = false;
+    pathtracer_validate_device_bvh = false;
+    pathtracer_cache_file = "";
+    pathtracer_stats_file = "";
+    pathtracer_tune_backend = "";
+    pathtracer_cpu_accel = "flat";
+    pathtracer_stream_trace = false;
+    pathtracer_cpu_render = false;
+    pathtracer_instancing = false;
+    pathtracer_lean = false;
 
   }
 
@@ -82,6 +93,18 @@ struct AppConfig {
   string pathtracer_filename;
   double pathtracer_lensRadius;
   double pathtracer_focalDistance;
+
+  StaticScene::BVHBuildParams pathtracer_bvh_params;
+  bool pathtracer_device_bvh;
+  bool pathtracer_validate_device_bvh;
+  string pathtracer_cache_file;
+  string pathtracer_stats_file;
+  string pathtracer_tune_backend;
+  string pathtracer_cpu_accel;
+  bool pathtracer_stream_trace;
+  bool pathtracer_cpu_render;
+  bool pathtracer_instancing;
+  bool pathtracer_lean;
 };
 
 class Application : public Renderer {
@@ -103,9 +126,26 @@ class Application : public Renderer {
   void mouse_event( int key, int event, unsigned char mods );
   void keyboard_event( int key, int event, unsigned char mods  );
 
+  /**
+   * Load a scene. Without a window the scene is only rendered, so it is
+   * built straight into the path tracer's static scene, without the
+   * halfedge meshes MeshEdit needs. If instancing is turned on, meshes that
+   * appear more than once in such a scene, by content, are kept once and
+   * instanced.
+   */
   void load(Collada::SceneInfo* sceneInfo);
+
+  /**
+   * Load the flattened scene cached for the given scene file, if there is a
+   * cache file and it is up to date. On a miss, the scene has to be loaded
+   * with load() and the cache is written when it is first rendered.
+   * \return true on a cache hit
+   */
+  bool load_from_cache(const std::string& scene_path);
+
   void render_to_file(std::string filename, size_t x, size_t y, size_t dx, size_t dy) { 
     set_up_pathtracer();
+    save_scene_cache();
     pathtracer->render_to_file(filename, x, y, dx, dy); 
   }
 
@@ -124,10 +164,26 @@ class Application : public Renderer {
 
   void to_edit_mode();
   void set_up_pathtracer();
+  void save_scene_cache();
 
   DynamicScene::Scene *scene;
+  StaticScene::Scene *staticScene;  ///< built by load without a window
   PathTracer* pathtracer;
 
+  // Scene cache
+  std::string cacheFile;                  ///< cache file, empty if disabled
+  StaticScene::BVHBuildParams bvhParams;  ///< part of the cache key
+  uint64_t sceneHash;                     ///< hash of the scene file
+  uint64_t cacheKey;                      ///< key of the loaded scene file
+  bool hasCacheKey;                       ///< cacheKey was computed
+  SceneCache* sceneCache;                 ///< open cache on a hit
+  SceneCacheView sceneView;               ///< camera and bounds of the scene
+  std::string tuneBackend;                ///< backend still to be tuned for
+  std::string tuningKey;                  ///< tuning file entry of tuneBackend
+
+  bool instancing;  ///< share meshes that appear more than once
+  bool lean;        ///< free each stage's input once the next has it
+
   // View Frustrum Variables.
   // On resize, the aspect ratio is changed. On reset_camera, the position and
   // orientation are reset but NOT the aspect ratio.
@@ -171,10 +227,20 @@ class Application : public Renderer {
   DynamicScene::SceneLight *init_light(Collada::LightInfo& light, const Matrix4x4& transform);
   DynamicScene::SceneObject *init_sphere(Collada::SphereInfo& polymesh, const Matrix4x4& transform);
   DynamicScene::SceneObject *init_polymesh(Collada::PolymeshInfo& polymesh, const Matrix4x4& transform);
+  StaticScene::SceneObject *init_static_sphere(Collada::SphereInfo& sphere, const Matrix4x4& transform);
+  StaticScene::SceneObject *init_static_polymesh(Collada::PolymeshInfo& polymesh, const Matrix4x4& transform);
+  std::shared_ptr<StaticScene::InstancedMesh> init_shared_mesh(Collada::PolymeshInfo& polymesh);
+  void find_shared_meshes(const std::vector<Collada::Node>& nodes, std::vector<size_t>& group_of,
+                          std::vector<size_t>& group_sizes);
   void init_material(Collada::MaterialInfo& material);
 
   void set_scroll_rate();
 
+  /**
+   * Place the camera around the scene bounds, looking along c_dir.
+   */
+  void place_cameras(const BBox& bbox, const Vector3D& c_dir);
+
   // Resets the camera to the canonical initial view position.
   void reset_camera();
 
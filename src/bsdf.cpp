@@ -171,6 +171,29 @@ void GlassBSDF::kernel_struct(kernel_bsdf_t *kernel_bsdf) {
   glass->transmittance = cglSpectrumToKernel(transmittance);
 }
 
+BSDF *BSDF::from_kernel_struct(const kernel_bsdf_t& kernel_bsdf) {
+  const kernel_bsdf_union_t& u = kernel_bsdf.u;
+  switch (kernel_bsdf.type) {
+    case KERNEL_BSDF_TYPE_DIFFUSE:
+      return new DiffuseBSDF(kernelSpectrumToCGL(u.diffuse.reflectance));
+    case KERNEL_BSDF_TYPE_MIRROR:
+      return new MirrorBSDF(kernelSpectrumToCGL(u.mirror.reflectance));
+    case KERNEL_BSDF_TYPE_MICROFACET:
+      return new MicrofacetBSDF(kernelSpectrumToCGL(u.microfacet.eta),
+                                kernelSpectrumToCGL(u.microfacet.k),
+                                u.microfacet.alpha);
+    case KERNEL_BSDF_TYPE_GLASS:
+      // The record has no roughness, which the host glass doesn't use.
+      return new GlassBSDF(kernelSpectrumToCGL(u.glass.transmittance),
+                           kernelSpectrumToCGL(u.glass.reflectance),
+                           0, u.glass.ior);
+    case KERNEL_BSDF_TYPE_EMISSION:
+      return new EmissionBSDF(kernelSpectrumToCGL(u.emission.radiance));
+    default:
+      return NULL;
+  }
+}
+
 void BSDF::reflect(const Vector3D& wo, Vector3D* wi) {
 
   // TODO: 1.1
@@ -56,6 +56,8 @@ void make_coord_space(Matrix3x3& o2w, const Vector3D& n);
 class BSDF {
  public:
 
+  virtual ~BSDF() { }
+
   /**
    * Evaluate BSDF.
    * Given incident light direction wi and outgoing light direction wo. Note
@@ -111,6 +113,13 @@ class BSDF {
    */
   virtual void kernel_struct(kernel_bsdf_t *kernel_bsdf) = 0;
 
+  /**
+   * Device->Host struct conversion, for scenes that only exist as kernel
+   * records (e.g. a scene cache). Returns a new BSDF, or NULL for a record
+   * of unknown type.
+   */
+  static BSDF *from_kernel_struct(const kernel_bsdf_t& kernel_bsdf);
+
   const HDRImageBuffer* reflectanceMap;
   const HDRImageBuffer* normalMap;
 
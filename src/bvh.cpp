@@ -1,19 +1,42 @@
 #include "bvh.h"
 
 #include "CGL/CGL.h"
+#include "static_scene/instance.h"
 #include "static_scene/triangle.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <queue>
 #include <stack>
+#include <unordered_map>
 
 using namespace std;
 
 namespace CGL { namespace StaticScene {
 
+// Subtrees with fewer primitives than this are built on the current thread;
+// larger ones are handed to an OpenMP task.
+static const size_t PARALLEL_BUILD_THRESHOLD = 4096;
+
+// Upper bound on BVHBuildParams::num_buckets, so that binning can use fixed
+// size arrays on the stack.
+static const size_t MAX_BUCKETS = 64;
+
+// Size of a treelet in the flattened BVH: one page of nodes.
+static const size_t TREELET_BYTES = 4096;
+
 BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
-                   size_t max_leaf_size) {
+                   size_t max_leaf_size) : params(max_leaf_size) {
 
-  root = construct_bvh(_primitives, max_leaf_size);
+  build(_primitives);
+
+}
+
+BVHAccel::BVHAccel(const std::vector<Primitive *> &_primitives,
+                   const BVHBuildParams& params) : params(params) {
+
+  build(_primitives);
 
 }
 
@@ -27,8 +50,8 @@ BBox BVHAccel::get_bbox() const {
 
 void BVHAccel::draw(BVHNode *node, const Color& c, float alpha) const {
   if (node->isLeaf()) {
-    for (Primitive *p : *(node->prims))
-      p->draw(c, alpha);
+    for (size_t i = node->start; i < node->start + node->range; i++)
+      primitives[i]->draw(c, alpha);
   } else {
     draw(node->l, c, alpha);
     draw(node->r, c, alpha);
@@ -37,107 +60,721 @@ void BVHAccel::draw(BVHNode *node, const Color& c, float alpha) const {
 
 void BVHAccel::drawOutline(BVHNode *node, const Color& c, float alpha) const {
   if (node->isLeaf()) {
-    for (Primitive *p : *(node->prims))
-      p->drawOutline(c, alpha);
+    for (size_t i = node->start; i < node->start + node->range; i++)
+      primitives[i]->drawOutline(c, alpha);
   } else {
     drawOutline(node->l, c, alpha);
     drawOutline(node->r, c, alpha);
   }
 }
 
-BVHNode *BVHAccel::construct_bvh(const std::vector<Primitive*>& prims, size_t max_leaf_size) {
-  // TODO (Part 2.1):
-  // Construct a BVH from the given vector of primitives and maximum leaf
-  // size configuration. The starter code build a BVH aggregate with a
-  // single leaf node (which is also the root) that encloses all the
-  // primitives.
-  BBox total_bbox, bb;
-  for (Primitive *p : prims) {
-    bb = p->get_bbox();
-    total_bbox.expand(bb);
+void BVHAccel::build(const std::vector<Primitive*>& prims) {
+  if (params.max_leaf_size < 1) params.max_leaf_size = 1;
+  if (params.num_buckets < 2) params.num_buckets = 2;
+  if (params.num_buckets > MAX_BUCKETS) params.num_buckets = MAX_BUCKETS;
+
+  // Query every primitive once; get_bbox() goes through the mesh and is
+  // far too slow to call at every level of the recursion.
+  size_t n = prims.size();
+  build_input = &prims;
+  build_bboxes.resize(n);
+  build_centroids.resize(n);
+  build_prims.resize(n);
+  build_indices.resize(n);
+  #pragma omp parallel for schedule(static)
+  for (size_t i = 0; i < n; i++) {
+    build_bboxes[i] = prims[i]->get_bbox();
+    build_centroids[i] = build_bboxes[i].centroid();
+    build_prims[i] = i;
+    build_indices[i] = i;
+  }
+
+  if (params.spatial_splits && n > 0) {
+    // Spatial splits append new references as they go, so this build runs
+    // on a single thread. Leaves write their references to build_indices.
+    BBox bbox;
+    for (size_t i = 0; i < n; i++) bbox.expand(build_bboxes[i]);
+    build_max_refs = n + (size_t) (n * std::max(0.0, params.max_duplication));
+    build_min_overlap = params.spatial_split_alpha * bbox.surface_area();
+    vector<size_t> refs;
+    refs.swap(build_indices);
+    build_indices.reserve(build_max_refs);
+    root = construct_sbvh(refs, 0);
+  } else {
+    #pragma omp parallel
+    #pragma omp single nowait
+    root = construct_bvh(0, n);
+  }
+
+  // Reorder the primitives so that every leaf covers a contiguous range.
+  primitives.resize(build_indices.size());
+  for (size_t i = 0; i < build_indices.size(); i++) {
+    primitives[i] = prims[build_prims[build_indices[i]]];
+  }
+
+  build_input = NULL;
+  vector<BBox>().swap(build_bboxes);
+  vector<Vector3D>().swap(build_centroids);
+  vector<size_t>().swap(build_prims);
+  vector<size_t>().swap(build_indices);
+
+  pack_triangles();
+  build_cost = sah_cost();
+}
+
+BVHNode *BVHAccel::construct_bvh(size_t start, size_t end) {
+  size_t count = end - start;
+  BBox bbox, centroid_bbox;
+  for (size_t i = start; i < end; i++) {
+    bbox.expand(build_bboxes[build_indices[i]]);
+    centroid_bbox.expand(build_centroids[build_indices[i]]);
+  }
+  BVHNode *node = new BVHNode(bbox, start, count);
+  if (count <= 1) return node;
+
+  int best_axis;
+  size_t best_split;
+  double best_cost = find_split(&build_indices[start], count, centroid_bbox,
+                                &best_axis, &best_split);
+
+  size_t mid;
+  if (best_axis < 0) {
+    // All centroids coincide, so no plane separates them. Split the range
+    // in half if it is too big for a single leaf.
+    if (count <= params.max_leaf_size) return node;
+    mid = start + count / 2;
+  } else {
+    double area = bbox.surface_area();
+    double split_cost = params.traversal_cost + params.intersection_cost *
+                        (area > 0 ? best_cost / area : count);
+    double leaf_cost = params.intersection_cost * count;
+    if (count <= params.max_leaf_size && leaf_cost <= split_cost) {
+      return node;
+    }
+
+    const size_t num_buckets = params.num_buckets;
+    double lo = centroid_bbox.min[best_axis];
+    double scale = num_buckets / (centroid_bbox.max[best_axis] - lo);
+    vector<size_t>::iterator it = std::partition(
+        build_indices.begin() + start, build_indices.begin() + end,
+        [&](size_t p) {
+          size_t b = std::min(num_buckets - 1,
+              (size_t) ((build_centroids[p][best_axis] - lo) * scale));
+          return b < best_split;
+        });
+    mid = it - build_indices.begin();
   }
-  BVHNode *node = new BVHNode(total_bbox);
-  if (prims.size() <= max_leaf_size) {
-    node->prims = new vector<Primitive *>(prims);
+
+  if (count > PARALLEL_BUILD_THRESHOLD) {
+    #pragma omp task
+    node->l = construct_bvh(start, mid);
+    node->r = construct_bvh(mid, end);
+    #pragma omp taskwait
+  } else {
+    node->l = construct_bvh(start, mid);
+    node->r = construct_bvh(mid, end);
+  }
+  return node;
+}
+
+// Returns the part of a that also lies in b.
+static BBox overlap(const BBox& a, const BBox& b) {
+  BBox bb(a.min, a.max);
+  for (int axis = 0; axis < 3; axis++) {
+    bb.min[axis] = std::max(a.min[axis], b.min[axis]);
+    bb.max[axis] = std::min(a.max[axis], b.max[axis]);
+    if (bb.min[axis] > bb.max[axis]) return BBox();
+  }
+  bb.extent = bb.max - bb.min;
+  return bb;
+}
+
+BVHNode *BVHAccel::construct_sbvh(vector<size_t>& refs, size_t depth) {
+  size_t count = refs.size();
+  BBox bbox, centroid_bbox;
+  for (size_t ref : refs) {
+    bbox.expand(build_bboxes[ref]);
+    centroid_bbox.expand(build_centroids[ref]);
+  }
+  BVHNode *node = new BVHNode(bbox, build_indices.size(), count);
+
+  int best_axis = -1;
+  size_t best_split = 0;
+  BBox left_bbox, right_bbox;
+  double best_cost = INF_D;
+  if (count > 1) {
+    best_cost = find_split(&refs[0], count, centroid_bbox, &best_axis,
+                           &best_split, &left_bbox, &right_bbox);
+  }
+
+  // Only try a spatial split if the children of the object split overlap
+  // noticeably and there are references left in the budget.
+  int spatial_axis = -1;
+  double spatial_plane = 0;
+  if (count > 1 && depth < 64 && build_bboxes.size() < build_max_refs &&
+      (best_axis < 0 ||
+       overlap(left_bbox, right_bbox).surface_area() > build_min_overlap)) {
+    double spatial_cost = find_spatial_split(refs, bbox, &spatial_axis,
+                                             &spatial_plane);
+    if (spatial_axis >= 0 && spatial_cost < best_cost) {
+      best_cost = spatial_cost;
+    } else {
+      spatial_axis = -1;
+    }
+  }
+
+  double area = bbox.surface_area();
+  double split_cost = params.traversal_cost + params.intersection_cost *
+                      (area > 0 ? best_cost / area : count);
+  double leaf_cost = params.intersection_cost * count;
+  if (count <= 1 || (count <= params.max_leaf_size &&
+                     (leaf_cost <= split_cost ||
+                      (best_axis < 0 && spatial_axis < 0)))) {
+    build_indices.insert(build_indices.end(), refs.begin(), refs.end());
     return node;
   }
 
-  // Use SAH to partition
-  static const uint16_t num_buckets = 8;
-  uint8_t best_axis = 0;
-  uint16_t best_split = num_buckets / 2;
-  double best_cost = INFINITY;
-  BBox buckets[3][num_buckets];
-  uint32_t tri_count[3][num_buckets];
-
-  for (uint8_t axis = 0; axis < 3; axis++) {
-    // Initialize partitions
-    double total_width = total_bbox.max[axis] - total_bbox.min[axis];
-    for (uint16_t i = 0; i < num_buckets; i++) {
-      tri_count[axis][i] = 0;
-    }
-
-    // Compute partitions
-    for (Primitive *p : prims) {
-      bb = p->get_bbox();
-      uint16_t bucket = floor(((bb.centroid()[axis] - total_bbox.min[axis])
-                               / total_width) * num_buckets);
-      buckets[axis][bucket].expand(bb);
-      tri_count[axis][bucket]++;
-    }
-
-    // Find best partitioning
-    for (uint16_t split = 1; split < num_buckets; split++) {
-      BBox left_bbox, right_bbox;
-      uint32_t left_count = 0, right_count = 0;
-      for (uint16_t bucket = 0; bucket < num_buckets; bucket++) {
-        if (bucket < split) {
-          left_bbox.expand(buckets[axis][bucket]);
-          left_count += tri_count[axis][bucket];
-        } else {
-          right_bbox.expand(buckets[axis][bucket]);
-          right_count += tri_count[axis][bucket];
-        }
+  vector<size_t> left_refs, right_refs;
+  if (spatial_axis >= 0) {
+    // References entirely on one side of the plane go to that side. The
+    // rest are split in two, unless moving the whole reference to one side
+    // is cheaper (reference unsplitting).
+    BBox lbb, rbb;
+    vector<size_t> straddling;
+    for (size_t ref : refs) {
+      const BBox& bb = build_bboxes[ref];
+      if (bb.max[spatial_axis] <= spatial_plane) {
+        left_refs.push_back(ref);
+        lbb.expand(bb);
+      } else if (bb.min[spatial_axis] >= spatial_plane) {
+        right_refs.push_back(ref);
+        rbb.expand(bb);
+      } else {
+        straddling.push_back(ref);
       }
+    }
+    size_t n_left = left_refs.size() + straddling.size();
+    size_t n_right = right_refs.size() + straddling.size();
+    for (size_t ref : straddling) {
+      BBox bb = build_bboxes[ref];
+      const Primitive *p = (*build_input)[build_prims[ref]];
+      BBox clip_l = overlap(p->get_clipped_bbox(spatial_axis, -INF_D,
+                                                spatial_plane), bb);
+      BBox clip_r = overlap(p->get_clipped_bbox(spatial_axis, spatial_plane,
+                                                INF_D), bb);
+      BBox l_split = lbb, r_split = rbb, l_all = lbb, r_all = rbb;
+      l_split.expand(clip_l);
+      r_split.expand(clip_r);
+      l_all.expand(bb);
+      r_all.expand(bb);
+      double c_split = l_split.surface_area() * n_left +
+                       r_split.surface_area() * n_right;
+      double c_left = l_all.surface_area() * n_left +
+                      rbb.surface_area() * (n_right - 1);
+      double c_right = lbb.surface_area() * (n_left - 1) +
+                       r_all.surface_area() * n_right;
+      bool can_split = build_bboxes.size() < build_max_refs &&
+                       !clip_l.empty() && !clip_r.empty();
+      if (clip_r.empty() || (!clip_l.empty() && c_left <= c_right &&
+                             (!can_split || c_left <= c_split))) {
+        left_refs.push_back(ref);
+        lbb = l_all;
+        n_right--;
+      } else if (!can_split || c_right <= c_split) {
+        right_refs.push_back(ref);
+        rbb = r_all;
+        n_left--;
+      } else {
+        size_t dup = build_bboxes.size();
+        build_bboxes.push_back(clip_r);
+        build_centroids.push_back(clip_r.centroid());
+        build_prims.push_back(build_prims[ref]);
+        build_bboxes[ref] = clip_l;
+        build_centroids[ref] = clip_l.centroid();
+        left_refs.push_back(ref);
+        right_refs.push_back(dup);
+        lbb = l_split;
+        rbb = r_split;
+      }
+    }
+  }
 
-      double cost = left_bbox.volume() * left_count +
-                    right_bbox.volume() * right_count;
-      if (left_count > 0 && right_count > 0 && cost < best_cost) {
+  if (left_refs.empty() || right_refs.empty()) {
+    left_refs.clear();
+    right_refs.clear();
+    if (best_axis >= 0 && spatial_axis < 0) {
+      const size_t num_buckets = params.num_buckets;
+      double lo = centroid_bbox.min[best_axis];
+      double scale = num_buckets / (centroid_bbox.max[best_axis] - lo);
+      for (size_t ref : refs) {
+        size_t b = std::min(num_buckets - 1,
+            (size_t) ((build_centroids[ref][best_axis] - lo) * scale));
+        (b < best_split ? left_refs : right_refs).push_back(ref);
+      }
+    } else {
+      left_refs.assign(refs.begin(), refs.begin() + count / 2);
+      right_refs.assign(refs.begin() + count / 2, refs.end());
+    }
+  }
+
+  vector<size_t>().swap(refs);
+  node->l = construct_sbvh(left_refs, depth + 1);
+  node->r = construct_sbvh(right_refs, depth + 1);
+  node->start = node->l->start;
+  node->range = build_indices.size() - node->start;
+  return node;
+}
+
+double BVHAccel::find_split(const size_t *refs, size_t count,
+                            const BBox& centroid_bbox, int *best_axis,
+                            size_t *best_split, BBox *left_bbox,
+                            BBox *right_bbox) const {
+  // Bin the centroids along every axis and sweep the bins to find the split
+  // plane with the lowest SAH cost.
+  const size_t num_buckets = params.num_buckets;
+  BBox bucket_bbox[MAX_BUCKETS];
+  size_t bucket_count[MAX_BUCKETS];
+  BBox right_bboxes[MAX_BUCKETS];
+  size_t right_count[MAX_BUCKETS];
+
+  double best_cost = INF_D;
+  *best_axis = -1;
+  *best_split = 0;
+
+  for (int axis = 0; axis < 3; axis++) {
+    double lo = centroid_bbox.min[axis];
+    double width = centroid_bbox.max[axis] - lo;
+    if (width <= 0) continue;
+    double scale = num_buckets / width;
+
+    for (size_t b = 0; b < num_buckets; b++) {
+      bucket_bbox[b] = BBox();
+      bucket_count[b] = 0;
+    }
+    for (size_t i = 0; i < count; i++) {
+      size_t p = refs[i];
+      size_t b = std::min(num_buckets - 1,
+                          (size_t) ((build_centroids[p][axis] - lo) * scale));
+      bucket_bbox[b].expand(build_bboxes[p]);
+      bucket_count[b]++;
+    }
+
+    // right_bboxes[b] and right_count[b] describe buckets [b, num_buckets)
+    BBox right;
+    size_t n_right = 0;
+    for (size_t b = num_buckets - 1; b > 0; b--) {
+      right.expand(bucket_bbox[b]);
+      n_right += bucket_count[b];
+      right_bboxes[b] = right;
+      right_count[b] = n_right;
+    }
+
+    BBox left;
+    size_t n_left = 0;
+    for (size_t split = 1; split < num_buckets; split++) {
+      left.expand(bucket_bbox[split - 1]);
+      n_left += bucket_count[split - 1];
+      if (n_left == 0 || right_count[split] == 0) continue;
+      double cost = left.surface_area() * n_left +
+                    right_bboxes[split].surface_area() * right_count[split];
+      if (cost < best_cost) {
         best_cost = cost;
-        best_axis = axis;
-        best_split = split;
+        *best_axis = axis;
+        *best_split = split;
+        if (left_bbox) *left_bbox = left;
+        if (right_bbox) *right_bbox = right_bboxes[split];
       }
     }
   }
 
-  vector<Primitive*> left_prims, right_prims;
+  return best_cost;
+}
+
+double BVHAccel::find_spatial_split(const vector<size_t>& refs,
+                                    const BBox& bbox, int *best_axis,
+                                    double *best_plane) const {
+  // Bin the node bounds by position. Each reference is clipped against
+  // every bin it spans, and counted as entering its first bin and exiting
+  // its last one.
+  const size_t num_buckets = params.num_buckets;
+  BBox bin_bbox[MAX_BUCKETS];
+  size_t entry[MAX_BUCKETS], exit[MAX_BUCKETS];
+  BBox right_bboxes[MAX_BUCKETS];
+  size_t right_count[MAX_BUCKETS];
+
+  double best_cost = INF_D;
+  *best_axis = -1;
+  *best_plane = 0;
+
+  for (int axis = 0; axis < 3; axis++) {
+    double lo = bbox.min[axis];
+    double width = bbox.max[axis] - lo;
+    if (width <= 0) continue;
+    double bin_width = width / num_buckets;
 
-  if (best_cost == INFINITY) {
-    // Edge case, all the primitives fall into the same bucket (or share the
-    // same centroid)
-    for (size_t i = 0; i < prims.size(); i++) {
-      if (i < prims.size() / 2) {
-        left_prims.push_back(prims[i]);
+    for (size_t b = 0; b < num_buckets; b++) {
+      bin_bbox[b] = BBox();
+      entry[b] = exit[b] = 0;
+    }
+    for (size_t ref : refs) {
+      const BBox& bb = build_bboxes[ref];
+      const Primitive *p = (*build_input)[build_prims[ref]];
+      size_t first = std::min(num_buckets - 1,
+          (size_t) std::max(0.0, (bb.min[axis] - lo) / bin_width));
+      size_t last = std::min(num_buckets - 1,
+          (size_t) std::max(0.0, (bb.max[axis] - lo) / bin_width));
+      if (first == last) {
+        bin_bbox[first].expand(bb);
       } else {
-        right_prims.push_back(prims[i]);
+        for (size_t b = first; b <= last; b++) {
+          double bin_lo = lo + b * bin_width;
+          double bin_hi = (b == num_buckets - 1) ? bbox.max[axis]
+                                                 : bin_lo + bin_width;
+          bin_bbox[b].expand(overlap(p->get_clipped_bbox(axis, bin_lo,
+                                                         bin_hi), bb));
+        }
       }
+      entry[first]++;
+      exit[last]++;
     }
-  } else {
-    double split_ratio = ((double) best_split) / ((double) num_buckets);
-    for (Primitive *p : prims) {
-      if (((p->get_bbox().centroid()[best_axis] - total_bbox.min[best_axis]) /
-           (total_bbox.max[best_axis] - total_bbox.min[best_axis])) < split_ratio) {
-        left_prims.push_back(p);
-      } else {
-        right_prims.push_back(p);
+
+    BBox right;
+    size_t n_right = 0;
+    for (size_t b = num_buckets - 1; b > 0; b--) {
+      right.expand(bin_bbox[b]);
+      n_right += exit[b];
+      right_bboxes[b] = right;
+      right_count[b] = n_right;
+    }
+
+    BBox left;
+    size_t n_left = 0;
+    for (size_t split = 1; split < num_buckets; split++) {
+      left.expand(bin_bbox[split - 1]);
+      n_left += entry[split - 1];
+      if (n_left == 0 || right_count[split] == 0) continue;
+      double cost = left.surface_area() * n_left +
+                    right_bboxes[split].surface_area() * right_count[split];
+      if (cost < best_cost) {
+        best_cost = cost;
+        *best_axis = axis;
+        *best_plane = lo + split * bin_width;
       }
     }
   }
-  node->l = construct_bvh(left_prims, max_leaf_size);
-  node->r = construct_bvh(right_prims, max_leaf_size);
-  return node;
+
+  return best_cost;
+}
+
+double BVHAccel::sah_cost() const {
+  if (!root) return 0;
+  double area = root->bb.surface_area();
+  if (area <= 0) return params.intersection_cost * root->range;
+  return sah_cost(root) / area;
 }
 
+double BVHAccel::sah_cost(BVHNode *node) const {
+  double area = node->bb.surface_area();
+  if (node->isLeaf()) {
+    return area * params.intersection_cost * node->range;
+  }
+  return area * params.traversal_cost + sah_cost(node->l) + sah_cost(node->r);
+}
+
+// The tree as index-linked records, so that a reinsertion can be tried,
+// measured and undone cheaply. Records only ever change through touch(),
+// which saves the old version once per move.
+namespace {
+
+struct ReinsertionNode {
+  BBox bb;
+  double area;
+  size_t parent, l, r;
+  BVHNode *node;
+  bool settled;  ///< reinsertion found nothing better since the last change
+};
+
+class Reinserter {
+ public:
+  static const size_t NONE = (size_t) -1;
+
+  explicit Reinserter(BVHNode *root_node) : move(0) {
+    std::vector<std::pair<BVHNode*, size_t> > stack;
+    stack.push_back(std::make_pair(root_node, NONE));
+    while (!stack.empty()) {
+      BVHNode *node = stack.back().first;
+      size_t parent = stack.back().second;
+      stack.pop_back();
+      size_t i = nodes.size();
+      ReinsertionNode n = { node->bb, node->bb.surface_area(), parent,
+                            NONE, NONE, node, false };
+      nodes.push_back(n);
+      if (parent != NONE) {
+        if (nodes[parent].l == NONE) nodes[parent].l = i;
+        else nodes[parent].r = i;
+      }
+      if (!node->isLeaf()) {
+        stack.push_back(std::make_pair(node->r, i));
+        stack.push_back(std::make_pair(node->l, i));
+      }
+    }
+    root = 0;
+    touched.assign(nodes.size(), 0);
+  }
+
+  /**
+   * Sum of the surface areas of the interior nodes, the only part of the
+   * SAH cost that reinsertion changes.
+   */
+  double interior_area() const {
+    double area = 0;
+    for (const ReinsertionNode& n : nodes) {
+      if (n.l != NONE) area += n.area;
+    }
+    return area;
+  }
+
+  /**
+   * Interior nodes other than the root, worst first by the combined
+   * measure of Bittner et al.: nodes that are large, and much larger than
+   * their children, are the ones that sit in the wrong place.
+   */
+  void candidates(std::vector<size_t>& order) const {
+    std::vector<std::pair<double, size_t> > measures;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      const ReinsertionNode& n = nodes[i];
+      if (n.l == NONE || n.settled || i == root) continue;
+      double area_l = nodes[n.l].area, area_r = nodes[n.r].area;
+      double m_sum = n.area / std::max(0.5 * (area_l + area_r), 1e-30);
+      double m_min = n.area / std::max(std::min(area_l, area_r), 1e-30);
+      measures.push_back(std::make_pair(-m_sum * m_min * n.area, i));
+    }
+    std::sort(measures.begin(), measures.end());
+    order.clear();
+    for (auto& m : measures) order.push_back(m.second);
+  }
+
+  /**
+   * Take node i and its parent out of the tree and insert the two
+   * children of i again, each where it adds the least area. The move is
+   * undone unless it lowers the interior area.
+   * \return change of the interior area, negative or zero
+   */
+  double reinsert(size_t i) {
+    size_t p = nodes[i].parent;
+    if (p == NONE || nodes[i].l == NONE) return 0;
+    move++;
+    log.clear();
+    size_t old_root = root;
+
+    size_t l = nodes[i].l, r = nodes[i].r;
+    size_t sibling = nodes[p].l == i ? nodes[p].r : nodes[p].l;
+    size_t grandparent = nodes[p].parent;
+    touch(i); touch(p); touch(l); touch(r); touch(sibling);
+    nodes[sibling].parent = grandparent;
+    if (grandparent == NONE) {
+      root = sibling;
+    } else {
+      replace_child(grandparent, p, sibling);
+      refit_up(grandparent);
+    }
+
+    // The larger child picks its place first.
+    if (nodes[l].area < nodes[r].area) std::swap(l, r);
+    insert(l, i);
+    insert(r, p);
+
+    double delta = 0;
+    for (auto& saved : log) delta += nodes[saved.first].area - saved.second.area;
+    if (delta < -1e-9 * nodes[root].area) {
+      for (auto& saved : log) nodes[saved.first].settled = false;
+      return delta;
+    }
+
+    for (size_t k = log.size(); k-- > 0;) nodes[log[k].first] = log[k].second;
+    root = old_root;
+    nodes[i].settled = true;
+    return 0;
+  }
+
+  /**
+   * Write the new structure and bounds back into the BVHNodes.
+   */
+  BVHNode *apply() {
+    for (ReinsertionNode& n : nodes) {
+      n.node->bb = n.bb;
+      n.node->l = n.l == NONE ? NULL : nodes[n.l].node;
+      n.node->r = n.r == NONE ? NULL : nodes[n.r].node;
+    }
+    return nodes[root].node;
+  }
+
+ private:
+  void touch(size_t i) {
+    if (touched[i] == move) return;
+    touched[i] = move;
+    log.push_back(std::make_pair(i, nodes[i]));
+  }
+
+  void replace_child(size_t parent, size_t from, size_t to) {
+    touch(parent);
+    if (nodes[parent].l == from) nodes[parent].l = to;
+    else nodes[parent].r = to;
+  }
+
+  void refit_up(size_t i) {
+    for (; i != NONE; i = nodes[i].parent) {
+      touch(i);
+      ReinsertionNode& n = nodes[i];
+      n.bb = nodes[n.l].bb;
+      n.bb.expand(nodes[n.r].bb);
+      n.area = n.bb.surface_area();
+    }
+  }
+
+  /**
+   * Make subtree s the sibling of the node where it adds the least area,
+   * using the free interior node f as their new parent. Branch and bound
+   * over the tree: a node's induced cost is how much its ancestors grow,
+   * which only increases on the way down.
+   */
+  void insert(size_t s, size_t f) {
+    const BBox& bb = nodes[s].bb;
+    double area = nodes[s].area;
+    double best_cost = INF_D;
+    size_t best = root;
+    typedef std::pair<double, size_t> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry> > queue;
+    queue.push(Entry(0, root));
+    while (!queue.empty()) {
+      Entry e = queue.top();
+      queue.pop();
+      if (e.first + area >= best_cost) break;
+      const ReinsertionNode& x = nodes[e.second];
+      BBox merged = x.bb;
+      merged.expand(bb);
+      double merged_area = merged.surface_area();
+      if (e.first + merged_area < best_cost) {
+        best_cost = e.first + merged_area;
+        best = e.second;
+      }
+      double induced = e.first + merged_area - x.area;
+      if (x.l != NONE && induced + area < best_cost) {
+        queue.push(Entry(induced, x.l));
+        queue.push(Entry(induced, x.r));
+      }
+    }
+
+    size_t parent = nodes[best].parent;
+    touch(best);
+    nodes[f].parent = parent;
+    nodes[f].l = best;
+    nodes[f].r = s;
+    nodes[best].parent = f;
+    nodes[s].parent = f;
+    if (parent == NONE) root = f;
+    else replace_child(parent, best, f);
+    refit_up(f);
+  }
+
+  std::vector<ReinsertionNode> nodes;
+  size_t root;
+  size_t move;                  ///< counts reinsertions, for touch()
+  std::vector<size_t> touched;  ///< last move that saved each record
+  std::vector<std::pair<size_t, ReinsertionNode> > log;
+};
+
+}  // namespace
+
+void BVHAccel::optimize(size_t max_passes) {
+  if (!root || root->isLeaf() || max_passes == 0) return;
+
+  // Work in batches of the worst nodes, re-ranking in between, until the
+  // passes run out or a few batches in a row hardly help. Counting passes
+  // rather than seconds keeps the tree the same from run to run, which
+  // the scene cache relies on.
+  Reinserter tree(root);
+  double area = tree.interior_area();
+  std::vector<size_t> candidates;
+  size_t stalled = 0;
+  for (size_t pass = 0; pass < max_passes && stalled < 3; pass++) {
+    tree.candidates(candidates);
+    if (candidates.empty()) break;
+    size_t batch = std::max<size_t>(1, candidates.size() / 100);
+    double gain = 0;
+    for (size_t k = 0; k < std::min(batch, candidates.size()); k++) {
+      gain -= tree.reinsert(candidates[k]);
+    }
+    stalled = gain < 1e-4 * area ? stalled + 1 : 0;
+    area -= gain;
+  }
+  root = tree.apply();
+
+  // Leaves may now be visited in a different order, so put the primitives
+  // back into one contiguous range per subtree.
+  std::vector<Primitive*> ordered;
+  ordered.reserve(primitives.size());
+  assign_ranges(root, primitives, ordered);
+  primitives.swap(ordered);
+  pack_triangles();
+  build_cost = sah_cost();
+}
+
+void BVHAccel::assign_ranges(BVHNode *node,
+                               const std::vector<Primitive*>& prims,
+                               std::vector<Primitive*>& ordered) {
+  size_t start = ordered.size();
+  if (node->isLeaf()) {
+    ordered.insert(ordered.end(), prims.begin() + node->start,
+                   prims.begin() + node->start + node->range);
+  } else {
+    assign_ranges(node->l, prims, ordered);
+    assign_ranges(node->r, prims, ordered);
+  }
+  node->start = start;
+  node->range = ordered.size() - start;
+}
+
+// Same test as Triangle::intersect, on a packed record, so that both paths
+// report the same hits.
+static inline bool intersect_packed(const PackedTriangle& tri, const Ray& r,
+                                    double *t, double *u, double *v) {
+  Vector3D pvec = cross(r.d, tri.e2);
+  double det = dot(tri.e1, pvec);
+  if (abs(det) <= 0) {
+    return false;
+  }
+  double invDet = 1 / det;
+  Vector3D tvec = r.o - tri.p0;
+  *u = dot(tvec, pvec) * invDet;
+  if (*u < 0 || *u > 1) {
+    return false;
+  }
+
+  Vector3D qvec = cross(tvec, tri.e1);
+  *v = dot(r.d, qvec) * invDet;
+  if (*v < 0 || *u + *v > 1) {
+    return false;
+  }
+
+  *t = dot(tri.e2, qvec) * invDet;
+  return *t >= r.min_t && *t <= r.max_t;
+}
+
+void BVHAccel::pack_triangles() {
+  packed_triangles.resize(primitives.size());
+  #pragma omp parallel for schedule(static)
+  for (size_t p = 0; p < primitives.size(); p++) {
+    PackedTriangle& packed = packed_triangles[p];
+    packed.triangle = dynamic_cast<const Triangle*>(primitives[p]);
+    if (!packed.triangle) continue;
+    Vector3D p1, p2, p3;
+    packed.triangle->get_vertices(&p1, &p2, &p3);
+    packed.p0 = p1;
+    packed.e1 = p2 - p1;
+    packed.e2 = p3 - p1;
+  }
+}
 
 bool BVHAccel::intersect(const Ray& ray, BVHNode *node) const {
 
@@ -156,9 +793,16 @@ bool BVHAccel::intersect(const Ray& ray, BVHNode *node) const {
   }
 
   if (node->isLeaf()) {
-    for (Primitive *p : *(node->prims)) {
+    for (size_t p = node->start; p < node->start + node->range; p++) {
       total_isects++;
-      if (p->intersect(ray)) {
+      const PackedTriangle& tri = packed_triangles[p];
+      if (!tri.triangle) {
+        if (primitives[p]->intersect(ray)) return true;
+        continue;
+      }
+      double t, u, v;
+      if (intersect_packed(tri, ray, &t, &u, &v)) {
+        ray.max_t = t;
         return true;
       }
     }
@@ -171,6 +815,20 @@ bool BVHAccel::intersect(const Ray& ray, Intersection* i, BVHNode *node) const {
 
   // TODO (Part 2.3):
   // Fill in the intersect function.
+  // Triangles only record which one is closest on the way down; the
+  // intersection is filled in once, for the final hit.
+  size_t hit = primitives.size();
+  double u, v;
+  bool intersects = intersect_closest(ray, i, node, &hit, &u, &v);
+  if (hit < primitives.size()) {
+    packed_triangles[hit].triangle->fill_intersection(ray.max_t, u, v, i);
+  }
+  return intersects;
+}
+
+bool BVHAccel::intersect_closest(const Ray& ray, Intersection* i,
+                                 BVHNode *node, size_t *hit,
+                                 double *hit_u, double *hit_v) const {
   double t0, t1;
   total_isects++;
   if (!node->bb.intersect(ray, t0, t1)) {
@@ -182,64 +840,244 @@ bool BVHAccel::intersect(const Ray& ray, Intersection* i, BVHNode *node) const {
 
   bool intersects = false;
   if (node->isLeaf()) {
-    for (Primitive *p : *(node->prims)) {
+    for (size_t p = node->start; p < node->start + node->range; p++) {
       total_isects++;
-      if (p->intersect(ray, i)) {
+      const PackedTriangle& tri = packed_triangles[p];
+      if (!tri.triangle) {
+        // Any hit here is closer than the pending triangle.
+        if (primitives[p]->intersect(ray, i)) {
+          intersects = true;
+          *hit = primitives.size();
+        }
+        continue;
+      }
+      double t, u, v;
+      if (intersect_packed(tri, ray, &t, &u, &v)) {
+        ray.max_t = t;
         intersects = true;
+        *hit = p;
+        *hit_u = u;
+        *hit_v = v;
       }
     }
     return intersects;
   }
-  intersects |= intersect(ray, i, node->l);
-  intersects |= intersect(ray, i, node->r);
+  intersects |= intersect_closest(ray, i, node->l, hit, hit_u, hit_v);
+  intersects |= intersect_closest(ray, i, node->r, hit, hit_u, hit_v);
   return intersects;
 }
 
-size_t BVHNode::kernel_struct(std::vector<kernel_bvh_node_t>& kernel_bvh,
-                              std::vector<kernel_primitive_t>& kernel_primitives,
-                              std::vector<BSDF*>& bsdf_pointers,
-                              size_t exit_index) {
-  size_t my_index = kernel_bvh.size();
-  kernel_bvh.emplace_back();
-  kernel_bvh_node_t node;
-
-  // Initialize stuff to 0's
-  node.entry_index = 0;
-  node.prim_count = 0;
-  node.prim_index = 0;
+void BVHAccel::kernel_layout(std::vector<BVHNode*>& order) const {
+  order.clear();
+  if (!root) return;
 
-  node.exit_index = exit_index;
-  node.bounds[0] = cglVectorToKernel(bb.min);
-  node.bounds[1] = cglVectorToKernel(bb.max);
-  if (isLeaf()) {
-    node.entry_index = exit_index;
-    node.prim_count = prims->size();
-    node.prim_index = kernel_primitives.size();
-    for (auto prim : *prims) {
-      kernel_primitive_t kernel_prim;
-      prim->kernel_struct(&kernel_prim, bsdf_pointers);
-      kernel_primitives.push_back(kernel_prim);
+  // Pre-order. Inside a treelet the left subtree goes first, so that a
+  // traversal only ever moves forward through the treelet: a hit steps to
+  // the left child, a miss skips past the subtree.
+  bool left_first = params.layout == BVHBuildParams::TREELETS;
+  std::vector<BVHNode*> preorder;
+  std::vector<BVHNode*> stack(1, root);
+  while (!stack.empty()) {
+    BVHNode *node = stack.back();
+    stack.pop_back();
+    preorder.push_back(node);
+    if (!node->isLeaf()) {
+      stack.push_back(left_first ? node->r : node->l);
+      stack.push_back(left_first ? node->l : node->r);
     }
-  } else {
-    // Push right side first
-    size_t right_index = r->kernel_struct(kernel_bvh, kernel_primitives, bsdf_pointers, exit_index);
-    node.entry_index = l->kernel_struct(kernel_bvh, kernel_primitives, bsdf_pointers, right_index);
   }
+  if (params.layout == BVHBuildParams::DEPTH_FIRST) {
+    order.swap(preorder);
+    return;
+  }
+
+  std::unordered_map<const BVHNode*, size_t> rank;
+  rank.reserve(preorder.size());
+  for (size_t i = 0; i < preorder.size(); i++) rank[preorder[i]] = i;
+  auto by_rank = [&rank](const BVHNode *a, const BVHNode *b) {
+    return rank[a] < rank[b];
+  };
 
-  kernel_bvh[my_index] = node;
-  return my_index;
+  // Grow each treelet from its root by taking the node with the largest
+  // surface area (the one most rays visit) until it fills a page. The nodes
+  // left on the frontier root the next treelets, which are laid out
+  // depth-first so that a treelet is followed by the ones hanging off it.
+  // Parents always precede their children, and the root stays at 0.
+  size_t treelet_size = std::max<size_t>(
+      1, TREELET_BYTES / sizeof(kernel_bvh_node_t));
+  auto smaller = [](const BVHNode *a, const BVHNode *b) {
+    return a->bb.surface_area() < b->bb.surface_area();
+  };
+  std::vector<BVHNode*> roots(1, root);
+  std::vector<BVHNode*> frontier, treelet;
+  while (!roots.empty()) {
+    frontier.assign(1, roots.back());
+    roots.pop_back();
+    treelet.clear();
+    while (treelet.size() < treelet_size && !frontier.empty()) {
+      std::pop_heap(frontier.begin(), frontier.end(), smaller);
+      BVHNode *node = frontier.back();
+      frontier.pop_back();
+      treelet.push_back(node);
+      if (!node->isLeaf()) {
+        frontier.push_back(node->l);
+        std::push_heap(frontier.begin(), frontier.end(), smaller);
+        frontier.push_back(node->r);
+        std::push_heap(frontier.begin(), frontier.end(), smaller);
+      }
+    }
+    std::sort(treelet.begin(), treelet.end(), by_rank);
+    order.insert(order.end(), treelet.begin(), treelet.end());
+    // Pushed in reverse, so the leftmost subtree is laid out next
+    std::sort(frontier.rbegin(), frontier.rend(), by_rank);
+    roots.insert(roots.end(), frontier.begin(), frontier.end());
+  }
 }
 
 void BVHAccel::kernel_struct(std::vector<kernel_bvh_node_t>& kernel_bvh,
                              std::vector<kernel_primitive_t>& kernel_primitives,
-                             std::vector<kernel_bsdf_t>& kernel_bsdfs) {
+                             std::vector<kernel_bsdf_t>& kernel_bsdfs,
+                             std::vector<Primitive*> *kernel_sources) {
+  kernel_bvh.clear();
+  kernel_primitives.clear();
+  kernel_primitives.reserve(primitives.size());
+  std::vector<Primitive*> sources;
+  sources.reserve(primitives.size());
   std::vector<BSDF*> bsdf_pointers;
-  root->kernel_struct(kernel_bvh, kernel_primitives, bsdf_pointers, 0);
+  kernel_append(kernel_bvh, kernel_primitives, bsdf_pointers, sources);
+
+  // The BVH of each instanced mesh follows once, however many instances it
+  // has, and their records point at its root.
+  std::unordered_map<const BVHAccel*, cl_uint> roots;
+  size_t top_level = kernel_primitives.size();
+  for (size_t k = 0; k < top_level; k++) {
+    if (kernel_primitives[k].type != KERNEL_PRIMITIVE_TYPE_INSTANCE) continue;
+    BVHAccel *mesh_bvh = static_cast<Instance*>(sources[k])->get_mesh()->get_bvh();
+    auto root = roots.find(mesh_bvh);
+    if (root == roots.end()) {
+      root = roots.insert(std::make_pair(mesh_bvh, (cl_uint) kernel_bvh.size())).first;
+      mesh_bvh->kernel_append(kernel_bvh, kernel_primitives, bsdf_pointers, sources);
+    }
+    kernel_primitives[k].instance.root = root->second;
+  }
+
+  kernel_bsdfs.clear();
   for (auto& bsdf : bsdf_pointers) {
     kernel_bsdf_t kernel_bsdf;
+    memset(&kernel_bsdf, 0, sizeof(kernel_bsdf));
     bsdf->kernel_struct(&kernel_bsdf);
     kernel_bsdfs.push_back(kernel_bsdf);
   }
+  if (kernel_sources) kernel_sources->swap(sources);
+}
+
+void BVHAccel::kernel_append(std::vector<kernel_bvh_node_t>& kernel_bvh,
+                             std::vector<kernel_primitive_t>& kernel_primitives,
+                             std::vector<BSDF*>& bsdf_pointers,
+                             std::vector<Primitive*>& kernel_sources) {
+  kernel_layout(kernel_order);
+  size_t n = kernel_order.size();
+  size_t base = kernel_bvh.size();
+  std::unordered_map<const BVHNode*, size_t> index;
+  index.reserve(n);
+  for (size_t i = 0; i < n; i++) index[kernel_order[i]] = base + i;
+
+  // Threaded links: a hit continues with the left child, a miss with the
+  // node after the subtree (the right sibling, or whatever follows the
+  // parent). An exit index of 0 ends the traversal, as only the root of the
+  // whole array can be at 0, and is not offset by base. Parents come before
+  // their children, so exits are known in time.
+  kernel_bvh.resize(base + n, kernel_bvh_node_t());
+  std::vector<size_t> exits(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    const BVHNode *node = kernel_order[i];
+    kernel_bvh_node_t& kernel_node = kernel_bvh[base + i];
+    kernel_node.bounds[0] = cglVectorToKernel(node->bb.min);
+    kernel_node.bounds[1] = cglVectorToKernel(node->bb.max);
+    kernel_node.exit_index = exits[i];
+    if (node->isLeaf()) {
+      // For leaf nodes, entry_index == exit_index
+      kernel_node.entry_index = exits[i];
+      kernel_node.prim_count = node->range;
+      kernel_node.prim_index = kernel_primitives.size();
+      for (size_t p = node->start; p < node->start + node->range; p++) {
+        // Zeroed so that kernel_refit can compare records bytewise
+        kernel_primitive_t kernel_prim;
+        memset(&kernel_prim, 0, sizeof(kernel_prim));
+        primitives[p]->kernel_struct(&kernel_prim, bsdf_pointers);
+        kernel_primitives.push_back(kernel_prim);
+        kernel_sources.push_back(primitives[p]);
+      }
+    } else {
+      size_t left = index[node->l];
+      size_t right = index[node->r];
+      exits[left - base] = right;
+      exits[right - base] = exits[i];
+      kernel_node.entry_index = left;
+      kernel_node.prim_count = 0;
+      kernel_node.prim_index = 0;
+    }
+  }
+}
+
+BBox BVHNode::refit(const std::vector<Primitive*>& primitives) {
+  if (isLeaf()) {
+    // References made by spatial splits get the full primitive bounds
+    // again, which is conservative but no longer tight.
+    bb = BBox();
+    for (size_t i = start; i < start + range; i++) {
+      bb.expand(primitives[i]->get_bbox());
+    }
+  } else {
+    bb = l->refit(primitives);
+    bb.expand(r->refit(primitives));
+  }
+  return bb;
+}
+
+static bool kernel_vector_equal(const cl_float3& a, const cl_float3& b) {
+  return a.s[0] == b.s[0] && a.s[1] == b.s[1] && a.s[2] == b.s[2];
+}
+
+void BVHAccel::refit() {
+  if (root) root->refit(primitives);
+  pack_triangles();
+}
+
+void BVHAccel::kernel_refit(std::vector<kernel_bvh_node_t>& kernel_bvh,
+                            std::vector<kernel_primitive_t>& kernel_primitives,
+                            DirtyRanges *dirty_nodes, DirtyRanges *dirty_prims) {
+  // BSDF indices are handed out in visiting order, so a fresh list
+  // reproduces the indices kernel_struct assigned.
+  std::vector<BSDF*> bsdf_pointers;
+  for (size_t i = 0; i < kernel_order.size(); i++) {
+    const BVHNode *node = kernel_order[i];
+    kernel_bvh_node_t& kernel_node = kernel_bvh[i];
+    cl_float3 lo = cglVectorToKernel(node->bb.min);
+    cl_float3 hi = cglVectorToKernel(node->bb.max);
+    if (!kernel_vector_equal(kernel_node.bounds[0], lo) ||
+        !kernel_vector_equal(kernel_node.bounds[1], hi)) {
+      kernel_node.bounds[0] = lo;
+      kernel_node.bounds[1] = hi;
+      dirty_nodes->add(i);
+    }
+    if (!node->isLeaf()) continue;
+
+    for (size_t j = 0; j < node->range; j++) {
+      kernel_primitive_t kernel_prim;
+      memset(&kernel_prim, 0, sizeof(kernel_prim));
+      primitives[node->start + j]->kernel_struct(&kernel_prim, bsdf_pointers);
+      size_t k = kernel_node.prim_index + j;
+      // Instanced meshes don't move, so their BVHs stay where they are.
+      if (kernel_prim.type == KERNEL_PRIMITIVE_TYPE_INSTANCE) {
+        kernel_prim.instance.root = kernel_primitives[k].instance.root;
+      }
+      if (memcmp(&kernel_prim, &kernel_primitives[k], sizeof(kernel_prim))) {
+        kernel_primitives[k] = kernel_prim;
+        dirty_prims->add(k);
+      }
+    }
+  }
 }
 
 }  // namespace StaticScene
@@ -5,9 +5,39 @@
 #include "static_scene/aggregate.h"
 
 #include <vector>
+#include <utility>
 
 namespace CGL { namespace StaticScene {
 
+class Triangle;
+
+/**
+ * Half-open index ranges [first, second) of a kernel array that need to be
+ * uploaded again. Indices must be added in increasing order; ranges that
+ * are at most merge_gap elements apart are merged, trading a few redundant bytes
+ * for fewer transfers.
+ */
+struct DirtyRanges {
+
+  DirtyRanges(size_t merge_gap = 16) : merge_gap(merge_gap), count(0) { }
+
+  void add(size_t index) {
+    count++;
+    if (!ranges.empty() && index <= ranges.back().second + merge_gap) {
+      ranges.back().second = index + 1;
+    } else {
+      ranges.push_back(std::make_pair(index, index + 1));
+    }
+  }
+
+  void clear() { ranges.clear(); count = 0; }
+  bool empty() const { return ranges.empty(); }
+
+  std::vector<std::pair<size_t, size_t> > ranges;
+  size_t merge_gap; ///< largest gap that is uploaded along with its neighbors
+  size_t count;     ///< number of indices actually changed
+
+};
 
 /**
  * A node in the BVH accelerator aggregate.
@@ -21,24 +51,91 @@ namespace CGL { namespace StaticScene {
  */
 struct BVHNode {
 
-  BVHNode(BBox bb): bb(bb), l(NULL), r(NULL), prims(NULL) { }
+  BVHNode(BBox bb, size_t start, size_t range)
+      : bb(bb), start(start), range(range), l(NULL), r(NULL) { }
 
   ~BVHNode() {
-    if (prims) delete prims;
     if (l) delete l;
     if (r) delete r;
   }
 
   inline bool isLeaf() const { return l == NULL && r == NULL; }
-  size_t kernel_struct(std::vector<kernel_bvh_node_t>& kernel_bvh,
-                       std::vector<kernel_primitive_t>& kernel_primitives,
-                       std::vector<BSDF*>& bsdf_pointers,
-                       size_t exit_index);
+
+  /**
+   * Recompute the bounds of this subtree from the current primitive bounds,
+   * bottom-up, without changing its structure.
+   */
+  BBox refit(const std::vector<Primitive*>& primitives);
 
   BBox bb;        ///< bounding box of the node
+  size_t start;   ///< start index into the primitive vector
+  size_t range;   ///< range of index into the primitive vector
   BVHNode* l;     ///< left child node
   BVHNode* r;     ///< right child node
-  std::vector<Primitive *> *prims;
+
+};
+
+/**
+ * A triangle as the C++ traversal tests it: the first vertex and the two
+ * edges from it, precomputed and stored in the same order as the primitives
+ * of the BVH, so that a leaf reads one contiguous block without going
+ * through the mesh. Shading data is only looked up, through triangle, for
+ * the closest hit. Other primitives have a NULL triangle and are tested
+ * through their Primitive interface.
+ */
+struct PackedTriangle {
+  Vector3D p0;     ///< first vertex
+  Vector3D e1;     ///< second vertex - first vertex
+  Vector3D e2;     ///< third vertex - first vertex
+  const Triangle *triangle; ///< triangle the record was made from
+};
+
+/**
+ * Parameters of the binned SAH builder.
+ * Costs are relative: only the ratio of traversal_cost to intersection_cost
+ * changes the tree that gets built.
+ * With spatial_splits enabled the builder produces an SBVH (Stich et al.
+ * 2009): a node may also be split by a plane that cuts primitives in two,
+ * in which case the primitive is referenced from both sides. The number of
+ * extra references is bounded by max_duplication times the primitive count.
+ * The build runs on one thread and takes several times longer. It helps
+ * most where long, thin triangles overlap many nodes.
+ */
+struct BVHBuildParams {
+
+  /**
+   * Order of the nodes in the flattened BVH.
+   */
+  enum Layout {
+    DEPTH_FIRST,  ///< pre-order, right subtree first
+    TREELETS      ///< page-sized treelets of the most visited nodes
+  };
+
+  BVHBuildParams(size_t max_leaf_size = 4, size_t num_buckets = 16,
+                 double traversal_cost = 1.0, double intersection_cost = 1.0)
+      : max_leaf_size(max_leaf_size), num_buckets(num_buckets),
+        traversal_cost(traversal_cost), intersection_cost(intersection_cost),
+        spatial_splits(false), max_duplication(0.3),
+        spatial_split_alpha(1e-5), refit_tolerance(0.3), layout(DEPTH_FIRST),
+        optimize_passes(0) { }
+
+  size_t max_leaf_size;     ///< leaves are never larger than this
+  size_t num_buckets;       ///< number of SAH bins per axis
+  double traversal_cost;    ///< cost of visiting an interior node
+  double intersection_cost; ///< cost of testing one primitive in a leaf
+
+  bool spatial_splits;        ///< also consider spatial splits (SBVH)
+  double max_duplication;     ///< extra references allowed, per primitive
+  double spatial_split_alpha; ///< min child overlap (relative to the root
+                              ///< surface area) to try a spatial split
+
+  double refit_tolerance; ///< relative SAH growth a refit may cause before
+                          ///< the tree should be rebuilt instead
+
+  Layout layout;          ///< node order of the flattened BVH
+
+  size_t optimize_passes; ///< batches of reinsertions BVHAccel::optimize
+                          ///< may run, 0 for no optimization
 
 };
 
@@ -64,6 +161,15 @@ class BVHAccel : public Aggregate {
    */
   BVHAccel(const std::vector<Primitive*>& primitives, size_t max_leaf_size = 4);
 
+  /**
+   * Parameterized Constructor.
+   * Same as above, but with full control over the SAH builder.
+   * \param primitives primitives to build from
+   * \param params SAH build parameters
+   */
+  BVHAccel(const std::vector<Primitive*>& primitives,
+           const BVHBuildParams& params);
+
   /**
    * Destructor.
    * The destructor only destroys the Aggregate itself, the primitives that
@@ -120,6 +226,49 @@ class BVHAccel : public Aggregate {
    */
   BSDF* get_bsdf() const { return NULL; }
 
+  /**
+   * SAH cost of the whole tree, normalized by the surface area of the root
+   * and measured with the costs the tree was built with.
+   */
+  double sah_cost() const;
+
+  /**
+   * SAH cost of the tree right after it was built.
+   */
+  double build_sah_cost() const { return build_cost; }
+
+  /**
+   * Lower the SAH cost of the tree by removing badly placed nodes and
+   * reinserting their subtrees where they cost the least (Bittner et al.
+   * 2013). Only changes that lower the cost are kept, so the tree never
+   * gets worse. Leaves are left as they are. The result only depends on
+   * the tree and the pass count, never on how fast the machine is.
+   * \param max_passes batches of reinsertions to run at most
+   */
+  void optimize(size_t max_passes);
+
+  /**
+   * Update all node bounds after the primitives moved. The tree structure
+   * and primitive order are kept, so the result only stays efficient for
+   * small deformations; compare sah_cost() against build_sah_cost() to
+   * decide when to rebuild instead.
+   */
+  void refit();
+
+  /**
+   * Bring arrays produced by kernel_struct up to date after a refit.
+   * \param dirty_nodes receives the node indices that changed
+   * \param dirty_prims receives the primitive indices that changed
+   */
+  void kernel_refit(std::vector<kernel_bvh_node_t>& kernel_bvh,
+                    std::vector<kernel_primitive_t>& kernel_primitives,
+                    DirtyRanges *dirty_nodes, DirtyRanges *dirty_prims);
+
+  /**
+   * Parameters the tree was built with.
+   */
+  const BVHBuildParams& get_params() const { return params; }
+
   /**
    * Get entry point (root) - used in visualizer
    */
@@ -140,14 +289,69 @@ class BVHAccel : public Aggregate {
   void kernel_struct(kernel_primitive_t *kernel_primitive,
                      std::vector<BSDF*>& bsdf_pointers) { };
 
+  /**
+   * Flatten the BVH into the arrays pathtrace_pixel takes, replacing their
+   * contents. Nodes are ordered as set by BVHBuildParams::layout, with the
+   * root at index 0, and primitive records follow the order of the leaves.
+   * The BVHs of the meshes of Instance primitives are appended after that,
+   * one per mesh, each with its nodes and then its records.
+   * \param kernel_sources if given, receives the primitive each record was
+   *        made from
+   */
   void kernel_struct(std::vector<kernel_bvh_node_t>& kernel_bvh,
                      std::vector<kernel_primitive_t>& kernel_primitives,
-                     std::vector<kernel_bsdf_t>& kernel_bsdfs);
+                     std::vector<kernel_bsdf_t>& kernel_bsdfs,
+                     std::vector<Primitive*> *kernel_sources = NULL);
+
+  /**
+   * Packed copies of the triangles in primitives, same order.
+   */
+  const std::vector<PackedTriangle>& get_packed_triangles() const {
+    return packed_triangles;
+  }
 
   mutable unsigned long long total_rays, total_isects;
  private:
   BVHNode* root; ///< root node of the BVH
-  BVHNode *construct_bvh(const std::vector<Primitive*>& prims, size_t max_leaf_size);
+  BVHBuildParams params; ///< parameters the BVH was built with
+  std::vector<PackedTriangle> packed_triangles; ///< parallel to primitives
+  double build_cost;     ///< SAH cost when the tree was built
+
+  void build(const std::vector<Primitive*>& prims);
+  BVHNode *construct_bvh(size_t start, size_t end);
+  BVHNode *construct_sbvh(std::vector<size_t>& refs, size_t depth);
+  double find_split(const size_t *refs, size_t count,
+                    const BBox& centroid_bbox, int *best_axis,
+                    size_t *best_split, BBox *left_bbox = NULL,
+                    BBox *right_bbox = NULL) const;
+  double find_spatial_split(const std::vector<size_t>& refs,
+                            const BBox& bbox, int *best_axis,
+                            double *best_plane) const;
+  double sah_cost(BVHNode *node) const;
+  void pack_triangles();
+  bool intersect_closest(const Ray& r, Intersection* i, BVHNode *node,
+                         size_t *hit, double *hit_u, double *hit_v) const;
+  void assign_ranges(BVHNode *node, const std::vector<Primitive*>& prims,
+                     std::vector<Primitive*>& ordered);
+  void kernel_layout(std::vector<BVHNode*>& order) const;
+  void kernel_append(std::vector<kernel_bvh_node_t>& kernel_bvh,
+                     std::vector<kernel_primitive_t>& kernel_primitives,
+                     std::vector<BSDF*>& bsdf_pointers,
+                     std::vector<Primitive*>& kernel_sources);
+
+  std::vector<BVHNode*> kernel_order; ///< node order of the last flattening
+
+  // Per-reference data cached for the duration of a build. A reference is
+  // a primitive (build_prims) together with the part of its bounds that a
+  // node covers. Without spatial splits there is exactly one reference per
+  // input primitive and the builder partitions build_indices in place.
+  const std::vector<Primitive*> *build_input;
+  std::vector<BBox> build_bboxes;
+  std::vector<Vector3D> build_centroids;
+  std::vector<size_t> build_prims;
+  std::vector<size_t> build_indices;
+  size_t build_max_refs;   ///< reference budget for spatial splits
+  double build_min_overlap; ///< overlap area that enables spatial splits
 };
 
 } // namespace StaticScene
@@ -0,0 +1,254 @@
+#include "bvh4.h"
+#include "bvh4_traverse.h"
+
+#include "static_scene/triangle.h"
+
+#include <cstring>
+#include <limits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace CGL { namespace StaticScene {
+
+#ifdef __SSE2__
+
+namespace {
+
+/**
+ * The scalar steps on four lanes at once, with SSE2, which every x86-64
+ * CPU has.
+ */
+struct SSE2Ops {
+
+  struct Ray4 {
+    Ray4(const Ray& r) {
+      for (int a = 0; a < 3; a++) {
+        float d_a = (float) r.d[a];
+        o[a] = _mm_set1_ps((float) r.o[a]);
+        d[a] = _mm_set1_ps(d_a);
+        inv_d[a] = _mm_set1_ps(1.0f / d_a);
+        near[a] = std::signbit(d_a) ? a + 3 : a;
+      }
+    }
+    __m128 o[3], d[3], inv_d[3];
+    int near[3];
+  };
+
+  static int intersect_boxes(const BVH4Node& node, const Ray4& r,
+                             float min_t, float max_t, float *t_near) {
+    __m128 t0 = _mm_set1_ps(min_t), t1 = _mm_set1_ps(max_t);
+    for (int a = 0; a < 3; a++) {
+      int near = r.near[a], far = near < 3 ? near + 3 : near - 3;
+      __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[near]), r.o[a]),
+                             r.inv_d[a]);
+      __m128 tf = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(node.bounds[far]), r.o[a]),
+                             r.inv_d[a]);
+      // Operand order as in std::max/min, so NaNs are ignored the same way.
+      t0 = _mm_max_ps(tn, t0);
+      t1 = _mm_min_ps(tf, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+  }
+
+  static int intersect_triangles(const BVH4Triangles& tri, const Ray4& r,
+                                 float min_t, float max_t,
+                                 float *t, float *u, float *v) {
+    __m128 e1x = _mm_loadu_ps(tri.e1[0]), e1y = _mm_loadu_ps(tri.e1[1]),
+           e1z = _mm_loadu_ps(tri.e1[2]);
+    __m128 e2x = _mm_loadu_ps(tri.e2[0]), e2y = _mm_loadu_ps(tri.e2[1]),
+           e2z = _mm_loadu_ps(tri.e2[2]);
+    __m128 sx = _mm_sub_ps(r.o[0], _mm_loadu_ps(tri.p0[0]));
+    __m128 sy = _mm_sub_ps(r.o[1], _mm_loadu_ps(tri.p0[1]));
+    __m128 sz = _mm_sub_ps(r.o[2], _mm_loadu_ps(tri.p0[2]));
+
+    __m128 px = _mm_sub_ps(_mm_mul_ps(r.d[1], e2z), _mm_mul_ps(r.d[2], e2y));
+    __m128 py = _mm_sub_ps(_mm_mul_ps(r.d[2], e2x), _mm_mul_ps(r.d[0], e2z));
+    __m128 pz = _mm_sub_ps(_mm_mul_ps(r.d[0], e2y), _mm_mul_ps(r.d[1], e2x));
+    __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+
+    __m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)),
+                            _mm_mul_ps(e1z, pz));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    __m128 uu = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)),
+                                      _mm_mul_ps(sz, pz)), inv_det);
+    __m128 vv = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(r.d[0], qx), _mm_mul_ps(r.d[1], qy)),
+                                      _mm_mul_ps(r.d[2], qz)), inv_det);
+    __m128 tt = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                      _mm_mul_ps(e2z, qz)), inv_det);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 mask = _mm_cmpneq_ps(det, zero);
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(uu, zero));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(vv, zero));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f)));
+    mask = _mm_and_ps(mask, _mm_cmpge_ps(tt, _mm_set1_ps(min_t)));
+    mask = _mm_and_ps(mask, _mm_cmple_ps(tt, _mm_set1_ps(max_t)));
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(mask);
+  }
+
+};
+
+} // namespace
+
+const BVH4Traversal bvh4_traversal_sse2 = find_hit<SSE2Ops>;
+
+#else
+
+const BVH4Traversal bvh4_traversal_sse2 = NULL;
+
+#endif
+
+const BVH4Traversal bvh4_traversal_scalar = find_hit<ScalarOps>;
+
+static BVH4Traversal select_traversal(const char **isa) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  if (bvh4_traversal_avx2 && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    *isa = "AVX2";
+    return bvh4_traversal_avx2;
+  }
+#endif
+#ifdef __SSE2__
+  *isa = "SSE2";
+  return bvh4_traversal_sse2;
+#else
+  *isa = "scalar";
+  return bvh4_traversal_scalar;
+#endif
+}
+
+static void clear_lane(BVH4Node *node, int lane) {
+  const float inf = std::numeric_limits<float>::infinity();
+  for (int a = 0; a < 3; a++) {
+    node->bounds[a][lane] = inf;
+    node->bounds[a + 3][lane] = -inf;
+  }
+  node->child[lane] = 0;
+  node->count[lane] = 0;
+}
+
+static void set_lane_bounds(BVH4Node *node, int lane, const BBox& bb) {
+  for (int a = 0; a < 3; a++) {
+    node->bounds[a][lane] = bb.min[a];
+    node->bounds[a + 3][lane] = bb.max[a];
+  }
+}
+
+BVH4::BVH4(const BVHAccel& bvh) : primitives(bvh.primitives), stack_size(1) {
+  traversal = select_traversal(&isa);
+
+  const BVHNode *root = bvh.get_root();
+  if (!root) return;
+  nodes.resize(1);
+  if (root->isLeaf()) {
+    BVH4Node& node = nodes[0];
+    for (int i = 0; i < 4; i++) clear_lane(&node, i);
+    set_lane_bounds(&node, 0, root->bb);
+    make_leaf(root, &node, 0);
+    stack_size = 4;
+    return;
+  }
+  build(root, 0, 1);
+}
+
+void BVH4::build(const BVHNode *binary, size_t index, size_t depth) {
+  // Expanding a node pops one entry and pushes up to four.
+  stack_size = std::max(stack_size, 3 * depth + 1);
+
+  // Open the largest interior child until there are four.
+  const BVHNode *children[4] = { binary->l, binary->r, NULL, NULL };
+  int n = 2;
+  while (n < 4) {
+    int best = -1;
+    double best_area = -1;
+    for (int i = 0; i < n; i++) {
+      if (children[i]->isLeaf()) continue;
+      double area = children[i]->bb.surface_area();
+      if (area > best_area) {
+        best = i;
+        best_area = area;
+      }
+    }
+    if (best < 0) break;
+    const BVHNode *open = children[best];
+    children[best] = open->l;
+    children[n++] = open->r;
+  }
+
+  BVH4Node node;
+  for (int i = 0; i < 4; i++) clear_lane(&node, i);
+  for (int i = 0; i < n; i++) {
+    set_lane_bounds(&node, i, children[i]->bb);
+    if (children[i]->isLeaf()) {
+      make_leaf(children[i], &node, i);
+    } else {
+      node.child[i] = nodes.size();
+      nodes.push_back(BVH4Node());
+    }
+  }
+  nodes[index] = node;
+
+  for (int i = 0; i < n; i++) {
+    if (!children[i]->isLeaf()) build(children[i], node.child[i], depth + 1);
+  }
+}
+
+void BVH4::make_leaf(const BVHNode *leaf, BVH4Node *node, int lane) {
+  node->child[lane] = ~(int32_t) blocks.size();
+  node->count[lane] = (leaf->range + 3) / 4;
+
+  size_t end = leaf->start + leaf->range;
+  for (size_t p = leaf->start; p < end; p += 4) {
+    BVH4Triangles tri;
+    memset(&tri, 0, sizeof(tri));
+    for (int i = 0; i < 4 && p + i < end; i++) {
+      tri.prim[i] = p + i;
+      const Triangle *triangle = dynamic_cast<const Triangle*>(primitives[p + i]);
+      if (!triangle) {
+        tri.others |= 1 << i;
+        continue;
+      }
+      Vector3D p1, p2, p3;
+      triangle->get_vertices(&p1, &p2, &p3);
+      Vector3D e1 = p2 - p1, e2 = p3 - p1;
+      for (int a = 0; a < 3; a++) {
+        tri.p0[a][i] = p1[a];
+        tri.e1[a][i] = e1[a];
+        tri.e2[a][i] = e2[a];
+      }
+    }
+    blocks.push_back(tri);
+  }
+}
+
+bool BVH4::intersect(const Ray& ray) const {
+  BVH4Hit hit;
+  if (!traversal(*this, ray, true, &hit)) return false;
+  ray.max_t = hit.t;
+  return true;
+}
+
+bool BVH4::intersect(const Ray& ray, Intersection* i) const {
+  BVH4Hit hit;
+  if (!traversal(*this, ray, false, &hit)) return false;
+  if (hit.other) {
+    *i = hit.isect;
+    ray.max_t = hit.isect.t;
+  } else {
+    const Triangle *triangle = static_cast<const Triangle*>(primitives[hit.prim]);
+    triangle->fill_intersection(hit.t, hit.u, hit.v, i);
+    ray.max_t = hit.t;
+  }
+  return true;
+}
+
+} // namespace StaticScene
+} // namespace CGL
@@ -0,0 +1,120 @@
+#ifndef CGL_BVH4_H
+#define CGL_BVH4_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "bvh.h"
+#include "intersection.h"
+#include "ray.h"
+
+namespace CGL { namespace StaticScene {
+
+/**
+ * A node of the 4-wide BVH. The bounds of the four children are stored
+ * component by component (min x of all children, then min y, ...), so that
+ * one ray is tested against all four boxes at once. Unused children have
+ * empty bounds, which no ray hits.
+ */
+struct BVH4Node {
+  float bounds[6][4];  ///< min x, y, z, then max x, y, z, per child
+  int32_t child[4];    ///< node index, or ~first triangle block of a leaf
+  uint32_t count[4];   ///< number of triangle blocks of a leaf child
+};
+
+/**
+ * Up to four triangles of a leaf, stored component by component like the
+ * node bounds, as the first vertex and the edges from it. Unused lanes have
+ * zero edges, which no ray hits. Lanes set in others hold a primitive that
+ * is not a triangle; it is tested through its Primitive interface.
+ */
+struct BVH4Triangles {
+  float p0[3][4];
+  float e1[3][4];
+  float e2[3][4];
+  uint32_t prim[4];    ///< index into BVH4::primitives
+  uint32_t others;     ///< bit mask of the lanes that aren't triangles
+  uint32_t padding[3];
+};
+
+/**
+ * Closest hit found by a traversal. Triangle hits only store where the
+ * triangle was hit; other primitives fill isect themselves.
+ */
+struct BVH4Hit {
+  uint32_t prim;
+  float t, u, v;
+  bool other;           ///< isect holds the hit of a non-triangle
+  Intersection isect;
+};
+
+class BVH4;
+
+/**
+ * A traversal kernel: find the closest hit of the ray, or any hit.
+ */
+typedef bool (*BVH4Traversal)(const BVH4& bvh, const Ray& ray, bool any_hit,
+                              BVH4Hit *hit);
+
+/**
+ * 4-wide BVH for the C++ renderer, collapsed from a binary BVHAccel. Each
+ * node tests one ray against four child boxes, and each leaf tests four
+ * triangles at a time, in single precision. The kernel that does this is
+ * picked when the BVH is built, from what the CPU supports: AVX2 with FMA,
+ * SSE2, or plain C++.
+ * The BVH refers to the primitives of the BVHAccel it was built from, which
+ * must outlive it. It does not follow refits; build a new one instead.
+ */
+class BVH4 {
+ public:
+
+  BVH4(const BVHAccel& bvh);
+
+  /**
+   * Same as BVHAccel::intersect, and like it a hit shortens the ray.
+   */
+  bool intersect(const Ray& r) const;
+
+  /**
+   * Same as BVHAccel::intersect, and like it a hit shortens the ray.
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Name of the instruction set the traversal uses.
+   */
+  const char *get_isa() const { return isa; }
+
+  /**
+   * Bytes used by the nodes and triangle blocks.
+   */
+  size_t memory() const {
+    return nodes.size() * sizeof(BVH4Node) +
+           blocks.size() * sizeof(BVH4Triangles);
+  }
+
+  std::vector<BVH4Node> nodes;        ///< root at index 0
+  std::vector<BVH4Triangles> blocks;  ///< leaf triangles
+  std::vector<Primitive*> primitives; ///< primitives of the BVHAccel
+  size_t stack_size;  ///< traversal stack entries the tree can need
+
+ private:
+
+  void build(const BVHNode *node, size_t index, size_t depth);
+  void make_leaf(const BVHNode *leaf, BVH4Node *node, int lane);
+
+  BVH4Traversal traversal;
+  const char *isa;
+
+};
+
+// Traversal kernels, one per instruction set. A kernel that wasn't
+// compiled for this target is NULL.
+extern const BVH4Traversal bvh4_traversal_scalar;
+extern const BVH4Traversal bvh4_traversal_sse2;
+extern const BVH4Traversal bvh4_traversal_avx2;
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_BVH4_H
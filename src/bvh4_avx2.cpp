@@ -0,0 +1,138 @@
+// The AVX2 traversal. BVH4 only calls into it after checking that the CPU
+// has AVX2 and FMA.
+//
+// Only the functions defined below, between the target pragmas, may use
+// them. The file as a whole is built for the baseline instruction set:
+// inline functions it shares with the rest of the program (std::min,
+// Vector3D::operator[], ...) get weak copies here, and the linker may keep
+// any of those, so they must not contain AVX2 instructions. The headers
+// bvh4_traverse.h pulls in are therefore included before the pragmas, and
+// everything it defines itself is in an anonymous namespace.
+
+#include "bvh4.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include <immintrin.h>
+
+#ifdef __clang__
+#pragma clang attribute push (__attribute__((target("avx2,fma"))), \
+                              apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("avx2,fma")
+#endif
+
+#include "bvh4_traverse.h"
+
+namespace CGL { namespace StaticScene {
+
+namespace {
+
+/**
+ * The SSE2 steps with fused multiply-adds: slab distances become one
+ * fmsub per plane, cross and dot products lose half their roundings.
+ */
+struct AVX2Ops {
+
+  struct Ray4 {
+    Ray4(const Ray& r) {
+      for (int a = 0; a < 3; a++) {
+        float o_a = (float) r.o[a], d_a = (float) r.d[a];
+        o[a] = _mm_set1_ps(o_a);
+        d[a] = _mm_set1_ps(d_a);
+        inv_d[a] = _mm_set1_ps(1.0f / d_a);
+        o_inv_d[a] = _mm_set1_ps(o_a * (1.0f / d_a));
+        near[a] = std::signbit(d_a) ? a + 3 : a;
+      }
+    }
+    __m128 o[3], d[3], inv_d[3], o_inv_d[3];
+    int near[3];
+  };
+
+  static int intersect_boxes(const BVH4Node& node, const Ray4& r,
+                             float min_t, float max_t, float *t_near) {
+    __m128 t0 = _mm_set1_ps(min_t), t1 = _mm_set1_ps(max_t);
+    for (int a = 0; a < 3; a++) {
+      int near = r.near[a], far = near < 3 ? near + 3 : near - 3;
+      __m128 tn = _mm_fmsub_ps(_mm_loadu_ps(node.bounds[near]), r.inv_d[a],
+                               r.o_inv_d[a]);
+      __m128 tf = _mm_fmsub_ps(_mm_loadu_ps(node.bounds[far]), r.inv_d[a],
+                               r.o_inv_d[a]);
+      t0 = _mm_max_ps(tn, t0);
+      t1 = _mm_min_ps(tf, t1);
+    }
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmp_ps(t0, t1, _CMP_LE_OQ));
+  }
+
+  static int intersect_triangles(const BVH4Triangles& tri, const Ray4& r,
+                                 float min_t, float max_t,
+                                 float *t, float *u, float *v) {
+    __m128 e1x = _mm_loadu_ps(tri.e1[0]), e1y = _mm_loadu_ps(tri.e1[1]),
+           e1z = _mm_loadu_ps(tri.e1[2]);
+    __m128 e2x = _mm_loadu_ps(tri.e2[0]), e2y = _mm_loadu_ps(tri.e2[1]),
+           e2z = _mm_loadu_ps(tri.e2[2]);
+    __m128 sx = _mm_sub_ps(r.o[0], _mm_loadu_ps(tri.p0[0]));
+    __m128 sy = _mm_sub_ps(r.o[1], _mm_loadu_ps(tri.p0[1]));
+    __m128 sz = _mm_sub_ps(r.o[2], _mm_loadu_ps(tri.p0[2]));
+
+    __m128 px = _mm_fmsub_ps(r.d[1], e2z, _mm_mul_ps(r.d[2], e2y));
+    __m128 py = _mm_fmsub_ps(r.d[2], e2x, _mm_mul_ps(r.d[0], e2z));
+    __m128 pz = _mm_fmsub_ps(r.d[0], e2y, _mm_mul_ps(r.d[1], e2x));
+    __m128 qx = _mm_fmsub_ps(sy, e1z, _mm_mul_ps(sz, e1y));
+    __m128 qy = _mm_fmsub_ps(sz, e1x, _mm_mul_ps(sx, e1z));
+    __m128 qz = _mm_fmsub_ps(sx, e1y, _mm_mul_ps(sy, e1x));
+
+    __m128 det = _mm_fmadd_ps(e1x, px, _mm_fmadd_ps(e1y, py, _mm_mul_ps(e1z, pz)));
+    __m128 inv_det = _mm_div_ps(_mm_set1_ps(1.0f), det);
+    __m128 uu = _mm_mul_ps(_mm_fmadd_ps(sx, px, _mm_fmadd_ps(sy, py, _mm_mul_ps(sz, pz))),
+                           inv_det);
+    __m128 vv = _mm_mul_ps(_mm_fmadd_ps(r.d[0], qx, _mm_fmadd_ps(r.d[1], qy,
+                                        _mm_mul_ps(r.d[2], qz))), inv_det);
+    __m128 tt = _mm_mul_ps(_mm_fmadd_ps(e2x, qx, _mm_fmadd_ps(e2y, qy, _mm_mul_ps(e2z, qz))),
+                           inv_det);
+
+    __m128 zero = _mm_setzero_ps();
+    __m128 mask = _mm_cmp_ps(det, zero, _CMP_NEQ_OQ);
+    mask = _mm_and_ps(mask, _mm_cmp_ps(uu, zero, _CMP_GE_OQ));
+    mask = _mm_and_ps(mask, _mm_cmp_ps(vv, zero, _CMP_GE_OQ));
+    mask = _mm_and_ps(mask, _mm_cmp_ps(_mm_add_ps(uu, vv), _mm_set1_ps(1.0f), _CMP_LE_OQ));
+    mask = _mm_and_ps(mask, _mm_cmp_ps(tt, _mm_set1_ps(min_t), _CMP_GE_OQ));
+    mask = _mm_and_ps(mask, _mm_cmp_ps(tt, _mm_set1_ps(max_t), _CMP_LE_OQ));
+    _mm_storeu_ps(t, tt);
+    _mm_storeu_ps(u, uu);
+    _mm_storeu_ps(v, vv);
+    return _mm_movemask_ps(mask);
+  }
+
+};
+
+} // namespace
+
+const BVH4Traversal bvh4_traversal_avx2 = find_hit<AVX2Ops>;
+
+} // namespace StaticScene
+} // namespace CGL
+
+#ifdef __clang__
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#else
+
+namespace CGL { namespace StaticScene {
+
+const BVH4Traversal bvh4_traversal_avx2 = NULL;
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif
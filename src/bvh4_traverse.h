@@ -0,0 +1,182 @@
+#ifndef CGL_BVH4_TRAVERSE_H
+#define CGL_BVH4_TRAVERSE_H
+
+// Traversal of a BVH4, written once for any set of 4-wide operations. Every
+// kernel translation unit includes this with its own Ops, compiled for its
+// own instruction set, so everything defined here is in an anonymous
+// namespace: no copy built for one instruction set may end up called from
+// another. That does not hold for the inline functions it uses from other
+// headers; see bvh4_avx2.cpp for how that file keeps them baseline.
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <vector>
+
+#include "bvh4.h"
+
+namespace CGL { namespace StaticScene {
+namespace {
+
+// Stack entries kept on the call stack; deeper trees (see
+// BVH4::stack_size) get a stack on the heap.
+const size_t BVH4_STACK_SIZE = 128;
+
+/**
+ * Portable operations, one lane at a time. The SIMD ones follow exactly
+ * the same steps.
+ */
+struct ScalarOps {
+
+  struct Ray4 {
+    Ray4(const Ray& r) {
+      for (int a = 0; a < 3; a++) {
+        o[a] = r.o[a];
+        d[a] = r.d[a];
+        inv_d[a] = 1.0f / d[a];
+        near[a] = std::signbit(d[a]) ? a + 3 : a;
+      }
+    }
+    float o[3], d[3], inv_d[3];
+    int near[3];  ///< bounds row of the near plane, per axis
+  };
+
+  static int intersect_boxes(const BVH4Node& node, const Ray4& r,
+                             float min_t, float max_t, float *t_near) {
+    int mask = 0;
+    for (int i = 0; i < 4; i++) {
+      float t0 = min_t, t1 = max_t;
+      for (int a = 0; a < 3; a++) {
+        int near = r.near[a], far = near < 3 ? near + 3 : near - 3;
+        float tn = (node.bounds[near][i] - r.o[a]) * r.inv_d[a];
+        float tf = (node.bounds[far][i] - r.o[a]) * r.inv_d[a];
+        t0 = std::max(t0, tn);
+        t1 = std::min(t1, tf);
+      }
+      t_near[i] = t0;
+      if (t0 <= t1) mask |= 1 << i;
+    }
+    return mask;
+  }
+
+  static int intersect_triangles(const BVH4Triangles& tri, const Ray4& r,
+                                 float min_t, float max_t,
+                                 float *t, float *u, float *v) {
+    int mask = 0;
+    for (int i = 0; i < 4; i++) {
+      float e1[3] = { tri.e1[0][i], tri.e1[1][i], tri.e1[2][i] };
+      float e2[3] = { tri.e2[0][i], tri.e2[1][i], tri.e2[2][i] };
+      float s[3] = { r.o[0] - tri.p0[0][i], r.o[1] - tri.p0[1][i],
+                     r.o[2] - tri.p0[2][i] };
+      float p[3] = { r.d[1] * e2[2] - r.d[2] * e2[1],
+                     r.d[2] * e2[0] - r.d[0] * e2[2],
+                     r.d[0] * e2[1] - r.d[1] * e2[0] };
+      float q[3] = { s[1] * e1[2] - s[2] * e1[1],
+                     s[2] * e1[0] - s[0] * e1[2],
+                     s[0] * e1[1] - s[1] * e1[0] };
+      float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+      float inv_det = 1.0f / det;
+      u[i] = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * inv_det;
+      v[i] = (r.d[0] * q[0] + r.d[1] * q[1] + r.d[2] * q[2]) * inv_det;
+      t[i] = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * inv_det;
+      if (det != 0 && u[i] >= 0 && v[i] >= 0 && u[i] + v[i] <= 1 &&
+          t[i] >= min_t && t[i] <= max_t) {
+        mask |= 1 << i;
+      }
+    }
+    return mask;
+  }
+
+};
+
+template <class Ops>
+bool find_hit(const BVH4& bvh, const Ray& ray, bool any_hit, BVH4Hit *hit) {
+  if (bvh.nodes.empty()) return false;
+
+  typename Ops::Ray4 r(ray);
+  float min_t = (float) ray.min_t;
+  float max_t = (float) std::min<double>(ray.max_t, FLT_MAX);
+
+  struct Entry { int32_t ref; uint32_t count; float t; };
+  Entry local_stack[BVH4_STACK_SIZE];
+  std::vector<Entry> heap_stack;
+  Entry *stack = local_stack;
+  if (bvh.stack_size > BVH4_STACK_SIZE) {
+    heap_stack.resize(bvh.stack_size);
+    stack = heap_stack.data();
+  }
+  stack[0].ref = 0;
+  stack[0].count = 0;
+  stack[0].t = min_t;
+  int top = 1;
+  bool found = false;
+
+  while (top > 0) {
+    const Entry entry = stack[--top];
+    if (entry.t > max_t) continue;
+
+    if (entry.ref >= 0) {
+      const BVH4Node& node = bvh.nodes[entry.ref];
+      float t_near[4];
+      int mask = Ops::intersect_boxes(node, r, min_t, max_t, t_near);
+
+      // Push the children far to near, so that the nearest is popped first.
+      Entry children[4];
+      int n = 0;
+      for (int i = 0; i < 4; i++) {
+        if (!(mask & (1 << i))) continue;
+        Entry child = { node.child[i], node.count[i], t_near[i] };
+        int j = n++;
+        while (j > 0 && children[j - 1].t < child.t) {
+          children[j] = children[j - 1];
+          j--;
+        }
+        children[j] = child;
+      }
+      for (int i = 0; i < n; i++) stack[top++] = children[i];
+      continue;
+    }
+
+    for (uint32_t b = ~entry.ref; b < ~entry.ref + entry.count; b++) {
+      const BVH4Triangles& tri = bvh.blocks[b];
+      float t[4], u[4], v[4];
+      int mask = Ops::intersect_triangles(tri, r, min_t, max_t, t, u, v);
+      for (int i = 0; i < 4; i++) {
+        if (!(mask & (1 << i)) || t[i] > max_t) continue;
+        max_t = t[i];
+        hit->prim = tri.prim[i];
+        hit->t = t[i];
+        hit->u = u[i];
+        hit->v = v[i];
+        hit->other = false;
+        found = true;
+        if (any_hit) return true;
+      }
+
+      if (!tri.others) continue;
+      for (int i = 0; i < 4; i++) {
+        if (!(tri.others & (1 << i))) continue;
+        const Primitive *prim = bvh.primitives[tri.prim[i]];
+        Ray shortened = ray;
+        shortened.max_t = max_t;
+        if (any_hit ? !prim->intersect(shortened)
+                    : !prim->intersect(shortened, &hit->isect)) {
+          continue;
+        }
+        max_t = (float) shortened.max_t;
+        hit->prim = tri.prim[i];
+        hit->t = max_t;
+        hit->other = true;
+        found = true;
+        if (any_hit) return true;
+      }
+    }
+  }
+  return found;
+}
+
+} // namespace
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_BVH4_TRAVERSE_H
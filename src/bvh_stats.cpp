@@ -0,0 +1,323 @@
+#include "bvh_stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+namespace CGL { namespace StaticScene {
+
+// A node of either kind of BVH, in pre-order: the subtree of node i is
+// [i, end). Leaves reference primitives [first, first + count) of a list in
+// leaf order.
+struct StatsNode {
+  BBox bb;
+  size_t l, r;
+  size_t end;
+  size_t first, count;
+  size_t depth;
+};
+
+static const size_t NO_CHILD = (size_t) -1;
+
+static Vector3D kernel_vector(const cl_float3& v) {
+  return Vector3D(v.s[0], v.s[1], v.s[2]);
+}
+
+static double volume(const BBox& bb) {
+  if (bb.empty()) return 0;
+  return bb.extent.x * bb.extent.y * bb.extent.z;
+}
+
+static double overlap_volume(const BBox& a, const BBox& b) {
+  if (a.empty() || b.empty()) return 0;
+  double v = 1;
+  for (int axis = 0; axis < 3; axis++) {
+    double lo = max(a.min[axis], b.min[axis]);
+    double hi = min(a.max[axis], b.max[axis]);
+    if (hi <= lo) return 0;
+    v *= hi - lo;
+  }
+  return v;
+}
+
+static bool overlaps(const BBox& a, const BBox& b) {
+  for (int axis = 0; axis < 3; axis++) {
+    if (a.max[axis] < b.min[axis] || b.max[axis] < a.min[axis]) return false;
+  }
+  return true;
+}
+
+static double polygon_area(const Vector3D *p, size_t n) {
+  Vector3D sum;
+  for (size_t i = 1; i + 1 < n; i++) sum += cross(p[i] - p[0], p[i + 1] - p[0]);
+  return 0.5 * sum.norm();
+}
+
+// Area of the part of a triangle inside a box, by clipping it against the
+// six planes of the box (Sutherland-Hodgman).
+static double clipped_area(const Vector3D *tri, const BBox& bb) {
+  Vector3D buffers[2][9];
+  size_t n = 3;
+  copy(tri, tri + 3, buffers[0]);
+  int in = 0;
+  for (int plane = 0; plane < 6 && n > 0; plane++) {
+    int axis = plane / 2;
+    bool upper = plane % 2;
+    double bound = upper ? bb.max[axis] : bb.min[axis];
+    const Vector3D *src = buffers[in];
+    Vector3D *dst = buffers[1 - in];
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+      const Vector3D& a = src[i];
+      const Vector3D& b = src[(i + 1) % n];
+      double da = upper ? bound - a[axis] : a[axis] - bound;
+      double db = upper ? bound - b[axis] : b[axis] - bound;
+      if (da >= 0) dst[m++] = a;
+      if ((da >= 0) != (db >= 0)) dst[m++] = a + (b - a) * (da / (da - db));
+    }
+    n = m;
+    in = 1 - in;
+  }
+  return n < 3 ? 0 : polygon_area(buffers[in], n);
+}
+
+static BVHStats compute(const vector<StatsNode>& nodes,
+                        const vector<kernel_primitive_t>& refs,
+                        double traversal_cost, double intersection_cost) {
+  BVHStats stats;
+  if (nodes.empty()) return stats;
+  stats.nodes = nodes.size();
+  stats.references = refs.size();
+
+  vector<size_t> leaf_of(refs.size(), 0);
+  double cost = 0, empty = 0, interior_area = 0;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const StatsNode& node = nodes[i];
+    double area = node.bb.surface_area();
+    if (node.l == NO_CHILD) {
+      stats.leaves++;
+      stats.max_depth = max(stats.max_depth, node.depth);
+      if (stats.leaf_sizes.size() <= node.count) {
+        stats.leaf_sizes.resize(node.count + 1, 0);
+      }
+      stats.leaf_sizes[node.count]++;
+      if (stats.leaf_depths.size() <= node.depth) {
+        stats.leaf_depths.resize(node.depth + 1, 0);
+      }
+      stats.leaf_depths[node.depth]++;
+      for (size_t j = node.first; j < node.first + node.count; j++) {
+        leaf_of[j] = i;
+      }
+      cost += area * intersection_cost * node.count;
+    } else {
+      cost += area * traversal_cost;
+      double v = volume(node.bb);
+      if (v > 0) {
+        const BBox& l = nodes[node.l].bb;
+        const BBox& r = nodes[node.r].bb;
+        double covered = volume(l) + volume(r) - overlap_volume(l, r);
+        empty += area * min(1.0, max(0.0, 1 - covered / v));
+        interior_area += area;
+      }
+    }
+  }
+  double root_area = nodes[0].bb.surface_area();
+  stats.sah = root_area > 0 ? cost / root_area
+                            : intersection_cost * refs.size();
+  stats.empty_space = interior_area > 0 ? empty / interior_area : 0;
+
+  // EPO: every triangle against every node it overlaps but isn't part of
+  double overlap = 0, total_area = 0;
+  #pragma omp parallel for schedule(dynamic, 256) reduction(+:overlap, total_area)
+  for (size_t j = 0; j < refs.size(); j++) {
+    if (refs[j].type != KERNEL_PRIMITIVE_TYPE_TRIANGLE) continue;
+    Vector3D tri[3];
+    BBox tri_bb;
+    for (int k = 0; k < 3; k++) {
+      tri[k] = kernel_vector(refs[j].triangle.vertices[k]);
+      tri_bb.expand(tri[k]);
+    }
+    total_area += polygon_area(tri, 3);
+
+    size_t leaf = leaf_of[j];
+    vector<size_t> stack(1, 0);
+    while (!stack.empty()) {
+      size_t i = stack.back();
+      stack.pop_back();
+      const StatsNode& node = nodes[i];
+      if (!overlaps(tri_bb, node.bb)) continue;
+      bool ancestor = i <= leaf && leaf < node.end;
+      if (!ancestor) {
+        double c = node.l == NO_CHILD ? intersection_cost * node.count
+                                      : traversal_cost;
+        overlap += c * clipped_area(tri, node.bb);
+      }
+      if (node.l != NO_CHILD) {
+        stack.push_back(node.r);
+        stack.push_back(node.l);
+      }
+    }
+  }
+  stats.epo = total_area > 0 ? overlap / total_area : 0;
+  return stats;
+}
+
+// Appends the subtree of node in pre-order and returns its index.
+static size_t gather(const BVHNode *node, size_t depth,
+                     vector<StatsNode>& nodes) {
+  size_t i = nodes.size();
+  StatsNode n = { node->bb, NO_CHILD, NO_CHILD, 0,
+                  node->start, node->range, depth };
+  nodes.push_back(n);
+  if (!node->isLeaf()) {
+    size_t l = gather(node->l, depth + 1, nodes);
+    size_t r = gather(node->r, depth + 1, nodes);
+    nodes[i].l = l;
+    nodes[i].r = r;
+  }
+  nodes[i].end = nodes.size();
+  return i;
+}
+
+BVHStats::BVHStats()
+    : nodes(0), leaves(0), references(0), max_depth(0),
+      sah(0), epo(0), empty_space(0) { }
+
+BVHStats BVHStats::collect(const BVHAccel& bvh) {
+  vector<StatsNode> nodes;
+  if (bvh.get_root()) gather(bvh.get_root(), 0, nodes);
+
+  vector<kernel_primitive_t> refs(bvh.primitives.size());
+  vector<BSDF*> bsdf_pointers;
+  for (size_t i = 0; i < refs.size(); i++) {
+    bvh.primitives[i]->kernel_struct(&refs[i], bsdf_pointers);
+  }
+
+  const BVHBuildParams& params = bvh.get_params();
+  BVHStats stats = compute(nodes, refs, params.traversal_cost,
+                           params.intersection_cost);
+  stats.memory.push_back(make_pair(string("nodes"),
+                                   nodes.size() * sizeof(BVHNode)));
+  stats.memory.push_back(make_pair(string("primitives"),
+                                   refs.size() * sizeof(Primitive*)));
+  stats.memory.push_back(make_pair(string("packed triangles"),
+      bvh.get_packed_triangles().size() * sizeof(PackedTriangle)));
+  return stats;
+}
+
+BVHStats BVHStats::collect(const vector<kernel_bvh_node_t>& kernel_bvh,
+                           const vector<kernel_primitive_t>& kernel_primitives,
+                           const vector<kernel_bsdf_t>& kernel_bsdfs,
+                           double traversal_cost, double intersection_cost) {
+  // Rebuild the tree from the threaded links: a leaf has entry == exit, the
+  // left child of an interior node is its entry and the right child is
+  // where the left child exits to.
+  vector<StatsNode> nodes;
+  vector<kernel_primitive_t> refs;
+  refs.reserve(kernel_primitives.size());
+  vector<pair<size_t, size_t> > stack;  // kernel index, parent
+  if (!kernel_bvh.empty()) stack.push_back(make_pair(0, NO_CHILD));
+  while (!stack.empty() && nodes.size() < kernel_bvh.size()) {
+    size_t k = stack.back().first;
+    size_t parent = stack.back().second;
+    stack.pop_back();
+
+    const kernel_bvh_node_t& kernel_node = kernel_bvh[k];
+    size_t i = nodes.size();
+    StatsNode n = { BBox(kernel_vector(kernel_node.bounds[0]),
+                         kernel_vector(kernel_node.bounds[1])),
+                    NO_CHILD, NO_CHILD, 0, refs.size(), 0,
+                    parent == NO_CHILD ? 0 : nodes[parent].depth + 1 };
+    nodes.push_back(n);
+    if (parent != NO_CHILD) {
+      if (nodes[parent].l == NO_CHILD) nodes[parent].l = i;
+      else nodes[parent].r = i;
+    }
+
+    if (kernel_node.entry_index == kernel_node.exit_index) {
+      size_t first = min<size_t>(kernel_node.prim_index, kernel_primitives.size());
+      size_t last = min<size_t>(first + kernel_node.prim_count,
+                                kernel_primitives.size());
+      refs.insert(refs.end(), kernel_primitives.begin() + first,
+                  kernel_primitives.begin() + last);
+      nodes[i].count = last - first;
+    } else {
+      size_t l = kernel_node.entry_index;
+      size_t r = kernel_bvh[l].exit_index;
+      stack.push_back(make_pair(r, i));
+      stack.push_back(make_pair(l, i));
+    }
+  }
+
+  // Subtree ends, now that every node is placed
+  for (size_t i = nodes.size(); i-- > 0;) {
+    const StatsNode& node = nodes[i];
+    nodes[i].end = node.l == NO_CHILD ? i + 1 : nodes[node.r].end;
+  }
+
+  BVHStats stats = compute(nodes, refs, traversal_cost, intersection_cost);
+  stats.memory.push_back(make_pair(string("nodes"),
+      kernel_bvh.size() * sizeof(kernel_bvh_node_t)));
+  stats.memory.push_back(make_pair(string("primitives"),
+      kernel_primitives.size() * sizeof(kernel_primitive_t)));
+  stats.memory.push_back(make_pair(string("bsdfs"),
+      kernel_bsdfs.size() * sizeof(kernel_bsdf_t)));
+  return stats;
+}
+
+static void print_histogram(FILE *out, const char *name,
+                            const vector<size_t>& histogram) {
+  fprintf(out, "[PathTracer]   %s:", name);
+  for (size_t i = 0; i < histogram.size(); i++) {
+    if (histogram[i]) fprintf(out, " %lu:%lu", i, histogram[i]);
+  }
+  fprintf(out, "\n");
+}
+
+void BVHStats::print(FILE *out, const char *name) const {
+  fprintf(out, "[PathTracer] BVH stats (%s): %lu nodes, %lu leaves, "
+          "%lu references, max depth %lu\n",
+          name, nodes, leaves, references, max_depth);
+  fprintf(out, "[PathTracer]   SAH cost %.4f, EPO %.4f, empty space %.1f%%\n",
+          sah, epo, 100 * empty_space);
+  print_histogram(out, "leaf sizes", leaf_sizes);
+  print_histogram(out, "leaf depths", leaf_depths);
+  fprintf(out, "[PathTracer]   memory:");
+  for (size_t i = 0; i < memory.size(); i++) {
+    fprintf(out, "%s %s %.2f MB", i ? "," : "", memory[i].first.c_str(),
+            memory[i].second / (1024.0 * 1024.0));
+  }
+  fprintf(out, "\n");
+}
+
+static void write_json_array(ostream& out, const vector<size_t>& values) {
+  out << "[";
+  for (size_t i = 0; i < values.size(); i++) {
+    out << (i ? ", " : "") << values[i];
+  }
+  out << "]";
+}
+
+void BVHStats::write_json(ostream& out) const {
+  out << "{\"nodes\": " << nodes
+      << ", \"leaves\": " << leaves
+      << ", \"references\": " << references
+      << ", \"max_depth\": " << max_depth
+      << ", \"sah\": " << sah
+      << ", \"epo\": " << epo
+      << ", \"empty_space\": " << empty_space
+      << ", \"leaf_sizes\": ";
+  write_json_array(out, leaf_sizes);
+  out << ", \"leaf_depths\": ";
+  write_json_array(out, leaf_depths);
+  out << ", \"memory\": {";
+  for (size_t i = 0; i < memory.size(); i++) {
+    out << (i ? ", " : "") << "\"" << memory[i].first << "\": "
+        << memory[i].second;
+  }
+  out << "}}";
+}
+
+} // namespace StaticScene
+} // namespace CGL
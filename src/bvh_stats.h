@@ -0,0 +1,76 @@
+#ifndef CGL_BVH_STATS_H
+#define CGL_BVH_STATS_H
+
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "bvh.h"
+#include "kernel_types.h"
+
+namespace CGL { namespace StaticScene {
+
+/**
+ * Shape and quality measures of a BVH, so that builders can be compared
+ * without rendering.
+ * Costs are normalized by the surface area of the root, like
+ * BVHAccel::sah_cost(). EPO is the end-point overlap of Aila et al. 2013:
+ * the cost-weighted surface area of geometry that lies inside a node
+ * without belonging to its subtree, relative to the total surface area of
+ * the geometry. Only triangles count towards EPO. The empty space ratio
+ * is the share of an interior node's volume that neither child covers,
+ * averaged over the interior nodes weighted by their surface area.
+ */
+struct BVHStats {
+
+  BVHStats();
+
+  /**
+   * Measure a host BVH.
+   */
+  static BVHStats collect(const BVHAccel& bvh);
+
+  /**
+   * Measure a BVH flattened by BVHAccel::kernel_struct, or built by the
+   * LBVH builder. Costs are not stored in the arrays, so they are given.
+   */
+  static BVHStats collect(const std::vector<kernel_bvh_node_t>& kernel_bvh,
+                          const std::vector<kernel_primitive_t>& kernel_primitives,
+                          const std::vector<kernel_bsdf_t>& kernel_bsdfs,
+                          double traversal_cost = 1.0,
+                          double intersection_cost = 1.0);
+
+  /**
+   * Print the stats in the [PathTracer] log format.
+   * \param name what was measured, e.g. "host" or "kernel"
+   */
+  void print(FILE *out, const char *name) const;
+
+  /**
+   * Write the stats as a JSON object.
+   */
+  void write_json(std::ostream& out) const;
+
+  size_t nodes;       ///< interior nodes and leaves
+  size_t leaves;
+  size_t references;  ///< primitives referenced from leaves
+  size_t max_depth;   ///< of the deepest leaf, the root is at depth 0
+
+  std::vector<size_t> leaf_sizes;   ///< number of leaves by primitive count
+  std::vector<size_t> leaf_depths;  ///< number of leaves by depth
+
+  double sah;          ///< SAH cost
+  double epo;          ///< end-point overlap
+  double empty_space;  ///< empty space ratio of the interior nodes
+
+  /// Bytes used by each array of the BVH, by name
+  std::vector<std::pair<std::string, size_t> > memory;
+
+};
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_BVH_STATS_H
@@ -0,0 +1,207 @@
+#include "bvh_tuner.h"
+
+#include "bsdf.h"
+#include "bvh4.h"
+#include "flat_bvh.h"
+#include "sampler.h"
+#include "CGL/timer.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+using namespace std;
+
+namespace CGL { namespace StaticScene {
+
+// Values tried for each parameter, in the order they are tuned.
+static const size_t LEAF_SIZES[] = { 1, 2, 4, 8 };
+static const size_t BUCKET_COUNTS[] = { 8, 16, 32 };
+static const double COST_RATIOS[] = { 0.5, 1.0, 2.0 };
+
+// Each candidate is timed this many times, keeping the fastest run.
+static const int TUNING_RUNS = 3;
+
+// A candidate has to be this much faster to replace the best so far, so
+// that timing noise doesn't pick parameters.
+static const double TUNING_MIN_GAIN = 0.03;
+
+BVHTuner::BVHTuner(const vector<Primitive*>& primitives,
+                   const BVHBuildParams& base)
+    : primitives(primitives), base(base) { }
+
+double BVHTuner::measure(const BVHBuildParams& params,
+                         const Benchmark& benchmark) {
+  // Optimizing every candidate would dominate the tuning time, and it
+  // doesn't change which parameters build the better tree.
+  BVHBuildParams unoptimized = params;
+  unoptimized.optimize_passes = 0;
+  BVHAccel accel(primitives, unoptimized);
+  double time = benchmark(accel);
+  fprintf(stdout, "[PathTracer]   leaf size %lu, %lu buckets, cost ratio %.2f: "
+          "SAH %.4f, %.4f sec\n", params.max_leaf_size, params.num_buckets,
+          params.traversal_cost / params.intersection_cost,
+          accel.sah_cost(), time);
+  return time;
+}
+
+static bool better(double time, double best_time) {
+  return time < best_time * (1 - TUNING_MIN_GAIN);
+}
+
+BVHBuildParams BVHTuner::tune(const Benchmark& benchmark) {
+  BVHBuildParams best = base;
+  double best_time = measure(best, benchmark);
+
+  size_t leaf_size_tried = best.max_leaf_size;
+  for (size_t leaf_size : LEAF_SIZES) {
+    if (leaf_size == leaf_size_tried) continue;
+    BVHBuildParams params = best;
+    params.max_leaf_size = leaf_size;
+    double time = measure(params, benchmark);
+    if (better(time, best_time)) { best = params; best_time = time; }
+  }
+  size_t buckets_tried = best.num_buckets;
+  for (size_t buckets : BUCKET_COUNTS) {
+    if (buckets == buckets_tried) continue;
+    BVHBuildParams params = best;
+    params.num_buckets = buckets;
+    double time = measure(params, benchmark);
+    if (better(time, best_time)) { best = params; best_time = time; }
+  }
+  double ratio = best.traversal_cost / best.intersection_cost;
+  for (double r : COST_RATIOS) {
+    if (r == ratio) continue;
+    BVHBuildParams params = best;
+    params.traversal_cost = r * params.intersection_cost;
+    double time = measure(params, benchmark);
+    if (better(time, best_time)) { best = params; best_time = time; }
+  }
+
+  // Confirm the winner against the starting point with fresh timings,
+  // since it may only have won on a lucky run.
+  if (best.max_leaf_size != base.max_leaf_size ||
+      best.num_buckets != base.num_buckets ||
+      best.traversal_cost != base.traversal_cost) {
+    double base_time = measure(base, benchmark);
+    best_time = measure(best, benchmark);
+    if (!better(best_time, base_time)) best = base;
+  }
+
+  return best;
+}
+
+vector<Ray> BVHTuner::sample_rays(const BVHAccel& accel, const Camera& camera,
+                                  size_t count) {
+  mt19937 rng(184);
+  uniform_real_distribution<double> uniform(0, 1);
+  CosineWeightedHemisphereSampler3D hemisphere;
+
+  vector<Ray> rays;
+  rays.reserve(2 * count);
+  for (size_t i = 0; i < count; i++) {
+    Ray ray = camera.generate_ray(uniform(rng), uniform(rng));
+    rays.push_back(ray);
+
+    Intersection isect;
+    if (!accel.intersect(ray, &isect)) continue;
+    Vector3D n = dot(isect.n, ray.d) > 0 ? -isect.n : isect.n;
+    Matrix3x3 o2w;
+    make_coord_space(o2w, n);
+    Vector3D hit = ray.o + ray.d * isect.t;
+    Ray bounce(hit, o2w * hemisphere.get_sample());
+    bounce.min_t = EPS_D;
+    rays.push_back(bounce);
+  }
+  return rays;
+}
+
+double BVHTuner::time_cpu(BVHAccel& accel, const vector<Ray>& rays) {
+  vector<kernel_bvh_node_t> kernel_bvh;
+  vector<kernel_primitive_t> kernel_primitives;
+  vector<kernel_bsdf_t> kernel_bsdfs;
+  accel.kernel_struct(kernel_bvh, kernel_primitives, kernel_bsdfs);
+  FlatBVH flat(kernel_bvh.data(), kernel_bvh.size(), kernel_primitives.data());
+
+  Timer timer;
+  double best = INF_D;
+  for (int run = 0; run < TUNING_RUNS; run++) {
+    timer.start();
+    for (const Ray& ray : rays) {
+      Intersection isect;
+      Ray r = ray;
+      flat.intersect(r, &isect);
+    }
+    timer.stop();
+    best = min(best, timer.duration());
+  }
+  return best;
+}
+
+double BVHTuner::time_cpu_bvh4(BVHAccel& accel, const vector<Ray>& rays) {
+  BVH4 wide(accel);
+
+  Timer timer;
+  double best = INF_D;
+  for (int run = 0; run < TUNING_RUNS; run++) {
+    timer.start();
+    for (const Ray& ray : rays) {
+      Intersection isect;
+      Ray r = ray;
+      wide.intersect(r, &isect);
+    }
+    timer.stop();
+    best = min(best, timer.duration());
+  }
+  return best;
+}
+
+static string tuning_line(const string& backend, uint64_t scene_hash) {
+  ostringstream line;
+  line << backend << " " << hex << scene_hash;
+  return line.str();
+}
+
+bool BVHTuner::load(const string& path, const string& backend,
+                    uint64_t scene_hash, BVHBuildParams *params) {
+  ifstream in(path.c_str());
+  string prefix = tuning_line(backend, scene_hash) + " ";
+  string line;
+  while (getline(in, line)) {
+    if (line.compare(0, prefix.size(), prefix) != 0) continue;
+    istringstream fields(line.substr(prefix.size()));
+    BVHBuildParams tuned = *params;
+    if (fields >> tuned.max_leaf_size >> tuned.num_buckets
+               >> tuned.traversal_cost >> tuned.intersection_cost) {
+      *params = tuned;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BVHTuner::save(const string& path, const string& backend,
+                    uint64_t scene_hash, const BVHBuildParams& params) {
+  string key = tuning_line(backend, scene_hash);
+  vector<string> lines;
+  {
+    ifstream in(path.c_str());
+    string line;
+    while (getline(in, line)) {
+      if (line.compare(0, key.size() + 1, key + " ") != 0) lines.push_back(line);
+    }
+  }
+  ostringstream line;
+  line.precision(17);
+  line << key << " " << params.max_leaf_size << " " << params.num_buckets
+       << " " << params.traversal_cost << " " << params.intersection_cost;
+  lines.push_back(line.str());
+
+  ofstream out(path.c_str());
+  for (const string& l : lines) out << l << "\n";
+  return (bool) out;
+}
+
+} // namespace StaticScene
+} // namespace CGL
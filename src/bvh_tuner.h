@@ -0,0 +1,94 @@
+#ifndef CGL_BVH_TUNER_H
+#define CGL_BVH_TUNER_H
+
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bvh.h"
+#include "camera.h"
+#include "ray.h"
+
+namespace CGL { namespace StaticScene {
+
+/**
+ * Picks the BVH build parameters that trace a scene fastest on a given
+ * backend. Candidate trees are built and timed one parameter at a time:
+ * first the leaf size, then the number of SAH buckets, then the ratio of
+ * traversal to intersection cost, each time keeping the best value found
+ * so far. How a tree is timed is up to the backend.
+ */
+class BVHTuner {
+ public:
+
+  /**
+   * Times a sample workload on the given tree, in seconds.
+   */
+  typedef std::function<double(BVHAccel&)> Benchmark;
+
+  /**
+   * \param primitives primitives to build the candidate trees from
+   * \param base parameters to start from; the ones that aren't tuned
+   *        (spatial splits, layout, ...) are kept as they are
+   */
+  BVHTuner(const std::vector<Primitive*>& primitives,
+           const BVHBuildParams& base);
+
+  /**
+   * Build and time the candidate trees.
+   * \return the fastest parameters
+   */
+  BVHBuildParams tune(const Benchmark& benchmark);
+
+  /**
+   * A small ray set that resembles what a path tracer traces: camera rays
+   * over the whole view, and a diffuse bounce from wherever they hit.
+   * \param accel tree used to find the hit points of the camera rays
+   * \param camera camera the view is seen from
+   * \param count number of camera rays
+   */
+  static std::vector<Ray> sample_rays(const BVHAccel& accel,
+                                      const Camera& camera, size_t count);
+
+  /**
+   * Benchmark for the C++ renderer: the time the flattened tree takes to
+   * trace every ray of the set with FlatBVH, best of a few runs.
+   */
+  static double time_cpu(BVHAccel& accel, const std::vector<Ray>& rays);
+
+  /**
+   * Same as time_cpu, tracing with a BVH4 built from the tree instead.
+   */
+  static double time_cpu_bvh4(BVHAccel& accel, const std::vector<Ray>& rays);
+
+  /**
+   * Look up parameters tuned earlier for a scene and backend.
+   * \param path tuning file, see save()
+   * \param backend name of the backend, e.g. "cl" or "cpu"
+   * \param scene_hash hash of the scene file, see SceneCache::hash_file
+   * \param params receives the tuned parameters; other fields are kept
+   * \return true if the file has parameters for this scene and backend
+   */
+  static bool load(const std::string& path, const std::string& backend,
+                   uint64_t scene_hash, BVHBuildParams *params);
+
+  /**
+   * Store tuned parameters for a scene and backend. The file has one line
+   * per scene and backend; an existing line for the same pair is replaced.
+   * \return true on success
+   */
+  static bool save(const std::string& path, const std::string& backend,
+                   uint64_t scene_hash, const BVHBuildParams& params);
+
+ private:
+  double measure(const BVHBuildParams& params, const Benchmark& benchmark);
+
+  const std::vector<Primitive*>& primitives;
+  BVHBuildParams base;
+};
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_BVH_TUNER_H
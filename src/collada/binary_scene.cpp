@@ -0,0 +1,776 @@
+#include "binary_scene.h"
+
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace CGL { namespace Collada {
+
+// Bump whenever the layout of the file changes.
+static const uint32_t BINARY_SCENE_VERSION = 1;
+static const char BINARY_SCENE_MAGIC[8] = {'C', 'G', 'L', 'B', 'S', 'C', 'N', 0};
+
+// Files are written in host order, which is little-endian everywhere this
+// builds; the tag makes a host of the other order refuse them.
+static const uint32_t BINARY_SCENE_BYTE_ORDER = 0x01020304;
+
+// Tables and arrays start on cache line boundaries.
+static const size_t BINARY_SCENE_ALIGNMENT = 64;
+
+// Index of a missing instance or material.
+static const uint32_t NONE = 0xffffffff;
+
+// The records are laid out so that every field is naturally aligned and
+// there is no padding the compiler could choose differently.
+
+struct StringRef {
+  uint32_t offset, length;  ///< into the string table
+};
+
+struct NodeRecord {
+  StringRef id, name;
+  uint32_t instance_type;   ///< Instance::Type
+  uint32_t instance;        ///< into the table of that type, or NONE
+  double transform[16];     ///< column major
+};
+
+struct CameraRecord {
+  StringRef id, name;
+  double view_dir[3], up_dir[3];
+  float h_fov, v_fov, n_clip, f_clip;
+};
+
+struct LightRecord {
+  StringRef id, name;
+  uint32_t light_type;
+  float spectrum[3];
+  double position[3], direction[3], up[3];
+  float falloff_deg, falloff_exp;
+  float constant_att, linear_att, quadratic_att;
+  uint32_t padding;
+};
+
+// The BSDF parameters as kernel_struct gives them: the first spectrum is
+// the reflectance, eta, transmittance or radiance, the second k or the
+// glass reflectance, and value is alpha or the index of refraction.
+struct MaterialRecord {
+  StringRef id, name;
+  uint32_t bsdf_type;       ///< KERNEL_BSDF_TYPE_*
+  float spectra[2][3];
+  float value;
+};
+
+struct SphereRecord {
+  StringRef id, name;
+  float radius;
+  uint32_t material;
+};
+
+enum MeshArray {
+  VERTICES,          ///< 3 floats each
+  NORMALS,           ///< 3 floats each
+  TEXCOORDS,         ///< 2 floats each
+  POLYGON_OFFSETS,   ///< uint32_t, one more than there are polygons
+  VERTEX_INDICES,    ///< uint32_t
+  NORMAL_INDICES,    ///< uint32_t
+  TEXCOORD_INDICES,  ///< uint32_t
+  NUM_MESH_ARRAYS
+};
+
+struct MeshRecord {
+  StringRef id, name;
+  uint32_t material;
+  uint32_t padding;
+  uint64_t offsets[NUM_MESH_ARRAYS];
+  uint64_t counts[NUM_MESH_ARRAYS];
+};
+
+enum Table {
+  NODES, CAMERAS, LIGHTS, MATERIALS, SPHERES, MESHES, STRINGS, NUM_TABLES
+};
+
+struct BinarySceneHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t offsets[NUM_TABLES];
+  uint64_t counts[NUM_TABLES];  ///< records, or bytes of strings
+};
+
+static const size_t TABLE_RECORD_SIZES[NUM_TABLES] = {
+  sizeof(NodeRecord), sizeof(CameraRecord), sizeof(LightRecord),
+  sizeof(MaterialRecord), sizeof(SphereRecord), sizeof(MeshRecord), 1
+};
+
+static const size_t MESH_ELEMENT_SIZES[NUM_MESH_ARRAYS] = {
+  3 * sizeof(float), 3 * sizeof(float), 2 * sizeof(float),
+  sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t), sizeof(uint32_t)
+};
+
+static size_t align( size_t offset ) {
+  return (offset + BINARY_SCENE_ALIGNMENT - 1) / BINARY_SCENE_ALIGNMENT
+         * BINARY_SCENE_ALIGNMENT;
+}
+
+static bool in_bounds( uint64_t offset, uint64_t count, size_t element_size,
+                       size_t size ) {
+  return offset <= size && count <= (size - offset) / element_size;
+}
+
+static void copy3( float* dst, const Spectrum& s ) {
+  dst[0] = s.r; dst[1] = s.g; dst[2] = s.b;
+}
+
+static void copy3( float* dst, const cl_float3& v ) {
+  dst[0] = v.s[0]; dst[1] = v.s[1]; dst[2] = v.s[2];
+}
+
+static void copy3( double* dst, const Vector3D& v ) {
+  dst[0] = v.x; dst[1] = v.y; dst[2] = v.z;
+}
+
+static Spectrum to_spectrum( const float* s ) {
+  return Spectrum(s[0], s[1], s[2]);
+}
+
+static Vector3D to_vector( const double* v ) {
+  return Vector3D(v[0], v[1], v[2]);
+}
+
+/*
+  Everything save writes, gathered before the file is laid out.
+*/
+struct SceneTables {
+
+  vector<NodeRecord> nodes;
+  vector<CameraRecord> cameras;
+  vector<LightRecord> lights;
+  vector<MaterialRecord> materials;
+  vector<SphereRecord> spheres;
+  vector<MeshRecord> meshes;
+  string strings;
+
+  vector<const PolymeshInfo*> polymeshes;  ///< by mesh record
+
+  // Instances shared by several nodes are written once
+  map<const Instance*, uint32_t> indices;
+
+  StringRef add_string( const string& s ) {
+    StringRef ref = { (uint32_t) strings.size(), (uint32_t) s.size() };
+    strings += s;
+    return ref;
+  }
+
+  template <typename Record>
+  void name( Record& record, const Instance* instance ) {
+    record.id = add_string(instance->id);
+    record.name = add_string(instance->name);
+  }
+
+  // Returns false if the material's BSDF has no kernel form.
+  bool add_material( const MaterialInfo* material, uint32_t* index );
+
+  // Returns false if the instance can't be written.
+  bool add_instance( const Instance* instance, uint32_t* index );
+
+};
+
+bool SceneTables::add_material( const MaterialInfo* material,
+                                uint32_t* index ) {
+
+  if (!material || !material->bsdf) {
+    *index = NONE;
+    return true;
+  }
+  if (indices.count(material)) {
+    *index = indices[material];
+    return true;
+  }
+
+  kernel_bsdf_t bsdf;
+  memset(&bsdf, 0, sizeof(bsdf));
+  try {
+    material->bsdf->kernel_struct(&bsdf);
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+
+  MaterialRecord record;
+  memset(&record, 0, sizeof(record));
+  name(record, material);
+  record.bsdf_type = bsdf.type;
+  switch (bsdf.type) {
+    case KERNEL_BSDF_TYPE_DIFFUSE:
+      copy3(record.spectra[0], bsdf.u.diffuse.reflectance);
+      break;
+    case KERNEL_BSDF_TYPE_MIRROR:
+      copy3(record.spectra[0], bsdf.u.mirror.reflectance);
+      break;
+    case KERNEL_BSDF_TYPE_MICROFACET:
+      copy3(record.spectra[0], bsdf.u.microfacet.eta);
+      copy3(record.spectra[1], bsdf.u.microfacet.k);
+      record.value = bsdf.u.microfacet.alpha;
+      break;
+    case KERNEL_BSDF_TYPE_GLASS:
+      copy3(record.spectra[0], bsdf.u.glass.transmittance);
+      copy3(record.spectra[1], bsdf.u.glass.reflectance);
+      record.value = bsdf.u.glass.ior;
+      break;
+    case KERNEL_BSDF_TYPE_EMISSION:
+      copy3(record.spectra[0], bsdf.u.emission.radiance);
+      break;
+    default:
+      return false;
+  }
+
+  *index = indices[material] = materials.size();
+  materials.push_back(record);
+  return true;
+
+}
+
+bool SceneTables::add_instance( const Instance* instance, uint32_t* index ) {
+
+  if (indices.count(instance)) {
+    *index = indices[instance];
+    return true;
+  }
+
+  switch (instance->type) {
+    case Instance::CAMERA: {
+      const CameraInfo& camera = static_cast<const CameraInfo&>(*instance);
+      CameraRecord record;
+      memset(&record, 0, sizeof(record));
+      name(record, instance);
+      copy3(record.view_dir, camera.view_dir);
+      copy3(record.up_dir, camera.up_dir);
+      record.h_fov = camera.hFov;
+      record.v_fov = camera.vFov;
+      record.n_clip = camera.nClip;
+      record.f_clip = camera.fClip;
+      *index = cameras.size();
+      cameras.push_back(record);
+      break;
+    }
+    case Instance::LIGHT: {
+      const LightInfo& light = static_cast<const LightInfo&>(*instance);
+      LightRecord record;
+      memset(&record, 0, sizeof(record));
+      name(record, instance);
+      record.light_type = light.light_type;
+      copy3(record.spectrum, light.spectrum);
+      copy3(record.position, light.position);
+      copy3(record.direction, light.direction);
+      copy3(record.up, light.up);
+      record.falloff_deg = light.falloff_deg;
+      record.falloff_exp = light.falloff_exp;
+      record.constant_att = light.constant_att;
+      record.linear_att = light.linear_att;
+      record.quadratic_att = light.quadratic_att;
+      *index = lights.size();
+      lights.push_back(record);
+      break;
+    }
+    case Instance::SPHERE: {
+      const SphereInfo& sphere = static_cast<const SphereInfo&>(*instance);
+      SphereRecord record;
+      memset(&record, 0, sizeof(record));
+      name(record, instance);
+      record.radius = sphere.radius;
+      if (!add_material(sphere.material, &record.material)) return false;
+      *index = spheres.size();
+      spheres.push_back(record);
+      break;
+    }
+    case Instance::POLYMESH: {
+      const PolymeshInfo& polymesh = static_cast<const PolymeshInfo&>(*instance);
+      if (polymesh.vertices.size() > NONE ||
+          polymesh.normals.size() > NONE ||
+          polymesh.texcoords.size() > NONE ||
+          polymesh.vertex_indices.size() > NONE) return false;
+      MeshRecord record;
+      memset(&record, 0, sizeof(record));
+      name(record, instance);
+      if (!add_material(polymesh.material, &record.material)) return false;
+      record.counts[VERTICES] = polymesh.vertices.size();
+      record.counts[NORMALS] = polymesh.normals.size();
+      record.counts[TEXCOORDS] = polymesh.texcoords.size();
+      record.counts[POLYGON_OFFSETS] = polymesh.polygon_offsets.size();
+      record.counts[VERTEX_INDICES] = polymesh.vertex_indices.size();
+      record.counts[NORMAL_INDICES] = polymesh.normal_indices.size();
+      record.counts[TEXCOORD_INDICES] = polymesh.texcoord_indices.size();
+      *index = meshes.size();
+      meshes.push_back(record);
+      polymeshes.push_back(&polymesh);
+      break;
+    }
+    default:
+      return false;
+  }
+
+  indices[instance] = *index;
+  return true;
+
+}
+
+// Write zeros up to offset.
+static bool pad( FILE* file, size_t offset ) {
+  static const char zeros[BINARY_SCENE_ALIGNMENT] = { 0 };
+  long at = ftell(file);
+  return at >= 0 && (size_t) at <= offset &&
+         fwrite(zeros, 1, offset - at, file) == offset - at;
+}
+
+template <typename T>
+static bool write_array( FILE* file, size_t offset, const T* data, size_t n ) {
+  return pad(file, offset) && fwrite(data, sizeof(T), n, file) == n;
+}
+
+template <typename T>
+static bool write_array( FILE* file, size_t offset, const vector<T>& data ) {
+  return write_array(file, offset, data.data(), data.size());
+}
+
+static bool write_vectors( FILE* file, size_t offset,
+                           const vector<Vector3D>& vectors ) {
+  vector<float> floats(3 * vectors.size());
+  for (size_t i = 0; i < vectors.size(); i++) {
+    floats[3 * i    ] = vectors[i].x;
+    floats[3 * i + 1] = vectors[i].y;
+    floats[3 * i + 2] = vectors[i].z;
+  }
+  return write_array(file, offset, floats);
+}
+
+static bool write_vectors( FILE* file, size_t offset,
+                           const vector<Vector2D>& vectors ) {
+  vector<float> floats(2 * vectors.size());
+  for (size_t i = 0; i < vectors.size(); i++) {
+    floats[2 * i    ] = vectors[i].x;
+    floats[2 * i + 1] = vectors[i].y;
+  }
+  return write_array(file, offset, floats);
+}
+
+static bool write_indices( FILE* file, size_t offset,
+                           const vector<size_t>& indices ) {
+  vector<uint32_t> narrow(indices.begin(), indices.end());
+  return write_array(file, offset, narrow);
+}
+
+bool BinaryScene::is_binary( const char* filename ) {
+
+  FILE* file = fopen(filename, "rb");
+  if (!file) return false;
+  char magic[sizeof(BINARY_SCENE_MAGIC)];
+  bool binary = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                !memcmp(magic, BINARY_SCENE_MAGIC, sizeof(magic));
+  fclose(file);
+  return binary;
+
+}
+
+int BinaryScene::save( const char* filename, const SceneInfo* sceneInfo ) {
+
+  SceneTables tables;
+  for (size_t i = 0; i < sceneInfo->nodes.size(); i++) {
+    const Node& node = sceneInfo->nodes[i];
+    NodeRecord record;
+    memset(&record, 0, sizeof(record));
+    record.id = tables.add_string(node.id);
+    record.name = tables.add_string(node.name);
+    record.instance = NONE;
+    if (node.instance) {
+      record.instance_type = node.instance->type;
+      if (!tables.add_instance(node.instance, &record.instance)) return -1;
+    }
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 4; r++) {
+        record.transform[4 * c + r] = node.transform(r, c);
+      }
+    }
+    tables.nodes.push_back(record);
+  }
+
+  // Lay the file out: the header, the tables, then the mesh arrays.
+  BinarySceneHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BINARY_SCENE_MAGIC, sizeof(BINARY_SCENE_MAGIC));
+  header.version = BINARY_SCENE_VERSION;
+  header.byte_order = BINARY_SCENE_BYTE_ORDER;
+  header.counts[NODES] = tables.nodes.size();
+  header.counts[CAMERAS] = tables.cameras.size();
+  header.counts[LIGHTS] = tables.lights.size();
+  header.counts[MATERIALS] = tables.materials.size();
+  header.counts[SPHERES] = tables.spheres.size();
+  header.counts[MESHES] = tables.meshes.size();
+  header.counts[STRINGS] = tables.strings.size();
+
+  size_t offset = sizeof(header);
+  for (int t = 0; t < NUM_TABLES; t++) {
+    offset = align(offset);
+    header.offsets[t] = offset;
+    offset += header.counts[t] * TABLE_RECORD_SIZES[t];
+  }
+  for (size_t m = 0; m < tables.meshes.size(); m++) {
+    MeshRecord& record = tables.meshes[m];
+    for (int a = 0; a < NUM_MESH_ARRAYS; a++) {
+      offset = align(offset);
+      record.offsets[a] = offset;
+      offset += record.counts[a] * MESH_ELEMENT_SIZES[a];
+    }
+  }
+
+  FILE* file = fopen(filename, "wb");
+  if (!file) return -1;
+
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            write_array(file, header.offsets[NODES], tables.nodes) &&
+            write_array(file, header.offsets[CAMERAS], tables.cameras) &&
+            write_array(file, header.offsets[LIGHTS], tables.lights) &&
+            write_array(file, header.offsets[MATERIALS], tables.materials) &&
+            write_array(file, header.offsets[SPHERES], tables.spheres) &&
+            write_array(file, header.offsets[MESHES], tables.meshes) &&
+            write_array(file, header.offsets[STRINGS], tables.strings.data(),
+                        tables.strings.size());
+
+  for (size_t m = 0; ok && m < tables.meshes.size(); m++) {
+    const MeshRecord& record = tables.meshes[m];
+    const PolymeshInfo& polymesh = *tables.polymeshes[m];
+    ok = write_vectors(file, record.offsets[VERTICES], polymesh.vertices) &&
+         write_vectors(file, record.offsets[NORMALS], polymesh.normals) &&
+         write_vectors(file, record.offsets[TEXCOORDS], polymesh.texcoords) &&
+         write_indices(file, record.offsets[POLYGON_OFFSETS],
+                       polymesh.polygon_offsets) &&
+         write_indices(file, record.offsets[VERTEX_INDICES],
+                       polymesh.vertex_indices) &&
+         write_indices(file, record.offsets[NORMAL_INDICES],
+                       polymesh.normal_indices) &&
+         write_indices(file, record.offsets[TEXCOORD_INDICES],
+                       polymesh.texcoord_indices);
+  }
+
+  if (fclose(file) != 0) ok = false;
+  if (!ok) {
+    remove(filename);
+    return -1;
+  }
+  return 0;
+
+}
+
+/*
+  Builds a SceneInfo from a mapped file, checking every offset against the
+  size of the mapping before it is followed.
+*/
+class SceneReader {
+ public:
+
+  SceneReader( const char* data, size_t size )
+      : data(data), size(size),
+        header(*(const BinarySceneHeader*) data) { }
+
+  bool read( SceneInfo* sceneInfo );
+
+ private:
+
+  template <typename Record>
+  const Record* table( Table t ) const {
+    return (const Record*) (data + header.offsets[t]);
+  }
+
+  bool read_string( StringRef ref, string* s ) const {
+    if (ref.offset > header.counts[STRINGS] ||
+        ref.length > header.counts[STRINGS] - ref.offset) return false;
+    s->assign(data + header.offsets[STRINGS] + ref.offset, ref.length);
+    return true;
+  }
+
+  template <typename Record>
+  bool read_name( const Record& record, Instance* instance ) const {
+    return read_string(record.id, &instance->id) &&
+           read_string(record.name, &instance->name);
+  }
+
+  bool read_material( uint32_t index, MaterialInfo** material );
+  bool read_mesh( const MeshRecord& record, PolymeshInfo* polymesh );
+
+  const char* data;
+  size_t size;
+  const BinarySceneHeader& header;
+
+  vector<MaterialInfo*> materials;  ///< created as they are referenced
+
+};
+
+bool SceneReader::read_material( uint32_t index, MaterialInfo** material ) {
+
+  *material = NULL;
+  if (index == NONE) return true;
+  if (index >= header.counts[MATERIALS]) return false;
+  if (materials[index]) {
+    *material = materials[index];
+    return true;
+  }
+
+  const MaterialRecord& record = table<MaterialRecord>(MATERIALS)[index];
+  Spectrum a = to_spectrum(record.spectra[0]);
+  Spectrum b = to_spectrum(record.spectra[1]);
+  BSDF* bsdf;
+  switch (record.bsdf_type) {
+    case KERNEL_BSDF_TYPE_DIFFUSE:
+      bsdf = new DiffuseBSDF(a);
+      break;
+    case KERNEL_BSDF_TYPE_MIRROR:
+      bsdf = new MirrorBSDF(a);
+      break;
+    case KERNEL_BSDF_TYPE_MICROFACET:
+      bsdf = new MicrofacetBSDF(a, b, record.value);
+      break;
+    case KERNEL_BSDF_TYPE_GLASS:
+      bsdf = new GlassBSDF(a, b, 0, record.value);
+      break;
+    case KERNEL_BSDF_TYPE_EMISSION:
+      bsdf = new EmissionBSDF(a);
+      break;
+    default:
+      return false;
+  }
+
+  MaterialInfo* info = new MaterialInfo();
+  info->type = Instance::MATERIAL;
+  info->bsdf = bsdf;
+  if (!read_name(record, info)) return false;
+  *material = materials[index] = info;
+  return true;
+
+}
+
+bool SceneReader::read_mesh( const MeshRecord& record,
+                             PolymeshInfo* polymesh ) {
+
+  for (int a = 0; a < NUM_MESH_ARRAYS; a++) {
+    if (!in_bounds(record.offsets[a], record.counts[a],
+                   MESH_ELEMENT_SIZES[a], size)) return false;
+  }
+
+  const float* vertices = (const float*) (data + record.offsets[VERTICES]);
+  polymesh->vertices.resize(record.counts[VERTICES]);
+  for (size_t i = 0; i < polymesh->vertices.size(); i++) {
+    const float* v = vertices + 3 * i;
+    polymesh->vertices[i] = Vector3D(v[0], v[1], v[2]);
+  }
+
+  const float* normals = (const float*) (data + record.offsets[NORMALS]);
+  polymesh->normals.resize(record.counts[NORMALS]);
+  for (size_t i = 0; i < polymesh->normals.size(); i++) {
+    const float* n = normals + 3 * i;
+    polymesh->normals[i] = Vector3D(n[0], n[1], n[2]);
+  }
+
+  const float* texcoords = (const float*) (data + record.offsets[TEXCOORDS]);
+  polymesh->texcoords.resize(record.counts[TEXCOORDS]);
+  for (size_t i = 0; i < polymesh->texcoords.size(); i++) {
+    const float* t = texcoords + 2 * i;
+    polymesh->texcoords[i] = Vector2D(t[0], t[1]);
+  }
+
+  vector<size_t>* indices[] = {
+    &polymesh->polygon_offsets, &polymesh->vertex_indices,
+    &polymesh->normal_indices, &polymesh->texcoord_indices
+  };
+  for (int a = POLYGON_OFFSETS; a < NUM_MESH_ARRAYS; a++) {
+    const uint32_t* begin = (const uint32_t*) (data + record.offsets[a]);
+    indices[a - POLYGON_OFFSETS]->assign(begin, begin + record.counts[a]);
+  }
+
+  // The polygons have to cover the corners in order.
+  const vector<size_t>& offsets = polymesh->polygon_offsets;
+  for (size_t i = 1; i < offsets.size(); i++) {
+    if (offsets[i] < offsets[i - 1]) return false;
+  }
+  if (!offsets.empty() && (offsets.front() != 0 ||
+                           offsets.back() != polymesh->vertex_indices.size())) {
+    return false;
+  }
+
+  // Every corner has to point into the arrays read above.
+  const size_t array_sizes[] = {
+    polymesh->vertices.size(), polymesh->normals.size(),
+    polymesh->texcoords.size()
+  };
+  for (int a = VERTEX_INDICES; a < NUM_MESH_ARRAYS; a++) {
+    const vector<size_t>& corners = *indices[a - POLYGON_OFFSETS];
+    size_t array_size = array_sizes[a - VERTEX_INDICES];
+    for (size_t i = 0; i < corners.size(); i++) {
+      if (corners[i] >= array_size) return false;
+    }
+  }
+
+  return read_name(record, polymesh) &&
+         read_material(record.material, &polymesh->material);
+
+}
+
+bool SceneReader::read( SceneInfo* sceneInfo ) {
+
+  if (header.version != BINARY_SCENE_VERSION ||
+      header.byte_order != BINARY_SCENE_BYTE_ORDER) return false;
+  for (int t = 0; t < NUM_TABLES; t++) {
+    if (!in_bounds(header.offsets[t], header.counts[t],
+                   TABLE_RECORD_SIZES[t], size)) return false;
+  }
+  materials.assign(header.counts[MATERIALS], NULL);
+
+  // Instances are created as the first node that refers to them is read.
+  const Instance::Type types[] = {
+    Instance::CAMERA, Instance::LIGHT, Instance::SPHERE, Instance::POLYMESH
+  };
+  const Table type_tables[] = { CAMERAS, LIGHTS, SPHERES, MESHES };
+  map<Instance::Type, vector<Instance*> > instances;
+  for (int i = 0; i < 4; i++) {
+    instances[types[i]].assign(header.counts[type_tables[i]], NULL);
+  }
+
+  const NodeRecord* nodes = table<NodeRecord>(NODES);
+  sceneInfo->nodes.resize(header.counts[NODES]);
+  for (size_t n = 0; n < sceneInfo->nodes.size(); n++) {
+
+    const NodeRecord& record = nodes[n];
+    Node& node = sceneInfo->nodes[n];
+    if (!read_string(record.id, &node.id) ||
+        !read_string(record.name, &node.name)) return false;
+    for (int c = 0; c < 4; c++) {
+      for (int r = 0; r < 4; r++) {
+        node.transform(r, c) = record.transform[4 * c + r];
+      }
+    }
+    if (record.instance == NONE) continue;
+
+    Instance::Type type = (Instance::Type) record.instance_type;
+    if (!instances.count(type) ||
+        record.instance >= instances[type].size()) return false;
+    Instance*& instance = instances[type][record.instance];
+    if (instance) {
+      node.instance = instance;
+      continue;
+    }
+
+    switch (type) {
+      case Instance::CAMERA: {
+        const CameraRecord& c = table<CameraRecord>(CAMERAS)[record.instance];
+        CameraInfo* camera = new CameraInfo();
+        instance = camera;
+        camera->view_dir = to_vector(c.view_dir);
+        camera->up_dir = to_vector(c.up_dir);
+        camera->hFov = c.h_fov;
+        camera->vFov = c.v_fov;
+        camera->nClip = c.n_clip;
+        camera->fClip = c.f_clip;
+        if (!read_name(c, camera)) return false;
+        break;
+      }
+      case Instance::LIGHT: {
+        const LightRecord& l = table<LightRecord>(LIGHTS)[record.instance];
+        LightInfo* light = new LightInfo();
+        instance = light;
+        light->light_type = (LightType::T) l.light_type;
+        light->spectrum = to_spectrum(l.spectrum);
+        light->position = to_vector(l.position);
+        light->direction = to_vector(l.direction);
+        light->up = to_vector(l.up);
+        light->falloff_deg = l.falloff_deg;
+        light->falloff_exp = l.falloff_exp;
+        light->constant_att = l.constant_att;
+        light->linear_att = l.linear_att;
+        light->quadratic_att = l.quadratic_att;
+        if (!read_name(l, light)) return false;
+        break;
+      }
+      case Instance::SPHERE: {
+        const SphereRecord& s = table<SphereRecord>(SPHERES)[record.instance];
+        SphereInfo* sphere = new SphereInfo();
+        instance = sphere;
+        sphere->radius = s.radius;
+        if (!read_name(s, sphere) ||
+            !read_material(s.material, &sphere->material)) return false;
+        break;
+      }
+      case Instance::POLYMESH: {
+        PolymeshInfo* polymesh = new PolymeshInfo();
+        instance = polymesh;
+        if (!read_mesh(table<MeshRecord>(MESHES)[record.instance],
+                       polymesh)) return false;
+        break;
+      }
+      default:
+        return false;
+    }
+    instance->type = type;
+    node.instance = instance;
+  }
+
+  return true;
+
+}
+
+int BinaryScene::load( const char* filename, SceneInfo* sceneInfo ) {
+
+#ifndef _WIN32
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(BinarySceneHeader)) {
+    close(fd);
+    return -1;
+  }
+  void* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file == MAP_FAILED) return -1;
+  size_t size = st.st_size;
+
+  // Only the pages of the arrays that are read get touched, once each.
+  madvise(file, size, MADV_SEQUENTIAL);
+  const char* data = (const char*) file;
+#else
+  // No mmap: the whole file is read into memory.
+  FILE* file = fopen(filename, "rb");
+  if (!file) return -1;
+  long length = -1;
+  if (fseek(file, 0, SEEK_END) == 0) length = ftell(file);
+  if (length < (long) sizeof(BinarySceneHeader) ||
+      fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return -1;
+  }
+  size_t size = length;
+  vector<char> buffer(size);
+  bool read_ok = fread(buffer.data(), 1, size, file) == size;
+  fclose(file);
+  if (!read_ok) return -1;
+  const char* data = buffer.data();
+#endif
+
+  int result = -1;
+  if (!memcmp(data, BINARY_SCENE_MAGIC, sizeof(BINARY_SCENE_MAGIC))) {
+    SceneReader reader(data, size);
+    if (reader.read(sceneInfo)) result = 0;
+  }
+#ifndef _WIN32
+  munmap(file, size);
+#endif
+  return result;
+
+}
+
+} // namespace Collada
+} // namespace CGL
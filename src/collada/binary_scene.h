@@ -0,0 +1,42 @@
+#ifndef CGL_COLLADA_BINARY_SCENE_H
+#define CGL_COLLADA_BINARY_SCENE_H
+
+#include "collada.h"
+
+namespace CGL { namespace Collada {
+
+/*
+  Reads and writes a SceneInfo in a compact binary file: a header, fixed
+  size records for the nodes, cameras, lights, materials, spheres and
+  meshes, and the mesh arrays as raw little-endian floats and 32-bit
+  indices. Materials are stored as their BSDF type and parameters, the way
+  the kernel takes them. Loading maps the file and fills the SceneInfo
+  straight from the mapped pages, with no parsing at all.
+*/
+class BinaryScene {
+ public:
+
+  /*
+    Whether a file starts like a binary scene.
+  */
+  static bool is_binary( const char* filename );
+
+  /*
+    Same contract as ColladaParser::load: returns 0 on success, or -1 if
+    the file can't be read or is not a binary scene of this version.
+  */
+  static int load( const char* filename, SceneInfo* sceneInfo );
+
+  /*
+    Write a scene, such as one ColladaParser loaded. Returns 0 on success,
+    or -1 if the file can't be written or the scene has a material the
+    format can't hold.
+  */
+  static int save( const char* filename, const SceneInfo* sceneInfo );
+
+}; // class BinaryScene
+
+} // namespace Collada
+} // namespace CGL
+
+#endif // CGL_COLLADA_BINARY_SCENE_H
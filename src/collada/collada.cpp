@@ -22,6 +22,9 @@ SceneInfo* ColladaParser::scene; // pointer to output scene description
 Vector3D ColladaParser::up; // scene up direction
 Matrix4x4 ColladaParser::transform; // current transformation
 map<string, XMLElement*> ColladaParser::sources; // URI lookup table
+vector< pair<XMLElement*, PolymeshInfo*> > ColladaParser::polymeshes; // geometry to parse
+map<string, PolymeshInfo*> ColladaParser::meshes; // streamed, not instanced yet
+map<string, PolymeshInfo*> ColladaParser::instanced; // streamed and instanced
 
 // Parser Helpers //
 
@@ -52,6 +55,173 @@ inline Color color_from_string ( string color_string ) {
 
 }
 
+// Number scanners for the arrays of a mesh. They read straight from the
+// text of the document, without copying it and without the locale, and
+// return the end of the number, or NULL if there is no number at s.
+
+inline bool is_space ( char c ) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+inline bool is_digit ( char c ) {
+  return c >= '0' && c <= '9';
+}
+
+static const char* scan_index ( const char* s, size_t* index ) {
+
+  while (is_space(*s)) s++;
+  if (!is_digit(*s)) return NULL;
+
+  size_t value = 0;
+  while (is_digit(*s)) value = value * 10 + (*s++ - '0');
+  *index = value;
+  return s;
+
+}
+
+static const char* scan_float ( const char* s, float* f ) {
+
+  static const double powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+  };
+
+  while (is_space(*s)) s++;
+  const char* start = s;
+
+  bool negative = *s == '-';
+  if (*s == '-' || *s == '+') s++;
+
+  // Up to 19 significant digits fit the mantissa; the rest only scale it.
+  uint64_t mantissa = 0; int digits = 0; int exponent = 0; bool any = false;
+  for (; is_digit(*s); s++) {
+    any = true;
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*s - '0');
+      if (mantissa) digits++;
+    } else {
+      exponent++;
+    }
+  }
+  if (*s == '.') {
+    for (s++; is_digit(*s); s++) {
+      any = true;
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*s - '0');
+        if (mantissa) digits++;
+        exponent--;
+      }
+    }
+  }
+
+  // Not a plain number, such as nan or inf.
+  if (!any) {
+    char* end;
+    *f = strtof(start, &end);
+    return end == start ? NULL : end;
+  }
+
+  if (*s == 'e' || *s == 'E') {
+    const char* e = s + 1;
+    bool negative_exponent = *e == '-';
+    if (*e == '-' || *e == '+') e++;
+    if (is_digit(*e)) {
+      int value = 0;
+      for (; is_digit(*e); e++) {
+        if (value < 10000) value = value * 10 + (*e - '0');
+      }
+      exponent += negative_exponent ? -value : value;
+      s = e;
+    }
+  }
+
+  double value = (double) mantissa;
+  for (; exponent > 22; exponent -= 22) value *= 1e22;
+  for (; exponent < -22; exponent += 22) value /= 1e22;
+  value = exponent < 0 ? value / powers_of_ten[-exponent]
+                       : value * powers_of_ten[exponent];
+  *f = (float) (negative ? -value : value);
+  return s;
+
+}
+
+// Parse a float_array into vectors of dim floats each. Returns false if the
+// array has fewer floats than its count.
+template <class Vector>
+static bool parse_vectors ( XMLElement* e_float_array, size_t dim,
+                            vector<Vector>& vectors ) {
+
+  size_t num_floats = e_float_array->IntAttribute("count");
+  vectors.resize(num_floats / dim);
+
+  const char* s = e_float_array->GetText();
+  for (size_t i = 0; i < vectors.size(); ++i) {
+    for (size_t j = 0; j < dim; ++j) {
+      float f;
+      if (!s || !(s = scan_float(s, &f))) {
+        stat("Error: missing floats in array: " << e_float_array->Attribute("id"));
+        return false;
+      }
+      vectors[i][j] = f;
+    }
+  }
+  return true;
+
+}
+
+// Read count numbers with scan from the text of the element a stream is in,
+// passing each with its position to store. Returns false if there are
+// fewer numbers.
+template <class Number, class Store>
+static bool stream_numbers ( XMLStream& xml, size_t count,
+                             const char* (*scan)(const char*, Number*),
+                             Store store ) {
+
+  if (count == 0) return true;
+  if (xml.next() != XMLStream::TEXT) return false;
+
+  const char* limit;
+  const char* s = xml.window(&limit);
+  for (size_t i = 0; i < count; ++i) {
+    while (is_space(*s)) s++;
+    if (s >= limit) {
+      xml.advance(s);
+      s = xml.window(&limit);
+    }
+    Number n;
+    const char* next = scan(s, &n);
+    if (!next) {
+      xml.advance(s);
+      return false;
+    }
+    store(i, n);
+    s = next;
+  }
+  xml.advance(s);
+  return true;
+
+}
+
+// Convert a float array read from a stream into vectors of dim floats each.
+template <class Vector>
+static bool vectors_from_floats ( const map< string, vector<float> >& arrays,
+                                  const string& id, size_t dim,
+                                  vector<Vector>& vectors ) {
+
+  map< string, vector<float> >::const_iterator array = arrays.find(id);
+  if (array == arrays.end()) return false;
+
+  const vector<float>& floats = array->second;
+  vectors.resize(floats.size() / dim);
+  for (size_t i = 0; i < vectors.size(); ++i) {
+    for (size_t j = 0; j < dim; ++j) {
+      vectors[i][j] = floats[i * dim + j];
+    }
+  }
+  return true;
+
+}
+
 void ColladaParser::uri_load( XMLElement* xml ) {
 
   if (xml->Attribute("id")) {
@@ -130,19 +300,107 @@ XMLElement* ColladaParser::get_technique_CGL( XMLElement* xml ) {
 
 int ColladaParser::load( const char* filename, SceneInfo* sceneInfo ) {
 
-  ifstream in (filename);
-  if (!in.is_open()) {
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
+    return -1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  if (ftell(file) > STREAM_FILE_SIZE) {
+    fclose(file);
+    return load_stream(filename, sceneInfo);
+  }
+  rewind(file);
+
+  XMLDocument doc;
+  doc.LoadFile(file);
+  fclose(file);
+  if (doc.Error()) {
+    stat("XML error: ");
+    doc.PrintError();
+    exit(EXIT_FAILURE);
+  }
+
+  return load_document(doc, sceneInfo);
+
+}
+
+int ColladaParser::load_stream( const char* filename, SceneInfo* sceneInfo ) {
+
+  FILE* file = fopen(filename, "rb");
+  if (!file) {
     return -1;
-  } in.close();
+  }
+
+  // Copy everything but the mesh data into a skeleton of the document. Mesh
+  // data is read into its PolymeshInfo as it goes by, and leaves an empty
+  // <mesh/> behind in the skeleton.
+  XMLStream xml (file);
+  string skeleton;
+  vector<string> open;
+  string geometry_id;
+  XMLStream::Token token;
+  while ((token = xml.next()) != XMLStream::END_OF_FILE) {
+    switch (token) {
+      case XMLStream::START:
+        if (xml.name() == "geometry") {
+          geometry_id = xml.attribute("id") ? xml.attribute("id") : "";
+        }
+        if (xml.name() == "mesh" && !xml.is_empty() && open.size() >= 2 &&
+            open[open.size() - 1] == "geometry" &&
+            open[open.size() - 2] == "library_geometries") {
+          PolymeshInfo* polymesh = new PolymeshInfo();
+          polymesh->id = geometry_id;
+          parse_polymesh(xml, *polymesh);
+          delete meshes[geometry_id];
+          meshes[geometry_id] = polymesh;
+          skeleton += "<mesh/>";
+          break;
+        }
+        skeleton += xml.raw();
+        if (!xml.is_empty()) open.push_back(xml.name());
+        break;
+      case XMLStream::END:
+        skeleton += xml.raw();
+        if (!open.empty()) open.pop_back();
+        break;
+      case XMLStream::TEXT:
+        xml.read_text(skeleton);
+        break;
+      default:
+        break;
+    }
+  }
+  fclose(file);
+  if (!xml.error().empty()) {
+    stat("XML error: " << xml.error());
+    exit(EXIT_FAILURE);
+  }
 
   XMLDocument doc;
-  doc.LoadFile(filename);
+  doc.Parse(skeleton.data(), skeleton.size());
+  string().swap(skeleton);
   if (doc.Error()) {
     stat("XML error: ");
     doc.PrintError();
     exit(EXIT_FAILURE);
   }
 
+  int result = load_document(doc, sceneInfo);
+
+  // Meshes no node instanced.
+  for (map<string, PolymeshInfo*>::iterator m = meshes.begin(); m != meshes.end(); m++) {
+    delete m->second;
+  }
+  meshes.clear();
+  instanced.clear();
+
+  return result;
+
+}
+
+int ColladaParser::load_document( XMLDocument& doc, SceneInfo* sceneInfo ) {
+
   // Check XML schema
   XMLElement* root = doc.FirstChildElement("COLLADA");
   if (!root) {
@@ -215,8 +473,38 @@ int ColladaParser::load( const char* filename, SceneInfo* sceneInfo ) {
 			e_node = e_node->NextSiblingElement("node");
 		}
 
+    // Meshes are independent of each other, so they're parsed in parallel
+    // once all nodes have been read. A geometry several nodes instance is
+    // parsed once, by a single thread, as tinyxml2 decodes element text in
+    // place on first access; the other nodes get copies.
+    map< XMLElement*, PolymeshInfo* > parsed;
+    vector< pair<XMLElement*, PolymeshInfo*> > unique;
+    for (size_t i = 0; i < polymeshes.size(); i++) {
+      if (parsed.insert(polymeshes[i]).second) unique.push_back(polymeshes[i]);
+    }
+    bool failed = false;
+    #pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < unique.size(); i++) {
+      if (!parse_polymesh(unique[i].first, *unique[i].second)) {
+        #pragma omp atomic write
+        failed = true;
+      }
+    }
+    if (failed) exit(EXIT_FAILURE);
+    for (size_t i = 0; i < polymeshes.size(); i++) {
+      PolymeshInfo* polymesh = polymeshes[i].second;
+      PolymeshInfo* first = parsed[polymeshes[i].first];
+      if (polymesh != first) {
+        MaterialInfo* material = polymesh->material;
+        *polymesh = *first;
+        polymesh->material = material;
+      }
+      stat("  |- " << *polymesh);
+    }
+    polymeshes.clear();
+
   } else {
-    stat("Error: No scene description found in file:" << filename);
+    stat("Error: No scene description found in file");
     return -1;
   }
 
@@ -364,9 +652,24 @@ void ColladaParser::parse_node( XMLElement* xml ) {
   } else if (e_geometry) {
 		if (get_element(e_geometry, "mesh")) {
 
-			// mesh geometry
-			PolymeshInfo* polymesh = new PolymeshInfo();
-			parse_polymesh(e_geometry, *polymesh);
+			// mesh geometry - if the file was streamed, the first node to
+			// instance it takes the mesh, and later ones copy that
+			string geometry_id = e_geometry->Attribute("id");
+			PolymeshInfo* polymesh = NULL;
+			if (meshes.count(geometry_id)) {
+				polymesh = meshes[geometry_id];
+				meshes.erase(geometry_id);
+				instanced[geometry_id] = polymesh;
+			} else if (instanced.count(geometry_id)) {
+				polymesh = new PolymeshInfo(*instanced[geometry_id]);
+				polymesh->material = NULL;
+			} else {
+				polymesh = new PolymeshInfo();
+				polymeshes.push_back(make_pair(e_geometry, polymesh));
+			}
+			polymesh->id   = geometry_id;
+			polymesh->name = e_geometry->Attribute("name");
+			polymesh->type = Instance::POLYMESH;
 
 			// mesh material
 			XMLElement* e_instance_material = get_element(xml,
@@ -601,45 +904,23 @@ void ColladaParser::parse_sphere(XMLElement* xml, SphereInfo& sphere) {
 }
 
 
-void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
-
-  // name & id
-  polymesh.id   = xml->Attribute( "id" );
-  polymesh.name = xml->Attribute("name");
-  polymesh.type = Instance::POLYMESH;
+bool ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
 
   XMLElement* e_mesh = xml->FirstChildElement("mesh");
   if (!e_mesh) {
     stat("Error: no mesh data defined in geometry: " << polymesh.id);
-    exit(EXIT_FAILURE);
+    return false;
   }
 
-  // array sources
-  map< string, vector<float> > arr_sources;
+  // array sources, parsed only once it is known what they hold
+  map< string, XMLElement* > arr_sources;
   XMLElement* e_source = e_mesh->FirstChildElement("source");
   while (e_source) {
 
-    // source id
-    string source_id = e_source->Attribute("id");
-
     // source float array - other formats not handled
     XMLElement* e_float_array = e_source->FirstChildElement("float_array");
     if (e_float_array) {
-
-      float f; vector<float> floats;
-
-      // load float array string
-      string s = e_float_array->GetText();
-      stringstream ss (s);
-
-      // load float array
-      size_t num_floats = e_float_array->IntAttribute("count");
-      for (size_t i = 0; i < num_floats; ++i) {
-        ss >> f; floats.push_back(f);
-      }
-
-      // add to array sources
-      arr_sources[source_id] = floats;
+      arr_sources[e_source->Attribute("id")] = e_float_array;
     }
 
     // parse next source
@@ -647,11 +928,11 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
   }
 
   // vertices
-  vector<Vector3D> vertices; string vertices_id;
+  string vertices_id;
   XMLElement* e_vertices = e_mesh->FirstChildElement("vertices");
   if (!e_vertices) {
     stat("Error: no vertices defined in geometry: " << polymesh.id);
-    exit(EXIT_FAILURE);
+    return false;
   } else {
     vertices_id = e_vertices->Attribute("id");
   }
@@ -666,15 +947,10 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
     if (semantic == "POSITION") {
       string source = e_input->Attribute("source") + 1;
       if (arr_sources.find(source) != arr_sources.end()) {
-        vector<float>& floats = arr_sources[source];
-        size_t num_floats = floats.size();
-        for (size_t i = 0; i < num_floats; i += 3) {
-          Vector3D v = Vector3D(floats[i], floats[i+1], floats[i+2]);
-          vertices.push_back(v);
-        }
+        if (!parse_vectors(arr_sources[source], 3, polymesh.vertices)) return false;
       } else {
         stat("Error: undefined input source: " << source);
-        exit(EXIT_FAILURE);
+        return false;
       }
     }
 
@@ -706,12 +982,9 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
         has_vertex_array = true;
         vertex_offset = offset;
 
-        if (source == vertices_id) {
-          polymesh.vertices.resize(vertices.size());
-          copy(vertices.begin(), vertices.end(), polymesh.vertices.begin());
-        } else {
+        if (source != vertices_id) {
           stat("Error: undefined source for VERTEX semantic: " << source);
-          exit(EXIT_FAILURE);
+          return false;
         }
       }
 
@@ -722,15 +995,10 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
         normal_offset = offset;
 
         if (arr_sources.find(source) != arr_sources.end()) {
-          vector<float>& floats = arr_sources[source];
-          size_t num_floats = floats.size();
-          for (size_t i = 0; i < num_floats; i += 3) {
-            Vector3D n = Vector3D(floats[i], floats[i+1], floats[i+2]);
-            polymesh.normals.push_back(n);
-          }
+          if (!parse_vectors(arr_sources[source], 3, polymesh.normals)) return false;
         } else {
           stat("Error: undefined source for NORMAL semantic: " << source);
-          exit(EXIT_FAILURE);
+          return false;
         }
       }
 
@@ -741,15 +1009,10 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
         texcoord_offset = offset;
 
         if (arr_sources.find(source) != arr_sources.end()) {
-          vector<float>& floats = arr_sources[source];
-          size_t num_floats = floats.size();
-          for (size_t i = 0; i < num_floats; i += 2) {
-            Vector2D n = Vector2D(floats[i], floats[i+1]);
-            polymesh.texcoords.push_back(n);
-          }
+          if (!parse_vectors(arr_sources[source], 2, polymesh.texcoords)) return false;
         } else {
           stat("Error: undefined source for TEXCOORD semantic: " << source);
-          exit(EXIT_FAILURE);
+          return false;
         }
       }
 
@@ -762,91 +1025,259 @@ void ColladaParser::parse_polymesh(XMLElement* xml, PolymeshInfo& polymesh) {
                     ( has_normal_array   ? 1 : 0 ) +
                     ( has_texcoord_array ? 1 : 0 ) ;
 
-    // create polygon size array and compute size of index array
-    vector<size_t> sizes; size_t num_indices = 0;
+    // polygon offsets from the polygon sizes
     XMLElement* e_vcount = e_polylist->FirstChildElement("vcount");
     if (e_vcount) {
 
-      size_t size;
-      string s = e_vcount->GetText();
-      stringstream ss (s);
-
+      const char* s = e_vcount->GetText();
+      polymesh.polygon_offsets.resize(num_polygons + 1);
+      polymesh.polygon_offsets[0] = 0;
       for (size_t i = 0; i < num_polygons; ++i) {
-        ss >> size;
-        sizes.push_back(size);
-        num_indices += size * stride;
+        size_t size;
+        if (!s || !(s = scan_index(s, &size))) {
+          stat("Error: missing polygon sizes in geometry: " << polymesh.id);
+          return false;
+        }
+        polymesh.polygon_offsets[i + 1] = polymesh.polygon_offsets[i] + size;
       }
 
     } else {
       stat("Error: polygon sizes undefined in geometry: " << polymesh.id);
-      exit(EXIT_FAILURE);
+      return false;
     }
 
-    // index array
-    vector<size_t> indices;
+    // index array, stride indices per corner
+    size_t num_corners = polymesh.polygon_offsets[num_polygons];
+    if (has_vertex_array)   polymesh.vertex_indices.resize(num_corners);
+    if (has_normal_array)   polymesh.normal_indices.resize(num_corners);
+    if (has_texcoord_array) polymesh.texcoord_indices.resize(num_corners);
+
     XMLElement* e_p = e_polylist->FirstChildElement("p");
     if (e_p) {
 
-      size_t index;
-      string s = e_p->GetText();
-      stringstream ss (s);
-
-      for (size_t i = 0; i < num_indices; ++i) {
-        ss >> index;
-        indices.push_back(index);
+      const char* s = e_p->GetText();
+      for (size_t k = 0; k < num_corners; ++k) {
+        for (size_t j = 0; j < stride; ++j) {
+          size_t index;
+          if (!s || !(s = scan_index(s, &index))) {
+            stat("Error: missing indices in geometry: " << polymesh.id);
+            return false;
+          }
+          if (has_vertex_array   && j == vertex_offset)   polymesh.vertex_indices[k]   = index;
+          if (has_normal_array   && j == normal_offset)   polymesh.normal_indices[k]   = index;
+          if (has_texcoord_array && j == texcoord_offset) polymesh.texcoord_indices[k] = index;
+        }
       }
 
     } else {
       stat("Error: no index array defined in geometry: " << polymesh.id);
+      return false;
+    }
+
+  }
+  return true;
+}
+
+void ColladaParser::parse_polymesh( XMLStream& xml, PolymeshInfo& polymesh ) {
+
+  auto attribute = [&xml] (const char* name) {
+    const char* value = xml.attribute(name);
+    return string(value ? value : "");
+  };
+
+  // id a "#id" attribute refers to
+  auto reference = [&attribute] (const char* name) {
+    string value = attribute(name);
+    return value.empty() ? value : value.substr(1);
+  };
+
+  // float arrays by source id, until the inputs say what they hold
+  map< string, vector<float> > arr_sources;
+  string source_id;
+
+  // vertices
+  string vertices_id, position_source;
+  bool in_vertices = false;
+
+  // polylist - only the first one is read, as by the document parser
+  bool in_polylist = false, has_polylist = false;
+  bool has_vertex_array   = false; size_t vertex_offset   = 0;
+  bool has_normal_array   = false; size_t normal_offset   = 0;
+  bool has_texcoord_array = false; size_t texcoord_offset = 0;
+  string normal_source, texcoord_source;
+  size_t num_polygons = 0;
+  bool has_vcount = false, has_p = false;
+
+  // read up to the end of the mesh
+  int depth = 0;
+  while (true) {
+
+    XMLStream::Token token = xml.next();
+    if (token == XMLStream::END_OF_FILE) {
+      stat("Error: unterminated mesh in geometry: " << polymesh.id);
       exit(EXIT_FAILURE);
     }
 
-    // create polygons
-    polymesh.polygons.resize(num_polygons);
+    if (token == XMLStream::END) {
+      if (depth == 0) break;
+      depth--;
+      if (xml.name() == "vertices") in_vertices = false;
+      if (xml.name() == "polylist") in_polylist = false;
+      continue;
+    }
 
-    // vertex array indices
-    if (has_vertex_array) {
-      size_t k = 0;
-      for (size_t i = 0; i < num_polygons; ++i) {
-        for (size_t j = 0; j < sizes[i]; ++j) {
-          polymesh.polygons[i].vertex_indices.push_back(
-            indices[k * stride + vertex_offset]
-          );
-          k++;
-        }
+    if (token != XMLStream::START) continue;
+    if (!xml.is_empty()) depth++;
+    const string& name = xml.name();
+
+    if (name == "source") {
+
+      source_id = attribute("id");
+
+    } else if (name == "float_array" && !xml.is_empty()) {
+
+      vector<float>& floats = arr_sources[source_id];
+      floats.resize(atol(attribute("count").c_str()));
+      float* data = floats.data();
+      if (!stream_numbers(xml, floats.size(), scan_float,
+                          [data] (size_t i, float f) { data[i] = f; })) {
+        stat("Error: missing floats in array of source: " << source_id);
+        exit(EXIT_FAILURE);
       }
-    }
 
-    // normal array indices
-    if (has_normal_array) {
-      size_t k = 0;
-      for (size_t i = 0; i < num_polygons; ++i) {
-        for (size_t j = 0; j < sizes[i]; ++j) {
-          polymesh.polygons[i].normal_indices.push_back(
-            indices[k * stride + normal_offset]
-          );
-          k++;
+    } else if (name == "vertices") {
+
+      in_vertices = !xml.is_empty();
+      vertices_id = attribute("id");
+
+    } else if (name == "input" && in_vertices) {
+
+      // NOTE (sky) : only positions are handled currently
+      if (attribute("semantic") == "POSITION") {
+        position_source = reference("source");
+      }
+
+    } else if (name == "polylist" && !has_polylist) {
+
+      in_polylist = has_polylist = true;
+      num_polygons = atol(attribute("count").c_str());
+
+    } else if (name == "input" && in_polylist) {
+
+      string semantic = attribute("semantic");
+      string source   = reference("source");
+      size_t offset   = atol(attribute("offset").c_str());
+
+      if (semantic == "VERTEX") {
+        has_vertex_array = true;
+        vertex_offset = offset;
+        if (source != vertices_id) {
+          stat("Error: undefined source for VERTEX semantic: " << source);
+          exit(EXIT_FAILURE);
         }
       }
-    }
 
-    // texcoord array indices
-    if (has_normal_array) {
-      size_t k = 0;
-      for (size_t i = 0; i < num_polygons; ++i) {
-        for (size_t j = 0; j < sizes[i]; ++j) {
-          polymesh.polygons[i].texcoord_indices.push_back(
-            indices[k * stride + texcoord_offset]
-          );
-          k++;
+      if (semantic == "NORMAL") {
+        has_normal_array = true;
+        normal_offset = offset;
+        normal_source = source;
+      }
+
+      if (semantic == "TEXCOORD") {
+        has_texcoord_array = true;
+        texcoord_offset = offset;
+        texcoord_source = source;
+      }
+
+    } else if (name == "vcount" && in_polylist) {
+
+      has_vcount = true;
+      vector<size_t>& offsets = polymesh.polygon_offsets;
+      offsets.resize(num_polygons + 1);
+      offsets[0] = 0;
+      size_t* data = offsets.data();
+      if (!stream_numbers(xml, num_polygons, scan_index,
+                          [data] (size_t i, size_t size) { data[i + 1] = data[i] + size; })) {
+        stat("Error: missing polygon sizes in geometry: " << polymesh.id);
+        exit(EXIT_FAILURE);
+      }
+
+    } else if (name == "p" && in_polylist) {
+
+      has_p = true;
+      if (!has_vcount) {
+        stat("Error: polygon sizes undefined in geometry: " << polymesh.id);
+        exit(EXIT_FAILURE);
+      }
+
+      // index array, stride indices per corner
+      size_t stride = ( has_vertex_array   ? 1 : 0 ) +
+                      ( has_normal_array   ? 1 : 0 ) +
+                      ( has_texcoord_array ? 1 : 0 ) ;
+      size_t num_corners = polymesh.polygon_offsets[num_polygons];
+      size_t* vertex_indices = NULL;
+      size_t* normal_indices = NULL;
+      size_t* texcoord_indices = NULL;
+      if (has_vertex_array) {
+        polymesh.vertex_indices.resize(num_corners);
+        vertex_indices = polymesh.vertex_indices.data();
+      }
+      if (has_normal_array) {
+        polymesh.normal_indices.resize(num_corners);
+        normal_indices = polymesh.normal_indices.data();
+      }
+      if (has_texcoord_array) {
+        polymesh.texcoord_indices.resize(num_corners);
+        texcoord_indices = polymesh.texcoord_indices.data();
+      }
+
+      size_t corner = 0, j = 0;
+      bool complete = stream_numbers(xml, num_corners * stride, scan_index,
+                                     [&] (size_t, size_t index) {
+        if (vertex_indices   && j == vertex_offset)   vertex_indices[corner]   = index;
+        if (normal_indices   && j == normal_offset)   normal_indices[corner]   = index;
+        if (texcoord_indices && j == texcoord_offset) texcoord_indices[corner] = index;
+        if (++j == stride) {
+          j = 0;
+          corner++;
         }
+      });
+      if (!complete) {
+        stat("Error: missing indices in geometry: " << polymesh.id);
+        exit(EXIT_FAILURE);
       }
     }
+  }
 
+  // arrays the inputs refer to
+  if (vertices_id.empty()) {
+    stat("Error: no vertices defined in geometry: " << polymesh.id);
+    exit(EXIT_FAILURE);
+  }
+  if (!position_source.empty() &&
+      !vectors_from_floats(arr_sources, position_source, 3, polymesh.vertices)) {
+    stat("Error: undefined input source: " << position_source);
+    exit(EXIT_FAILURE);
+  }
+  if (has_normal_array &&
+      !vectors_from_floats(arr_sources, normal_source, 3, polymesh.normals)) {
+    stat("Error: undefined source for NORMAL semantic: " << normal_source);
+    exit(EXIT_FAILURE);
+  }
+  if (has_texcoord_array &&
+      !vectors_from_floats(arr_sources, texcoord_source, 2, polymesh.texcoords)) {
+    stat("Error: undefined source for TEXCOORD semantic: " << texcoord_source);
+    exit(EXIT_FAILURE);
   }
 
-  // print summary
-  stat("  |- " << polymesh);
+  if (has_polylist && !has_vcount) {
+    stat("Error: polygon sizes undefined in geometry: " << polymesh.id);
+    exit(EXIT_FAILURE);
+  }
+  if (has_polylist && !has_p) {
+    stat("Error: no index array defined in geometry: " << polymesh.id);
+    exit(EXIT_FAILURE);
+  }
 }
 
 void ColladaParser::parse_material ( XMLElement* xml, MaterialInfo& material ) {
@@ -3,6 +3,8 @@
 
 #include <map>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "CGL/CGL.h"
 #include "CGL/tinyexr.h"
@@ -14,6 +16,7 @@
 #include "sphere_info.h"
 #include "polymesh_info.h"
 #include "material_info.h"
+#include "xml_stream.h"
 
 using namespace tinyxml2;
 
@@ -28,6 +31,19 @@ class ColladaParser {
  public:
 
   static int load( const char* filename, SceneInfo* sceneInfo );
+
+  /*
+    Same as load, but reads the file as a stream rather than as a whole
+    document: meshes are parsed as they go by, and only the rest of the
+    document, which is small, is kept and parsed as usual. Memory then
+    grows with the meshes rather than with the file. load does this for
+    files larger than STREAM_FILE_SIZE.
+  */
+  static int load_stream( const char* filename, SceneInfo* sceneInfo );
+
+  // Smaller files are parsed faster as a whole document, with their meshes
+  // in parallel, and without XMLStream's limits.
+  static const long STREAM_FILE_SIZE = 16 << 20;
   static int save( const char* filename, const SceneInfo* sceneInfo );
 
  private:
@@ -45,6 +61,18 @@ class ColladaParser {
 	// The lookup table is constructed when the file is loaded
 	static std::map<std::string, XMLElement*> sources;
 
+	// Meshes found in the scene, with their geometry elements. They're parsed
+	// once all nodes have been read.
+	static std::vector< std::pair<XMLElement*, PolymeshInfo*> > polymeshes;
+
+	// Meshes read by load_stream, by geometry id, before and after a node
+	// instanced them
+	static std::map<std::string, PolymeshInfo*> meshes;
+	static std::map<std::string, PolymeshInfo*> instanced;
+
+	// Load the scene from a parsed document
+	static int load_document( XMLDocument& doc, SceneInfo* sceneInfo );
+
  	// Load Collada elements with UUID into lookup table
  	static void uri_load( XMLElement* xml );
 
@@ -67,7 +95,8 @@ class ColladaParser {
   static void parse_camera	 ( XMLElement* xml, CameraInfo& 	camera	 );
   static void parse_light		 ( XMLElement* xml, LightInfo& 		light		 );
 	static void parse_sphere	 ( XMLElement* xml, SphereInfo& 	sphere	 );
-  static void parse_polymesh ( XMLElement* xml, PolymeshInfo& polymesh );
+  static bool parse_polymesh ( XMLElement* xml, PolymeshInfo& polymesh );
+  static void parse_polymesh ( XMLStream& xml, PolymeshInfo& polymesh );
 	static void parse_material ( XMLElement* xml, MaterialInfo&	material );
 
 }; // class ColladaParser
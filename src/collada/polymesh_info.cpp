@@ -10,7 +10,7 @@ std::ostream& operator<<( std::ostream& os, const PolymeshInfo& polymesh ) {
 
   os << " [";
 
-    os << " num_polygons="  << polymesh.polygons.size();
+    os << " num_polygons="  << polymesh.num_polygons();
     os << " num_vertices="  << polymesh.vertices.size();
     os << " num_normals="   << polymesh.normals.size();
     os << " num_texcoords=" << polymesh.texcoords.size();
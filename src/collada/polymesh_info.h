@@ -8,24 +8,23 @@
 
 namespace CGL { namespace Collada {
 
-struct Polygon {
-
-  std::vector<size_t> vertex_indices;   ///< indices into vertex array
-  std::vector<size_t> normal_indices;   ///< indices into normal array
-  std::vector<size_t> texcoord_indices; ///< indices into texcoord array
-
-}; // struct Polygon
-
-typedef std::vector<Polygon> PolyList;
-typedef PolyList::iterator PolyListIter;
-
 struct PolymeshInfo : Instance {
 
   std::vector<Vector3D> vertices;   ///< polygon vertex array
   std::vector<Vector3D> normals;    ///< polygon normal array
   std::vector<Vector2D> texcoords;  ///< texture coordinate array
 
-  std::vector<Polygon>  polygons;   ///< polygons
+  // Corners of all polygons, one after the other. Polygon i has the corners
+  // polygon_offsets[i] up to polygon_offsets[i + 1], so there is one more
+  // offset than there are polygons.
+  std::vector<size_t> polygon_offsets;
+  std::vector<size_t> vertex_indices;   ///< indices into vertex array
+  std::vector<size_t> normal_indices;   ///< indices into normal array
+  std::vector<size_t> texcoord_indices; ///< indices into texcoord array
+
+  size_t num_polygons() const {
+    return polygon_offsets.empty() ? 0 : polygon_offsets.size() - 1;
+  }
 
   MaterialInfo* material;  ///< material of the mesh
 
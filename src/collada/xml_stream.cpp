@@ -0,0 +1,237 @@
+#include "xml_stream.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+namespace CGL { namespace Collada {
+
+// Bytes read from the file at a time.
+static const size_t BUFFER_SIZE = 1 << 20;
+
+// Longest token window promises to hold in full.
+static const size_t WINDOW_MARGIN = 256;
+
+static inline bool is_space( char c ) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static void decode_entities( string& s ) {
+
+  static const char* entities[][2] = {
+    { "&lt;", "<" }, { "&gt;", ">" }, { "&quot;", "\"" }, { "&apos;", "'" },
+    { "&amp;", "&" }
+  };
+
+  if (s.find('&') == string::npos) return;
+  string decoded;
+  for (size_t i = 0; i < s.size(); ) {
+    bool replaced = false;
+    if (s[i] == '&') {
+      for (size_t e = 0; e < 5; e++) {
+        size_t n = strlen(entities[e][0]);
+        if (s.compare(i, n, entities[e][0]) == 0) {
+          decoded += entities[e][1];
+          i += n;
+          replaced = true;
+          break;
+        }
+      }
+    }
+    if (!replaced) decoded += s[i++];
+  }
+  s.swap(decoded);
+
+}
+
+XMLStream::XMLStream( FILE* file )
+    : file(file), buffer(BUFFER_SIZE + 1), pos(0), end(0), at_eof(false),
+      in_text(false), empty_tag(false) {
+  buffer[0] = '\0';
+}
+
+bool XMLStream::fill( size_t n ) {
+
+  if (end - pos >= n) return true;
+
+  // Keep the unread bytes, then top the buffer up.
+  memmove(&buffer[0], &buffer[pos], end - pos);
+  end -= pos;
+  pos = 0;
+  while (end < n && !at_eof) {
+    size_t got = fread(&buffer[end], 1, BUFFER_SIZE - end, file);
+    if (got == 0) at_eof = true;
+    end += got;
+  }
+  buffer[end] = '\0';
+  return end - pos >= n;
+
+}
+
+bool XMLStream::skip_past( const char* terminator ) {
+
+  size_t n = strlen(terminator);
+  while (true) {
+    char* found = search(&buffer[pos], &buffer[end], terminator, terminator + n);
+    if (found != &buffer[end]) {
+      pos = found - &buffer[0] + n;
+      return true;
+    }
+    // Keep what could be the start of the terminator.
+    pos = max(pos, end - min(end, n - 1));
+    if (!fill(end - pos + 1)) {
+      message = string("unterminated markup, expected ") + terminator;
+      return false;
+    }
+  }
+
+}
+
+bool XMLStream::read_tag() {
+
+  // Markup that isn't a tag is skipped.
+  static const char* markup[][2] = {
+    { "<!--", "-->" }, { "<![CDATA[", "]]>" }, { "<?", "?>" }, { "<!", ">" }
+  };
+  fill(9);
+  for (size_t m = 0; m < 4; m++) {
+    if (!strncmp(&buffer[pos], markup[m][0], strlen(markup[m][0]))) {
+      skip_past(markup[m][1]);
+      return false;
+    }
+  }
+
+  // Raw tag, up to the '>' that isn't quoted.
+  tag.clear();
+  char quote = 0;
+  int c;
+  while ((c = get()) != EOF) {
+    tag += (char) c;
+    if (quote) {
+      if (c == quote) quote = 0;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+    } else if (c == '>') {
+      break;
+    }
+  }
+  if (c != '>') {
+    message = "unterminated tag: " + tag.substr(0, 64);
+    return false;
+  }
+
+  // Name and attributes.
+  size_t i = tag[1] == '/' ? 2 : 1;
+  size_t n = tag.size() - 1;
+  size_t name_end = i;
+  while (name_end < n && !is_space(tag[name_end]) && tag[name_end] != '/') name_end++;
+  tag_name.assign(tag, i, name_end - i);
+  empty_tag = tag[1] != '/' && tag[n - 1] == '/';
+
+  attributes.clear();
+  i = name_end;
+  while (true) {
+    while (i < n && is_space(tag[i])) i++;
+    if (i >= n || tag[i] == '/') break;
+
+    size_t key = i;
+    while (i < n && tag[i] != '=' && !is_space(tag[i])) i++;
+    string attribute_name = tag.substr(key, i - key);
+    while (i < n && is_space(tag[i])) i++;
+    if (i >= n || tag[i] != '=') {
+      message = "malformed attribute in tag: " + tag.substr(0, 64);
+      return false;
+    }
+    i++;
+    while (i < n && is_space(tag[i])) i++;
+    if (i >= n || (tag[i] != '"' && tag[i] != '\'')) {
+      message = "unquoted attribute in tag: " + tag.substr(0, 64);
+      return false;
+    }
+    char q = tag[i++];
+    size_t value = i;
+    while (i < n && tag[i] != q) i++;
+    attributes.push_back(make_pair(attribute_name, tag.substr(value, i - value)));
+    decode_entities(attributes.back().second);
+    i++;
+  }
+
+  return true;
+
+}
+
+XMLStream::Token XMLStream::next() {
+
+  while (true) {
+
+    // Skip text that wasn't read.
+    if (in_text) {
+      while (true) {
+        const char* lt = (const char*) memchr(&buffer[pos], '<', end - pos);
+        if (lt) {
+          pos = lt - &buffer[0];
+          break;
+        }
+        pos = end;
+        if (!fill(1)) break;
+      }
+      in_text = false;
+    }
+
+    int c = peek();
+    if (c == EOF) return END_OF_FILE;
+    if (c != '<') {
+      in_text = true;
+      return TEXT;
+    }
+
+    if (read_tag()) return tag[1] == '/' ? END : START;
+    if (!message.empty()) return END_OF_FILE;
+  }
+
+}
+
+const char* XMLStream::attribute( const char* name ) const {
+
+  for (size_t i = 0; i < attributes.size(); i++) {
+    if (attributes[i].first == name) return attributes[i].second.c_str();
+  }
+  return NULL;
+
+}
+
+void XMLStream::read_text( string& out ) {
+
+  while (true) {
+    const char* start = &buffer[pos];
+    const char* lt = (const char*) memchr(start, '<', end - pos);
+    if (lt) {
+      out.append(start, lt);
+      pos = lt - &buffer[0];
+      break;
+    }
+    out.append(start, end - pos);
+    pos = end;
+    if (!fill(1)) break;
+  }
+  in_text = false;
+
+}
+
+const char* XMLStream::window( const char** limit ) {
+
+  while (true) {
+    while (pos < end && is_space(buffer[pos])) pos++;
+    if (pos < end || !fill(1)) break;
+  }
+
+  // Near the end of the file, everything left is in the buffer.
+  fill(2 * WINDOW_MARGIN);
+  *limit = at_eof ? &buffer[end] : &buffer[end - WINDOW_MARGIN];
+  return &buffer[pos];
+
+}
+
+} // namespace Collada
+} // namespace CGL
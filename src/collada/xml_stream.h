@@ -0,0 +1,102 @@
+#ifndef CGL_COLLADA_XML_STREAM_H
+#define CGL_COLLADA_XML_STREAM_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace CGL { namespace Collada {
+
+/*
+  Reads an XML file one token at a time, through a fixed size buffer, so
+  that the text of large elements can be consumed without ever holding all
+  of it. Comments, CDATA sections, processing instructions and the
+  document type are skipped. Only what COLLADA files use is supported: no
+  entities beyond the five predefined ones, and no internal DTD subsets.
+*/
+class XMLStream {
+ public:
+
+  enum Token {
+    START,        ///< start tag, see name, attribute and is_empty
+    END,          ///< end tag, see name
+    TEXT,         ///< character data, not read yet, see read_text and window
+    END_OF_FILE,  ///< end of the file, or an error
+  };
+
+  XMLStream( FILE* file );
+
+  /**
+   * Read the next token. Text that wasn't read is skipped.
+   */
+  Token next();
+
+  /**
+   * Name of the last tag.
+   */
+  const std::string& name() const { return tag_name; }
+
+  /**
+   * Whether the last start tag closes itself, as in <mesh/>.
+   */
+  bool is_empty() const { return empty_tag; }
+
+  /**
+   * Value of an attribute of the last start tag, or NULL.
+   */
+  const char* attribute( const char* name ) const;
+
+  /**
+   * The last tag as it is in the file.
+   */
+  const std::string& raw() const { return tag; }
+
+  /**
+   * Append the text of the current TEXT token, as it is in the file.
+   */
+  void read_text( std::string& out );
+
+  /**
+   * Skip whitespace in the current text and expose the buffer from there.
+   * Any token that starts before limit, such as a number, ends in the
+   * buffer; the buffer is terminated by a '\0' past its last byte. Call
+   * advance with where reading stopped, then window again for more.
+   */
+  const char* window( const char** limit );
+  void advance( const char* p ) { pos = p - &buffer[0]; }
+
+  /**
+   * An error message if the file isn't well formed, else empty.
+   */
+  const std::string& error() const { return message; }
+
+ private:
+
+  bool fill( size_t n );
+  int peek() { return pos < end || fill(1) ? buffer[pos] : EOF; }
+  int get() { return pos < end || fill(1) ? buffer[pos++] : EOF; }
+  bool skip_past( const char* terminator );
+
+  // Read a tag, or skip other markup. Returns false if there was no tag,
+  // and sets message if that was because of an error.
+  bool read_tag();
+
+  FILE* file;
+  std::vector<char> buffer;
+  size_t pos, end;     ///< unread bytes of the buffer
+  bool at_eof;
+  bool in_text;        ///< the current token is text that wasn't read
+
+  std::string tag;     ///< raw last tag
+  std::string tag_name;
+  bool empty_tag;
+  std::vector< std::pair<std::string, std::string> > attributes;
+
+  std::string message;
+
+}; // class XMLStream
+
+} // namespace Collada
+} // namespace CGL
+
+#endif // CGL_COLLADA_XML_STREAM_H
@@ -17,9 +17,10 @@ static const double high_threshold = 1.0 - low_threshold;
 Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
 
 	// Build halfedge mesh from polygon soup
-  vector< vector<size_t> > polygons;
-  for (const Collada::Polygon& p : polyMesh.polygons) {
-    polygons.push_back(p.vertex_indices);
+  vector< vector<size_t> > polygons(polyMesh.num_polygons());
+  for (size_t i = 0; i < polygons.size(); i++) {
+    polygons[i].assign(polyMesh.vertex_indices.begin() + polyMesh.polygon_offsets[i],
+                       polyMesh.vertex_indices.begin() + polyMesh.polygon_offsets[i + 1]);
   }
   vector<Vector3D> vertices = polyMesh.vertices; // DELIBERATE COPY.
   for (int i = 0; i < vertices.size(); i++) {
@@ -27,6 +28,7 @@ Mesh::Mesh(Collada::PolymeshInfo& polyMesh, const Matrix4x4& transform) {
   }
 
   mesh.build(polygons, vertices);  
+  topologyChanged = false;
   if (polyMesh.material) {
     bsdf = polyMesh.material->bsdf;
   } else {
@@ -368,6 +370,7 @@ void Mesh::collapse_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.collapseEdge(edge->halfedge()->edge());
+  topologyChanged = true;
   invalidate_selection();
 }
 
@@ -377,6 +380,7 @@ void Mesh::flip_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.flipEdge(edge->halfedge()->edge());
+  topologyChanged = true;
   invalidate_selection();
 }
 
@@ -386,21 +390,28 @@ void Mesh::split_selected_edge() {
   Edge *edge = element->getEdge();
   if (edge == nullptr) return;
   mesh.splitEdge(edge->halfedge()->edge());
+  topologyChanged = true;
   invalidate_selection();
 }
 
 void Mesh::upsample() {
   resampler.upsample(mesh);
+  mesh.compact();
+  topologyChanged = true;
   invalidate_selection();
 }
 
 void Mesh::downsample() {
   resampler.downsample(mesh);
+  mesh.compact();
+  topologyChanged = true;
   invalidate_selection();
 }
 
 void Mesh::resample() {
   resampler.resample(mesh);
+  mesh.compact();
+  topologyChanged = true;
   invalidate_selection();
 }
 
@@ -506,9 +517,20 @@ BSDF* Mesh::get_bsdf() {
 }
 
 StaticScene::SceneObject *Mesh::get_static_object() {
+  topologyChanged = false;
   return new StaticScene::Mesh(mesh, bsdf);
 }
 
+bool Mesh::can_update_static_object(StaticScene::SceneObject *obj) const {
+  if (topologyChanged) return false;
+  StaticScene::Mesh *staticMesh = dynamic_cast<StaticScene::Mesh *>(obj);
+  return staticMesh != nullptr && staticMesh->can_update_positions(mesh);
+}
+
+void Mesh::update_static_object(StaticScene::SceneObject *obj) {
+  static_cast<StaticScene::Mesh *>(obj)->update_positions(mesh);
+}
+
 
 } // namespace DynamicScene
 } // namespace CGL
@@ -63,6 +63,8 @@ class Mesh : public SceneObject, public MeshView {
 
   BSDF *get_bsdf();
   StaticScene::SceneObject *get_static_object();
+  bool can_update_static_object(StaticScene::SceneObject *obj) const;
+  void update_static_object(StaticScene::SceneObject *obj);
 
   // MeshView methods
   void collapse_selected_edge();
@@ -111,6 +113,10 @@ class Mesh : public SceneObject, public MeshView {
   HalfedgeMesh mesh;
   MeshResampler resampler;
 
+  // set by edits that add, remove or reconnect elements; positions alone
+  // can be copied into the last static mesh
+  bool topologyChanged;
+
   // material
   BSDF* bsdf;
 };
@@ -131,6 +131,21 @@ void Scene::resample_selected_mesh() {
 }
 
 StaticScene::Scene *Scene::get_static_scene() {
+  // Only touch the current static objects once all of them are known to
+  // be updatable, so that a rebuild never starts from half-updated ones.
+  if (staticScene != nullptr && staticScene->objects.size() == objects.size()) {
+    bool updatable = true;
+    for (size_t i = 0; i < objects.size() && updatable; i++) {
+      updatable = objects[i]->can_update_static_object(staticScene->objects[i]);
+    }
+    if (updatable) {
+      for (size_t i = 0; i < objects.size(); i++) {
+        objects[i]->update_static_object(staticScene->objects[i]);
+      }
+      return staticScene;
+    }
+  }
+
   std::vector<StaticScene::SceneObject *> staticObjects;
   std::vector<StaticScene::SceneLight *> staticLights;
 
@@ -141,7 +156,8 @@ StaticScene::Scene *Scene::get_static_scene() {
     staticLights.push_back(light->get_static_light());
   }
 
-  return new StaticScene::Scene(staticObjects, staticLights);
+  staticScene = new StaticScene::Scene(staticObjects, staticLights);
+  return staticScene;
 }
 
 
@@ -118,6 +118,21 @@ class SceneObject {
    * expects all the objects to be
    */
   virtual StaticScene::SceneObject *get_static_object() = 0;
+
+  /**
+   * Whether a static object previously returned by get_static_object can be
+   * brought up to date with the edits made since in place (e.g. only
+   * vertices moved). Returns false if a new static object is needed.
+   */
+  virtual bool can_update_static_object(StaticScene::SceneObject *) const {
+    return false;
+  }
+
+  /**
+   * Brings a static object up to date in place. Only called once
+   * can_update_static_object has returned true for it.
+   */
+  virtual void update_static_object(StaticScene::SceneObject *) { }
 };
 
 
@@ -126,6 +141,7 @@ class SceneObject {
  */
 class SceneLight {
  public:
+  virtual ~SceneLight() { }
   virtual StaticScene::SceneLight *get_static_light() const = 0;
 };
 
@@ -139,6 +155,7 @@ class Scene {
     this->lights = lights;
     this->selectionIdx = -1;
     this->hoverIdx = -1;
+    this->staticScene = nullptr;
   }
 
   /**
@@ -211,6 +228,9 @@ class Scene {
   /**
    * Builds a static scene that's equivalent to the current scene and is easier
    * to use in raytracing, but doesn't allow modifications.
+   * If every object can update its static counterpart in place, the static
+   * scene returned last time is returned again, so that the raytracer can
+   * refit its acceleration structures instead of rebuilding them.
    */
   StaticScene::Scene *get_static_scene();
 
@@ -219,6 +239,7 @@ class Scene {
   std::vector<SceneObject *> objects;
   std::vector<SceneLight *> lights;
   int selectionIdx, hoverIdx;
+  StaticScene::Scene *staticScene; ///< last static scene handed out
 
   /**
    * If there is a selected object and it's a mesh, returns it as a MeshView.
@@ -34,6 +34,10 @@ class Sphere : public SceneObject {
 
   BSDF* get_bsdf();
   StaticScene::SceneObject *get_static_object();
+  // Spheres can't be edited, so their static objects never go stale.
+  bool can_update_static_object(StaticScene::SceneObject *) const {
+    return true;
+  }
 
  private:
 
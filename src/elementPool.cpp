@@ -0,0 +1,43 @@
+#include "elementPool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+
+using namespace std;
+
+namespace CGL {
+
+ElementPoolRegistry::Entry ElementPoolRegistry::entries[MAX_POOLS];
+
+static mutex registryLock;
+static vector<uint32_t> freeIds;
+static uint32_t nextId = 0;
+
+uint32_t ElementPoolRegistry::acquire( void ) {
+
+  lock_guard<mutex> lock(registryLock);
+  if (!freeIds.empty()) {
+    uint32_t id = freeIds.back();
+    freeIds.pop_back();
+    return id;
+  }
+  if (nextId == MAX_POOLS) {
+    fprintf(stderr, "Error: more than %u halfedge element pools\n", MAX_POOLS);
+    exit(EXIT_FAILURE);
+  }
+  return nextId++;
+
+}
+
+void ElementPoolRegistry::release( uint32_t id ) {
+
+  lock_guard<mutex> lock(registryLock);
+  entries[id].data = NULL;
+  entries[id].alive = NULL;
+  entries[id].size = 0;
+  freeIds.push_back(id);
+
+}
+
+} // namespace CGL
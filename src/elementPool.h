@@ -0,0 +1,283 @@
+#ifndef CGL_ELEMENTPOOL_H
+#define CGL_ELEMENTPOOL_H
+
+#include <cstddef>
+#include <iterator>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace CGL {
+
+/*
+  Storage for the elements of a HalfedgeMesh with the interface of the
+  std::list it replaces when HALFEDGE_POOL is defined. Elements live in one
+  contiguous array. An ElementHandle is a 32-bit pool id and a 32-bit slot
+  index, so it is as small as a list iterator while the elements lose the
+  list node around them. Erased slots go on a free list and are reused by
+  later inserts; compact() closes the holes.
+
+  Handles stay valid when the pool grows, but the array may move, so plain
+  pointers and references to elements only last until the next insert.
+*/
+
+/*
+  Where the slots of every live pool are, indexed by pool id. Each pool
+  keeps its own entry up to date; ids are handed out under a lock, so pools
+  may be created and destroyed from any thread.
+*/
+class ElementPoolRegistry {
+ public:
+
+  struct Entry {
+    void* data;                 ///< the slot array
+    const unsigned char* alive; ///< whether each slot holds an element
+    uint32_t size;              ///< number of slots
+  };
+
+  static const uint32_t MAX_POOLS = 1 << 18;
+
+  static uint32_t acquire( void );
+  static void release( uint32_t id );
+
+  static Entry entries[MAX_POOLS];
+
+}; // class ElementPoolRegistry
+
+template <class T> class ElementPool;
+
+/*
+  A forward iterator over an ElementPool, and the handle elements keep to
+  each other. Value is T or const T.
+*/
+template <class Value>
+class ElementHandle {
+ public:
+  typedef std::forward_iterator_tag iterator_category;
+  typedef typename std::remove_const<Value>::type value_type;
+  typedef std::ptrdiff_t difference_type;
+  typedef Value* pointer;
+  typedef Value& reference;
+
+  // Index of end(), and of the pool of a handle that was never set.
+  static const uint32_t NONE = 0xffffffff;
+
+  ElementHandle( void ) : pool(NONE), index(NONE) { }
+
+  // A handle converts to a const handle, as list iterators do.
+  template <class Other>
+  ElementHandle( const ElementHandle<Other>& h,
+                 typename std::enable_if<
+                   std::is_convertible<Other*, Value*>::value>::type* = 0 )
+    : pool(h.pool), index(h.index) { }
+
+  reference operator*( void ) const { return *get(); }
+  pointer operator->( void ) const { return get(); }
+
+  ElementHandle& operator++( void ) {
+    const ElementPoolRegistry::Entry& entry = ElementPoolRegistry::entries[pool];
+    uint32_t i = index + 1;
+    while (i < entry.size && !entry.alive[i]) i++;
+    index = i < entry.size ? i : NONE;
+    return *this;
+  }
+
+  ElementHandle operator++( int ) {
+    ElementHandle h = *this;
+    ++*this;
+    return h;
+  }
+
+  uint32_t poolId( void ) const { return pool; }
+  uint32_t slot( void ) const { return index; }
+
+ private:
+
+  template <class> friend class ElementHandle;
+  template <class> friend class ElementPool;
+
+  ElementHandle( uint32_t pool, uint32_t index ) : pool(pool), index(index) { }
+
+  pointer get( void ) const {
+    return static_cast<pointer>(ElementPoolRegistry::entries[pool].data) + index;
+  }
+
+  uint32_t pool;
+  uint32_t index;
+
+}; // class ElementHandle
+
+template <class Value> const uint32_t ElementHandle<Value>::NONE;
+
+template <class A, class B>
+inline bool operator==( const ElementHandle<A>& a, const ElementHandle<B>& b ) {
+  return a.slot() == b.slot() && a.poolId() == b.poolId();
+}
+
+template <class A, class B>
+inline bool operator!=( const ElementHandle<A>& a, const ElementHandle<B>& b ) {
+  return !(a == b);
+}
+
+// Handles order by pool, then by slot; end() comes last in its pool.
+template <class A, class B>
+inline bool operator<( const ElementHandle<A>& a, const ElementHandle<B>& b ) {
+  if (a.poolId() != b.poolId()) return a.poolId() < b.poolId();
+  return a.slot() < b.slot();
+}
+
+template <class T>
+class ElementPool {
+ public:
+  typedef ElementHandle<T> iterator;
+  typedef ElementHandle<const T> const_iterator;
+
+  ElementPool( void ) : id(ElementPoolRegistry::acquire()), count(0) {
+    publish();
+  }
+
+  ~ElementPool( void ) { ElementPoolRegistry::release(id); }
+
+  iterator begin( void ) { return iterator(id, first()); }
+  const_iterator begin( void ) const { return const_iterator(id, first()); }
+  iterator end( void ) { return iterator(id, iterator::NONE); }
+  const_iterator end( void ) const { return const_iterator(id, iterator::NONE); }
+
+  size_t size( void ) const { return count; }
+  bool empty( void ) const { return count == 0; }
+
+  /**
+   * Add an element, in a free slot if there is one, else at the end. The
+   * position is only there for the list interface; elements have no order
+   * other than their slots.
+   */
+  iterator insert( const_iterator position, const T& value ) {
+    uint32_t i;
+    if (freeSlots.empty()) {
+      i = (uint32_t) slots.size();
+      slots.push_back(value);
+      alive.push_back(1);
+    } else {
+      i = freeSlots.back();
+      freeSlots.pop_back();
+      slots[i] = value;
+      alive[i] = 1;
+    }
+    count++;
+    publish();
+    return iterator(id, i);
+  }
+
+  /**
+   * Free the slot of an element. Other handles stay valid, and advancing
+   * the erased one still moves on to the next element.
+   */
+  void erase( const_iterator position ) {
+    uint32_t i = position.index;
+    slots[i] = T();
+    alive[i] = 0;
+    freeSlots.push_back(i);
+    count--;
+  }
+
+  void clear( void ) {
+    std::vector<T>().swap(slots);
+    std::vector<unsigned char>().swap(alive);
+    std::vector<uint32_t>().swap(freeSlots);
+    count = 0;
+    publish();
+  }
+
+  /**
+   * Add default elements, or erase the last ones, until there are n.
+   */
+  void resize( size_t n ) {
+    if (freeSlots.empty() && n >= count) {
+      slots.resize(n);
+      alive.resize(n, 1);
+      count = n;
+      publish();
+      return;
+    }
+    while (count > n) {
+      uint32_t i = (uint32_t) slots.size();
+      while (!alive[--i]) { }
+      erase(const_iterator(id, i));
+    }
+    while (count < n) insert(end(), T());
+  }
+
+  /**
+   * Move the elements down over the free slots, keeping their order, and
+   * release the memory left over. Every handle to the pool is out of date
+   * afterwards until it has gone through relocate with the map this
+   * returns, which gives the new slot of each old one. Without free slots
+   * nothing moves, and the map is empty.
+   */
+  std::vector<uint32_t> compact( void ) {
+    if (freeSlots.empty()) {
+      slots.shrink_to_fit();
+      alive.shrink_to_fit();
+      publish();
+      return std::vector<uint32_t>();
+    }
+    std::vector<uint32_t> newSlot(slots.size(), iterator::NONE);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < slots.size(); i++) {
+      if (!alive[i]) continue;
+      if (n != i) slots[n] = std::move(slots[i]);
+      newSlot[i] = n++;
+    }
+    slots.erase(slots.begin() + n, slots.end());
+    slots.shrink_to_fit();
+    std::vector<unsigned char>(n, 1).swap(alive);
+    std::vector<uint32_t>().swap(freeSlots);
+    publish();
+    return newSlot;
+  }
+
+  /**
+   * Update a handle after compact(). Handles to other pools, and end(),
+   * are left alone.
+   */
+  template <class Value>
+  void relocate( ElementHandle<Value>& h,
+                 const std::vector<uint32_t>& newSlot ) const {
+    if (h.pool == id && h.index != iterator::NONE && !newSlot.empty()) {
+      h.index = newSlot[h.index];
+    }
+  }
+
+ private:
+
+  // A pool owns its registry entry, so it can't be copied.
+  ElementPool( const ElementPool& );
+  ElementPool& operator=( const ElementPool& );
+
+  uint32_t first( void ) const {
+    if (count == 0) return iterator::NONE;
+    uint32_t i = 0;
+    while (!alive[i]) i++;
+    return i;
+  }
+
+  void publish( void ) {
+    ElementPoolRegistry::Entry& entry = ElementPoolRegistry::entries[id];
+    entry.data = slots.data();
+    entry.alive = alive.data();
+    entry.size = (uint32_t) slots.size();
+  }
+
+  uint32_t id;
+  std::vector<T> slots;
+  std::vector<unsigned char> alive;
+  std::vector<uint32_t> freeSlots;
+  size_t count;
+
+}; // class ElementPool
+
+} // namespace CGL
+
+#endif // CGL_ELEMENTPOOL_H
@@ -0,0 +1,752 @@
+#include "flat_bvh.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <stdint.h>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace CGL { namespace StaticScene {
+
+// Deepest tree the stack traversal handles. Every push goes one level down,
+// so the stack never holds more entries than the depth of the tree.
+static const size_t STACK_SIZE = 64;
+
+static const size_t NO_HIT = (size_t) -1;
+
+// A hit inside an instance is the index of the record hit in the mesh, with
+// the index of the instance record plus one in the bits above this one.
+static const int INSTANCE_SHIFT = 32;
+static const size_t RECORD_MASK = ((size_t) 1 << INSTANCE_SHIFT) - 1;
+
+// A packet with no more rays than this left in a subtree has diverged.
+static const size_t PACKET_MIN_RAYS = 2;
+
+// Widest spread of directions, summed over the axes, that is still traced as
+// a packet. The intervals of wider ones cull too little to pay off.
+static const float PACKET_MAX_SPREAD = 0.8f;
+
+// The ray in the precision of the kernel records.
+struct FlatRay {
+
+  FlatRay() { }
+
+  FlatRay(const Ray& ray) : min_t(ray.min_t), max_t(ray.max_t) {
+    for (int a = 0; a < 3; a++) {
+      o[a] = ray.o[a];
+      d[a] = ray.d[a];
+      inv_d[a] = 1.0f / d[a];
+      sign[a] = std::signbit(d[a]);
+    }
+  }
+
+  // The ray in the space of an instanced mesh, as intersect_instance in
+  // kernel/intersect.h moves it there.
+  FlatRay(const FlatRay& ray, const kernel_instance_t& instance)
+      : min_t(ray.min_t), max_t(ray.max_t) {
+    for (int a = 0; a < 3; a++) {
+      const cl_float4& row = instance.world_to_object[a];
+      o[a] = row.s[0] * ray.o[0] + row.s[1] * ray.o[1] + row.s[2] * ray.o[2] +
+             row.s[3];
+      d[a] = row.s[0] * ray.d[0] + row.s[1] * ray.d[1] + row.s[2] * ray.d[2];
+      inv_d[a] = 1.0f / d[a];
+      sign[a] = std::signbit(d[a]);
+    }
+  }
+
+  float o[3], d[3], inv_d[3];
+  int sign[3];
+  float min_t, max_t;
+
+};
+
+static inline bool intersect_box(const FlatRay& r, const kernel_bvh_node_t& node,
+                                 float *t0) {
+  float tmin = (node.bounds[r.sign[0]].s[0] - r.o[0]) * r.inv_d[0];
+  float tmax = (node.bounds[1 - r.sign[0]].s[0] - r.o[0]) * r.inv_d[0];
+  for (int a = 1; a < 3; a++) {
+    float amin = (node.bounds[r.sign[a]].s[a] - r.o[a]) * r.inv_d[a];
+    float amax = (node.bounds[1 - r.sign[a]].s[a] - r.o[a]) * r.inv_d[a];
+    if (tmin > amax || amin > tmax) return false;
+    if (amin > tmin) tmin = amin;
+    if (amax < tmax) tmax = amax;
+  }
+  if (tmin > r.max_t || tmax < r.min_t) return false;
+  *t0 = tmin;
+  return true;
+}
+
+// Rays traced as a packet, their closest hits so far, and intervals
+// bounding their origins and inverse directions.
+struct FlatPacket {
+
+  FlatRay rays[FlatBVH::PACKET_SIZE];
+  size_t count;
+  uint32_t active;  ///< bit mask of the rays still being traced
+
+  // The rays again, lane by lane, to test all of them against a box at once.
+  float o[3][FlatBVH::PACKET_SIZE], inv_d[3][FlatBVH::PACKET_SIZE];
+  float min_t[FlatBVH::PACKET_SIZE], max_t[FlatBVH::PACKET_SIZE];
+
+  int sign[3];      ///< direction signs, the same for every ray
+  float o_min[3], o_max[3];
+  float inv_d_min[3], inv_d_max[3];
+  float t_min, t_max;  ///< over the active rays
+
+  size_t hit[FlatBVH::PACKET_SIZE];
+  float hit_t[FlatBVH::PACKET_SIZE];
+  float hit_u[FlatBVH::PACKET_SIZE], hit_v[FlatBVH::PACKET_SIZE];
+
+  void record_hit(size_t i, size_t prim, float t, float u, float v,
+                  bool any_hit) {
+    hit[i] = prim;
+    hit_t[i] = t; hit_u[i] = u; hit_v[i] = v;
+    rays[i].max_t = max_t[i] = t;
+    if (any_hit) active &= ~(1u << i);
+  }
+
+  void update_t_max() {
+    t_max = -INFINITY;
+    for (size_t i = 0; i < count; i++) {
+      if (active & (1u << i)) t_max = std::max(t_max, max_t[i]);
+    }
+  }
+
+};
+
+// Whether the rays are coherent enough to be traced as a packet. For the
+// intervals to bound them at all, every direction must point into the same
+// octant, and none may be parallel to an axis.
+static bool coherent(const Ray *rays, size_t count) {
+  float d_min[3], d_max[3];
+  for (int a = 0; a < 3; a++) d_min[a] = d_max[a] = rays[0].d[a];
+  for (size_t i = 0; i < count; i++) {
+    float spread = 0;
+    for (int a = 0; a < 3; a++) {
+      float d = rays[i].d[a];
+      // Below FLT_MIN, 1 / d overflows.
+      if (fabsf(d) < FLT_MIN || std::signbit(d) != std::signbit(d_min[a])) {
+        return false;
+      }
+      d_min[a] = std::min(d_min[a], d);
+      d_max[a] = std::max(d_max[a], d);
+      spread += d_max[a] - d_min[a];
+    }
+    if (spread > PACKET_MAX_SPREAD) return false;
+  }
+  return true;
+}
+
+static void make_packet(const Ray *rays, size_t count, FlatPacket *packet) {
+  packet->count = count;
+  packet->active = (1u << count) - 1;
+  for (size_t i = 0; i < FlatBVH::PACKET_SIZE; i++) {
+    // Unused lanes are masked out, but still tested.
+    FlatRay r = i < count ? FlatRay(rays[i]) : FlatRay(rays[0]);
+    packet->rays[i] = r;
+    for (int a = 0; a < 3; a++) {
+      packet->o[a][i] = r.o[a];
+      packet->inv_d[a][i] = r.inv_d[a];
+    }
+    packet->min_t[i] = r.min_t;
+    packet->max_t[i] = r.max_t;
+    packet->hit[i] = NO_HIT;
+  }
+
+  const FlatRay& r0 = packet->rays[0];
+  for (int a = 0; a < 3; a++) {
+    packet->sign[a] = r0.sign[a];
+    packet->o_min[a] = packet->o_max[a] = r0.o[a];
+    packet->inv_d_min[a] = packet->inv_d_max[a] = r0.inv_d[a];
+  }
+  packet->t_min = r0.min_t;
+  packet->t_max = r0.max_t;
+  for (size_t i = 1; i < count; i++) {
+    const FlatRay& r = packet->rays[i];
+    for (int a = 0; a < 3; a++) {
+      packet->o_min[a] = std::min(packet->o_min[a], r.o[a]);
+      packet->o_max[a] = std::max(packet->o_max[a], r.o[a]);
+      packet->inv_d_min[a] = std::min(packet->inv_d_min[a], r.inv_d[a]);
+      packet->inv_d_max[a] = std::max(packet->inv_d_max[a], r.inv_d[a]);
+    }
+    packet->t_min = std::min(packet->t_min, r.min_t);
+    packet->t_max = std::max(packet->t_max, r.max_t);
+  }
+}
+
+// Bit mask of the rays at or after first.
+static inline uint32_t rays_from(size_t first) {
+  return ~((1u << first) - 1);
+}
+
+static inline size_t lowest_bit(uint32_t mask) {
+  size_t i = 0;
+  while (!(mask & (1u << i))) i++;
+  return i;
+}
+
+static inline size_t count_bits(uint32_t mask) {
+  size_t n = 0;
+  for (; mask; mask &= mask - 1) n++;
+  return n;
+}
+
+// Bit mask of the rays of the packet that hit the box, the same test as
+// intersect_box, done for four rays at a time where SSE2 is available.
+static inline uint32_t box_mask(const FlatPacket& p,
+                                const kernel_bvh_node_t& node) {
+  uint32_t mask = 0;
+#ifdef __SSE2__
+  for (size_t i = 0; i < p.count; i += 4) {
+    __m128 t0 = _mm_loadu_ps(p.min_t + i), t1 = _mm_loadu_ps(p.max_t + i);
+    for (int a = 0; a < 3; a++) {
+      __m128 o = _mm_loadu_ps(p.o[a] + i), inv_d = _mm_loadu_ps(p.inv_d[a] + i);
+      __m128 near = _mm_set1_ps(node.bounds[p.sign[a]].s[a]);
+      __m128 far = _mm_set1_ps(node.bounds[1 - p.sign[a]].s[a]);
+      t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(near, o), inv_d));
+      t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(far, o), inv_d));
+    }
+    mask |= (uint32_t) _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+  }
+#else
+  for (size_t i = 0; i < p.count; i++) {
+    float t0;
+    if (intersect_box(p.rays[i], node, &t0)) mask |= 1u << i;
+  }
+#endif
+  return mask & p.active;
+}
+
+// Smallest and largest product of a value in [a0, a1] and one in [b0, b1].
+static inline float product_min(float a0, float a1, float b0, float b1) {
+  return std::min(std::min(a0 * b0, a0 * b1), std::min(a1 * b0, a1 * b1));
+}
+
+static inline float product_max(float a0, float a1, float b0, float b1) {
+  return std::max(std::max(a0 * b0, a0 * b1), std::max(a1 * b0, a1 * b1));
+}
+
+// The slab test of intersect_box in interval arithmetic: false if no ray of
+// the packet can hit the box. Rounding is monotonic, so the bounds hold in
+// floating point too.
+static inline bool packet_may_hit(const FlatPacket& p,
+                                  const kernel_bvh_node_t& node) {
+  float t0 = p.t_min, t1 = p.t_max;
+  for (int a = 0; a < 3; a++) {
+    float near = node.bounds[p.sign[a]].s[a];
+    float far = node.bounds[1 - p.sign[a]].s[a];
+    t0 = std::max(t0, product_min(near - p.o_max[a], near - p.o_min[a],
+                                  p.inv_d_min[a], p.inv_d_max[a]));
+    t1 = std::min(t1, product_max(far - p.o_max[a], far - p.o_min[a],
+                                  p.inv_d_min[a], p.inv_d_max[a]));
+  }
+  return t0 <= t1;
+}
+
+// A stream of rays traced breadth-first, their closest hits so far, and the
+// ray ids of the stream at every node on the way down.
+struct FlatStream {
+
+  // Rays are filtered one by one, as they are, rather than component by
+  // component: after the first few nodes the ids of a segment are scattered
+  // and gathering the components would cost more than it saves.
+  std::vector<FlatRay> rays;
+
+  std::vector<size_t> hit;
+  std::vector<float> hit_t, hit_u, hit_v;
+
+  // A node is entered with a segment of ids, the rays that hit its parent,
+  // and appends the ones that hit it too for its children.
+  std::vector<uint32_t> ids;
+
+  FlatStream(const Ray *stream, size_t count)
+      : rays(stream, stream + count), hit(count, NO_HIT), hit_t(count),
+        hit_u(count), hit_v(count), ids(count) {
+    for (size_t i = 0; i < count; i++) ids[i] = i;
+  }
+
+  void record_hit(size_t i, size_t prim, float t, float u, float v) {
+    hit[i] = prim;
+    hit_t[i] = t; hit_u[i] = u; hit_v[i] = v;
+    rays[i].max_t = t;
+  }
+
+  // Append the rays of the segment [begin, end) of ids that hit the box,
+  // by the same test as intersect_box. Rays done with an any hit are left
+  // out.
+  void filter(size_t begin, size_t end, const kernel_bvh_node_t& node,
+              bool any_hit) {
+    size_t n = ids.size();
+    ids.resize(n + end - begin);
+    uint32_t *out = ids.data() + n;
+    for (size_t k = begin; k < end; k++) {
+      uint32_t i = ids[k];
+      if (any_hit && hit[i] != NO_HIT) continue;
+      float t0;
+      if (!intersect_box(rays[i], node, &t0)) continue;
+      *out++ = i;
+    }
+    ids.resize(out - ids.data());
+  }
+
+};
+
+static inline float dot3(const float *a, const float *b) {
+  return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void cross3(const float *a, const float *b, float *c) {
+  c[0] = a[1] * b[2] - a[2] * b[1];
+  c[1] = a[2] * b[0] - a[0] * b[2];
+  c[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Same tests as intersect_triangle and intersect_sphere in
+// kernel/intersect.h.
+static inline bool intersect_record(const FlatRay& r,
+                                    const kernel_primitive_t& prim,
+                                    float *t, float *u, float *v) {
+  if (prim.type == KERNEL_PRIMITIVE_TYPE_TRIANGLE) {
+    const cl_float3 *p = prim.triangle.vertices;
+    float e1[3], e2[3], tvec[3], pvec[3], qvec[3];
+    for (int a = 0; a < 3; a++) {
+      e1[a] = p[1].s[a] - p[0].s[a];
+      e2[a] = p[2].s[a] - p[0].s[a];
+      tvec[a] = r.o[a] - p[0].s[a];
+    }
+    cross3(r.d, e2, pvec);
+    float det = dot3(e1, pvec);
+    if (fabsf(det) <= 0.0f) return false;
+    float invDet = 1.0f / det;
+    *u = dot3(tvec, pvec) * invDet;
+    if (*u < 0.0f || *u > 1.0f) return false;
+    cross3(tvec, e1, qvec);
+    *v = dot3(r.d, qvec) * invDet;
+    if (*v < 0.0f || *u + *v > 1.0f) return false;
+    *t = dot3(e2, qvec) * invDet;
+    return *t >= r.min_t && *t <= r.max_t;
+  }
+  if (prim.type == KERNEL_PRIMITIVE_TYPE_SPHERE) {
+    float oc[3];
+    for (int a = 0; a < 3; a++) oc[a] = r.o[a] - prim.sphere.origin.s[a];
+    float a = dot3(r.d, r.d);
+    float b = 2 * dot3(oc, r.d);
+    float c = dot3(oc, oc) - prim.sphere.radius * prim.sphere.radius;
+    float det = b * b - 4 * a * c;
+    if (det < 0) return false;
+    float sqrt_det = sqrtf(det);
+    *t = (-b - sqrt_det) / (2 * a);
+    if (*t < 0) *t = (-b + sqrt_det) / (2 * a);
+    *u = *v = 0;
+    return *t >= r.min_t && *t <= r.max_t;
+  }
+  return false;
+}
+
+static Vector3D kernel_vector(const cl_float3& v) {
+  return Vector3D(v.s[0], v.s[1], v.s[2]);
+}
+
+FlatBVH::FlatBVH()
+    : nodes(NULL), num_nodes(0), primitives(NULL), sources(NULL),
+      bsdfs(NULL), use_stack(true) { }
+
+FlatBVH::FlatBVH(const kernel_bvh_node_t *nodes, size_t num_nodes,
+                 const kernel_primitive_t *primitives,
+                 Primitive * const *sources, BSDF * const *bsdfs)
+    : nodes(nodes), num_nodes(num_nodes), primitives(primitives),
+      sources(sources), bsdfs(bsdfs), use_stack(true) {
+  if (num_nodes == 0) return;
+
+  // Find the depth of the tree: the children of an interior node are its
+  // entry and the exit of that entry, a leaf has equal entry and exit.
+  // The BVH of an instanced mesh is traversed with a stack of its own, so
+  // its depth starts over at its root.
+  std::vector<std::pair<cl_uint, size_t> > todo(1, std::make_pair(0u, 0));
+  std::unordered_set<cl_uint> mesh_roots;
+  while (!todo.empty() && use_stack) {
+    cl_uint index = todo.back().first;
+    size_t depth = todo.back().second;
+    todo.pop_back();
+    const kernel_bvh_node_t& node = nodes[index];
+    if (node.entry_index == node.exit_index) {
+      for (cl_uint p = node.prim_index; p < node.prim_index + node.prim_count; p++) {
+        if (primitives[p].type != KERNEL_PRIMITIVE_TYPE_INSTANCE) continue;
+        cl_uint root = primitives[p].instance.root;
+        if (mesh_roots.insert(root).second) todo.push_back(std::make_pair(root, 0));
+      }
+      continue;
+    }
+    if (depth + 1 > STACK_SIZE) use_stack = false;
+    todo.push_back(std::make_pair(node.entry_index, depth + 1));
+    todo.push_back(std::make_pair(nodes[node.entry_index].exit_index,
+                                  depth + 1));
+  }
+}
+
+size_t FlatBVH::find_closest(const FlatRay& ray, cl_uint root, bool any_hit,
+                             float *hit_t, float *hit_u, float *hit_v) const {
+  FlatRay r = ray;
+  float t0;
+  if (!intersect_box(r, nodes[root], &t0)) return NO_HIT;
+
+  struct { cl_uint index; float t; } stack[STACK_SIZE];
+  size_t top = 0;
+  size_t hit = NO_HIT;
+  cl_uint index = root;
+  while (true) {
+    const kernel_bvh_node_t& node = nodes[index];
+    if (node.entry_index == node.exit_index) {
+      for (cl_uint p = node.prim_index; p < node.prim_index + node.prim_count; p++) {
+        float t, u, v;
+        size_t h;
+        if (!intersect_leaf(r, p, any_hit, &t, &u, &v, &h)) continue;
+        r.max_t = t;
+        hit = h;
+        *hit_t = t; *hit_u = u; *hit_v = v;
+        if (any_hit) return hit;
+      }
+    } else {
+      cl_uint left = node.entry_index;
+      cl_uint right = nodes[left].exit_index;
+      float t_left, t_right;
+      bool hit_left = intersect_box(r, nodes[left], &t_left);
+      bool hit_right = intersect_box(r, nodes[right], &t_right);
+      if (hit_left && hit_right) {
+        if (t_right < t_left) {
+          std::swap(left, right);
+          std::swap(t_left, t_right);
+        }
+        stack[top].index = right;
+        stack[top].t = t_right;
+        top++;
+        index = left;
+        continue;
+      }
+      if (hit_left || hit_right) {
+        index = hit_left ? left : right;
+        continue;
+      }
+    }
+
+    // Skip the far children that start beyond the closest hit by now.
+    do {
+      if (top == 0) return hit;
+      top--;
+    } while (stack[top].t > r.max_t);
+    index = stack[top].index;
+  }
+}
+
+size_t FlatBVH::find_threaded(const FlatRay& ray, cl_uint root, bool any_hit,
+                              float *hit_t, float *hit_u, float *hit_v) const {
+  FlatRay r = ray;
+  size_t hit = NO_HIT;
+  cl_uint index = root;
+  do {
+    const kernel_bvh_node_t& node = nodes[index];
+    float t0;
+    if (!intersect_box(r, node, &t0)) {
+      index = node.exit_index;
+      continue;
+    }
+    for (cl_uint p = node.prim_index; p < node.prim_index + node.prim_count; p++) {
+      float t, u, v;
+      size_t h;
+      if (!intersect_leaf(r, p, any_hit, &t, &u, &v, &h)) continue;
+      r.max_t = t;
+      hit = h;
+      *hit_t = t; *hit_u = u; *hit_v = v;
+      if (any_hit) return hit;
+    }
+    index = node.entry_index;
+  } while (index != 0);
+  return hit;
+}
+
+bool FlatBVH::intersect_leaf(const FlatRay& r, cl_uint p, bool any_hit,
+                             float *t, float *u, float *v, size_t *hit) const {
+  const kernel_primitive_t& prim = primitives[p];
+  if (prim.type != KERNEL_PRIMITIVE_TYPE_INSTANCE) {
+    if (!intersect_record(r, prim, t, u, v)) return false;
+    *hit = p;
+    return true;
+  }
+
+  // The leaves of the mesh hold no instances, so this goes one level deep.
+  FlatRay local(r, prim.instance);
+  cl_uint root = prim.instance.root;
+  size_t h = use_stack ? find_closest(local, root, any_hit, t, u, v)
+                       : find_threaded(local, root, any_hit, t, u, v);
+  if (h == NO_HIT) return false;
+  *hit = h | ((size_t) p + 1) << INSTANCE_SHIFT;
+  return true;
+}
+
+size_t FlatBVH::first_hit(const FlatPacket& p, const kernel_bvh_node_t& node,
+                          size_t first) const {
+  // The ray that entered the parent first mostly enters the child too.
+  float t0;
+  if (intersect_box(p.rays[first], node, &t0)) return first;
+  if (!packet_may_hit(p, node)) return PACKET_SIZE;
+  uint32_t mask = box_mask(p, node) & rays_from(first + 1);
+  return mask ? lowest_bit(mask) : PACKET_SIZE;
+}
+
+void FlatBVH::trace_packet(FlatPacket& p, bool any_hit) const {
+  // Every node pops one entry and pushes at most two, one level down.
+  struct { cl_uint index; size_t first; } stack[STACK_SIZE + 1];
+  stack[0].index = 0;
+  stack[0].first = 0;
+  size_t top = 1;
+  while (top > 0) {
+    top--;
+    cl_uint index = stack[top].index;
+    const kernel_bvh_node_t& node = nodes[index];
+    uint32_t left_rays = p.active & rays_from(stack[top].first);
+    if (!left_rays) continue;
+    size_t first = first_hit(p, node, lowest_bit(left_rays));
+    if (first == PACKET_SIZE) continue;
+
+    // The rays before first miss this subtree. With only a few rays left
+    // after it, the packet has diverged and they are faster on their own.
+    left_rays = p.active & rays_from(first);
+    if (count_bits(left_rays) <= PACKET_MIN_RAYS) {
+      for (size_t i = first; i < p.count; i++) {
+        if (!(left_rays & (1u << i))) continue;
+        float t, u, v;
+        size_t h = find_closest(p.rays[i], index, any_hit, &t, &u, &v);
+        if (h != NO_HIT) p.record_hit(i, h, t, u, v, any_hit);
+      }
+      if (!p.active) return;
+      p.update_t_max();
+      continue;
+    }
+
+    if (node.entry_index == node.exit_index) {
+      uint32_t in_leaf = (box_mask(p, node) & rays_from(first)) | (1u << first);
+      for (cl_uint q = node.prim_index; q < node.prim_index + node.prim_count; q++) {
+        for (size_t i = first; i < p.count; i++) {
+          if (!(in_leaf & p.active & (1u << i))) continue;
+          float t, u, v;
+          size_t h;
+          if (intersect_leaf(p.rays[i], q, any_hit, &t, &u, &v, &h)) {
+            p.record_hit(i, h, t, u, v, any_hit);
+          }
+        }
+      }
+      if (!p.active) return;
+      p.update_t_max();
+      continue;
+    }
+
+    // Visit the child nearer along the direction of the packet first.
+    cl_uint left = node.entry_index;
+    cl_uint right = nodes[left].exit_index;
+    const FlatRay& r = p.rays[first];
+    float toward = 0;
+    for (int a = 0; a < 3; a++) {
+      toward += (nodes[left].bounds[0].s[a] + nodes[left].bounds[1].s[a] -
+                 nodes[right].bounds[0].s[a] - nodes[right].bounds[1].s[a]) * r.d[a];
+    }
+    if (toward > 0) std::swap(left, right);
+    stack[top].index = right;
+    stack[top].first = first;
+    top++;
+    stack[top].index = left;
+    stack[top].first = first;
+    top++;
+  }
+}
+
+void FlatBVH::trace_stream(FlatStream& s, bool any_hit) const {
+  // Every node pops one entry and pushes at most two, one level down. The
+  // segments of the entries on the stack are nested in the order they were
+  // pushed, so popping one drops every segment appended after its own.
+  struct { cl_uint index; size_t begin, end; } stack[STACK_SIZE + 1];
+  stack[0].index = 0;
+  stack[0].begin = 0;
+  stack[0].end = s.ids.size();
+  size_t top = 1;
+  while (top > 0) {
+    top--;
+    cl_uint index = stack[top].index;
+    const kernel_bvh_node_t& node = nodes[index];
+    s.ids.resize(stack[top].end);
+    size_t begin = s.ids.size();
+    s.filter(stack[top].begin, stack[top].end, node, any_hit);
+    size_t end = s.ids.size();
+    if (begin == end) continue;
+
+    // A few rays left on their own are faster without the stream.
+    if (end - begin <= PACKET_MIN_RAYS) {
+      for (size_t k = begin; k < end; k++) {
+        uint32_t i = s.ids[k];
+        float t, u, v;
+        size_t h = find_closest(s.rays[i], index, any_hit, &t, &u, &v);
+        if (h != NO_HIT) s.record_hit(i, h, t, u, v);
+      }
+      continue;
+    }
+
+    if (node.entry_index == node.exit_index) {
+      for (cl_uint q = node.prim_index; q < node.prim_index + node.prim_count; q++) {
+        for (size_t k = begin; k < end; k++) {
+          uint32_t i = s.ids[k];
+          if (any_hit && s.hit[i] != NO_HIT) continue;
+          float t, u, v;
+          size_t h;
+          if (intersect_leaf(s.rays[i], q, any_hit, &t, &u, &v, &h)) {
+            s.record_hit(i, h, t, u, v);
+          }
+        }
+      }
+      continue;
+    }
+
+    // Visit the child nearer along the first ray of the segment first; the
+    // stream is sorted, so its neighbours mostly agree.
+    cl_uint left = node.entry_index;
+    cl_uint right = nodes[left].exit_index;
+    const FlatRay& r = s.rays[s.ids[begin]];
+    float toward = 0;
+    for (int a = 0; a < 3; a++) {
+      toward += (nodes[left].bounds[0].s[a] + nodes[left].bounds[1].s[a] -
+                 nodes[right].bounds[0].s[a] - nodes[right].bounds[1].s[a]) * r.d[a];
+    }
+    if (toward > 0) std::swap(left, right);
+    stack[top].index = right;
+    stack[top].begin = begin;
+    stack[top].end = end;
+    top++;
+    stack[top].index = left;
+    stack[top].begin = begin;
+    stack[top].end = end;
+    top++;
+  }
+}
+
+bool FlatBVH::intersect(const Ray& ray) const {
+  if (empty()) return false;
+  float t, u, v;
+  size_t hit = use_stack ? find_closest(FlatRay(ray), 0, true, &t, &u, &v)
+                         : find_threaded(FlatRay(ray), 0, true, &t, &u, &v);
+  if (hit == NO_HIT) return false;
+  ray.max_t = t;
+  return true;
+}
+
+bool FlatBVH::intersect(const Ray& ray, Intersection* i) const {
+  if (empty()) return false;
+  float t, u, v;
+  size_t hit = use_stack ? find_closest(FlatRay(ray), 0, false, &t, &u, &v)
+                         : find_threaded(FlatRay(ray), 0, false, &t, &u, &v);
+  if (hit == NO_HIT) return false;
+  ray.max_t = t;
+  fill_intersection(ray, hit, t, u, v, i);
+  return true;
+}
+
+void FlatBVH::intersect(const Ray *rays, size_t count, bool *hits,
+                        Intersection *isects) const {
+  if (count > PACKET_SIZE) {
+    intersect(rays, PACKET_SIZE, hits, isects);
+    intersect(rays + PACKET_SIZE, count - PACKET_SIZE, hits + PACKET_SIZE,
+              isects ? isects + PACKET_SIZE : NULL);
+    return;
+  }
+
+  if (empty() || !use_stack || count < 2 || !coherent(rays, count)) {
+    for (size_t i = 0; i < count; i++) {
+      hits[i] = isects ? intersect(rays[i], &isects[i]) : intersect(rays[i]);
+    }
+    return;
+  }
+
+  FlatPacket packet;
+  make_packet(rays, count, &packet);
+  trace_packet(packet, !isects);
+  for (size_t i = 0; i < count; i++) {
+    hits[i] = packet.hit[i] != NO_HIT;
+    if (!hits[i]) continue;
+    float t = packet.hit_t[i];
+    rays[i].max_t = t;
+    if (isects) {
+      fill_intersection(rays[i], packet.hit[i], t, packet.hit_u[i],
+                        packet.hit_v[i], &isects[i]);
+    }
+  }
+}
+
+void FlatBVH::intersect_stream(const Ray *rays, size_t count, bool *hits,
+                               Intersection *isects) const {
+  if (empty() || !use_stack || count == 0) {
+    for (size_t i = 0; i < count; i++) {
+      hits[i] = isects ? intersect(rays[i], &isects[i]) : intersect(rays[i]);
+    }
+    return;
+  }
+
+  FlatStream stream(rays, count);
+  trace_stream(stream, !isects);
+  for (size_t i = 0; i < count; i++) {
+    hits[i] = stream.hit[i] != NO_HIT;
+    if (!hits[i]) continue;
+    float t = stream.hit_t[i];
+    rays[i].max_t = t;
+    if (isects) {
+      fill_intersection(rays[i], stream.hit[i], t, stream.hit_u[i],
+                        stream.hit_v[i], &isects[i]);
+    }
+  }
+}
+
+void FlatBVH::fill_intersection(const Ray& ray, size_t hit, float t,
+                                float u, float v, Intersection *i) const {
+  size_t instance = hit >> INSTANCE_SHIFT;
+  hit &= RECORD_MASK;
+  const kernel_primitive_t& prim = primitives[hit];
+  i->t = t;
+  Vector3D n;
+  if (prim.type == KERNEL_PRIMITIVE_TYPE_TRIANGLE) {
+    const cl_float3 *normals = prim.triangle.normals;
+    n = (1 - u - v) * kernel_vector(normals[0]) + u * kernel_vector(normals[1]) +
+        v * kernel_vector(normals[2]);
+  } else {
+    Vector3D p = ray.o + ray.d * t;
+    if (instance) {
+      const cl_float4 *rows = primitives[instance - 1].instance.world_to_object;
+      Vector3D world = p;
+      for (int a = 0; a < 3; a++) {
+        p[a] = rows[a].s[0] * world.x + rows[a].s[1] * world.y +
+               rows[a].s[2] * world.z + rows[a].s[3];
+      }
+    }
+    n = p - kernel_vector(prim.sphere.origin);
+  }
+  if (instance) {
+    // Normals go with the inverse transpose of the transform.
+    const cl_float4 *rows = primitives[instance - 1].instance.world_to_object;
+    n = n.x * kernel_vector(rows[0]) + n.y * kernel_vector(rows[1]) +
+        n.z * kernel_vector(rows[2]);
+  }
+  i->n = n.unit();
+  i->primitive = sources ? sources[hit] : NULL;
+  if (sources) {
+    i->bsdf = sources[hit]->get_bsdf();
+  } else if (bsdfs) {
+    i->bsdf = bsdfs[prim.type == KERNEL_PRIMITIVE_TYPE_TRIANGLE ?
+                    prim.triangle.bsdf_index : prim.sphere.bsdf_index];
+  } else {
+    i->bsdf = NULL;
+  }
+}
+
+} // namespace StaticScene
+} // namespace CGL
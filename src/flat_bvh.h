@@ -0,0 +1,133 @@
+#ifndef CGL_FLAT_BVH_H
+#define CGL_FLAT_BVH_H
+
+#include "kernel_types.h"
+#include "ray.h"
+#include "static_scene/primitive.h"
+
+namespace CGL { namespace StaticScene {
+
+struct FlatRay;
+struct FlatPacket;
+struct FlatStream;
+
+/**
+ * C++ traversal of a flattened BVH, the same kernel_bvh_node_t and
+ * kernel_primitive_t arrays pathtrace_pixel takes, so that the CPU and the
+ * device trace one acceleration structure. The arrays are not copied and
+ * must outlive the FlatBVH.
+ * Traversal is iterative with a fixed-size stack: at an interior node both
+ * children are tested, the nearer one is visited first and the other one is
+ * only visited if it still starts before the closest hit found so far.
+ * Trees too deep for the stack are traversed through the threaded links
+ * instead, in the fixed order the device uses.
+ * Tests run in single precision on the kernel records, like on the device.
+ * An instance record is traced by moving the ray into the space of its mesh
+ * and traversing the BVH of the mesh from its root, as the kernel does.
+ *
+ * Coherent rays, such as the camera rays of a few neighbouring pixels or the
+ * shadow rays from one point to one light, can also be traced as a packet.
+ * A node is then tested once for the packet: against the ray that entered
+ * its parent first, and if that one misses, against the interval bounding
+ * the origins and directions of all rays, before looking for another ray
+ * that hits it. Once only a couple of rays are left in a subtree, they go
+ * on alone.
+ *
+ * Large sets of rays, such as all the secondary rays of a tile, are better
+ * traced as a stream: every node filters the rays that reached it down to
+ * the ones that hit its box, and passes those on to its children, so each
+ * node is fetched once for the whole stream. The stream is best sorted so
+ * that neighbouring rays take similar paths.
+ */
+class FlatBVH {
+ public:
+
+  /**
+   * Most rays traced as one packet.
+   */
+  static const size_t PACKET_SIZE = 16;
+
+  FlatBVH();
+
+  /**
+   * \param nodes flattened nodes, root at index 0
+   * \param num_nodes number of nodes
+   * \param primitives primitive records, in leaf order
+   * \param sources host primitive of every record, reported in
+   *        Intersection::primitive and used for the BSDF; may be NULL if
+   *        there is no host scene, e.g. for a cached one
+   * \param bsdfs host BSDF of every BSDF record, used for the BSDF when
+   *        there are no sources
+   */
+  FlatBVH(const kernel_bvh_node_t *nodes, size_t num_nodes,
+          const kernel_primitive_t *primitives,
+          Primitive * const *sources = NULL, BSDF * const *bsdfs = NULL);
+
+  bool empty() const { return num_nodes == 0; }
+
+  /**
+   * Check if the ray hits anything, stopping at the first hit. Like
+   * BVHAccel::intersect, a hit shortens the ray to it.
+   */
+  bool intersect(const Ray& r) const;
+
+  /**
+   * Find the closest hit of the ray and store it in i. The normal is
+   * interpolated from the record, the primitive and BSDF come from the
+   * sources, if any, else the BSDF comes from the bsdfs.
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  /**
+   * Trace rays in packets of PACKET_SIZE. Rays whose directions don't all
+   * point into the same octant, or spread too widely, are traced one by one
+   * instead.
+   * \param rays rays of the packet, each shortened to its hit
+   * \param count number of rays
+   * \param hits whether each ray hit anything
+   * \param isects closest hit of each ray, or NULL to only check if the
+   *        rays hit anything, like intersect(const Ray&)
+   */
+  void intersect(const Ray *rays, size_t count, bool *hits,
+                 Intersection *isects = NULL) const;
+
+  /**
+   * Trace any number of rays as a stream, breadth-first. Results are the
+   * same as tracing the rays one by one.
+   * \param rays rays of the stream, each shortened to its hit
+   * \param count number of rays
+   * \param hits whether each ray hit anything
+   * \param isects closest hit of each ray, or NULL to only check if the
+   *        rays hit anything, like intersect(const Ray&)
+   */
+  void intersect_stream(const Ray *rays, size_t count, bool *hits,
+                        Intersection *isects = NULL) const;
+
+ private:
+
+  size_t find_closest(const FlatRay& r, cl_uint root, bool any_hit,
+                      float *hit_t, float *hit_u, float *hit_v) const;
+  size_t find_threaded(const FlatRay& r, cl_uint root, bool any_hit,
+                       float *hit_t, float *hit_u, float *hit_v) const;
+  bool intersect_leaf(const FlatRay& r, cl_uint p, bool any_hit, float *t,
+                      float *u, float *v, size_t *hit) const;
+  void trace_packet(FlatPacket& packet, bool any_hit) const;
+  void trace_stream(FlatStream& stream, bool any_hit) const;
+  size_t first_hit(const FlatPacket& packet, const kernel_bvh_node_t& node,
+                   size_t first) const;
+  void fill_intersection(const Ray& r, size_t hit, float t, float u, float v,
+                         Intersection *i) const;
+
+  const kernel_bvh_node_t *nodes;
+  size_t num_nodes;
+  const kernel_primitive_t *primitives;
+  Primitive * const *sources;
+  BSDF * const *bsdfs;
+  bool use_stack;  ///< false if the tree is deeper than the stack
+
+};
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_FLAT_BVH_H
@@ -26,6 +26,165 @@ Vector3D Face::normal(void) const {
   return N.unit();
 }
 
+bool HalfedgeMesh::buildTrianglesAndQuads(
+    const vector<vector<Index> >& polygons,
+    const vector<Vector3D>& vertexPositions)
+// Builds exactly what build does: elements are created in the same order and
+// point to the same neighbors, so the two can't be told apart. Halfedges are
+// numbered by polygon corner, and each one finds its twin in the short list
+// of halfedges leaving its target vertex.
+{
+  const Size nVertices = vertexPositions.size();
+  const Size nFaces = polygons.size();
+  const Index none = (Index) -1;
+
+  // Corners, vertex degrees, and the vertices in the order polygons first
+  // use them, which is the order build creates them in.
+  vector<Index> corners;
+  vector<Index> polygonStart(nFaces + 1);
+  vector<Size> vertexDegree(nVertices, 0);
+  vector<Index> vertexOrder(nVertices, none);
+  Size nUsed = 0;
+  for (Index p = 0; p < nFaces; p++) {
+    const vector<Index>& polygon = polygons[p];
+    Size degree = polygon.size();
+    if (degree != 3 && degree != 4) return false;
+    polygonStart[p] = corners.size();
+    for (Index i = 0; i < degree; i++) {
+      Index a = polygon[i];
+      if (a >= nVertices) return false;
+      for (Index j = 0; j < i; j++) {
+        if (polygon[j] == a) return false;
+      }
+      if (vertexDegree[a]++ == 0) vertexOrder[a] = nUsed++;
+      corners.push_back(a);
+    }
+  }
+  polygonStart[nFaces] = corners.size();
+  if (nUsed != nVertices) return false;
+  const Size nCorners = corners.size();
+
+  // Halfedge c goes from corner c to the next corner of its polygon.
+  vector<Index> target(nCorners);
+  for (Index p = 0; p < nFaces; p++) {
+    for (Index c = polygonStart[p]; c < polygonStart[p + 1]; c++) {
+      target[c] = c + 1 < polygonStart[p + 1] ? corners[c + 1]
+                                              : corners[polygonStart[p]];
+    }
+  }
+
+  // The halfedges leaving each vertex
+  vector<Index> outStart(nVertices + 1, 0);
+  for (Index v = 0; v < nVertices; v++) {
+    outStart[v + 1] = outStart[v] + vertexDegree[v];
+  }
+  vector<Index> outgoing(nCorners);
+  vector<Index> filled(outStart.begin(), outStart.end() - 1);
+  for (Index c = 0; c < nCorners; c++) {
+    outgoing[filled[corners[c]]++] = c;
+  }
+
+  // Pair up halfedges. A second halfedge between the same two vertices in
+  // the same direction means the surface isn't an oriented manifold.
+  vector<Index> twin(nCorners, none);
+  long duplicates = 0, paired = 0;
+  #pragma omp parallel for reduction(+:duplicates,paired)
+  for (long c = 0; c < (long) nCorners; c++) {
+    Index a = corners[c], b = target[c];
+    for (Index o = outStart[a]; o < outStart[a + 1]; o++) {
+      if (outgoing[o] != (Index) c && target[outgoing[o]] == b) duplicates++;
+    }
+    for (Index o = outStart[b]; o < outStart[b + 1]; o++) {
+      if (target[outgoing[o]] == a) {
+        twin[c] = outgoing[o];
+        paired++;
+      }
+    }
+  }
+  if (duplicates) return false;
+
+  // Allocate everything at once, and keep the iterators by index.
+  halfedges.clear();
+  vertices.clear();
+  edges.clear();
+  faces.clear();
+  boundaries.clear();
+  halfedges.resize(nCorners);
+  vertices.resize(nVertices);
+  faces.resize(nFaces);
+  edges.resize(paired / 2);
+
+  vector<HalfedgeIter> halfedgeAt(nCorners);
+  HalfedgeIter h = halfedges.begin();
+  for (Index c = 0; c < nCorners; c++, h++) halfedgeAt[c] = h;
+
+  vector<VertexIter> orderedVertices(nVertices);
+  VertexIter v = vertices.begin();
+  for (Index i = 0; i < nVertices; i++, v++) orderedVertices[i] = v;
+  vector<VertexIter> vertexAt(nVertices);
+  vector<Size> orderedDegree(nVertices);
+  for (Index a = 0; a < nVertices; a++) {
+    vertexAt[a] = orderedVertices[vertexOrder[a]];
+    orderedDegree[vertexOrder[a]] = vertexDegree[a];
+  }
+
+  // Connectivity, in the order build sets it up: an edge is made when the
+  // second halfedge of its pair comes along.
+  EdgeIter e = edges.begin();
+  FaceIter f = faces.begin();
+  for (Index p = 0; p < nFaces; p++, f++) {
+    Index first = polygonStart[p], last = polygonStart[p + 1];
+    for (Index c = first; c < last; c++) {
+      HalfedgeIter hab = halfedgeAt[c];
+      hab->face() = f;
+      f->halfedge() = hab;
+      hab->vertex() = vertexAt[corners[c]];
+      hab->vertex()->halfedge() = hab;
+      hab->next() = halfedgeAt[c + 1 < last ? c + 1 : first];
+      if (twin[c] == none) {
+        hab->twin() = halfedges.end();
+      } else if (twin[c] < c) {
+        HalfedgeIter hba = halfedgeAt[twin[c]];
+        hab->twin() = hba;
+        hba->twin() = hab;
+        hab->edge() = e;
+        hba->edge() = e;
+        e->halfedge() = hab;
+        e++;
+      }
+    }
+  }
+
+  buildBoundaries();
+
+  // Every vertex has to be a single fan of polygons.
+  long nonmanifold = 0;
+  #pragma omp parallel for reduction(+:nonmanifold)
+  for (long i = 0; i < (long) nVertices; i++) {
+    VertexIter v = orderedVertices[i];
+    Size count = 0;
+    HalfedgeIter h = v->halfedge();
+    do {
+      if (!h->face()->isBoundary()) count++;
+      h = h->twin()->next();
+    } while (h != v->halfedge() && count <= nCorners);
+    if (count != orderedDegree[i]) nonmanifold++;
+  }
+  if (nonmanifold) return false;
+
+  for (Index a = 0; a < nVertices; a++) {
+    vertexAt[a]->position = vertexPositions[a];
+  }
+
+  #pragma omp parallel for
+  for (long i = 0; i < (long) nVertices; i++) {
+    orderedVertices[i]->computeNormal();
+  }
+
+  return true;
+
+}  // end HalfedgeMesh::buildTrianglesAndQuads()
+
 void HalfedgeMesh::build(const vector<vector<Index> >& polygons,
                          const vector<Vector3D>& vertexPositions)
 // This method initializes the halfedge data structure from a raw list of
@@ -44,6 +203,11 @@ void HalfedgeMesh::build(const vector<vector<Index> >& polygons,
 // appearing in any polygon corresponds to the first entry of the list of
 // positions and so on).
 {
+  // Scenes are made of triangles and quads, which have a much faster path.
+  // Whatever it can't handle, bad input included, is built here, which also
+  // reports what is wrong with the input.
+  if (buildTrianglesAndQuads(polygons, vertexPositions)) return;
+
   // define some types, to improve readability
   typedef vector<Index> IndexList;
   typedef IndexList::const_iterator IndexListCIter;
@@ -230,6 +394,78 @@ void HalfedgeMesh::build(const vector<vector<Index> >& polygons,
 
   }  // done building basic halfedge connectivity
 
+  // Close the surface with boundary loops.
+  buildBoundaries();
+
+  // Finally, we check that all vertices are manifold.
+  for (VertexIter v = vertices.begin(); v != vertices.end(); v++) {
+    // First check that this vertex is not a "floating" vertex;
+    // if it is then we do not have a valid 2-manifold surface.
+    if (v->halfedge() == halfedges.end()) {
+      cerr << "Error converting polygons to halfedge mesh: some vertices are "
+              "not referenced by any polygon." << endl;
+      exit(1);
+    }
+
+    // Next, check that the number of halfedges emanating from this vertex in
+    // our half edge data structure equals the number of polygons containing
+    // this vertex, which we counted during our first pass over the mesh.  If
+    // not, then our vertex is not a "fan" of polygons, but instead has some
+    // other (nonmanifold) structure.
+    Size count = 0;
+    HalfedgeIter h = v->halfedge();
+    do {
+      if (!h->face()->isBoundary()) {
+        count++;
+      }
+      h = h->twin()->next();
+    } while (h != v->halfedge());
+
+    if (count != vertexDegree[v]) {
+      cerr << "Error converting polygons to halfedge mesh: at least one of the "
+              "vertices is nonmanifold." << endl;
+      exit(1);
+    }
+  }  // end loop over vertices
+
+  // Now that we have the connectivity, we copy the list of vertex
+  // positions into member variables of the individual vertices.
+  if (vertexPositions.size() != vertices.size()) {
+    cerr << "Error converting polygons to halfedge mesh: number of vertex "
+            "positions is different from the number of distinct vertices!"
+         << endl;
+    cerr << "(number of positions in input: " << vertexPositions.size() << ")"
+         << endl;
+    cerr << "(  number of vertices in mesh: " << vertices.size() << ")" << endl;
+    exit(1);
+  }
+  // Since an STL map internally sorts its keys, we can iterate over the map
+  // from vertex indices to vertex iterators to visit our (input) vertices in
+  // lexicographic order
+  int i = 0;
+  for (map<Index, VertexIter>::const_iterator e = indexToVertex.begin();
+       e != indexToVertex.end(); e++) {
+    // grab a pointer to the vertex associated with the current key (i.e., the
+    // current index)
+    VertexIter v = e->second;
+
+    // set the att of this vertex to the corresponding
+    // position in the input
+    v->position = vertexPositions[i];
+    i++;
+  }
+
+  // compute initial normals
+  for (VertexIter v = verticesBegin(); v != verticesEnd(); v++) {
+    v->computeNormal();
+  }
+
+}  // end HalfedgeMesh::build()
+
+void HalfedgeMesh::buildBoundaries(void)
+// Links every halfedge that has no twin yet into a boundary loop, once the
+// halfedges of all polygons have been built and paired up.
+{
   // For each vertex on the boundary, advance its halfedge pointer to one that
   // is also on the boundary.
   for (VertexIter v = verticesBegin(); v != verticesEnd(); v++) {
@@ -311,6 +547,7 @@ void HalfedgeMesh::build(const vector<vector<Index> >& polygons,
         Index q = (p - 1 + degree) % degree;
         boundaryHalfedges[p]->next() = boundaryHalfedges[q];
       }
+      b->halfedge() = boundaryHalfedges[0];
 
     }  // end construction of one of the boundary loops
 
@@ -331,70 +568,10 @@ void HalfedgeMesh::build(const vector<vector<Index> >& polygons,
     v->halfedge() = v->halfedge()->twin()->next();
   }
 
-  // Finally, we check that all vertices are manifold.
-  for (VertexIter v = vertices.begin(); v != vertices.end(); v++) {
-    // First check that this vertex is not a "floating" vertex;
-    // if it is then we do not have a valid 2-manifold surface.
-    if (v->halfedge() == halfedges.end()) {
-      cerr << "Error converting polygons to halfedge mesh: some vertices are "
-              "not referenced by any polygon." << endl;
-      exit(1);
-    }
-
-    // Next, check that the number of halfedges emanating from this vertex in
-    // our half edge data structure equals the number of polygons containing
-    // this vertex, which we counted during our first pass over the mesh.  If
-    // not, then our vertex is not a "fan" of polygons, but instead has some
-    // other (nonmanifold) structure.
-    Size count = 0;
-    HalfedgeIter h = v->halfedge();
-    do {
-      if (!h->face()->isBoundary()) {
-        count++;
-      }
-      h = h->twin()->next();
-    } while (h != v->halfedge());
-
-    if (count != vertexDegree[v]) {
-      cerr << "Error converting polygons to halfedge mesh: at least one of the "
-              "vertices is nonmanifold." << endl;
-      exit(1);
-    }
-  }  // end loop over vertices
-
-  // Now that we have the connectivity, we copy the list of vertex
-  // positions into member variables of the individual vertices.
-  if (vertexPositions.size() != vertices.size()) {
-    cerr << "Error converting polygons to halfedge mesh: number of vertex "
-            "positions is different from the number of distinct vertices!"
-         << endl;
-    cerr << "(number of positions in input: " << vertexPositions.size() << ")"
-         << endl;
-    cerr << "(  number of vertices in mesh: " << vertices.size() << ")" << endl;
-    exit(1);
-  }
-  // Since an STL map internally sorts its keys, we can iterate over the map
-  // from vertex indices to vertex iterators to visit our (input) vertices in
-  // lexicographic order
-  int i = 0;
-  for (map<Index, VertexIter>::const_iterator e = indexToVertex.begin();
-       e != indexToVertex.end(); e++) {
-    // grab a pointer to the vertex associated with the current key (i.e., the
-    // current index)
-    VertexIter v = e->second;
-
-    // set the att of this vertex to the corresponding
-    // position in the input
-    v->position = vertexPositions[i];
-    i++;
-  }
-
-  // compute initial normals
-  for (VertexIter v = verticesBegin(); v != verticesEnd(); v++) {
-    v->computeNormal();
-  }
+  // Give back the room the boundary elements left at the end of the storage.
+  compact();
 
-}  // end HalfedgeMesh::build()
+}  // end HalfedgeMesh::buildBoundaries()
 
 const HalfedgeMesh& HalfedgeMesh::operator=(const HalfedgeMesh& mesh)
 // The assignment operator does a "deep" copy of the halfedge mesh data
@@ -457,4 +634,38 @@ const HalfedgeMesh& HalfedgeMesh::operator=(const HalfedgeMesh& mesh)
 
 HalfedgeMesh::HalfedgeMesh(const HalfedgeMesh& mesh) { *this = mesh; }
 
+void HalfedgeMesh::compact(void)
+// Moves every element down over the slots of deleted ones, then points each
+// iterator kept by an element at the new slot of its target.
+{
+#ifdef HALFEDGE_POOL
+  vector<uint32_t> halfedgeSlot = halfedges.compact();
+  vector<uint32_t> vertexSlot = vertices.compact();
+  vector<uint32_t> edgeSlot = edges.compact();
+  vector<uint32_t> faceSlot = faces.compact();
+  vector<uint32_t> boundarySlot = boundaries.compact();
+  if (halfedgeSlot.empty() && vertexSlot.empty() && edgeSlot.empty() &&
+      faceSlot.empty() && boundarySlot.empty()) return;
+
+  for (HalfedgeIter h = halfedgesBegin(); h != halfedgesEnd(); h++) {
+    halfedges.relocate(h->next(), halfedgeSlot);
+    halfedges.relocate(h->twin(), halfedgeSlot);
+    vertices.relocate(h->vertex(), vertexSlot);
+    edges.relocate(h->edge(), edgeSlot);
+    faces.relocate(h->face(), faceSlot);
+    boundaries.relocate(h->face(), boundarySlot);
+  }
+  for (VertexIter v = verticesBegin(); v != verticesEnd(); v++)
+    halfedges.relocate(v->halfedge(), halfedgeSlot);
+  for (EdgeIter e = edgesBegin(); e != edgesEnd(); e++) {
+    halfedges.relocate(e->halfedge(), halfedgeSlot);
+    edges.relocate(e->record.edge, edgeSlot);
+  }
+  for (FaceIter f = facesBegin(); f != facesEnd(); f++)
+    halfedges.relocate(f->halfedge(), halfedgeSlot);
+  for (FaceIter b = boundariesBegin(); b != boundariesEnd(); b++)
+    halfedges.relocate(b->halfedge(), halfedgeSlot);
+#endif
+}
+
 }  // namespace CGL
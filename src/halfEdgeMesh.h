@@ -149,6 +149,7 @@
 #include "CGL/CGL.h"  // Standard 462 Vectors, etc.
 
 #include "collada/polymesh_info.h"
+#include "elementPool.h"
 
 using namespace std;
 using namespace CGL;
@@ -173,11 +174,26 @@ class Halfedge;
  * Rather than using raw pointers to mesh elements, we store references
  * as STL::iterators---for convenience, we give shorter names to these
  * iterators (e.g., EdgeIter instead of list<Edge>::iterator).
+ *
+ * Building with HALFEDGE_POOL defined stores the elements in ElementPools
+ * instead, contiguous arrays with the same interface, and these become
+ * ElementHandles: a pool id and a 32-bit index, used just like iterators.
  */
+#ifdef HALFEDGE_POOL
+template <class T> using ElementList = ElementPool<T>;
+
+typedef ElementHandle<Vertex> VertexIter;
+typedef ElementHandle<Edge> EdgeIter;
+typedef ElementHandle<Face> FaceIter;
+typedef ElementHandle<Halfedge> HalfedgeIter;
+#else
+template <class T> using ElementList = list<T>;
+
 typedef list<Vertex>::iterator VertexIter;
 typedef list<Edge>::iterator EdgeIter;
 typedef list<Face>::iterator FaceIter;
 typedef list<Halfedge>::iterator HalfedgeIter;
+#endif
 
 /*
  * We also need "const" iterator types, for situations where a method takes
@@ -185,6 +201,12 @@ typedef list<Halfedge>::iterator HalfedgeIter;
  * used so frequently, we will use "CIter" as a shorthand abbreviation for
  * "constant iterator."
  */
+#ifdef HALFEDGE_POOL
+typedef ElementHandle<const Vertex> VertexCIter;
+typedef ElementHandle<const Edge> EdgeCIter;
+typedef ElementHandle<const Face> FaceCIter;
+typedef ElementHandle<const Halfedge> HalfedgeCIter;
+#else
 typedef list<Vertex>::const_iterator VertexCIter;
 typedef list<Edge>::const_iterator EdgeCIter;
 typedef list<Face>::const_iterator FaceCIter;
@@ -195,6 +217,7 @@ typedef list<Halfedge>::const_iterator HalfedgeCIter;
  * first?)
  * Here we just say that one iterator comes before another if the address of the
  * object it points to is smaller.  (You should not have to worry about this!)
+ * (ElementHandles compare by pool and index instead.)
  */
 inline bool operator<(const HalfedgeIter& i, const HalfedgeIter& j) {
   return &*i < &*j;
@@ -222,6 +245,7 @@ inline bool operator<(const EdgeCIter& i, const EdgeCIter& j) {
 inline bool operator<(const FaceCIter& i, const FaceCIter& j) {
   return &*i < &*j;
 }
+#endif
 
 /**
  * The elementAddress() function is defined only for convenience (and
@@ -611,6 +635,12 @@ class Edge : public HalfedgeElement {
 
   EdgeRecord record;
 
+  /**
+   * For mesh simplification, the id of this edge in the queue of edges to
+   * collapse
+   */
+  Index queueId;
+
  protected:
 
   /**
@@ -762,21 +792,49 @@ class HalfedgeMesh {
   VertexIter splitEdge(EdgeIter e);
 
   /**
-   * collapse an edge, returning a pointer to the collapsed vertex
+   * collapse an edge, returning a pointer to the collapsed vertex, which sits
+   * at the edge midpoint; if the edge can't be collapsed without making the
+   * surface nonmanifold, or isn't between triangles, the mesh is left as it
+   * is and verticesEnd() is returned
    */
   VertexIter collapseEdge(EdgeIter e);
 
+  /**
+   * Release the slots of deleted elements, once a batch of edits is done.
+   * Iterators kept from before are invalid afterwards. Lists have no free
+   * slots, so this only does something with HALFEDGE_POOL.
+   */
+  void compact(void);
+
+  /**
+   * Fast path of build for meshes of triangles and quads whose vertex
+   * indices are exactly 0 to vertexPositions.size() - 1. It builds the same
+   * mesh, element for element, pairing halfedges through per-vertex lists
+   * instead of maps and checking the vertices in parallel.
+   * \return false if the input is anything else, in which case the mesh may
+   *         be partly built and build falls back to the general builder;
+   *         unlike build, it never exits on bad input
+   */
+  bool buildTrianglesAndQuads(const vector<vector<Index> >& polygons,
+                              const vector<Vector3D>& vertexPositions);
+
  protected:
 
+  /**
+   * Link every halfedge without a twin into a boundary loop; the last step
+   * of building the connectivity.
+   */
+  void buildBoundaries(void);
+
   /*
    * Here's where the mesh elements are actually stored---this is the one
    * and only place we have actual data (rather than pointers/iterators).
    */
-  list<Halfedge> halfedges;
-  list<Vertex> vertices;
-  list<Edge> edges;
-  list<Face> faces;
-  list<Face> boundaries;
+  ElementList<Halfedge> halfedges;
+  ElementList<Vertex> vertices;
+  ElementList<Edge> edges;
+  ElementList<Face> faces;
+  ElementList<Face> boundaries;
 
 };  // class HalfedgeMesh
 
@@ -122,6 +122,73 @@ bool intersect_bvh_bbox(ray_t *ray,
     return true;
 }
 
+/**
+ * Intersection test for the BVH of an instanced mesh, which starts at node
+ * root of the flattened array and whose leaves hold no instances.
+ */
+bool intersect_mesh_bvh(ray_t *ray,
+                        global bvh_node_t *bvh,
+                        global primitive_t *primitives,
+                        uint root,
+                        intersection_t *isect) {
+  float t0, t1;
+  bool intersects = false;
+  uint next_node_index = root;
+  do {
+    global bvh_node_t *curr_node = &bvh[next_node_index];
+
+    if (!intersect_bvh_bbox(ray, curr_node, &t0, &t1)
+        || t0 > ray->max_t
+        || t1 < ray->min_t) {
+      next_node_index = curr_node->exit_index;
+    } else {
+      for (uint i = curr_node->prim_index;
+           i < curr_node->prim_index + curr_node->prim_count;
+           i++) {
+        intersects = intersect_primitive(ray, &primitives[i], isect)
+                     || intersects;
+      }
+      next_node_index = curr_node->entry_index;
+    }
+  } while (next_node_index != 0);
+  return intersects;
+}
+
+/**
+ * Intersection test for an instance: the ray is moved into the space of the
+ * mesh, where t stays the same as the direction is not normalized, and the
+ * normal of a hit is brought back with the transpose of the transform.
+ */
+bool intersect_instance(ray_t *ray,
+                        global instance_t *instance,
+                        global bvh_node_t *bvh,
+                        global primitive_t *primitives,
+                        intersection_t *isect) {
+  float4 o = (float4)(ray->o, 1.0f);
+  float4 d = (float4)(ray->d, 0.0f);
+  float4 r0 = instance->world_to_object[0];
+  float4 r1 = instance->world_to_object[1];
+  float4 r2 = instance->world_to_object[2];
+  ray_t object_ray = (ray_t) {
+    (float3)(dot(r0, o), dot(r1, o), dot(r2, o)),
+    (float3)(dot(r0, d), dot(r1, d), dot(r2, d)),
+    ray->min_t,
+    ray->max_t
+  };
+  if (!intersect_mesh_bvh(&object_ray, bvh, primitives, instance->root, isect)) {
+    return false;
+  }
+
+  if (isect) {
+    isect->n = normalize(isect->n.x * r0.xyz
+                         + isect->n.y * r1.xyz
+                         + isect->n.z * r2.xyz);
+  }
+
+  ray->max_t = object_ray.max_t;
+  return true;
+}
+
 /** Intersection test for a flattened BVH */
 bool intersect_bvh(ray_t *ray,
                    global bvh_node_t *bvh,
@@ -142,8 +209,15 @@ bool intersect_bvh(ray_t *ray,
         for (uint i = curr_node->prim_index;
              i < curr_node->prim_index + curr_node->prim_count;
              i++) {
-          intersects = intersect_primitive(ray, &primitives[i], isect)
-                       || intersects;
+          global primitive_t *primitive = &primitives[i];
+          if (primitive->type == PRIMITIVE_TYPE_INSTANCE) {
+            intersects = intersect_instance(ray, &primitive->instance, bvh,
+                                            primitives, isect)
+                         || intersects;
+          } else {
+            intersects = intersect_primitive(ray, primitive, isect)
+                         || intersects;
+          }
         }
         // For leaf nodes, entry_index == exit_index
       }
@@ -0,0 +1,365 @@
+#include "types.h"
+
+/* Linear BVH construction (Karras 2012, "Maximizing Parallelism in the
+ * Construction of BVHs, Octrees, and k-d Trees").
+ *
+ * The tree has n leaves and n - 1 internal nodes, stored in one array:
+ * internal node i lives at index i, the leaf for sorted primitive k at index
+ * n - 1 + k. The root is internal node 0 (or the single leaf if n == 1), so
+ * the output can be traversed by intersect_bvh as is. */
+
+#define LBVH_NO_PARENT 0xffffffffu
+#define RADIX_BITS 4
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+typedef struct lbvh_node {
+  uint left;
+  uint right;
+  uint parent;
+} lbvh_node_t;
+
+void primitive_bounds(global primitive_t *primitive, float3 *lo, float3 *hi) {
+  if (primitive->type == PRIMITIVE_TYPE_TRIANGLE) {
+    global triangle_t *triangle = &primitive->triangle;
+    *lo = fmin(fmin(triangle->vertices[0], triangle->vertices[1]),
+               triangle->vertices[2]);
+    *hi = fmax(fmax(triangle->vertices[0], triangle->vertices[1]),
+               triangle->vertices[2]);
+  } else {
+    global sphere_t *sphere = &primitive->sphere;
+    float3 r = (float3)(sphere->radius, sphere->radius, sphere->radius);
+    *lo = sphere->origin - r;
+    *hi = sphere->origin + r;
+  }
+}
+
+/** Reduces the centroid bounds of each work-group's primitives. */
+kernel void lbvh_centroid_bounds(global primitive_t *primitives,
+                                 uint count,
+                                 global float3 *group_bounds,
+                                 local float3 *scratch) {
+  size_t gid = get_global_id(0);
+  size_t lid = get_local_id(0);
+  size_t size = get_local_size(0);
+
+  float3 lo = (float3)(INFINITY, INFINITY, INFINITY);
+  float3 hi = -lo;
+  for (size_t i = gid; i < count; i += get_global_size(0)) {
+    float3 plo, phi;
+    primitive_bounds(&primitives[i], &plo, &phi);
+    float3 c = 0.5f * (plo + phi);
+    lo = fmin(lo, c);
+    hi = fmax(hi, c);
+  }
+  scratch[2 * lid] = lo;
+  scratch[2 * lid + 1] = hi;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (size_t stride = size / 2; stride > 0; stride /= 2) {
+    if (lid < stride) {
+      scratch[2 * lid] = fmin(scratch[2 * lid], scratch[2 * (lid + stride)]);
+      scratch[2 * lid + 1] = fmax(scratch[2 * lid + 1],
+                                  scratch[2 * (lid + stride) + 1]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0) {
+    group_bounds[2 * get_group_id(0)] = scratch[0];
+    group_bounds[2 * get_group_id(0) + 1] = scratch[1];
+  }
+}
+
+/** Spreads the lower 10 bits of v so that there are two zeros between
+ * each bit. */
+uint expand_bits(uint v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+/** Computes the 30-bit Morton code of every primitive centroid. The scene
+ * centroid bounds are reduced from group_bounds first. */
+kernel void lbvh_morton_codes(global primitive_t *primitives,
+                              uint count,
+                              global float3 *group_bounds,
+                              uint num_groups,
+                              global uint *keys,
+                              global uint *values) {
+  size_t i = get_global_id(0);
+  if (i >= count) {
+    return;
+  }
+
+  float3 lo = group_bounds[0];
+  float3 hi = group_bounds[1];
+  for (uint g = 1; g < num_groups; g++) {
+    lo = fmin(lo, group_bounds[2 * g]);
+    hi = fmax(hi, group_bounds[2 * g + 1]);
+  }
+  float3 extent = hi - lo;
+  extent = fmax(extent, (float3)(1e-20f, 1e-20f, 1e-20f));
+
+  float3 plo, phi;
+  primitive_bounds(&primitives[i], &plo, &phi);
+  float3 c = (0.5f * (plo + phi) - lo) / extent;
+  c = fmin(fmax(c * 1024.0f, (float3)(0, 0, 0)),
+           (float3)(1023.0f, 1023.0f, 1023.0f));
+
+  keys[i] = (expand_bits((uint) c.x) << 2)
+          | (expand_bits((uint) c.y) << 1)
+          | expand_bits((uint) c.z);
+  values[i] = i;
+}
+
+/* Stable LSD radix sort of (key, value) pairs, RADIX_BITS per pass. Each
+ * work-item owns a contiguous chunk of the input and processes it in order,
+ * which is what keeps the sort stable. Digit counts are laid out digit-major
+ * (counts[digit * num_chunks + chunk]) so that one exclusive scan over the
+ * whole array yields every chunk's output offsets. */
+
+kernel void radix_count(global uint *keys,
+                        uint count,
+                        uint shift,
+                        uint chunk_size,
+                        uint num_chunks,
+                        global uint *counts) {
+  size_t chunk = get_global_id(0);
+  if (chunk >= num_chunks) {
+    return;
+  }
+
+  uint histogram[RADIX_BUCKETS];
+  for (uint d = 0; d < RADIX_BUCKETS; d++) {
+    histogram[d] = 0;
+  }
+  uint begin = chunk * chunk_size;
+  uint end = min(begin + chunk_size, count);
+  for (uint i = begin; i < end; i++) {
+    histogram[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+  }
+  for (uint d = 0; d < RADIX_BUCKETS; d++) {
+    counts[d * num_chunks + chunk] = histogram[d];
+  }
+}
+
+/** Exclusive scan of counts in place. Runs as a single work-group. */
+kernel void radix_scan(global uint *counts,
+                       uint total,
+                       local uint *scratch) {
+  size_t lid = get_local_id(0);
+  size_t size = get_local_size(0);
+  uint per_item = (total + size - 1) / size;
+  uint begin = min((uint) lid * per_item, total);
+  uint end = min(begin + per_item, total);
+
+  uint sum = 0;
+  for (uint i = begin; i < end; i++) {
+    sum += counts[i];
+  }
+  scratch[lid] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  // Hillis-Steele inclusive scan of the per-item sums
+  for (size_t offset = 1; offset < size; offset *= 2) {
+    uint value = lid >= offset ? scratch[lid - offset] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+    scratch[lid] += value;
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  uint running = scratch[lid] - sum;
+  for (uint i = begin; i < end; i++) {
+    uint c = counts[i];
+    counts[i] = running;
+    running += c;
+  }
+}
+
+kernel void radix_scatter(global uint *keys_in,
+                          global uint *values_in,
+                          global uint *keys_out,
+                          global uint *values_out,
+                          uint count,
+                          uint shift,
+                          uint chunk_size,
+                          uint num_chunks,
+                          global uint *offsets) {
+  size_t chunk = get_global_id(0);
+  if (chunk >= num_chunks) {
+    return;
+  }
+
+  uint offset[RADIX_BUCKETS];
+  for (uint d = 0; d < RADIX_BUCKETS; d++) {
+    offset[d] = offsets[d * num_chunks + chunk];
+  }
+  uint begin = chunk * chunk_size;
+  uint end = min(begin + chunk_size, count);
+  for (uint i = begin; i < end; i++) {
+    uint key = keys_in[i];
+    uint dst = offset[(key >> shift) & (RADIX_BUCKETS - 1)]++;
+    keys_out[dst] = key;
+    values_out[dst] = values_in[i];
+  }
+}
+
+/** Length of the common prefix of the keys at i and j, or -1 if j is out of
+ * range. Duplicate keys are disambiguated by their index. */
+int common_prefix(global uint *keys, uint count, int i, int j) {
+  if (j < 0 || j >= (int) count) {
+    return -1;
+  }
+  uint ki = keys[i];
+  uint kj = keys[j];
+  if (ki == kj) {
+    return 32 + clz((uint) i ^ (uint) j);
+  }
+  return clz(ki ^ kj);
+}
+
+/** Finds the children of every internal node. */
+kernel void lbvh_emit_hierarchy(global uint *keys,
+                                uint count,
+                                global lbvh_node_t *nodes,
+                                global uint *leaf_parents) {
+  int i = get_global_id(0);
+  if (i >= (int) count - 1) {
+    return;
+  }
+
+  // Direction of the range covered by node i
+  int d = common_prefix(keys, count, i, i + 1)
+          - common_prefix(keys, count, i, i - 1) > 0 ? 1 : -1;
+
+  // Upper bound for the length of the range, then binary search for it
+  int delta_min = common_prefix(keys, count, i, i - d);
+  int l_max = 2;
+  while (common_prefix(keys, count, i, i + l_max * d) > delta_min) {
+    l_max *= 2;
+  }
+  int l = 0;
+  for (int t = l_max / 2; t >= 1; t /= 2) {
+    if (common_prefix(keys, count, i, i + (l + t) * d) > delta_min) {
+      l += t;
+    }
+  }
+  int j = i + l * d;
+
+  // Binary search for the split position
+  int delta_node = common_prefix(keys, count, i, j);
+  int s = 0;
+  int t = l;
+  do {
+    t = (t + 1) / 2;
+    if (common_prefix(keys, count, i, i + (s + t) * d) > delta_node) {
+      s += t;
+    }
+  } while (t > 1);
+  int gamma = i + s * d + min(d, 0);
+
+  uint leaf_base = count - 1;
+  uint left = (min(i, j) == gamma) ? leaf_base + gamma : (uint) gamma;
+  uint right = (max(i, j) == gamma + 1) ? leaf_base + gamma + 1
+                                        : (uint) gamma + 1;
+  nodes[i].left = left;
+  nodes[i].right = right;
+  if (left >= leaf_base) {
+    leaf_parents[left - leaf_base] = i;
+  } else {
+    nodes[left].parent = i;
+  }
+  if (right >= leaf_base) {
+    leaf_parents[right - leaf_base] = i;
+  } else {
+    nodes[right].parent = i;
+  }
+  if (i == 0) {
+    nodes[0].parent = LBVH_NO_PARENT;
+  }
+}
+
+/** Gathers the primitives in Morton order and writes the leaf nodes. */
+kernel void lbvh_emit_leaves(global primitive_t *primitives,
+                             global uint *values,
+                             uint count,
+                             global primitive_t *sorted_primitives,
+                             global bvh_node_t *bvh) {
+  size_t k = get_global_id(0);
+  if (k >= count) {
+    return;
+  }
+  sorted_primitives[k] = primitives[values[k]];
+
+  float3 lo, hi;
+  primitive_bounds(&sorted_primitives[k], &lo, &hi);
+  global bvh_node_t *leaf = &bvh[count - 1 + k];
+  leaf->bounds[0] = lo;
+  leaf->bounds[1] = hi;
+  leaf->prim_index = k;
+  leaf->prim_count = 1;
+}
+
+/** Computes the bounds of internal nodes bottom-up. Every leaf walks towards
+ * the root; at each node the first thread to arrive stops, and the second
+ * one, which knows both children are done, computes the union. */
+kernel void lbvh_refit(global lbvh_node_t *nodes,
+                       global uint *leaf_parents,
+                       uint count,
+                       volatile global uint *visits,
+                       volatile global bvh_node_t *bvh) {
+  size_t k = get_global_id(0);
+  if (k >= count) {
+    return;
+  }
+
+  uint node = leaf_parents[k];
+  while (node != LBVH_NO_PARENT) {
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+    if (atomic_inc(&visits[node]) == 0) {
+      return;
+    }
+    mem_fence(CLK_GLOBAL_MEM_FENCE);
+
+    uint left = nodes[node].left;
+    uint right = nodes[node].right;
+    bvh[node].bounds[0] = fmin(bvh[left].bounds[0], bvh[right].bounds[0]);
+    bvh[node].bounds[1] = fmax(bvh[left].bounds[1], bvh[right].bounds[1]);
+    bvh[node].prim_index = 0;
+    bvh[node].prim_count = 0;
+    node = nodes[node].parent;
+  }
+}
+
+/** Writes the threaded entry/exit links used by the stackless traversal:
+ * an internal node is entered through its left child, and a subtree is left
+ * through the right sibling of its nearest ancestor that is a left child. */
+kernel void lbvh_emit_links(global lbvh_node_t *nodes,
+                            global uint *leaf_parents,
+                            uint count,
+                            global bvh_node_t *bvh) {
+  uint index = get_global_id(0);
+  if (index >= 2 * count - 1) {
+    return;
+  }
+
+  uint leaf_base = count - 1;
+  uint exit_index = 0;
+  uint child = index;
+  uint parent = index >= leaf_base ? (count > 1 ? leaf_parents[index - leaf_base]
+                                                : LBVH_NO_PARENT)
+                                   : nodes[index].parent;
+  while (parent != LBVH_NO_PARENT) {
+    if (nodes[parent].left == child) {
+      exit_index = nodes[parent].right;
+      break;
+    }
+    child = parent;
+    parent = nodes[parent].parent;
+  }
+
+  bvh[index].exit_index = exit_index;
+  bvh[index].entry_index = index >= leaf_base ? exit_index : nodes[index].left;
+}
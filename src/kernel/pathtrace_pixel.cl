@@ -63,7 +63,7 @@ float3 one_bounce_radiance(ray_t *ray,
       ray_t shadow = (ray_t) {
         *hit_p + EPS_F * w_in_world,
         w_in_world,
-        0.0,
+        0.0f,
         dist_to_light
       };
       if (intersect_bvh(&shadow, globals->bvh, globals->primitives, 0)) {
@@ -125,7 +125,7 @@ float3 est_radiance_global_illumination(ray_t *ray,
     *ray = (ray_t) {
       hit_p + EPS_F * w_in_world,
       w_in_world,
-      0.0,
+      0.0f,
       INFINITY
     };
     uint old_bsdf_index = isect.bsdf_index;
@@ -73,10 +73,18 @@ typedef struct __attribute__ ((packed)) triangle {
   uint bsdf_index;
 } triangle_t;
 
+#define PRIMITIVE_TYPE_INSTANCE 2
+typedef struct __attribute__ ((packed)) instance {
+  uchar type;
+  float4 world_to_object[3]; // Rows of the affine transform
+  uint root; // Index of the root node of the instanced mesh's BVH
+} instance_t;
+
 typedef union __attribute__ ((packed)) primitive {
   uchar type;
   sphere_t sphere;
   triangle_t triangle;
+  instance_t instance;
 } primitive_t;
 
 typedef struct __attribute__ ((packed)) mat3 {
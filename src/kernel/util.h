@@ -40,7 +40,7 @@ float rand(rand_state_t* seed) {
   int const m = 2147483647; //ie 2**31-1
 
   *seed = ((long)(*seed * a)) % m;
-  return (float) (*seed) / m;
+  return (float) (*seed) / (float) m;
 }
 
 bool coin_flip(float p, global_state_t *globals) {
@@ -3,10 +3,12 @@
 cl_float3 cglVectorToKernel(CGL::Vector3D vector, bool normalize) {
   cl_float3 out = {(float) vector.x, (float) vector.y, (float) vector.z};
   if (normalize) {
-    cl_float sum = fabs(out.s0 + out.s1 + out.s2);
-    out.s0 /= sum;
-    out.s1 /= sum;
-    out.s2 /= sum;
+    // By length: the device interpolates vertex normals, which only comes
+    // out as on the host if they are all unit vectors.
+    cl_float length = sqrt(out.s0 * out.s0 + out.s1 * out.s1 + out.s2 * out.s2);
+    out.s0 /= length;
+    out.s1 /= length;
+    out.s2 /= length;
   }
   return out;
 }
@@ -15,6 +17,14 @@ cl_float3 cglSpectrumToKernel(CGL::Spectrum spectrum) {
   return {spectrum.r, spectrum.g, spectrum.b};
 }
 
+CGL::Vector3D kernelVectorToCGL(cl_float3 vector) {
+  return CGL::Vector3D(vector.s0, vector.s1, vector.s2);
+}
+
+CGL::Spectrum kernelSpectrumToCGL(cl_float3 spectrum) {
+  return CGL::Spectrum(spectrum.s0, spectrum.s1, spectrum.s2);
+}
+
 kernel_mat3 cglMatrixToKernel(CGL::Matrix3x3 matrix) {
   return {
     {(float) matrix[0][0], (float) matrix[0][1], (float) matrix[0][2]},
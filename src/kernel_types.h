@@ -128,10 +128,18 @@ typedef struct kernel_triangle {
   cl_uint bsdf_index;
 } kernel_triangle_t;
 
+#define KERNEL_PRIMITIVE_TYPE_INSTANCE 2
+typedef struct kernel_instance {
+  cl_uchar type;
+  cl_float4 world_to_object[3]; // Rows of the affine transform
+  cl_uint root; // Index of the root node of the instanced mesh's BVH
+} kernel_instance_t;
+
 typedef union kernel_primitive {
   cl_uchar type;
   kernel_sphere_t sphere;
   kernel_triangle_t triangle;
+  kernel_instance_t instance;
 } kernel_primitive_t;
 
 typedef struct kernel_bvh_node {
@@ -150,4 +158,8 @@ cl_float3 cglSpectrumToKernel(CGL::Spectrum spectrum);
 
 kernel_mat3_t cglMatrixToKernel(CGL::Matrix3x3 matrix);
 
+CGL::Vector3D kernelVectorToCGL(cl_float3 vector);
+
+CGL::Spectrum kernelSpectrumToCGL(cl_float3 spectrum);
+
 #endif // KERNEL_TYPES_H
@@ -0,0 +1,340 @@
+#include "lbvh.h"
+
+#include <iostream>
+#include <algorithm>
+
+#include "CGL/timer.h"
+
+using namespace std;
+
+namespace CGL {
+
+// Work-group size of the centroid bounds reduction, must be a power of two
+static const size_t BOUNDS_GROUP_SIZE = 64;
+static const size_t BOUNDS_GROUPS = 64;
+
+// Keys handled by one work-item of the radix sort
+static const size_t RADIX_CHUNK_SIZE = 256;
+static const size_t RADIX_BUCKETS = 16;
+static const size_t RADIX_BITS = 4;
+
+// Morton codes are 30 bits wide
+static const size_t MORTON_BITS = 32;
+
+// Mirrors lbvh_node_t in kernel/lbvh.cl
+struct lbvh_node_t {
+  cl_uint left;
+  cl_uint right;
+  cl_uint parent;
+};
+
+static size_t round_up(size_t n, size_t multiple) {
+  return (n + multiple - 1) / multiple * multiple;
+}
+
+// Reports a failed OpenCL call; returns whether err is CL_SUCCESS.
+static bool check(cl_int err, const char* what) {
+  if (err != CL_SUCCESS) {
+    cerr << "[PathTracer] LBVH: " << what << " failed with error " << err << endl;
+  }
+  return err == CL_SUCCESS;
+}
+
+LBVHBuilder::LBVHBuilder(const cl::Context& context, const cl::Device& device)
+    : context(context), device(device), capacity(0) {
+
+  const char* src = "#include \"kernel/lbvh.cl\"";
+  cl::Program program = cl::Program(context, src);
+  try {
+#ifdef DEBUG
+    program.build("-g -I. -cl-std=CL1.2");
+#else
+    int err = program.build("-I. -cl-std=CL1.2");
+    if (err != 0) {
+      cerr << "[PathTracer] Error building LBVH kernels: " << err << endl;
+      throw 1;
+    }
+#endif
+  } catch (...) {
+    cl_int buildErr = CL_SUCCESS;
+    auto buildInfo = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device, &buildErr);
+    cerr << "[PathTracer] Error building LBVH kernels: " << buildInfo << endl;
+    throw 1;
+  }
+
+  struct { cl::Kernel* kernel; const char* name; } kernels[] = {
+    { &centroidBounds, "lbvh_centroid_bounds" },
+    { &mortonCodes, "lbvh_morton_codes" },
+    { &radixCount, "radix_count" },
+    { &radixScan, "radix_scan" },
+    { &radixScatter, "radix_scatter" },
+    { &emitHierarchy, "lbvh_emit_hierarchy" },
+    { &emitLeaves, "lbvh_emit_leaves" },
+    { &refit, "lbvh_refit" },
+    { &emitLinks, "lbvh_emit_links" },
+  };
+  for (auto& k : kernels) {
+    cl_int err = CL_SUCCESS;
+    *k.kernel = cl::Kernel(program, k.name, &err);
+    if (!check(err, k.name)) throw 1;
+  }
+
+  max_group_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+  max_group_size = std::max<size_t>(1, std::min<size_t>(max_group_size, 256));
+}
+
+size_t LBVHBuilder::group_size(const cl::Kernel& kernel) const {
+  // A kernel can be limited to less than the device maximum, e.g. by the
+  // registers or local memory it uses.
+  size_t limit = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  return std::max<size_t>(1, std::min(max_group_size, limit));
+}
+
+bool LBVHBuilder::reserve(size_t count) {
+  if (count <= capacity) return true;
+  size_t num_chunks = (count + RADIX_CHUNK_SIZE - 1) / RADIX_CHUNK_SIZE;
+  cl_int err[9];
+  groupBounds = cl::Buffer(context, CL_MEM_READ_WRITE,
+                           2 * BOUNDS_GROUPS * sizeof(cl_float3), NULL, &err[0]);
+  for (int i = 0; i < 2; i++) {
+    keys[i] = cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(cl_uint),
+                         NULL, &err[1 + i]);
+    values[i] = cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(cl_uint),
+                           NULL, &err[3 + i]);
+  }
+  counts = cl::Buffer(context, CL_MEM_READ_WRITE,
+                      RADIX_BUCKETS * num_chunks * sizeof(cl_uint), NULL, &err[5]);
+  nodes = cl::Buffer(context, CL_MEM_READ_WRITE,
+                     std::max<size_t>(count - 1, 1) * sizeof(lbvh_node_t),
+                     NULL, &err[6]);
+  leafParents = cl::Buffer(context, CL_MEM_READ_WRITE, count * sizeof(cl_uint),
+                           NULL, &err[7]);
+  visits = cl::Buffer(context, CL_MEM_READ_WRITE,
+                      std::max<size_t>(count - 1, 1) * sizeof(cl_uint),
+                      NULL, &err[8]);
+  for (int i = 0; i < 9; i++) {
+    if (!check(err[i], "scratch buffer allocation")) return false;
+  }
+  capacity = count;
+  return true;
+}
+
+bool LBVHBuilder::build(cl::CommandQueue& queue, const cl::Buffer& primitives,
+                        size_t count, cl::Buffer* sorted_primitives,
+                        cl::Buffer* bvh) {
+  Timer timer;
+  timer.start();
+
+  if (!reserve(count)) return false;
+  cl_uint n = count;
+  size_t num_chunks = (count + RADIX_CHUNK_SIZE - 1) / RADIX_CHUNK_SIZE;
+
+  cl_int err = CL_SUCCESS;
+  *sorted_primitives = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                  count * sizeof(kernel_primitive_t), NULL, &err);
+  if (!check(err, "primitive buffer allocation")) return false;
+  *bvh = cl::Buffer(context, CL_MEM_READ_WRITE,
+                    (2 * count - 1) * sizeof(kernel_bvh_node_t), NULL, &err);
+  if (!check(err, "node buffer allocation")) return false;
+
+  // Scene centroid bounds and Morton codes. The reduction halves its group,
+  // so the group size is kept a power of two.
+  size_t bounds_group = 1;
+  while (2 * bounds_group <= std::min(BOUNDS_GROUP_SIZE, group_size(centroidBounds))) {
+    bounds_group *= 2;
+  }
+  uint32_t argNum = 0;
+  centroidBounds.setArg(argNum++, primitives);
+  centroidBounds.setArg(argNum++, n);
+  centroidBounds.setArg(argNum++, groupBounds);
+  centroidBounds.setArg(argNum++, cl::Local(2 * bounds_group * sizeof(cl_float3)));
+  if (!check(queue.enqueueNDRangeKernel(centroidBounds, cl::NullRange,
+                                        cl::NDRange(BOUNDS_GROUPS * bounds_group),
+                                        cl::NDRange(bounds_group)),
+             "lbvh_centroid_bounds")) return false;
+
+  size_t group = group_size(mortonCodes);
+  argNum = 0;
+  mortonCodes.setArg(argNum++, primitives);
+  mortonCodes.setArg(argNum++, n);
+  mortonCodes.setArg(argNum++, groupBounds);
+  mortonCodes.setArg(argNum++, (cl_uint) BOUNDS_GROUPS);
+  mortonCodes.setArg(argNum++, keys[0]);
+  mortonCodes.setArg(argNum++, values[0]);
+  if (!check(queue.enqueueNDRangeKernel(mortonCodes, cl::NullRange,
+                                        cl::NDRange(round_up(count, group)),
+                                        cl::NDRange(group)),
+             "lbvh_morton_codes")) return false;
+
+  // Radix sort, ping-ponging between the two key/value buffers. The number
+  // of passes is even, so the result ends up back in keys[0]/values[0].
+  size_t count_group = group_size(radixCount);
+  size_t scan_group = group_size(radixScan);
+  size_t scatter_group = group_size(radixScatter);
+  for (size_t shift = 0, pass = 0; shift < MORTON_BITS; shift += RADIX_BITS, pass++) {
+    int src = pass % 2, dst = 1 - src;
+
+    argNum = 0;
+    radixCount.setArg(argNum++, keys[src]);
+    radixCount.setArg(argNum++, n);
+    radixCount.setArg(argNum++, (cl_uint) shift);
+    radixCount.setArg(argNum++, (cl_uint) RADIX_CHUNK_SIZE);
+    radixCount.setArg(argNum++, (cl_uint) num_chunks);
+    radixCount.setArg(argNum++, counts);
+    if (!check(queue.enqueueNDRangeKernel(radixCount, cl::NullRange,
+                                          cl::NDRange(round_up(num_chunks, count_group)),
+                                          cl::NDRange(count_group)),
+               "radix_count")) return false;
+
+    argNum = 0;
+    radixScan.setArg(argNum++, counts);
+    radixScan.setArg(argNum++, (cl_uint) (RADIX_BUCKETS * num_chunks));
+    radixScan.setArg(argNum++, cl::Local(scan_group * sizeof(cl_uint)));
+    if (!check(queue.enqueueNDRangeKernel(radixScan, cl::NullRange,
+                                          cl::NDRange(scan_group),
+                                          cl::NDRange(scan_group)),
+               "radix_scan")) return false;
+
+    argNum = 0;
+    radixScatter.setArg(argNum++, keys[src]);
+    radixScatter.setArg(argNum++, values[src]);
+    radixScatter.setArg(argNum++, keys[dst]);
+    radixScatter.setArg(argNum++, values[dst]);
+    radixScatter.setArg(argNum++, n);
+    radixScatter.setArg(argNum++, (cl_uint) shift);
+    radixScatter.setArg(argNum++, (cl_uint) RADIX_CHUNK_SIZE);
+    radixScatter.setArg(argNum++, (cl_uint) num_chunks);
+    radixScatter.setArg(argNum++, counts);
+    if (!check(queue.enqueueNDRangeKernel(radixScatter, cl::NullRange,
+                                          cl::NDRange(round_up(num_chunks, scatter_group)),
+                                          cl::NDRange(scatter_group)),
+               "radix_scatter")) return false;
+  }
+
+  // Hierarchy, leaves, bounds and links
+  if (count > 1) {
+    group = group_size(emitHierarchy);
+    argNum = 0;
+    emitHierarchy.setArg(argNum++, keys[0]);
+    emitHierarchy.setArg(argNum++, n);
+    emitHierarchy.setArg(argNum++, nodes);
+    emitHierarchy.setArg(argNum++, leafParents);
+    if (!check(queue.enqueueNDRangeKernel(emitHierarchy, cl::NullRange,
+                                          cl::NDRange(round_up(count - 1, group)),
+                                          cl::NDRange(group)),
+               "lbvh_emit_hierarchy")) return false;
+  }
+
+  group = group_size(emitLeaves);
+  argNum = 0;
+  emitLeaves.setArg(argNum++, primitives);
+  emitLeaves.setArg(argNum++, values[0]);
+  emitLeaves.setArg(argNum++, n);
+  emitLeaves.setArg(argNum++, *sorted_primitives);
+  emitLeaves.setArg(argNum++, *bvh);
+  if (!check(queue.enqueueNDRangeKernel(emitLeaves, cl::NullRange,
+                                        cl::NDRange(round_up(count, group)),
+                                        cl::NDRange(group)),
+             "lbvh_emit_leaves")) return false;
+
+  if (count > 1) {
+    if (!check(queue.enqueueFillBuffer(visits, (cl_uint) 0, 0,
+                                       (count - 1) * sizeof(cl_uint)),
+               "clearing the refit counters")) return false;
+    group = group_size(refit);
+    argNum = 0;
+    refit.setArg(argNum++, nodes);
+    refit.setArg(argNum++, leafParents);
+    refit.setArg(argNum++, n);
+    refit.setArg(argNum++, visits);
+    refit.setArg(argNum++, *bvh);
+    if (!check(queue.enqueueNDRangeKernel(refit, cl::NullRange,
+                                          cl::NDRange(round_up(count, group)),
+                                          cl::NDRange(group)),
+               "lbvh_refit")) return false;
+  }
+
+  group = group_size(emitLinks);
+  argNum = 0;
+  emitLinks.setArg(argNum++, nodes);
+  emitLinks.setArg(argNum++, leafParents);
+  emitLinks.setArg(argNum++, n);
+  emitLinks.setArg(argNum++, *bvh);
+  if (!check(queue.enqueueNDRangeKernel(emitLinks, cl::NullRange,
+                                        cl::NDRange(round_up(2 * count - 1, group)),
+                                        cl::NDRange(group)),
+             "lbvh_emit_links")) return false;
+
+  if (!check(queue.finish(), "LBVH build")) return false;
+  timer.stop();
+  fprintf(stdout, "[PathTracer] Built LBVH on device from %lu primitives (%.4f sec)\n",
+          count, timer.duration());
+  return true;
+}
+
+static bool contains(const kernel_bvh_node_t& outer, const kernel_bvh_node_t& inner) {
+  return outer.bounds[0].s0 <= inner.bounds[0].s0 &&
+         outer.bounds[0].s1 <= inner.bounds[0].s1 &&
+         outer.bounds[0].s2 <= inner.bounds[0].s2 &&
+         outer.bounds[1].s0 >= inner.bounds[1].s0 &&
+         outer.bounds[1].s1 >= inner.bounds[1].s1 &&
+         outer.bounds[1].s2 >= inner.bounds[1].s2;
+}
+
+bool LBVHBuilder::validate(cl::CommandQueue& queue, const cl::Buffer& bvh,
+                           size_t count) {
+  size_t num_nodes = 2 * count - 1;
+  vector<kernel_bvh_node_t> nodes(num_nodes);
+  if (!check(queue.enqueueReadBuffer(bvh, CL_TRUE, 0,
+                                     num_nodes * sizeof(kernel_bvh_node_t),
+                                     &nodes[0]),
+             "reading back the LBVH")) return false;
+
+  // Follow the links as if every box was hit; this must visit every node
+  // exactly once and every primitive exactly once.
+  vector<bool> node_seen(num_nodes, false), prim_seen(count, false);
+  size_t visited = 0;
+  size_t index = 0;
+  do {
+    if (index >= num_nodes || node_seen[index]) {
+      cerr << "[PathTracer] LBVH validation failed: bad link to node "
+           << index << endl;
+      return false;
+    }
+    node_seen[index] = true;
+    visited++;
+
+    const kernel_bvh_node_t& node = nodes[index];
+    if (node.prim_count > 0) {
+      for (size_t i = node.prim_index; i < node.prim_index + node.prim_count; i++) {
+        if (i >= count || prim_seen[i]) {
+          cerr << "[PathTracer] LBVH validation failed: primitive " << i
+               << " referenced twice" << endl;
+          return false;
+        }
+        prim_seen[i] = true;
+      }
+    } else {
+      size_t left = node.entry_index;
+      size_t right = left < num_nodes ? nodes[left].exit_index : num_nodes;
+      if (right >= num_nodes || !contains(node, nodes[left]) ||
+          !contains(node, nodes[right])) {
+        cerr << "[PathTracer] LBVH validation failed: node " << index
+             << " does not bound its children" << endl;
+        return false;
+      }
+    }
+    index = node.entry_index;
+  } while (index != 0);
+
+  if (visited != num_nodes ||
+      std::find(prim_seen.begin(), prim_seen.end(), false) != prim_seen.end()) {
+    cerr << "[PathTracer] LBVH validation failed: visited " << visited
+         << " of " << num_nodes << " nodes" << endl;
+    return false;
+  }
+  fprintf(stdout, "[PathTracer] LBVH validation passed\n");
+  return true;
+}
+
+}  // namespace CGL
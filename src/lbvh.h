@@ -0,0 +1,82 @@
+#ifndef CGL_LBVH_H
+#define CGL_LBVH_H
+
+#define CL_HPP_ENABLE_EXCEPTIONS
+#define CL_HPP_TARGET_OPENCL_VERSION 120
+
+#include <CL/cl.hpp>
+
+#include "kernel_types.h"
+
+namespace CGL {
+
+/**
+ * Builds a linear BVH (LBVH) over primitives that already live in device
+ * memory, using the kernels in kernel/lbvh.cl: Morton codes of the primitive
+ * centroids, a radix sort, hierarchy emission, bottom-up bounds and threaded
+ * links. The result is a kernel_bvh_node_t array that can be handed to
+ * pathtrace_pixel as is, so rebuilding never goes through the host.
+ * Leaves hold a single primitive, and the primitives are reordered to match.
+ */
+class LBVHBuilder {
+ public:
+
+  /**
+   * Compiles the LBVH kernels for the given device. Throws if they don't
+   * build.
+   */
+  LBVHBuilder(const cl::Context& context, const cl::Device& device);
+
+  /**
+   * Build a BVH over the first count primitives of the given buffer.
+   * \param queue command queue to build on
+   * \param primitives kernel_primitive_t records in any order
+   * \param count number of primitives, must be at least 1
+   * \param sorted_primitives receives the primitives in leaf order
+   * \param bvh receives the 2 * count - 1 nodes, root at index 0
+   * \return false if an OpenCL call failed; the outputs are then unusable
+   */
+  bool build(cl::CommandQueue& queue, const cl::Buffer& primitives,
+             size_t count, cl::Buffer* sorted_primitives, cl::Buffer* bvh);
+
+  /**
+   * Read back a BVH produced by build() and check its structure: the links
+   * visit every node once, every primitive is in exactly one leaf and every
+   * node bounds its children.
+   * \return true if the BVH could be read back and is valid
+   */
+  bool validate(cl::CommandQueue& queue, const cl::Buffer& bvh,
+                size_t count);
+
+ private:
+  bool reserve(size_t count);
+  size_t group_size(const cl::Kernel& kernel) const;
+
+  cl::Context context;
+  cl::Device device;
+  size_t max_group_size;
+
+  cl::Kernel centroidBounds;
+  cl::Kernel mortonCodes;
+  cl::Kernel radixCount;
+  cl::Kernel radixScan;
+  cl::Kernel radixScatter;
+  cl::Kernel emitHierarchy;
+  cl::Kernel emitLeaves;
+  cl::Kernel refit;
+  cl::Kernel emitLinks;
+
+  // Scratch buffers, reused across builds of the same size or smaller
+  size_t capacity;
+  cl::Buffer groupBounds;
+  cl::Buffer keys[2];
+  cl::Buffer values[2];
+  cl::Buffer counts;
+  cl::Buffer nodes;
+  cl::Buffer leafParents;
+  cl::Buffer visits;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_LBVH_H
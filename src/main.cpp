@@ -5,16 +5,21 @@
 #include "CGL/tinyexr.h"
 
 #include "application.h"
+#include "collada/binary_scene.h"
+#include "misc/startup_profile.h"
 typedef uint32_t gid_t;
 #include "image.h"
 typedef uint32_t gid_t;
 
 #include <iostream>
+#include <map>
+#include <set>
 #include <string>
 
 #ifdef _WIN32
 #include "misc/getopt.h"
 #else
+#include <getopt.h>
 #include <unistd.h>
 #endif
 
@@ -25,6 +30,7 @@ using namespace CGL;
 
 void usage(const char* binaryName) {
   printf("Usage: %s [options] <scenefile>\n", binaryName);
+  printf("       %s --convert <scenefile> <binaryfile>\n", binaryName);
   printf("Program Options:\n");
   printf("  -s  <INT>        Number of camera rays per pixel\n");
   printf("  -l  <INT>        Number of samples per area light\n");
@@ -33,7 +39,46 @@ void usage(const char* binaryName) {
   printf("  -e  <PATH>       Path to environment map\n");
   printf("  -f  <FILENAME>   Image (.png) file to save output to in windowless mode\n");
   printf("  -r  <INT> <INT>  Width and height of output image (if windowless)\n");
+  printf("  -S  <FLOAT>      Build an SBVH, allowing this many duplicate references per primitive,\n");
+  printf("                   in (0, 1] (e.g. 0.3); builds several times slower and pays off\n");
+  printf("                   mostly on scenes with long, thin triangles\n");
+#ifdef DEVICE_BVH
+  printf("  -D               Experimental: build the BVH on the OpenCL device (LBVH);\n");
+  printf("                   not yet run on a real device, traces slower, and falls\n");
+  printf("                   back to the host builder if the device build fails\n");
+#endif
+  printf("  -C  <PATH>       Cache the flattened scene in this file (windowless mode)\n");
+  printf("  -L  <LAYOUT>     Node order of the flattened BVH: dfs (default) or treelet\n");
+  printf("  -O  <PASSES>     Reinsertion passes to optimize the BVH with (default 100 with -f, else 0)\n");
+  printf("  -j  <PATH>       Write BVH stats to this file as JSON\n");
+  printf("  -M  <INT>        Maximum number of primitives in a BVH leaf\n");
+  printf("  -B  <INT>        Number of SAH buckets per axis\n");
+  printf("  -R  <FLOAT>      Ratio of BVH traversal cost to intersection cost\n");
+  printf("  -T  <BACKEND>    Tune the BVH parameters for cl or cpu (kept next to -C cache)\n");
+  printf("  -x  <ACCEL>      What --cpu renders trace: flat (the OpenCL BVH, default) or bvh4\n");
+  printf("  -w               Trace the secondary and shadow rays of --cpu renders as streams\n");
   printf("  -h               Print this help message\n");
+  printf("  --convert        Write the scene as a binary scene file, which loads\n");
+  printf("                   in place of the .dae much faster\n");
+  printf("  --simplify <FLOAT>\n");
+  printf("                   With --convert, simplify each mesh to this fraction of\n");
+  printf("                   its triangles (quadric error edge collapses)\n");
+  printf("  --simplify-min <INT>\n");
+  printf("                   Leave meshes with fewer triangles than this as they are\n");
+  printf("                   (default 10000)\n");
+  printf("  --instancing     Share meshes that appear more than once instead of\n");
+  printf("                   copying them into each place; saves memory, but can\n");
+  printf("                   trace slower where the copies overlap (windowless mode)\n");
+  printf("  --cpu            Render with the C++ path tracer on the CPU instead of\n");
+  printf("                   the OpenCL kernel\n");
+#ifdef DEVICE_BVH
+  printf("  --validate-bvh   With -D, read back and check each device BVH, and build\n");
+  printf("                   on the host instead if it is broken\n");
+#endif
+  printf("  --lean           Free each host copy of the scene as soon as the next one\n");
+  printf("                   is built, down to none once it is on the device\n");
+  printf("                   (windowless mode, for many renders per machine;\n");
+  printf("                   not with --cpu, which renders from the host scene)\n");
   printf("\n");
 }
 
@@ -75,16 +120,137 @@ HDRImageBuffer* load_exr(const char* file_path) {
 
   return envmap;
 }
+Collada::SceneInfo* parse_scene(const string& sceneFilePath) {
+  Misc::StartupStage stage("parse");
+  Collada::SceneInfo *sceneInfo = new Collada::SceneInfo();
+  const char *path = sceneFilePath.c_str();
+  int result = Collada::BinaryScene::is_binary(path)
+             ? Collada::BinaryScene::load(path, sceneInfo)
+             : Collada::ColladaParser::load(path, sceneInfo);
+  if (result < 0) {
+    delete sceneInfo;
+    exit(0);
+  }
+  return sceneInfo;
+}
+
+// Parse all of s as a number, for options where a typo should not quietly
+// become 0.
+bool parse_double(const char* s, double* value) {
+  char* end;
+  *value = strtod(s, &end);
+  return end != s && *end == '\0';
+}
+
+bool parse_count(const char* s, size_t* value) {
+  char* end;
+  if (!isdigit((unsigned char) *s)) return false;
+  *value = strtoul(s, &end, 10);
+  return *end == '\0';
+}
+
+// Replace every mesh of at least minTriangles triangles with a simplified
+// one of about fraction as many. Meshes that several nodes instance are
+// simplified once: a binary scene shares one PolymeshInfo between them, but
+// the COLLADA parser gives every node its own copy, so copies of a geometry
+// already seen take its result instead.
+void simplify_scene(Collada::SceneInfo* sceneInfo, double fraction,
+                    size_t minTriangles) {
+  MeshResampler resampler;
+  set<Collada::PolymeshInfo*> done;
+  map<string, Collada::PolymeshInfo*> geometries;
+  for (size_t i = 0; i < sceneInfo->nodes.size(); i++) {
+    Collada::Instance* instance = sceneInfo->nodes[i].instance;
+    if (!instance || instance->type != Collada::Instance::POLYMESH) continue;
+    Collada::PolymeshInfo* polymesh = (Collada::PolymeshInfo*) instance;
+    if (!done.insert(polymesh).second) continue;
+    if (!polymesh->id.empty()) {
+      Collada::PolymeshInfo*& first = geometries[polymesh->id];
+      if (first) {
+        Collada::MaterialInfo* material = polymesh->material;
+        *polymesh = *first;
+        polymesh->material = material;
+        continue;
+      }
+      first = polymesh;
+    }
+
+    size_t triangles = 0;
+    for (size_t p = 0; p < polymesh->num_polygons(); p++) {
+      size_t degree = polymesh->polygon_offsets[p + 1] -
+                      polymesh->polygon_offsets[p];
+      if (degree >= 3) triangles += degree - 2;
+    }
+    if (triangles < minTriangles) continue;
+
+    size_t target = max((size_t) 1, (size_t) (triangles * fraction));
+    if (!resampler.simplify(*polymesh, target)) {
+      msg("Warning: " << polymesh->id << " is not a manifold, oriented "
+          << "surface; left as it is");
+      continue;
+    }
+    msg("Simplified " << polymesh->id << ": " << triangles << " -> "
+        << polymesh->num_polygons() << " triangles");
+  }
+}
+
+// Long options that have no short form
+enum { OPT_CONVERT = 256, OPT_SIMPLIFY, OPT_SIMPLIFY_MIN, OPT_INSTANCING,
+       OPT_LEAN, OPT_CPU, OPT_VALIDATE_BVH };
+
+static const struct option long_options[] = {
+  { "convert", no_argument, NULL, OPT_CONVERT },
+  { "simplify", required_argument, NULL, OPT_SIMPLIFY },
+  { "simplify-min", required_argument, NULL, OPT_SIMPLIFY_MIN },
+  { "instancing", no_argument, NULL, OPT_INSTANCING },
+  { "lean", no_argument, NULL, OPT_LEAN },
+  { "cpu", no_argument, NULL, OPT_CPU },
+  { "validate-bvh", no_argument, NULL, OPT_VALIDATE_BVH },
+  { NULL, 0, NULL, 0 }
+};
 
 int main( int argc, char** argv ) {
 
   // get the options
   AppConfig config; int opt;
+  bool convert = false, simplify = false;
+  double simplify_fraction = 1.0;
+  size_t simplify_min = 10000;
+  double max_duplication;
   bool write_to_file = false;
+  size_t optimize_passes = 0;
+  bool optimize_set = false;
   size_t w = 0, h = 0, x = -1, y = 0, dx = 0, dy = 0;
   string filename, cam_settings = "";
-  while ( (opt = getopt(argc, argv, "s:l:t:m:e:h:H:f:r:c:a:p:b:d:")) != -1 ) {  // for each option...
+  while ( (opt = getopt_long(argc, argv, "s:l:t:m:e:h:H:f:r:c:a:p:b:d:S:DC:L:O:j:M:B:R:T:x:w", long_options, NULL)) != -1 ) {  // for each option...
     switch ( opt ) {
+      case OPT_CONVERT:
+          convert = true;
+          break;
+      case OPT_SIMPLIFY:
+          if (!parse_double(optarg, &simplify_fraction) ||
+              !(simplify_fraction > 0 && simplify_fraction <= 1)) {
+            msg("Error: --simplify takes a fraction in (0, 1], not " << optarg);
+            return 1;
+          }
+          simplify = true;
+          break;
+      case OPT_SIMPLIFY_MIN:
+          if (!parse_count(optarg, &simplify_min)) {
+            msg("Error: --simplify-min takes a triangle count, not " << optarg);
+            return 1;
+          }
+          simplify = true;
+          break;
+      case OPT_INSTANCING:
+          config.pathtracer_instancing = true;
+          break;
+      case OPT_LEAN:
+          config.pathtracer_lean = true;
+          break;
+      case OPT_CPU:
+          config.pathtracer_cpu_render = true;
+          break;
       case 'f':
           write_to_file = true;
           filename  = string(optarg);
@@ -130,6 +296,83 @@ int main( int argc, char** argv ) {
           config.pathtracer_max_tolerance = atof(argv[optind]);
           optind++;
           break;
+      case 'S':
+          if (!parse_double(optarg, &max_duplication) ||
+              !(max_duplication > 0 && max_duplication <= 1)) {
+            msg("Error: -S takes a duplication budget in (0, 1], not " << optarg);
+            return 1;
+          }
+          config.pathtracer_bvh_params.spatial_splits = true;
+          config.pathtracer_bvh_params.max_duplication = max_duplication;
+          break;
+      case 'D':
+#ifdef DEVICE_BVH
+          msg("Warning: -D is experimental; the LBVH has only been checked "
+              << "against an emulated device and traces slower than the host BVH");
+          config.pathtracer_device_bvh = true;
+          break;
+#else
+          msg("Error: -D needs a build with BUILD_DEVICE_BVH");
+          return 1;
+#endif
+      case OPT_VALIDATE_BVH:
+#ifdef DEVICE_BVH
+          config.pathtracer_validate_device_bvh = true;
+          break;
+#else
+          msg("Error: --validate-bvh needs a build with BUILD_DEVICE_BVH");
+          return 1;
+#endif
+      case 'C':
+          config.pathtracer_cache_file = string(optarg);
+          break;
+      case 'L':
+          if (string(optarg) == "dfs") {
+            config.pathtracer_bvh_params.layout = StaticScene::BVHBuildParams::DEPTH_FIRST;
+          } else if (string(optarg) == "treelet") {
+            config.pathtracer_bvh_params.layout = StaticScene::BVHBuildParams::TREELETS;
+          } else {
+            usage(argv[0]);
+            return 1;
+          }
+          break;
+      case 'M':
+          config.pathtracer_bvh_params.max_leaf_size = atoi(optarg);
+          break;
+      case 'B':
+          config.pathtracer_bvh_params.num_buckets = atoi(optarg);
+          break;
+      case 'R':
+          config.pathtracer_bvh_params.traversal_cost =
+              atof(optarg) * config.pathtracer_bvh_params.intersection_cost;
+          break;
+      case 'T':
+          if (string(optarg) != "cl" && string(optarg) != "cpu") {
+            usage(argv[0]);
+            return 1;
+          }
+          config.pathtracer_tune_backend = string(optarg);
+          break;
+      case 'x':
+          if (string(optarg) != "flat" && string(optarg) != "bvh4") {
+            usage(argv[0]);
+            return 1;
+          }
+          config.pathtracer_cpu_accel = string(optarg);
+          break;
+      case 'w':
+          config.pathtracer_stream_trace = true;
+          break;
+      case 'j':
+          config.pathtracer_stats_file = string(optarg);
+          break;
+      case 'O':
+          if (!parse_count(optarg, &optimize_passes)) {
+            msg("Error: -O takes a number of passes, not " << optarg);
+            return 1;
+          }
+          optimize_set = true;
+          break;
       case 'H':
           config.pathtracer_direct_hemisphere_sample = true;
           optind--;
@@ -146,18 +389,45 @@ int main( int argc, char** argv ) {
     return 1;
   }
 
+  if (simplify && !convert) {
+    msg("Error: --simplify and --simplify-min only apply with --convert");
+    return 1;
+  }
+
+  if (config.pathtracer_lean && config.pathtracer_cpu_render) {
+    msg("Error: --lean frees the host scene, which --cpu renders from");
+    return 1;
+  }
+
   string sceneFilePath = argv[optind];
   msg("Input scene file: " << sceneFilePath);
+
+  // convert the scene and exit, no renderer needed
+  if (convert) {
+    if (optind + 1 >= argc) {
+      usage(argv[0]);
+      return 1;
+    }
+    string binaryFilePath = argv[optind + 1];
+    Collada::SceneInfo *sceneInfo = parse_scene(sceneFilePath);
+    if (simplify_fraction < 1.0) {
+      simplify_scene(sceneInfo, simplify_fraction, simplify_min);
+    }
+    if (Collada::BinaryScene::save(binaryFilePath.c_str(), sceneInfo) < 0) {
+      msg("Error writing binary scene file: " << binaryFilePath);
+      return 1;
+    }
+    msg("Wrote binary scene file: " << binaryFilePath);
+    return 0;
+  }
+
   string sceneFile = sceneFilePath.substr(sceneFilePath.find_last_of('/')+1);
-  sceneFile = sceneFile.substr(0,sceneFile.find(".dae"));
+  sceneFile = sceneFile.substr(0,sceneFile.find_last_of('.'));
   config.pathtracer_filename = sceneFile;
 
-  // parse scene
-  Collada::SceneInfo *sceneInfo = new Collada::SceneInfo();
-  if (Collada::ColladaParser::load(sceneFilePath.c_str(), sceneInfo) < 0) {
-    delete sceneInfo;
-    exit(0);
-  }
+  // A batch render traces enough rays to pay for optimizing the BVH
+  if (!optimize_set) optimize_passes = write_to_file ? 100 : 0;
+  config.pathtracer_bvh_params.optimize_passes = optimize_passes;
 
   // create application
   Application *app  = new Application(config, !write_to_file);
@@ -165,8 +435,13 @@ int main( int argc, char** argv ) {
   // write straight to file without opening a window if -f option provided
   if (write_to_file) {
     app->init();
-    app->load(sceneInfo);
-    delete sceneInfo;
+
+    // a cache hit skips parsing, BVH construction and flattening
+    if (!app->load_from_cache(sceneFilePath)) {
+      Collada::SceneInfo *sceneInfo = parse_scene(sceneFilePath);
+      app->load(sceneInfo);
+      delete sceneInfo;
+    }
 
     if (w && h)
       app->resize(w, h);
@@ -188,6 +463,7 @@ int main( int argc, char** argv ) {
   viewer.init();
 
   // load scene 
+  Collada::SceneInfo *sceneInfo = parse_scene(sceneFilePath);
   app->load(sceneInfo);
 
   delete sceneInfo;
@@ -1,6 +1,8 @@
 #include "meshEdit.h"
 #include "mutablePriorityQueue.h"
 
+#include <algorithm>
+
 namespace CGL {
 
 VertexIter HalfedgeMesh::splitEdge(EdgeIter e0) {
@@ -14,13 +16,143 @@ VertexIter HalfedgeMesh::splitEdge(EdgeIter e0) {
 
 }
 
+// Next halfedge leaving the same vertex, turning around it
+static HalfedgeIter rotate(HalfedgeIter h) {
+  return h->twin()->next();
+}
+
+// Whether the face of a halfedge has exactly three sides
+static bool isTriangle(HalfedgeCIter h) {
+  return h->next()->next()->next() == h;
+}
+
+// Number of edges at a vertex, boundary edges included
+static Size valence(VertexCIter v) {
+  Size n = 0;
+  HalfedgeCIter h = v->halfedge();
+  do {
+    n++;
+    h = h->twin()->next();
+  } while (h != v->halfedge());
+  return n;
+}
+
 VertexIter HalfedgeMesh::collapseEdge(EdgeIter e) {
 
-  // TODO: (meshEdit)
-  // This method should collapse the given edge and return an iterator to
-  // the new vertex created by the collapse.
+  HalfedgeIter sides[2] = { e->halfedge(), e->halfedge()->twin() };
+  VertexIter v0 = sides[0]->vertex();
+  VertexIter v1 = sides[1]->vertex();
 
-  return VertexIter();
+  // Each side is a triangle that goes away, or a boundary loop that gets
+  // shorter; a loop of three would be left with two edges.
+  for (int s = 0; s < 2; s++) {
+    if (sides[s]->face()->isBoundary() == isTriangle(sides[s])) {
+      return verticesEnd();
+    }
+  }
+  if (sides[0]->face()->isBoundary() && sides[1]->face()->isBoundary()) {
+    return verticesEnd();
+  }
+
+  // Joining two boundary vertices across the interior would pinch the
+  // surface.
+  if (!e->isBoundary() && v0->isBoundary() && v1->isBoundary()) {
+    return verticesEnd();
+  }
+
+  // Link condition: the only vertices next to both ends are the tips of the
+  // triangles that go away, and those keep enough edges to stay manifold.
+  vector<VertexIter> tips;
+  for (int s = 0; s < 2; s++) {
+    if (sides[s]->face()->isBoundary()) continue;
+    VertexIter tip = sides[s]->next()->next()->vertex();
+    if (valence(tip) <= (tip->isBoundary() ? 2 : 3)) return verticesEnd();
+    tips.push_back(tip);
+  }
+  vector<VertexIter> ring0;
+  HalfedgeIter h = v0->halfedge();
+  do {
+    ring0.push_back(h->twin()->vertex());
+    h = rotate(h);
+  } while (h != v0->halfedge());
+  h = v1->halfedge();
+  do {
+    VertexIter w = h->twin()->vertex();
+    if (find(ring0.begin(), ring0.end(), w) != ring0.end() &&
+        find(tips.begin(), tips.end(), w) == tips.end()) {
+      return verticesEnd();
+    }
+    h = rotate(h);
+  } while (h != v1->halfedge());
+
+  // Everything that is needed from the old connectivity: a halfedge of v0
+  // that survives, and the boundary halfedge before each boundary side.
+  HalfedgeIter keep = sides[0]->face()->isBoundary()
+                    ? sides[0]->next()
+                    : sides[0]->next()->next()->twin();
+  HalfedgeIter before[2];
+  for (int s = 0; s < 2; s++) {
+    if (!sides[s]->face()->isBoundary()) continue;
+    HalfedgeIter q = sides[s];
+    while (rotate(q) != sides[s]) q = rotate(q);
+    before[s] = q->twin();
+  }
+
+  // The halfedges leaving v1 will leave v0 instead.
+  h = v1->halfedge();
+  do {
+    h->vertex() = v0;
+    h = rotate(h);
+  } while (h != v1->halfedge());
+
+  for (int s = 0; s < 2; s++) {
+    HalfedgeIter a = sides[s];
+    FaceIter f = a->face();
+
+    if (f->isBoundary()) {
+      // Step over the edge in the boundary loop.
+      before[s]->next() = a->next();
+      if (f->halfedge() == a) f->halfedge() = a->next();
+      continue;
+    }
+
+    // Glue the other two edges of the triangle into one.
+    HalfedgeIter b = a->next();
+    HalfedgeIter c = b->next();
+    HalfedgeIter bt = b->twin();
+    HalfedgeIter ct = c->twin();
+    EdgeIter kept = c->edge();
+    bt->twin() = ct;
+    ct->twin() = bt;
+    bt->edge() = kept;
+    kept->halfedge() = ct;
+    if (c->vertex()->halfedge() == c) c->vertex()->halfedge() = bt;
+
+    deleteEdge(b->edge());
+    deleteHalfedge(b);
+    deleteHalfedge(c);
+    deleteFace(f);
+  }
+
+  deleteHalfedge(sides[0]);
+  deleteHalfedge(sides[1]);
+  deleteEdge(e);
+
+  // Boundary vertices start at their boundary halfedge.
+  v0->halfedge() = keep;
+  h = keep;
+  do {
+    if (h->face()->isBoundary()) {
+      v0->halfedge() = h;
+      break;
+    }
+    h = rotate(h);
+  } while (h != keep);
+
+  v0->position = (v0->position + v1->position) / 2.;
+  deleteVertex(v1);
+
+  return v0;
 
 }
 
@@ -34,16 +166,50 @@ EdgeIter HalfedgeMesh::flipEdge(EdgeIter e0) {
 
 }
 
+// Quadric error of a point
+static double quadricError(const Matrix4x4& K, const Vector3D& p) {
+  Vector4D x(p, 1.);
+  return dot(x, K * x);
+}
+
 EdgeRecord::EdgeRecord(EdgeIter& _edge) : edge(_edge) {
 
-  // TODO: (meshEdit)
-  // Compute the combined quadric from the edge endpoints.
-  // -> Build the 3x3 linear system whose solution minimizes the quadric error
-  //    associated with these two endpoints.
-  // -> Use this system to solve for the optimal position, and store it in
-  //    EdgeRecord::optimalPoint.
-  // -> Also store the cost associated with collapsing this edg in
-  //    EdgeRecord::Cost.
+  VertexCIter v0 = edge->halfedge()->vertex();
+  VertexCIter v1 = edge->halfedge()->twin()->vertex();
+  Matrix4x4 K = v0->quadric;
+  K += v1->quadric;
+
+  // The error is smallest where its gradient vanishes, which is where
+  // A x = b for the upper 3x3 block A of K and b minus its last column.
+  Matrix3x3 A;
+  Vector3D b;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) A(i, j) = K(i, j);
+    b[i] = -K(i, 3);
+  }
+
+  // A flat or straight neighborhood has no single best point, and a nearly
+  // singular one puts it far away; then the best of the two ends and the
+  // midpoint will do.
+  Vector3D midpoint = (v0->position + v1->position) / 2.;
+  double length = (v1->position - v0->position).norm();
+  bool solved = false;
+  double det = A.det();
+  if (det != 0. && std::abs(det) > 1e-12 * std::pow(A.norm(), 3)) {
+    optimalPoint = A.inv() * b;
+    solved = (optimalPoint - midpoint).norm() <= 2. * length;
+  }
+  if (!solved) {
+    const Vector3D candidates[3] = { midpoint, v0->position, v1->position };
+    optimalPoint = candidates[0];
+    for (int i = 1; i < 3; i++) {
+      if (quadricError(K, candidates[i]) < quadricError(K, optimalPoint)) {
+        optimalPoint = candidates[i];
+      }
+    }
+  }
+
+  score = quadricError(K, optimalPoint);
 
 }
 
@@ -70,21 +236,214 @@ void MeshResampler::upsample(HalfedgeMesh& mesh) {
 
 void MeshResampler::downsample(HalfedgeMesh& mesh) {
 
-  // TODO: (meshEdit)
-  // Compute initial quadrics for each face by simply writing the plane equation
-  // for the face in homogeneous coordinates. These quadrics should be stored
-  // in Face::quadric
-  // -> Compute an initial quadric for each vertex as the sum of the quadrics
-  //    associated with the incident faces, storing it in Vertex::quadric
-  // -> Build a priority queue of edges according to their quadric error cost,
-  //    i.e., by building an EdgeRecord for each edge and sticking it in the
-  //    queue.
-  // -> Until we reach the target edge budget, collapse the best edge. Remember
-  //    to remove from the queue any edge that touches the collapsing edge
-  //    BEFORE it gets collapsed, and add back into the queue any edge touching
-  //    the collapsed vertex AFTER it's been collapsed. Also remember to assign
-  //    a quadric to the collapsed vertex, and to pop the collapsed edge off the
-  //    top of the queue.
+  // A quarter of the faces
+  simplify(mesh, mesh.nFaces() / 4);
+
+}
+
+// Planes along boundary edges count this much more than the faces, so that
+// open surfaces keep their outline.
+static const double BOUNDARY_WEIGHT = 100.;
+
+// Twice the area of a face, times its normal
+static Vector3D areaVector(FaceCIter f) {
+  Vector3D N(0., 0., 0.);
+  HalfedgeCIter h = f->halfedge();
+  do {
+    N += cross(h->vertex()->position, h->next()->vertex()->position);
+    h = h->next();
+  } while (h != f->halfedge());
+  return N;
+}
+
+// Quadric of the plane through p with unit normal N
+static Matrix4x4 planeQuadric(const Vector3D& N, const Vector3D& p) {
+  Vector4D v(N, -dot(N, p));
+  return outer(v, v);
+}
+
+// Whether moving both ends of an edge to p turns over any triangle that
+// remains around them.
+static bool foldsOver(EdgeIter e, const Vector3D& p) {
+
+  HalfedgeIter ends[2] = { e->halfedge(), e->halfedge()->twin() };
+  for (int s = 0; s < 2; s++) {
+    HalfedgeIter h = ends[s];
+    do {
+      if (!h->face()->isBoundary() && h->edge() != e &&
+          h->next()->next()->edge() != e) {
+        Vector3D a = h->vertex()->position;
+        Vector3D b = h->next()->vertex()->position;
+        Vector3D c = h->next()->next()->vertex()->position;
+        if (dot(cross(b - a, c - a), cross(b - p, c - p)) <= 0.) return true;
+      }
+      h = h->twin()->next();
+    } while (h != ends[s]);
+  }
+  return false;
+
+}
+
+void MeshResampler::simplify(HalfedgeMesh& mesh, Size targetFaces) {
+
+  // The quadric of a face is that of its plane.
+  for (FaceIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
+    Vector3D N = areaVector(f);
+    double length = N.norm();
+    f->quadric = length > 0. ? planeQuadric(N / length,
+                                            f->halfedge()->vertex()->position)
+                             : Matrix4x4();
+  }
+
+  // A vertex sums the quadrics of its faces...
+  for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
+    v->quadric = Matrix4x4();
+    HalfedgeIter h = v->halfedge();
+    do {
+      if (!h->face()->isBoundary()) v->quadric += h->face()->quadric;
+      h = h->twin()->next();
+    } while (h != v->halfedge());
+  }
+
+  // ...and of the planes that stand on its boundary edges, square to the
+  // face beside them.
+  for (FaceIter b = mesh.boundariesBegin(); b != mesh.boundariesEnd(); b++) {
+    HalfedgeIter h = b->halfedge();
+    do {
+      HalfedgeIter inside = h->twin();
+      Vector3D p0 = inside->vertex()->position;
+      Vector3D p1 = h->vertex()->position;
+      Vector3D N = cross(p1 - p0, areaVector(inside->face()));
+      double length = N.norm();
+      if (length > 0.) {
+        Matrix4x4 K = BOUNDARY_WEIGHT * planeQuadric(N / length, p0);
+        inside->vertex()->quadric += K;
+        h->vertex()->quadric += K;
+      }
+      h = h->next();
+    } while (h != b->halfedge());
+  }
+
+  // Queue every edge by the error of collapsing it.
+  MutablePriorityQueue<EdgeRecord> queue;
+  Index id = 0;
+  for (EdgeIter e = mesh.edgesBegin(); e != mesh.edgesEnd(); e++) {
+    e->queueId = id++;
+    e->record = EdgeRecord(e);
+    queue.insert(e->queueId, e->record);
+  }
+
+  // Collapse the cheapest edge until there are few enough faces. An edge
+  // that can't be collapsed leaves the queue, and comes back when a
+  // collapse next to it changes its cost.
+  vector<Index> touched, kept;
+  while (mesh.nFaces() > targetFaces && !queue.empty()) {
+    EdgeRecord record = queue.top();
+    queue.pop();
+    EdgeIter e = record.edge;
+    if (foldsOver(e, record.optimalPoint)) continue;
+
+    // The edges around both ends, some of which the collapse deletes
+    touched.clear();
+    HalfedgeIter ends[2] = { e->halfedge(), e->halfedge()->twin() };
+    for (int s = 0; s < 2; s++) {
+      HalfedgeIter h = ends[s];
+      do {
+        touched.push_back(h->edge()->queueId);
+        h = h->twin()->next();
+      } while (h != ends[s]);
+    }
+
+    Matrix4x4 K = ends[0]->vertex()->quadric;
+    K += ends[1]->vertex()->quadric;
+    VertexIter v = mesh.collapseEdge(e);
+    if (v == mesh.verticesEnd()) continue;
+    v->position = record.optimalPoint;
+    v->quadric = K;
+
+    // Edges left around the new vertex change cost in place; the others
+    // that were around the ends are gone.
+    kept.clear();
+    HalfedgeIter h = v->halfedge();
+    do {
+      EdgeIter around = h->edge();
+      around->record = EdgeRecord(around);
+      queue.update(around->queueId, around->record);
+      kept.push_back(around->queueId);
+      h = h->twin()->next();
+    } while (h != v->halfedge());
+    for (size_t i = 0; i < touched.size(); i++) {
+      if (find(kept.begin(), kept.end(), touched[i]) == kept.end()) {
+        queue.remove(touched[i]);
+      }
+    }
+  }
+
+  for (VertexIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
+    v->computeNormal();
+  }
+
+}
+
+bool MeshResampler::simplify(Collada::PolymeshInfo& polymesh,
+                             Size targetTriangles) {
+
+  // Fan the polygons into triangles over the vertices they use, numbered
+  // from zero as the halfedge mesh builder wants them.
+  const Index unused = (Index) -1;
+  vector<Index> number(polymesh.vertices.size(), unused);
+  vector<Vector3D> positions;
+  vector<vector<Index> > triangles;
+  for (size_t p = 0; p < polymesh.num_polygons(); p++) {
+    size_t first = polymesh.polygon_offsets[p];
+    size_t end = polymesh.polygon_offsets[p + 1];
+    for (size_t c = first; c < end; c++) {
+      Index i = polymesh.vertex_indices[c];
+      if (i >= number.size()) return false;
+      if (number[i] == unused) {
+        number[i] = positions.size();
+        positions.push_back(polymesh.vertices[i]);
+      }
+    }
+    for (size_t c = first + 1; c + 1 < end; c++) {
+      vector<Index> triangle(3);
+      triangle[0] = number[polymesh.vertex_indices[first]];
+      triangle[1] = number[polymesh.vertex_indices[c]];
+      triangle[2] = number[polymesh.vertex_indices[c + 1]];
+      triangles.push_back(triangle);
+    }
+  }
+
+  HalfedgeMesh mesh;
+  if (!mesh.buildTrianglesAndQuads(triangles, positions)) return false;
+  simplify(mesh, targetTriangles);
+
+  // Back to a polygon list
+  polymesh.vertices.clear();
+  polymesh.normals.clear();
+  polymesh.texcoords.clear();
+  polymesh.polygon_offsets.clear();
+  polymesh.vertex_indices.clear();
+  polymesh.normal_indices.clear();
+  polymesh.texcoord_indices.clear();
+
+  map<const Vertex*, Index> vertexIndex;
+  for (VertexCIter v = mesh.verticesBegin(); v != mesh.verticesEnd(); v++) {
+    vertexIndex[elementAddress(v)] = polymesh.vertices.size();
+    polymesh.vertices.push_back(v->position);
+  }
+  polymesh.polygon_offsets.push_back(0);
+  for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
+    HalfedgeCIter h = f->halfedge();
+    do {
+      polymesh.vertex_indices.push_back(
+          vertexIndex[elementAddress(h->vertex())]);
+      h = h->next();
+    } while (h != f->halfedge());
+    polymesh.polygon_offsets.push_back(polymesh.vertex_indices.size());
+  }
+
+  return true;
 
 }
 
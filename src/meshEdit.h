@@ -16,6 +16,22 @@ public:
   void upsample  ( HalfedgeMesh& mesh );
   void downsample( HalfedgeMesh& mesh );
   void resample  ( HalfedgeMesh& mesh );
+
+  /**
+   * Quadric error simplification: collapse the edge that changes the
+   * surface least, again and again, until at most targetFaces faces are
+   * left or no edge can be collapsed. The faces must be triangles.
+   */
+  void simplify  ( HalfedgeMesh& mesh, Size targetFaces );
+
+  /**
+   * Simplify a scene mesh to at most targetTriangles triangles. Its
+   * polygons become triangles, and its normals and texture coordinates are
+   * dropped, since they no longer match the vertices.
+   * \return false, leaving the mesh as it is, if it isn't a manifold,
+   *         oriented surface
+   */
+  bool simplify  ( Collada::PolymeshInfo& polymesh, Size targetTriangles );
 };
 
 } // namespace CGL
@@ -0,0 +1,72 @@
+#include "memory_usage.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+namespace CGL { namespace Misc {
+
+size_t current_memory_usage() {
+#ifdef __APPLE__
+  mach_task_basic_info info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                (task_info_t) &info, &count) != KERN_SUCCESS) {
+    return 0;
+  }
+  return info.resident_size;
+#elif defined(_WIN32)
+  return 0;
+#else
+  // The second field of statm is the resident size, in pages.
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (!statm) return 0;
+  unsigned long size, resident;
+  int fields = fscanf(statm, "%lu %lu", &size, &resident);
+  fclose(statm);
+  if (fields != 2) return 0;
+  return (size_t) resident * sysconf(_SC_PAGESIZE);
+#endif
+}
+
+size_t peak_memory_usage() {
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;         // bytes
+#else
+  return usage.ru_maxrss * 1024;  // kilobytes
+#endif
+#endif
+}
+
+std::string format_memory(size_t bytes) {
+  if (bytes == 0) return "unavailable";
+  char text[32];
+  snprintf(text, sizeof(text), "%.1f MB", bytes / (1024.0 * 1024.0));
+  return text;
+}
+
+void release_free_memory() {
+#ifdef __GLIBC__
+  // Small blocks are freed into the heap, which only shrinks from the top.
+  malloc_trim(0);
+#endif
+}
+
+} // namespace Misc
+} // namespace CGL
@@ -0,0 +1,36 @@
+#ifndef CGL_UTIL_MEMORYUSAGE_H
+#define CGL_UTIL_MEMORYUSAGE_H
+
+#include <cstddef>
+#include <string>
+
+namespace CGL { namespace Misc {
+
+/**
+ * Resident set size of the process right now, in bytes, or 0 where the
+ * platform doesn't report it.
+ */
+size_t current_memory_usage();
+
+/**
+ * Largest resident set size the process has reached so far, in bytes, or 0
+ * where the platform doesn't report it.
+ */
+size_t peak_memory_usage();
+
+/**
+ * A size from the functions above in megabytes, e.g. "12.5 MB", or
+ * "unavailable" for 0.
+ */
+std::string format_memory(size_t bytes);
+
+/**
+ * Hand memory the allocator keeps free back to the system, where the
+ * platform allows it, so that freeing shows in the resident set size.
+ */
+void release_free_memory();
+
+} // namespace Misc
+} // namespace CGL
+
+#endif //CGL_UTIL_MEMORYUSAGE_H
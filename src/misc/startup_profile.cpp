@@ -0,0 +1,123 @@
+#include "startup_profile.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace CGL { namespace Misc {
+
+namespace {
+
+struct Stage {
+  const char *name;
+  double start, end;
+  std::thread::id thread;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// Set during static initialization, which is as close to the start of the
+// process as it gets.
+const Clock::time_point epoch = Clock::now();
+
+std::mutex stages_mutex;
+std::vector<Stage> stages;
+bool printed = false;
+
+double now() {
+  return std::chrono::duration<double>(Clock::now() - epoch).count();
+}
+
+} // namespace
+
+StartupStage::StartupStage(const char *name)
+    : name(name), start(now()), ended(false) { }
+
+void StartupStage::end() {
+  if (ended) return;
+  ended = true;
+  Stage stage = { name, start, now(), std::this_thread::get_id() };
+  std::lock_guard<std::mutex> lock(stages_mutex);
+  if (!printed) stages.push_back(stage);
+}
+
+void print_startup_profile(FILE *out) {
+  std::lock_guard<std::mutex> lock(stages_mutex);
+  if (printed || stages.empty()) return;
+  printed = true;
+  double finish = now();
+
+  std::vector<Stage> sorted = stages;
+  std::sort(sorted.begin(), sorted.end(),
+            [](const Stage& a, const Stage& b) { return a.start < b.start; });
+  fprintf(out, "[PathTracer] Startup stages (seconds since launch):\n");
+  for (const Stage& stage : sorted) {
+    fprintf(out, "  %-22s %8.4f - %8.4f  (%.4f)\n", stage.name,
+            stage.start, stage.end, stage.end - stage.start);
+  }
+
+  // A stage inside another one on the same thread (flatten runs inside
+  // upload) is already counted by the outer one; leave it out of the sums
+  // and of the path.
+  std::vector<Stage> outer;
+  double busy = 0;
+  for (size_t i = 0; i < sorted.size(); i++) {
+    bool nested = false;
+    for (size_t j = 0; j < sorted.size() && !nested; j++) {
+      nested = j != i && sorted[j].thread == sorted[i].thread &&
+               sorted[j].start <= sorted[i].start &&
+               sorted[j].end >= sorted[i].end &&
+               // Of two stages with the same span, keep the first.
+               (sorted[j].start < sorted[i].start ||
+                sorted[j].end > sorted[i].end || j < i);
+    }
+    if (nested) continue;
+    outer.push_back(sorted[i]);
+    busy += sorted[i].end - sorted[i].start;
+  }
+
+  // Walk back from the end. A stage that finished just as the current one
+  // started held it up, whichever thread ran it; of several, the one that
+  // started first, as the others were waiting on it too. Otherwise the
+  // current one came after the last stage of its own thread.
+  const double slack = 2e-3;
+  std::vector<const Stage*> path;
+  double cursor = finish;
+  std::thread::id thread = std::this_thread::get_id();
+  for (;;) {
+    const Stage *waited = NULL, *before = NULL, *latest = NULL;
+    for (const Stage& stage : outer) {
+      if (stage.end > cursor + slack || stage.start >= cursor) continue;
+      if (stage.end >= cursor - slack &&
+          (!waited || stage.start < waited->start)) {
+        waited = &stage;
+      }
+      if (stage.thread == thread && (!before || stage.end > before->end)) {
+        before = &stage;
+      }
+      if (!latest || stage.end > latest->end) latest = &stage;
+    }
+    const Stage *best = waited ? waited : before ? before : latest;
+    if (!best) break;
+    path.push_back(best);
+    cursor = best->start;
+    thread = best->thread;
+  }
+  std::reverse(path.begin(), path.end());
+
+  fprintf(out, "[PathTracer] Startup critical path:");
+  double on_path = 0;
+  for (size_t i = 0; i < path.size(); i++) {
+    fprintf(out, "%s %s (%.4f)", i ? " ->" : "", path[i]->name,
+            path[i]->end - path[i]->start);
+    on_path += path[i]->end - path[i]->start;
+  }
+  fprintf(out, "\n[PathTracer] Startup took %.4f sec, %.4f of it in the stages "
+          "above; %.4f sec of other work ran alongside them\n",
+          finish, on_path, std::max(0.0, busy - on_path));
+}
+
+} // namespace Misc
+} // namespace CGL
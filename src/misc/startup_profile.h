@@ -0,0 +1,49 @@
+#ifndef CGL_UTIL_STARTUPPROFILE_H
+#define CGL_UTIL_STARTUPPROFILE_H
+
+#include <cstdio>
+
+namespace CGL { namespace Misc {
+
+/**
+ * Times one stage of startup, from construction until end() or destruction,
+ * on whichever thread runs it. Stages of all threads are collected together
+ * so that print_startup_profile can show how they overlapped.
+ */
+class StartupStage {
+ public:
+
+  /**
+   * Start the stage. The name must outlive the profile; string literals
+   * are what it is meant for.
+   */
+  explicit StartupStage(const char *name);
+
+  ~StartupStage() { end(); }
+
+  /**
+   * End the stage early. Further calls do nothing.
+   */
+  void end();
+
+ private:
+  StartupStage(const StartupStage&);
+  StartupStage& operator=(const StartupStage&);
+
+  const char *name;
+  double start;  ///< seconds since the process started
+  bool ended;
+};
+
+/**
+ * Print the stages recorded so far, in the order they started, followed by
+ * the critical path: the chain of stages, back from the one that ended last,
+ * where each stage is the one that finished last before the next started.
+ * Only prints once; stages of later renders are not startup.
+ */
+void print_startup_profile(FILE *out);
+
+} // namespace Misc
+} // namespace CGL
+
+#endif //CGL_UTIL_STARTUPPROFILE_H
@@ -6,15 +6,13 @@
 
 /**
  * A MutablePriorityQueue is a minimum-priority queue that
- * allows elements to be both inserted and removed from the
- * queue.  Together, one can easily change the priority of
- * an item by removing it, and re-inserting the same item
- * but with a different priority.  A priority queue, for
- * those who don't remember or haven't seen it before, is a
- * data structure that always keeps track of the item with
- * the smallest priority or "score," even as new elements
- * are inserted and removed.  Priority queues are often an
- * essential component of greedy algorithms, where one wants
+ * allows elements to be inserted, removed, and have their
+ * priority changed while they are in the queue.  A priority
+ * queue, for those who don't remember or haven't seen it
+ * before, is a data structure that always keeps track of the
+ * item with the smallest priority or "score," even as new
+ * elements are inserted and removed.  Priority queues are often
+ * an essential component of greedy algorithms, where one wants
  * to iteratively operate on the current "best" element.
  *
  * MutablePriorityQueue is templated on the type T of the object
@@ -26,6 +24,14 @@
  * which returns true if and only if t1 is considered to have a
  * lower priority than t2.
  *
+ * Every item in the queue is named by an id, a small integer
+ * chosen by the caller (such as the number of a mesh element);
+ * ids need not be contiguous, but the queue keeps a slot for
+ * every id up to the largest one used.  The queue is a binary
+ * heap that knows where each id sits in it, so that removing an
+ * item or changing its priority only costs a logarithmic number
+ * of swaps.
+ *
  * Basic use of a MutablePriorityQueue might look
  * something like this:
  *
@@ -35,9 +41,9 @@
  *    // add some items (which we assume have been created
  *    // elsewhere, each of which has its priority stored as
  *    // some kind of internal member variable)
- *    queue.insertItem( item1 );
- *    queue.insertItem( item2 );
- *    queue.insertItem( item3 );
+ *    queue.insert( 0, item0 );
+ *    queue.insert( 1, item1 );
+ *    queue.insert( 2, item2 );
  *
  *    // get the highest priority item currently in the queue
  *    myItemType highestPriorityItem = queue.top();
@@ -46,20 +52,23 @@
  *    // promoting the next-highest priority item to the top
  *    queue.pop();
  *
- *    myItemType nextHighestPriorityItem = queue.top();
- *
- *    // Etc.
+ *    // change the priority of an item still in the queue
+ *    // (inserting an id that is already queued does the same)
+ *    queue.update( 2, item2 );
  *
  *    // We can also remove an item, making sure it is no
  *    // longer in the queue (note that this item may already
  *    // have been removed, if it was the 1st or 2nd-highest
  *    // priority item!)
- *    queue.remove( item2 );
+ *    queue.remove( 1 );
  *
  */
 
-#ifndef CGL_CAMERA_H
-#define CGL_CAMERA_H
+#ifndef CGL_MUTABLEPRIORITYQUEUE_H
+#define CGL_MUTABLEPRIORITYQUEUE_H
+
+#include <cstddef>
+#include <vector>
 
 namespace CGL
 {
@@ -68,33 +77,141 @@ namespace CGL
    class MutablePriorityQueue
    {
       public:
-         void insert( const T& item )
+         /**
+          * Add an item, or give the item with this id a new priority.
+          */
+         void insert( size_t id, const T& item )
+         {
+            if( id >= position.size() ) position.resize( id + 1, NONE );
+            size_t i = position[id];
+            if( i == NONE )
+            {
+               i = heap.size();
+               heap.push_back( Entry( item, id ) );
+               position[id] = i;
+               siftUp( i );
+            }
+            else
+            {
+               heap[i].item = item;
+               siftUp( i );
+               siftDown( position[id] );
+            }
+         }
+
+         /**
+          * Give a queued item a new priority, higher or lower.
+          */
+         void update( size_t id, const T& item )
          {
-            queue.insert( item );
+            insert( id, item );
          }
 
-         void remove( const T& item )
+         void remove( size_t id )
          {
-            if( queue.find( item ) != queue.end() )
+            if( !contains( id ) ) return;
+            size_t i = position[id];
+            position[id] = NONE;
+            size_t last = heap.size() - 1;
+            if( i == last )
             {
-               queue.erase( item );
+               heap.pop_back();
+               return;
             }
+
+            // Fill the hole with the last entry, then restore the order.
+            size_t moved = heap[last].id;
+            heap[i] = heap[last];
+            heap.pop_back();
+            position[moved] = i;
+            siftUp( i );
+            siftDown( position[moved] );
+         }
+
+         bool contains( size_t id ) const
+         {
+            return id < position.size() && position[id] != NONE;
          }
 
          const T& top( void ) const
          {
-            return *( queue.begin() );
+            return heap[0].item;
+         }
+
+         /**
+          * The id of the highest priority item.
+          */
+         size_t topId( void ) const
+         {
+            return heap[0].id;
          }
 
          void pop( void )
          {
-            queue.erase( queue.begin() );
+            remove( heap[0].id );
+         }
+
+         bool empty( void ) const
+         {
+            return heap.empty();
+         }
+
+         size_t size( void ) const
+         {
+            return heap.size();
          }
 
       protected:
-         set<T> queue;
+         struct Entry
+         {
+            Entry( const T& item, size_t id ) : item( item ), id( id ) {}
+            T item;
+            size_t id;
+         };
+
+         static const size_t NONE = (size_t) -1;
+
+         // Move the entry at i toward the root while it beats its parent.
+         void siftUp( size_t i )
+         {
+            Entry entry = heap[i];
+            while( i > 0 )
+            {
+               size_t parent = ( i - 1 ) / 2;
+               if( !( entry.item < heap[parent].item ) ) break;
+               heap[i] = heap[parent];
+               position[heap[i].id] = i;
+               i = parent;
+            }
+            heap[i] = entry;
+            position[entry.id] = i;
+         }
+
+         // Move the entry at i toward the leaves while a child beats it.
+         void siftDown( size_t i )
+         {
+            Entry entry = heap[i];
+            size_t n = heap.size();
+            while( true )
+            {
+               size_t child = 2 * i + 1;
+               if( child >= n ) break;
+               if( child + 1 < n && heap[child + 1].item < heap[child].item ) child++;
+               if( !( heap[child].item < entry.item ) ) break;
+               heap[i] = heap[child];
+               position[heap[i].id] = i;
+               i = child;
+            }
+            heap[i] = entry;
+            position[entry.id] = i;
+         }
+
+         std::vector<Entry> heap;       ///< items in heap order
+         std::vector<size_t> position;  ///< where each id is in the heap, or NONE
    };
 
+   template<class T> const size_t MutablePriorityQueue<T>::NONE;
+
 } // namespace CGL
 
-#endif // CGL_CAMERA_H
+#endif // CGL_MUTABLEPRIORITYQUEUE_H
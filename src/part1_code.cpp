@@ -4,6 +4,7 @@
 
 #include "part1_code.h"
 #include <time.h>
+#include <memory>
 
 using namespace CGL::StaticScene;
 
@@ -12,6 +13,49 @@ using std::max;
 
 namespace CGL {
 
+  // Spread the low 10 bits of x out to every third bit.
+  static uint32_t spread_bits(uint32_t x) {
+    x &= 0x3ff;
+    x = (x | (x << 16)) & 0x030000ff;
+    x = (x | (x << 8)) & 0x0300f00f;
+    x = (x | (x << 4)) & 0x030c30c3;
+    x = (x | (x << 2)) & 0x09249249;
+    return x;
+  }
+
+  // Sort a stream by the octant of the ray directions, then along a Morton
+  // curve through the ray origins, so that rays next to each other in the
+  // stream tend to visit the same BVH nodes.
+  static void sort_stream(vector<Ray>& rays, vector<StreamPath>& paths) {
+    BBox bounds;
+    for (const Ray& r : rays) bounds.expand(r.o);
+
+    vector<std::pair<uint64_t, size_t> > keys(rays.size());
+    for (size_t i = 0; i < rays.size(); i++) {
+      const Ray& r = rays[i];
+      uint64_t octant = (r.d.x < 0) | (r.d.y < 0) << 1 | (r.d.z < 0) << 2;
+      uint32_t morton = 0;
+      for (int a = 0; a < 3; a++) {
+        double extent = bounds.extent[a] > 0 ? bounds.extent[a] : 1;
+        double cell = min(1023.0, (r.o[a] - bounds.min[a]) / extent * 1024);
+        morton |= spread_bits((uint32_t) cell) << a;
+      }
+      keys[i] = std::make_pair(octant << 30 | morton, i);
+    }
+    std::sort(keys.begin(), keys.end());
+
+    vector<Ray> sorted_rays;
+    vector<StreamPath> sorted_paths;
+    sorted_rays.reserve(rays.size());
+    sorted_paths.reserve(paths.size());
+    for (const auto& key : keys) {
+      sorted_rays.push_back(rays[key.second]);
+      sorted_paths.push_back(paths[key.second]);
+    }
+    rays.swap(sorted_rays);
+    paths.swap(sorted_paths);
+  }
+
   Spectrum PathTracer::estimate_direct_lighting_hemisphere(const Ray& r, const Intersection& isect) {
     // Estimate the lighting from this intersection coming directly from a light.
     // For this function, sample uniformly in a hemisphere.
@@ -39,8 +83,8 @@ namespace CGL {
       const Vector3D w_in = hemisphereSampler->get_sample();
       const Vector3D& w_in_world = o2w * w_in;
       Intersection cast_isect;
-      Ray cast(hit_p + EPS_D * w_in_world, w_in_world);
-      if (bvh->intersect(cast, &cast_isect)) {
+      Ray cast(hit_p + EPS_F * w_in_world, w_in_world);
+      if (intersect_scene(cast, &cast_isect)) {
         L_out += isect.bsdf->f(w_out, w_in) * cast_isect.bsdf->get_emission() * w_in.z;
       }
     }
@@ -51,7 +95,30 @@ namespace CGL {
   Spectrum PathTracer::estimate_direct_lighting_importance(const Ray& r, const Intersection& isect) {
     // Estimate the lighting from this intersection coming directly from a light.
     // To implement importance sampling, sample only from lights, not uniformly in a hemisphere.
+    Spectrum L_out;
 
+    // TODO (Part 3.2):
+    // Here is where your code for looping over scene lights goes
+    // COMMENT OUT `normal_shading` IN `est_radiance_global_illumination` BEFORE YOU BEGIN
+    vector<Ray> casts;
+    vector<Spectrum> contributions;
+    sample_lights(r, isect, casts, contributions);
+
+    // Shadow rays from one point are coherent, so they are traced in packets.
+    bool occluded[FlatBVH::PACKET_SIZE];
+    for (size_t first = 0; first < casts.size(); first += FlatBVH::PACKET_SIZE) {
+      size_t end = min(casts.size(), first + FlatBVH::PACKET_SIZE);
+      intersect_scene(casts.data() + first, end - first, occluded);
+      for (size_t i = first; i < end; i++) {
+        if (!occluded[i - first]) L_out += contributions[i];
+      }
+    }
+
+    return L_out;
+  }
+
+  void PathTracer::sample_lights(const Ray& r, const Intersection& isect,
+                                 vector<Ray>& casts, vector<Spectrum>& contributions) {
     // make a coordinate system for a hit point
     // with N aligned with the Z direction.
     Matrix3x3 o2w;
@@ -62,18 +129,13 @@ namespace CGL {
     // toward the camera if this is a primary ray)
     const Vector3D& hit_p = r.o + r.d * isect.t;
     const Vector3D& w_out = w2o * (-r.d);
-    Spectrum L_out;
 
-    // TODO (Part 3.2):
-    // Here is where your code for looping over scene lights goes
-    // COMMENT OUT `normal_shading` IN `est_radiance_global_illumination` BEFORE YOU BEGIN
     for (SceneLight *light : scene->lights) {
       size_t light_samples = 1;
       if (!light->is_delta_light()) {
         light_samples = ns_area_light;
       }
 
-      Spectrum light_irradiance;
       for (size_t i = 0; i < light_samples; i++) {
         Vector3D w_in_world;
         float dist_to_light, pdf;
@@ -84,17 +146,13 @@ namespace CGL {
           continue;
         }
 
-        Ray cast(hit_p + EPS_D * w_in_world, w_in_world, dist_to_light);
-        if (bvh->intersect(cast)) {
-          continue;
-        }
-
-        light_irradiance += isect.bsdf->f(w_out, w_in) * radiance * fabs(w_in.z) / pdf;
+        // The scene is traced in single precision, like on the device, so
+        // rays leave the surface by the kernel's epsilon.
+        casts.push_back(Ray(hit_p + EPS_F * w_in_world, w_in_world, dist_to_light));
+        contributions.push_back(isect.bsdf->f(w_out, w_in) * radiance * fabs(w_in.z) /
+                                pdf / (double) light_samples);
       }
-      L_out += light_irradiance / (double) light_samples;
     }
-
-    return L_out;
   }
 
   Spectrum PathTracer::zero_bounce_radiance(const Ray&r, const Intersection& isect) {
@@ -140,9 +198,9 @@ namespace CGL {
     if (r.depth > 1 && coin_flip(continuation_probability) && pdf > 0) {
       // Continue this ray
       const Vector3D& w_in_world = o2w * w_in;
-      Ray new_ray(hit_p + EPS_D * w_in_world, w_in_world, (int) r.depth - 1);
+      Ray new_ray(hit_p + EPS_F * w_in_world, w_in_world, (int) r.depth - 1);
       Intersection new_isect;
-      if (bvh->intersect(new_ray, &new_isect)) {
+      if (intersect_scene(new_ray, &new_isect)) {
         Spectrum L = at_least_one_bounce_radiance(new_ray, new_isect);
         if (isect.bsdf->is_delta()) {
           L += zero_bounce_radiance(new_ray, new_isect);
@@ -156,14 +214,19 @@ namespace CGL {
 
   Spectrum PathTracer::est_radiance_global_illumination(const Ray &r) {
     Intersection isect;
+    return est_radiance_global_illumination(r, intersect_scene(r, &isect) ? &isect : NULL);
+  }
+
+  Spectrum PathTracer::est_radiance_global_illumination(const Ray &r, const Intersection *hit) {
     Spectrum L_out;
 
     // You will extend this in assignment 3-2.
     // If no intersection occurs, we simply return black.
     // This changes if you implement hemispherical lighting for extra credit.
 
-    if (!bvh->intersect(r, &isect))
+    if (!hit)
       return envLight ? envLight->sample_dir(r) : L_out;
+    const Intersection& isect = *hit;
 
     // This line returns a color depending only on the normal vector
     // to the surface at the intersection point.
@@ -191,44 +254,9 @@ namespace CGL {
 
     const static bool adaptive_sampling = true;
     if (adaptive_sampling) {
-      double i = 0.0;
-      double s1 = 0.0, s2 = 0.0;
-
-      int num_samples = 0;
-      Spectrum total;
-      while (num_samples < max_samples) {
-        num_samples++;
-        Vector2D sample_offset = gridSampler->get_sample();
-        if (max_samples == 1) {
-          sample_offset = {0.5, 0.5};
-        }
-        Vector2D lensSample = gridSampler->get_sample();
-        // Ray r = camera->generate_ray((origin.x + sample_offset.x) / sampleBuffer.w,
-        //                              (origin.y + sample_offset.y) / sampleBuffer.h);
-        Ray r = camera->generate_ray_for_thin_lens((origin.x + sample_offset.x) / sampleBuffer.w,
-                                                   (origin.y + sample_offset.y) / sampleBuffer.h,
-                                                   lensSample[0],
-                                                   lensSample[1] * 2.0 * PI);
-        r.depth = max_ray_depth;
-        Spectrum sample = est_radiance_global_illumination(r);
-        total += sample;
-        const float& illum = sample.illum();
-        s1 += illum;
-        s2 += illum * illum;
-
-        // Check for convergence
-        if (num_samples % samplesPerBatch == 0) {
-          double mean = s1 / num_samples;
-          double var = (1.0 / (num_samples - 1.0)) * (s2 - (s1 * s1 / num_samples));
-          if (1.96 * sqrt(var) / sqrt(num_samples) <= maxTolerance * mean) {
-            // Converged!
-            break;
-          }
-        }
-      }
-
-      sampleCountBuffer[x + y * frameBuffer.w] = num_samples;
-      return total / num_samples;
+      PixelSamples pixel(x, y);
+      raytrace_pixels(&pixel, 1);
+      return pixel.total / pixel.num_samples;
     } else {
       vector<Vector2D> sample_offsets(max_samples);
       if (max_samples == 1) {
@@ -252,6 +280,193 @@ namespace CGL {
     }
   }
 
+  void PathTracer::raytrace_pixels(PixelSamples *pixels, size_t count) {
+    // Every round takes one more sample of each pixel that hasn't converged
+    // yet, and traces the camera rays of the round as one packet.
+    vector<Ray> rays;
+    vector<size_t> owners;
+    bool hits[FlatBVH::PACKET_SIZE];
+    Intersection isects[FlatBVH::PACKET_SIZE];
+    while (true) {
+      rays.clear();
+      owners.clear();
+      for (size_t i = 0; i < count; i++) {
+        if (pixels[i].done) continue;
+        rays.push_back(generate_pixel_ray(pixels[i].x, pixels[i].y));
+        owners.push_back(i);
+      }
+      if (rays.empty()) break;
+
+      intersect_scene(rays.data(), rays.size(), hits, isects);
+      for (size_t j = 0; j < rays.size(); j++) {
+        Spectrum sample = est_radiance_global_illumination(rays[j], hits[j] ? &isects[j] : NULL);
+        add_pixel_sample(pixels[owners[j]], sample);
+      }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      sampleCountBuffer[pixels[i].x + pixels[i].y * frameBuffer.w] = pixels[i].num_samples;
+    }
+  }
+
+  void PathTracer::raytrace_stream(PixelSamples *pixels, size_t count) {
+    vector<Ray> rays, next_rays, shadow_rays;
+    vector<StreamPath> paths, next_paths, shadow_paths;
+    vector<Intersection> isects;
+    std::unique_ptr<bool[]> hits;
+    vector<Spectrum> samples(count);
+    while (true) {
+      rays.clear();
+      paths.clear();
+      for (size_t i = 0; i < count; i++) {
+        if (pixels[i].done) continue;
+        rays.push_back(generate_pixel_ray(pixels[i].x, pixels[i].y));
+        StreamPath path = { i, Spectrum(1, 1, 1), true };
+        paths.push_back(path);
+        samples[i] = Spectrum();
+      }
+      if (rays.empty()) break;
+
+      // One bounce of every path per pass; paths that end drop out.
+      for (bool camera_rays = true; !rays.empty(); camera_rays = false) {
+        sort_stream(rays, paths);
+        hits.reset(new bool[rays.size()]);
+        isects.resize(rays.size());
+        intersect_stream(rays.data(), rays.size(), hits.get(), isects.data());
+
+        shadow_rays.clear();
+        shadow_paths.clear();
+        next_rays.clear();
+        next_paths.clear();
+        shade_stream(rays, paths, hits.get(), isects.data(), camera_rays, samples,
+                     shadow_rays, shadow_paths, next_rays, next_paths);
+
+        if (!shadow_rays.empty()) {
+          sort_stream(shadow_rays, shadow_paths);
+          hits.reset(new bool[shadow_rays.size()]);
+          intersect_stream(shadow_rays.data(), shadow_rays.size(), hits.get());
+          for (size_t j = 0; j < shadow_rays.size(); j++) {
+            if (!hits[j]) samples[shadow_paths[j].pixel] += shadow_paths[j].throughput;
+          }
+        }
+
+        rays.swap(next_rays);
+        paths.swap(next_paths);
+      }
+
+      for (size_t i = 0; i < count; i++) {
+        if (!pixels[i].done) add_pixel_sample(pixels[i], samples[i]);
+      }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      sampleCountBuffer[pixels[i].x + pixels[i].y * frameBuffer.w] = pixels[i].num_samples;
+    }
+  }
+
+  void PathTracer::shade_stream(const vector<Ray>& rays, const vector<StreamPath>& paths,
+                                const bool *hits, const Intersection *isects,
+                                bool camera_rays, vector<Spectrum>& samples,
+                                vector<Ray>& shadow_rays, vector<StreamPath>& shadow_paths,
+                                vector<Ray>& next_rays, vector<StreamPath>& next_paths) {
+    // The same estimate as est_radiance_global_illumination, with the
+    // recursion of at_least_one_bounce_radiance unrolled into the paths.
+    vector<Spectrum> contributions;
+    for (size_t j = 0; j < rays.size(); j++) {
+      const Ray& r = rays[j];
+      const StreamPath& path = paths[j];
+      Spectrum& sample = samples[path.pixel];
+      if (!hits[j]) {
+        if (camera_rays && envLight) sample += envLight->sample_dir(r);
+        continue;
+      }
+      const Intersection& isect = isects[j];
+
+      if (path.add_emission) {
+        sample += path.throughput * zero_bounce_radiance(r, isect);
+      }
+      if (camera_rays && max_ray_depth == 0) continue;
+
+      if (!isect.bsdf->is_delta()) {
+        if (direct_hemisphere_sample) {
+          sample += path.throughput * estimate_direct_lighting_hemisphere(r, isect);
+        } else {
+          contributions.clear();
+          sample_lights(r, isect, shadow_rays, contributions);
+          for (const Spectrum& contribution : contributions) {
+            StreamPath shadow = { path.pixel, path.throughput * contribution, false };
+            shadow_paths.push_back(shadow);
+          }
+        }
+      }
+
+      Matrix3x3 o2w;
+      make_coord_space(o2w, isect.n);
+      Matrix3x3 w2o = o2w.T();
+
+      Vector3D hit_p = r.o + r.d * isect.t;
+      Vector3D w_out = w2o * (-r.d);
+
+      Vector3D w_in;
+      float pdf;
+      Spectrum radiance = isect.bsdf->sample_f(w_out, &w_in, &pdf);
+
+      double continuation_probability = 0.7;
+      if (max_ray_depth > 1 && r.depth == max_ray_depth) {
+        continuation_probability = 1.0;
+      }
+      if (r.depth > 1 && coin_flip(continuation_probability) && pdf > 0) {
+        const Vector3D& w_in_world = o2w * w_in;
+        next_rays.push_back(Ray(hit_p + EPS_F * w_in_world, w_in_world, (int) r.depth - 1));
+        StreamPath next = { path.pixel,
+                            path.throughput * radiance * fabs(w_in.z) / pdf /
+                                continuation_probability,
+                            isect.bsdf->is_delta() };
+        next_paths.push_back(next);
+      }
+    }
+  }
+
+  Ray PathTracer::generate_pixel_ray(size_t x, size_t y) {
+    Vector2D origin = Vector2D(x,y);    // bottom left corner of the pixel
+    Vector2D sample_offset = gridSampler->get_sample();
+    if (ns_aa == 1) {
+      sample_offset = {0.5, 0.5};
+    }
+    Vector2D lensSample = gridSampler->get_sample();
+    // Ray r = camera->generate_ray((origin.x + sample_offset.x) / sampleBuffer.w,
+    //                              (origin.y + sample_offset.y) / sampleBuffer.h);
+    Ray r = camera->generate_ray_for_thin_lens((origin.x + sample_offset.x) / sampleBuffer.w,
+                                               (origin.y + sample_offset.y) / sampleBuffer.h,
+                                               lensSample[0],
+                                               lensSample[1] * 2.0 * PI);
+    r.depth = max_ray_depth;
+    return r;
+  }
+
+  void PathTracer::add_pixel_sample(PixelSamples& pixel, const Spectrum& sample) {
+    pixel.num_samples++;
+    pixel.total += sample;
+    const float& illum = sample.illum();
+    pixel.s1 += illum;
+    pixel.s2 += illum * illum;
+    if (pixel.num_samples >= (int) ns_aa) {
+      pixel.done = true;
+      return;
+    }
+
+    // Check for convergence
+    if (pixel.num_samples % samplesPerBatch == 0) {
+      double mean = pixel.s1 / pixel.num_samples;
+      double var = (1.0 / (pixel.num_samples - 1.0)) *
+                   (pixel.s2 - (pixel.s1 * pixel.s1 / pixel.num_samples));
+      if (1.96 * sqrt(var) / sqrt(pixel.num_samples) <= maxTolerance * mean) {
+        // Converged!
+        pixel.done = true;
+      }
+    }
+  }
+
   // Diffuse BSDF //
 
   Spectrum DiffuseBSDF::f(const Vector3D& wo, const Vector3D& wi) {
@@ -8,6 +8,7 @@
 #include <random>
 #include <algorithm>
 #include <sstream>
+#include <fstream>
 
 #include "CGL/CGL.h"
 #include "CGL/vector3D.h"
@@ -16,11 +17,15 @@
 
 #include "GL/glew.h"
 
+#include "static_scene/instance.h"
 #include "static_scene/sphere.h"
 #include "static_scene/triangle.h"
 #include "static_scene/light.h"
 
 #include "kernel_types.h"
+#include "bvh_tuner.h"
+#include "misc/memory_usage.h"
+#include "misc/startup_profile.h"
 
 
 using namespace CGL::StaticScene;
@@ -28,6 +33,19 @@ using namespace CGL::StaticScene;
 using std::min;
 using std::max;
 
+// Work-group shape of pathtrace_pixel: KERNEL_LOCAL_SIZE squared pixels,
+// with KERNEL_LOCAL_SAMPLES samples each.
+static const int KERNEL_LOCAL_SIZE = 4;
+static const int KERNEL_LOCAL_SAMPLES = 32;
+
+// Side of the pixel blocks the C++ renderer samples together, so that their
+// camera rays fill a packet.
+static const size_t PIXEL_BLOCK_SIZE = 4;
+
+// Workloads that candidate BVHs are timed with when tuning
+static const size_t TUNING_SIZE = 64;     // image size on the device
+static const size_t TUNING_RAYS = 65536;  // camera rays on the host
+
 namespace CGL {
 
 PathTracer::PathTracer(size_t ns_aa,
@@ -43,7 +61,9 @@ PathTracer::PathTracer(size_t ns_aa,
                        bool direct_hemisphere_sample,
                        string filename,
                        double lensRadius,
-                       double focalDistance){
+                       double focalDistance,
+                       const BVHBuildParams& bvh_params,
+                       bool device_bvh){
   state = INIT,
   this->ns_aa = ns_aa;
   this->max_ray_depth = max_ray_depth;
@@ -57,6 +77,9 @@ PathTracer::PathTracer(size_t ns_aa,
   this->focalDistance = focalDistance;
   this->direct_hemisphere_sample = direct_hemisphere_sample;
   this->filename = filename;
+  this->bvh_params = bvh_params;
+  this->device_bvh = device_bvh;
+  this->instanced = false;
 
   if (envmap) {
     this->envLight = new EnvironmentLight(envmap);
@@ -65,6 +88,16 @@ PathTracer::PathTracer(size_t ns_aa,
   }
 
   bvh = NULL;
+  bvh4 = NULL;
+  cpuAccel = "flat";
+  streamTrace = false;
+  cpuRender = false;
+  lean = false;
+  lbvhBuilder = NULL;
+  validateDeviceBVH = false;
+  bvhTuned = false;
+  kernelSceneValid = false;
+  sceneCache = NULL;
   scene = NULL;
   camera = NULL;
 
@@ -91,7 +124,12 @@ PathTracer::PathTracer(size_t ns_aa,
 
 PathTracer::~PathTracer() {
 
+  if (kernelBuild.valid()) kernelBuild.wait();
   delete bvh;
+  delete bvh4;
+  for (BSDF *bsdf : cacheBSDFs) delete bsdf;
+  for (SceneLight *light : cacheLights) delete light;
+  delete lbvhBuilder;
   delete gridSampler;
   delete hemisphereSampler;
 
@@ -104,6 +142,7 @@ static void handleContextError(const char *errinfo, const void *private_info, si
 
 void PathTracer::init_open_cl(cl_device_type device_type) {
   // TODO(PenguinToast): Do proper error handling (throw an exception)
+  Misc::StartupStage stage("OpenCL setup");
   setenv("CUDA_CACHE_DISABLE", "1", 1);
   std::vector<cl::Platform> platforms;
   cl::Platform::get(&platforms);
@@ -128,9 +167,8 @@ void PathTracer::init_open_cl(cl_device_type device_type) {
     fprintf(stderr, "[PathTracer] Requested device not found\n");
     throw 1;
   }
+  clDevice = device;
 
-  // Create kernel program
-  const char* src = "#include \"kernel/pathtrace_pixel.cl\"";
   int err = 0;
   clContext = cl::Context(
       device,
@@ -141,6 +179,17 @@ void PathTracer::init_open_cl(cl_device_type device_type) {
   if (err != 0) {
     cerr << "[PathTracer] Error creating context: " << err << endl;
   }
+  stage.end();
+
+  // Compiling takes longer than anything before rendering but the scene
+  // load, so the two go on at the same time.
+  kernelBuild = std::async(std::launch::async, &PathTracer::build_kernel, this);
+}
+
+void PathTracer::build_kernel() {
+  Misc::StartupStage stage("kernel compile");
+  const char* src = "#include \"kernel/pathtrace_pixel.cl\"";
+  int err = 0;
   cl::Program pathtracePixelProgram = cl::Program(clContext, src);
   try {
 #ifdef DEBUG
@@ -155,7 +204,7 @@ void PathTracer::init_open_cl(cl_device_type device_type) {
   } catch (...) {
     // Print build info for all devices
     cl_int buildErr = CL_SUCCESS;
-    auto buildInfo = pathtracePixelProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device, &buildErr);
+    auto buildInfo = pathtracePixelProgram.getBuildInfo<CL_PROGRAM_BUILD_LOG>(clDevice, &buildErr);
     cerr << "[PathTracer] Error building kernel: " << buildInfo << endl;
     throw 1;
   }
@@ -167,16 +216,36 @@ void PathTracer::init_open_cl(cl_device_type device_type) {
   }
 }
 
+void PathTracer::wait_for_kernel() {
+  // Rethrows what the build threw.
+  if (kernelBuild.valid()) kernelBuild.get();
+}
+
 void PathTracer::set_scene(Scene *scene) {
 
   if (state != INIT) {
     return;
   }
 
+  if (scene == this->scene && !primitives.empty()) {
+    // Same objects and primitives as before, only moved.
+    refit_accel();
+    if (has_valid_configuration()) {
+      state = READY;
+    }
+    return;
+  }
+
   if (this->scene != nullptr) {
-    delete scene;
+    delete this->scene;
     delete bvh;
-    selectionHistory.pop();
+    bvh = NULL;
+    delete bvh4;
+    bvh4 = NULL;
+    kernelBVH.clear();
+    flatBVH = FlatBVH();
+    kernelSceneValid = false;
+    while (!selectionHistory.empty()) selectionHistory.pop();
   }
 
   if (this->envLight != nullptr) {
@@ -184,6 +253,7 @@ void PathTracer::set_scene(Scene *scene) {
   }
 
   this->scene = scene;
+  sceneCache = NULL;
   build_accel();
 
   if (has_valid_configuration()) {
@@ -191,6 +261,65 @@ void PathTracer::set_scene(Scene *scene) {
   }
 }
 
+void PathTracer::set_scene_cache(const SceneCache* cache) {
+
+  if (state != INIT || this->scene != nullptr) {
+    return;
+  }
+
+  // The cache holds all objects and scene lights; the empty scene only
+  // carries the environment light, which comes from the command line.
+  this->scene = new Scene(vector<StaticScene::SceneObject *>(),
+                          vector<StaticScene::SceneLight *>());
+  if (this->envLight != nullptr) {
+    this->scene->lights.push_back(this->envLight);
+  }
+  sceneCache = cache;
+  kernelSceneValid = false;
+
+  // Reading the whole cache for stats costs what mapping it saves, so
+  // only do it when they were asked for.
+  if (!statsFile.empty()) {
+    report_kernel_stats(
+        vector<kernel_bvh_node_t>(cache->bvh(), cache->bvh() + cache->bvh_count()),
+        vector<kernel_primitive_t>(cache->primitives(),
+                                   cache->primitives() + cache->primitive_count()),
+        vector<kernel_bsdf_t>(cache->bsdfs(), cache->bsdfs() + cache->bsdf_count()));
+  }
+
+  if (has_valid_configuration()) {
+    state = READY;
+  }
+}
+
+bool PathTracer::save_scene_cache(const std::string& path, uint64_t key,
+                                  const SceneCacheView& view) {
+  if (!bvh) return false;
+
+  fprintf(stdout, "[PathTracer] Writing scene cache to %s... ", path.c_str());
+  fflush(stdout);
+  timer.start();
+  if (kernelBVH.empty()) flatten_accel();
+  vector<kernel_light_t> kernelLights;
+  for (SceneLight *light : scene->lights) {
+    if (light == envLight) continue;
+    // Zero the padding too, so the same scene always writes the same file.
+    kernel_light_t kernel_light;
+    memset(&kernel_light, 0, sizeof(kernel_light));
+    light->kernel_struct(&kernel_light);
+    kernelLights.push_back(kernel_light);
+  }
+  bool ok = SceneCache::write(path, key, view, kernelBVH, kernelPrimitives,
+                              kernelBSDFs, kernelLights);
+  timer.stop();
+  if (ok) {
+    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  } else {
+    fprintf(stdout, "Failed!\n");
+  }
+  return ok;
+}
+
 void PathTracer::set_camera(Camera *camera) {
 
   if (state != INIT) {
@@ -266,9 +395,12 @@ void PathTracer::stop() {
     case RENDERING:
       continueRaytracing = false;
     case DONE:
+      // Only a render on the CPU has worker threads.
       for (int i=0; i<numWorkerThreads; i++) {
+            if (!workerThreads[i]) continue;
             workerThreads[i]->join();
             delete workerThreads[i];
+            workerThreads[i] = NULL;
         }
       state = READY;
       break;
@@ -278,11 +410,8 @@ void PathTracer::stop() {
 
 void PathTracer::clear() {
   if (state != READY) return;
-  delete bvh;
-  bvh = NULL;
-  scene = NULL;
   camera = NULL;
-  selectionHistory.pop();
+  while (!selectionHistory.empty()) selectionHistory.pop();
   sampleBuffer.resize(0, 0);
   frameBuffer.resize(0, 0);
   state = INIT;
@@ -290,9 +419,11 @@ void PathTracer::clear() {
 }
 
 void PathTracer::start_visualizing() {
-  if (state != READY) {
+  // A cached scene has no host BVH to show.
+  if (state != READY || sceneCache) {
     return;
   }
+  if (!bvh) build_host_bvh();
   state = VISUALIZE;
 }
 
@@ -348,68 +479,130 @@ void PathTracer::start_raytracing() {
     }
   }
 
-  bvh->total_isects = 0; bvh->total_rays = 0;
-  // launch threads
-  fprintf(stdout, "[PathTracer] Rendering...\n"); fflush(stdout);
-  // for (int i=0; i<numWorkerThreads; i++) {
-  //     workerThreads[i] = new std::thread(&PathTracer::worker_thread, this);
-  // }
+  if (cpuRender) {
+    if (bvh) {
+      bvh->total_isects = 0; bvh->total_rays = 0;
+    }
+    prepare_cpu_accel();
+    Misc::print_startup_profile(stdout);
 
-  cl::CommandQueue commandQueue(clContext);
+    // launch threads
+    fprintf(stdout, "[PathTracer] Rendering...\n"); fflush(stdout);
+    for (int i=0; i<numWorkerThreads; i++) {
+        workerThreads[i] = new std::thread(&PathTracer::worker_thread, this);
+    }
+    return;
+  }
 
-  const int localSize = 4;
-  const int localSamples = 32;
+  cl::CommandQueue commandQueue(clContext);
 
-  const int maxLocalSamples = (int) ceil((float) ns_aa / localSamples);
+  const int maxLocalSamples = (int) ceil((float) ns_aa / KERNEL_LOCAL_SAMPLES);
 
   // Set up arguments
 
   vector<cl_float3> output(sampleBuffer.w * sampleBuffer.h * maxLocalSamples, cl_float3());
-  cl_uint2 dim = {(cl_uint) sampleBuffer.w, (cl_uint) sampleBuffer.h};
-  kernel_camera_t camera_arg;
-  camera->kernel_struct(&camera_arg);
 
-  // Build kernel bvh/primitives array
-  vector<kernel_bvh_node_t> kernelBVH;
-  vector<kernel_primitive_t> kernelPrimitives;
-  vector<kernel_bsdf_t> kernelBSDFs;
-  bvh->kernel_struct(kernelBVH, kernelPrimitives, kernelBSDFs);
+  upload_kernel_scene(commandQueue);
 
   vector<kernel_light_t> kernelLights;
+  collect_kernel_lights(kernelLights);
+
+  // Memory allocations
+  cl::Buffer outputBuffer(clContext, begin(output), end(output), false);
+  cl::Buffer lightBuffer(clContext, begin(kernelLights), end(kernelLights), true);
+
+  if (lean) release_kernel_scene();
+  fprintf(stdout, "[PathTracer] Memory while rendering: %s resident, %s peak\n",
+          Misc::format_memory(Misc::current_memory_usage()).c_str(),
+          Misc::format_memory(Misc::peak_memory_usage()).c_str());
+
+  // The scene went up while the kernel may still have been compiling.
+  wait_for_kernel();
+  Misc::print_startup_profile(stdout);
+
+  double duration = run_kernel(commandQueue, outputBuffer, sampleBuffer.w,
+                               sampleBuffer.h, ns_aa, bvhBuffer, primitivesBuffer,
+                               lightBuffer, kernelLights.size(), bsdfBuffer);
+  printf("[PathTracer] Kernel finished: (%.4fs)\n", duration);
+  int err = cl::copy(commandQueue, outputBuffer, begin(output), end(output));
+  if (err != 0) {
+    cout << "[Pathtracer] Error reading output buffer: " << err << endl;
+    throw 1;
+  }
+  for (int y = 0; y < sampleBuffer.h; y++) {
+    for (int x = 0; x < sampleBuffer.w; x++) {
+      Spectrum total;
+      for (int s = 0; s < maxLocalSamples; s++) {
+        cl_float3 sample = output[(y * sampleBuffer.w + x) * maxLocalSamples + s];
+        total += Spectrum(sample.s0, sample.s1, sample.s2);
+      }
+      sampleBuffer.update_pixel(total, x, y);
+    }
+  }
+  sampleBuffer.toColor(frameBuffer, 0, 0, sampleBuffer.w, sampleBuffer.h);
+
+  state = DONE;
+}
+
+void PathTracer::collect_kernel_lights(vector<kernel_light_t>& kernel_lights) {
+  kernel_lights.clear();
+  if (sceneCache) {
+    // The host lights of a cached scene are copies of these records, made
+    // for a render on the CPU; only the environment light is not cached.
+    kernel_lights.assign(sceneCache->lights(),
+                         sceneCache->lights() + sceneCache->light_count());
+    if (envLight) {
+      kernel_light_t kernel_light;
+      envLight->kernel_struct(&kernel_light);
+      kernel_lights.push_back(kernel_light);
+    }
+    return;
+  }
   for (SceneLight *light : scene->lights) {
     kernel_light_t kernel_light;
     light->kernel_struct(&kernel_light);
-    kernelLights.push_back(kernel_light);
+    kernel_lights.push_back(kernel_light);
   }
+}
 
-  // Memory allocations
-  cl::Buffer outputBuffer(clContext, begin(output), end(output), false);
-  cl::Buffer bvhBuffer(clContext, begin(kernelBVH), end(kernelBVH), true);
-  cl::Buffer primitivesBuffer(clContext, begin(kernelPrimitives), end(kernelPrimitives), true);
-  cl::Buffer lightBuffer(clContext, begin(kernelLights), end(kernelLights), true);
-  cl::Buffer bsdfBuffer(clContext, begin(kernelBSDFs), end(kernelBSDFs), true);
+double PathTracer::run_kernel(cl::CommandQueue& commandQueue,
+                              const cl::Buffer& outputBuffer,
+                              size_t width, size_t height, size_t samples,
+                              const cl::Buffer& bvh, const cl::Buffer& primitives,
+                              const cl::Buffer& lights, size_t num_lights,
+                              const cl::Buffer& bsdfs) {
+  const int localSize = KERNEL_LOCAL_SIZE;
+  const int localSamples = KERNEL_LOCAL_SAMPLES;
+
+  const int maxLocalSamples = (int) ceil((float) samples / localSamples);
+
+  wait_for_kernel();
+  cl_uint2 dim = {(cl_uint) width, (cl_uint) height};
+  kernel_camera_t camera_arg;
+  camera->kernel_struct(&camera_arg);
 
   uint32_t argNum = 0;
   pathtracePixel.setArg(argNum++, outputBuffer);
   pathtracePixel.setArg(argNum++, dim);
-  pathtracePixel.setArg(argNum++, (cl_uint) ns_aa);
+  pathtracePixel.setArg(argNum++, (cl_uint) samples);
   pathtracePixel.setArg(argNum++, (cl_uint) ns_area_light);
   pathtracePixel.setArg(argNum++, (cl_uint) max_ray_depth);
   pathtracePixel.setArg(argNum++, camera_arg);
-  pathtracePixel.setArg(argNum++, bvhBuffer);
-  pathtracePixel.setArg(argNum++, primitivesBuffer);
-  pathtracePixel.setArg(argNum++, lightBuffer);
-  pathtracePixel.setArg(argNum++, (cl_uint) kernelLights.size());
-  pathtracePixel.setArg(argNum++, bsdfBuffer);
+  pathtracePixel.setArg(argNum++, bvh);
+  pathtracePixel.setArg(argNum++, primitives);
+  pathtracePixel.setArg(argNum++, lights);
+  pathtracePixel.setArg(argNum++, (cl_uint) num_lights);
+  pathtracePixel.setArg(argNum++, bsdfs);
   pathtracePixel.setArg(argNum++, localSize * localSize * localSamples * sizeof(cl_float3), NULL);
 
+  Timer timer;
   timer.start();
 
   int err = commandQueue.enqueueNDRangeKernel(
       pathtracePixel,
       cl::NullRange, // TODO(PenguinToast): We can get an extra workgroup here
-      cl::NDRange(sampleBuffer.w + (localSize - sampleBuffer.w % localSize),
-                  sampleBuffer.h + (localSize - sampleBuffer.h % localSize),
+      cl::NDRange(width + (localSize - width % localSize),
+                  height + (localSize - height % localSize),
                   maxLocalSamples * localSamples),
       cl::NDRange(localSize, localSize, localSamples));
   // int err = commandQueue.enqueueNDRangeKernel(
@@ -428,25 +621,7 @@ void PathTracer::start_raytracing() {
     throw 1;
   }
   timer.stop();
-  printf("[PathTracer] Kernel finished: (%.4fs)\n", timer.duration());
-  err = cl::copy(commandQueue, outputBuffer, begin(output), end(output));
-  if (err != 0) {
-    cout << "[Pathtracer] Error reading output buffer: " << err << endl;
-    throw 1;
-  }
-  for (int y = 0; y < sampleBuffer.h; y++) {
-    for (int x = 0; x < sampleBuffer.w; x++) {
-      Spectrum total;
-      for (int s = 0; s < maxLocalSamples; s++) {
-        cl_float3 sample = output[(y * sampleBuffer.w + x) * maxLocalSamples + s];
-        total += Spectrum(sample.s0, sample.s1, sample.s2);
-      }
-      sampleBuffer.update_pixel(total, x, y);
-    }
-  }
-  sampleBuffer.toColor(frameBuffer, 0, 0, sampleBuffer.w, sampleBuffer.h);
-
-  state = DONE;
+  return timer.duration();
 }
 
 void PathTracer::render_to_file(string filename, size_t x, size_t y, size_t dx, size_t dy) {
@@ -456,7 +631,8 @@ void PathTracer::render_to_file(string filename, size_t x, size_t y, size_t dx,
     cv_done.wait(lk, [this]{ return state == DONE; });
     lk.unlock();
     save_image(filename);
-    fprintf(stdout, "[PathTracer] Job completed.\n");
+    fprintf(stdout, "[PathTracer] Job completed. (%s peak memory)\n",
+            Misc::format_memory(Misc::peak_memory_usage()).c_str());
   } else {
     render_cell = true;
     cell_tl = Vector2D(x,y);
@@ -469,32 +645,424 @@ void PathTracer::render_to_file(string filename, size_t x, size_t y, size_t dx,
 }
 
 
+void PathTracer::upload_kernel_scene(cl::CommandQueue& commandQueue) {
+
+  if (kernelSceneValid) {
+    // Only the nodes and primitives touched by the last refit have to go
+    // over the bus again. The writes are ordered before the render on the
+    // in-order queue.
+    size_t bytes = 0, writes = 0;
+    for (auto& range : dirtyNodes.ranges) {
+      size_t size = (range.second - range.first) * sizeof(kernel_bvh_node_t);
+      commandQueue.enqueueWriteBuffer(bvhBuffer, CL_FALSE,
+                                      range.first * sizeof(kernel_bvh_node_t),
+                                      size, &kernelBVH[range.first]);
+      bytes += size;
+      writes++;
+    }
+    for (auto& range : dirtyPrimitives.ranges) {
+      size_t size = (range.second - range.first) * sizeof(kernel_primitive_t);
+      commandQueue.enqueueWriteBuffer(primitivesBuffer, CL_FALSE,
+                                      range.first * sizeof(kernel_primitive_t),
+                                      size, &kernelPrimitives[range.first]);
+      bytes += size;
+      writes++;
+    }
+    if (writes > 0) {
+      fprintf(stdout, "[PathTracer] Updated %lu bytes of device scene in %lu writes\n",
+              bytes, writes);
+    }
+    dirtyNodes.clear();
+    dirtyPrimitives.clear();
+    return;
+  }
+
+  dirtyNodes.clear();
+  dirtyPrimitives.clear();
+  Misc::StartupStage stage("upload");
+
+  if (sceneCache) {
+    // Straight from the mapped file, without a copy on the host.
+    cl_mem_flags flags = CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR;
+    bvhBuffer = cl::Buffer(clContext, flags,
+                           sceneCache->bvh_count() * sizeof(kernel_bvh_node_t),
+                           (void *) sceneCache->bvh());
+    primitivesBuffer = cl::Buffer(clContext, flags,
+                                  sceneCache->primitive_count() * sizeof(kernel_primitive_t),
+                                  (void *) sceneCache->primitives());
+    bsdfBuffer = cl::Buffer(clContext, flags,
+                            sceneCache->bsdf_count() * sizeof(kernel_bsdf_t),
+                            (void *) sceneCache->bsdfs());
+    kernelSceneValid = true;
+    return;
+  }
+
+  // Build kernel bvh/primitives array
+  bool use_lbvh = device_bvh && !primitives.empty() && !instanced &&
+                  build_device_bvh(commandQueue);
+  if (!use_lbvh) {
+    if (kernelBVH.empty()) {
+      // A failed device build leaves no host BVH to flatten.
+      if (!bvh) build_host_bvh();
+      flatten_accel();
+    }
+    // The flattened arrays are all the device needs.
+    if (lean) release_host_scene();
+    bvhBuffer = cl::Buffer(clContext, begin(kernelBVH), end(kernelBVH), true);
+    primitivesBuffer = cl::Buffer(clContext, begin(kernelPrimitives), end(kernelPrimitives), true);
+  }
+  bsdfBuffer = cl::Buffer(clContext, begin(kernelBSDFs), end(kernelBSDFs), true);
+
+  // The device BVH is rebuilt for every render, so there is nothing to keep.
+  kernelSceneValid = !use_lbvh;
+}
+
+bool PathTracer::build_device_bvh(cl::CommandQueue& commandQueue) {
+  kernelBVH.clear();
+  kernelPrimitives.clear();
+  kernelBSDFs.clear();
+  flatBVH = FlatBVH();
+  // Upload the primitives in scene order; the device sorts them.
+  vector<BSDF*> bsdf_pointers;
+  kernelPrimitives.resize(primitives.size());
+  for (size_t i = 0; i < primitives.size(); i++) {
+    primitives[i]->kernel_struct(&kernelPrimitives[i], bsdf_pointers);
+  }
+  for (BSDF *bsdf : bsdf_pointers) {
+    kernel_bsdf_t kernel_bsdf;
+    memset(&kernel_bsdf, 0, sizeof(kernel_bsdf));
+    bsdf->kernel_struct(&kernel_bsdf);
+    kernelBSDFs.push_back(kernel_bsdf);
+  }
+
+  bool ok = true;
+  try {
+    if (!lbvhBuilder) lbvhBuilder = new LBVHBuilder(clContext, clDevice);
+  } catch (...) {
+    ok = false;
+  }
+  if (ok) {
+    cl_int err = CL_SUCCESS;
+    cl::Buffer unsortedPrimitives(clContext, begin(kernelPrimitives),
+                                  end(kernelPrimitives), true, false, &err);
+    ok = err == CL_SUCCESS &&
+         lbvhBuilder->build(commandQueue, unsortedPrimitives,
+                            kernelPrimitives.size(), &primitivesBuffer,
+                            &bvhBuffer) &&
+         (!validateDeviceBVH ||
+          lbvhBuilder->validate(commandQueue, bvhBuffer, kernelPrimitives.size()));
+  }
+
+  if (!ok) {
+    // The host scene is still there to build from, and stays the source of
+    // every later render.
+    fprintf(stdout, "[PathTracer] Device BVH build failed, building the BVH on the host\n");
+    device_bvh = false;
+    kernelPrimitives.clear();
+    kernelBSDFs.clear();
+    return false;
+  }
+  if (lean) release_host_scene();
+  return true;
+}
+
+// Reports how much the resident set shrank since it was `before` bytes.
+static void print_released(const char *what, size_t before) {
+  size_t after = Misc::current_memory_usage();
+  if (before == 0 || after == 0) {
+    fprintf(stdout, "[PathTracer] Released %s: size unavailable\n", what);
+    return;
+  }
+  fprintf(stdout, "[PathTracer] Released %s: %.1f MB\n", what,
+          ((double) before - after) / (1024.0 * 1024.0));
+}
+
+void PathTracer::release_host_scene() {
+  size_t before = Misc::current_memory_usage();
+  delete bvh;
+  bvh = NULL;
+  delete bvh4;
+  bvh4 = NULL;
+  while (!selectionHistory.empty()) selectionHistory.pop();
+  flatBVH = FlatBVH();
+  vector<Primitive *>().swap(kernelSources);
+  vector<Primitive *>().swap(primitives);
+  for (SceneObject *obj : scene->objects) delete obj;
+  vector<SceneObject *>().swap(scene->objects);
+  Misc::release_free_memory();
+  print_released("host scene", before);
+}
+
+void PathTracer::release_kernel_scene() {
+  size_t before = Misc::current_memory_usage();
+  vector<kernel_bvh_node_t>().swap(kernelBVH);
+  vector<kernel_primitive_t>().swap(kernelPrimitives);
+  vector<kernel_bsdf_t>().swap(kernelBSDFs);
+  // Nothing on the host to bring up to date any more
+  kernelSceneValid = false;
+  Misc::release_free_memory();
+  print_released("flattened scene", before);
+}
+
+void PathTracer::prepare_cpu_accel() {
+  if (sceneCache) {
+    prepare_cached_scene();
+    return;
+  }
+  // A device BVH leaves nothing on the host to trace.
+  if (!bvh) build_host_bvh();
+  if (cpuAccel != "bvh4") {
+    if (kernelBVH.empty()) flatten_accel();
+    return;
+  }
+  if (bvh4) return;
+
+  fprintf(stdout, "[PathTracer] Building BVH4... "); fflush(stdout);
+  timer.start();
+  bvh4 = new BVH4(*bvh);
+  timer.stop();
+  fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  fprintf(stdout, "[PathTracer] BVH4: %lu nodes, %lu triangle blocks, %.1f KB, %s traversal\n",
+          bvh4->nodes.size(), bvh4->blocks.size(), bvh4->memory() / 1024.0,
+          bvh4->get_isa());
+}
+
+void PathTracer::prepare_cached_scene() {
+  if (!flatBVH.empty()) return;
+
+  // A cached scene has no host BVH to build a BVH4 from.
+  if (cpuAccel == "bvh4") {
+    fprintf(stdout, "[PathTracer] No BVH4 for a cached scene, tracing the flat BVH\n");
+  }
+
+  // The C++ renderer shades with host BSDFs and samples host lights, so
+  // both are made from the cached records; the primitives are traced as
+  // they are in the cache.
+  for (size_t i = 0; i < sceneCache->bsdf_count(); i++) {
+    cacheBSDFs.push_back(BSDF::from_kernel_struct(sceneCache->bsdfs()[i]));
+  }
+  for (size_t i = 0; i < sceneCache->light_count(); i++) {
+    SceneLight *light = SceneLight::from_kernel_struct(sceneCache->lights()[i]);
+    if (!light) continue;
+    cacheLights.push_back(light);
+    scene->lights.push_back(light);
+  }
+  flatBVH = FlatBVH(sceneCache->bvh(), sceneCache->bvh_count(),
+                    sceneCache->primitives(), NULL, cacheBSDFs.data());
+}
+
+void PathTracer::flatten_accel() {
+  Misc::StartupStage stage("flatten");
+  kernelBVH.clear();
+  kernelPrimitives.clear();
+  kernelBSDFs.clear();
+  bvh->kernel_struct(kernelBVH, kernelPrimitives, kernelBSDFs, &kernelSources);
+  flatBVH = FlatBVH(kernelBVH.data(), kernelBVH.size(), kernelPrimitives.data(),
+                    kernelSources.data());
+  report_kernel_stats(kernelBVH, kernelPrimitives, kernelBSDFs);
+}
+
+void PathTracer::report_kernel_stats(const vector<kernel_bvh_node_t>& kernel_bvh,
+                                     const vector<kernel_primitive_t>& kernel_primitives,
+                                     const vector<kernel_bsdf_t>& kernel_bsdfs) {
+  BVHStats stats = BVHStats::collect(kernel_bvh, kernel_primitives, kernel_bsdfs,
+                                     bvh_params.traversal_cost,
+                                     bvh_params.intersection_cost);
+  stats.print(stdout, "kernel");
+  if (statsFile.empty()) return;
+
+  ofstream out(statsFile.c_str());
+  out << "{";
+  if (bvh) {
+    out << "\"host\": ";
+    hostStats.write_json(out);
+    out << ", ";
+  }
+  out << "\"kernel\": ";
+  stats.write_json(out);
+  out << "}" << endl;
+  if (!out) {
+    fprintf(stderr, "[PathTracer] Failed to write BVH stats to %s\n", statsFile.c_str());
+  }
+}
+
 void PathTracer::build_accel() {
 
   // collect primitives //
   fprintf(stdout, "[PathTracer] Collecting primitives... "); fflush(stdout);
   timer.start();
-  vector<Primitive *> primitives;
+  primitives.clear();
+  instanced = false;
   for (SceneObject *obj : scene->objects) {
     const vector<Primitive *> &obj_prims = obj->get_primitives();
     primitives.reserve(primitives.size() + obj_prims.size());
     primitives.insert(primitives.end(), obj_prims.begin(), obj_prims.end());
+    if (dynamic_cast<StaticScene::InstanceObject *>(obj)) instanced = true;
   }
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
 
+  // The device builds its own BVH at render time; the host one is only
+  // built if the visualizer asks for it. The device builder doesn't know
+  // instances, so scenes with them always get a host BVH.
+  if (!device_bvh || primitives.empty() || instanced) {
+    Misc::StartupStage stage("BVH build");
+    build_host_bvh();
+  }
+  fprintf(stdout, "[PathTracer] Memory: %s resident, %s peak\n",
+          Misc::format_memory(Misc::current_memory_usage()).c_str(),
+          Misc::format_memory(Misc::peak_memory_usage()).c_str());
+}
+
+void PathTracer::tune_bvh() {
+
+  fprintf(stdout, "[PathTracer] Tuning BVH for the %s backend...\n",
+          tuneBackend.c_str());
+  Timer tuningTimer;
+  tuningTimer.start();
+
+  BVHTuner tuner(primitives, bvh_params);
+  BVHTuner::Benchmark benchmark;
+  vector<Ray> rays;
+  if (tuneBackend == "cpu") {
+    BVHBuildParams params = bvh_params;
+    params.optimize_passes = 0;
+    BVHAccel accel(primitives, params);
+    rays = BVHTuner::sample_rays(accel, *camera, TUNING_RAYS);
+    bool wide = cpuAccel == "bvh4";
+    benchmark = [&rays, wide](BVHAccel& accel) {
+      return wide ? BVHTuner::time_cpu_bvh4(accel, rays)
+                  : BVHTuner::time_cpu(accel, rays);
+    };
+  } else {
+    benchmark = [this](BVHAccel& accel) { return time_kernel(accel); };
+  }
+  bvh_params = tuner.tune(benchmark);
+  bvhTuned = true;
+
+  tuningTimer.stop();
+  fprintf(stdout, "[PathTracer] Tuned BVH: leaf size %lu, %lu buckets, cost ratio %.2f (%.4f sec)\n",
+          bvh_params.max_leaf_size, bvh_params.num_buckets,
+          bvh_params.traversal_cost / bvh_params.intersection_cost,
+          tuningTimer.duration());
+}
+
+double PathTracer::time_kernel(BVHAccel& accel) {
+  vector<kernel_bvh_node_t> kernel_bvh;
+  vector<kernel_primitive_t> kernel_primitives;
+  vector<kernel_bsdf_t> kernel_bsdfs;
+  accel.kernel_struct(kernel_bvh, kernel_primitives, kernel_bsdfs);
+  vector<kernel_light_t> kernel_lights;
+  collect_kernel_lights(kernel_lights);
+
+  cl::CommandQueue commandQueue(clContext);
+  cl::Buffer bvh(clContext, begin(kernel_bvh), end(kernel_bvh), true);
+  cl::Buffer prims(clContext, begin(kernel_primitives), end(kernel_primitives), true);
+  cl::Buffer bsdfs(clContext, begin(kernel_bsdfs), end(kernel_bsdfs), true);
+  cl::Buffer lights(clContext, begin(kernel_lights), end(kernel_lights), true);
+  cl::Buffer output(clContext, CL_MEM_WRITE_ONLY,
+                    TUNING_SIZE * TUNING_SIZE * sizeof(cl_float3));
+
+  // The first launch also pays for moving the buffers to the device.
+  double best = INF_D;
+  for (int run = 0; run < 3; run++) {
+    best = min(best, run_kernel(commandQueue, output, TUNING_SIZE, TUNING_SIZE,
+                                KERNEL_LOCAL_SAMPLES, bvh, prims, lights,
+                                kernel_lights.size(), bsdfs));
+  }
+  return best;
+}
+
+void PathTracer::build_host_bvh() {
+
+  if (!tuneBackend.empty() && !bvhTuned && camera) {
+    tune_bvh();
+  }
+
   // build BVH //
   fprintf(stdout, "[PathTracer] Building BVH from %lu primitives... ", primitives.size());
   fflush(stdout);
   timer.start();
-  bvh = new BVHAccel(primitives);
+  bvh = new BVHAccel(primitives, bvh_params);
   timer.stop();
   fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  if (bvh_params.spatial_splits) {
+    fprintf(stdout, "[PathTracer] Spatial splits: %lu references (%.1f%% duplicated)\n",
+            bvh->primitives.size(),
+            100.0 * (bvh->primitives.size() - primitives.size()) /
+            std::max<size_t>(primitives.size(), 1));
+  }
+  fprintf(stdout, "[PathTracer] BVH SAH cost: %.4f\n", bvh->sah_cost());
+
+  if (bvh_params.optimize_passes > 0) {
+    fprintf(stdout, "[PathTracer] Optimizing BVH for up to %lu passes... ",
+            bvh_params.optimize_passes);
+    fflush(stdout);
+    double cost = bvh->sah_cost();
+    timer.start();
+    bvh->optimize(bvh_params.optimize_passes);
+    timer.stop();
+    fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+    // Rays visit nodes roughly in proportion to the SAH cost, so this is an
+    // estimate of the change in traversal time only. Shading is untouched,
+    // so whole renders gain less.
+    fprintf(stdout, "[PathTracer] BVH SAH cost: %.4f -> %.4f (%+.1f%% estimated traversal time)\n",
+            cost, bvh->sah_cost(), 100 * (bvh->sah_cost() / cost - 1));
+  }
+
+  hostStats = BVHStats::collect(*bvh);
+  hostStats.print(stdout, "host");
 
   // initial visualization //
   selectionHistory.push(bvh->get_root());
 }
 
+void PathTracer::refit_accel() {
+
+  // Without a host BVH the device builds a new one for every render, from
+  // the primitives that already moved.
+  if (!bvh) return;
+
+  fprintf(stdout, "[PathTracer] Refitting BVH... "); fflush(stdout);
+  timer.start();
+  bvh->refit();
+  double cost = bvh->sah_cost();
+  timer.stop();
+  fprintf(stdout, "Done! (%.4f sec)\n", timer.duration());
+  fprintf(stdout, "[PathTracer] BVH SAH cost: %.4f (%.4f when built)\n",
+          cost, bvh->build_sah_cost());
+
+  while (!selectionHistory.empty()) selectionHistory.pop();
+  if (cost > bvh->build_sah_cost() * (1 + bvh_params.refit_tolerance)) {
+    fprintf(stdout, "[PathTracer] Refit BVH is too slow, rebuilding\n");
+    delete bvh;
+    bvh = NULL;
+    delete bvh4;
+    bvh4 = NULL;
+    kernelBVH.clear();
+    flatBVH = FlatBVH();
+    kernelSceneValid = false;
+    build_host_bvh();
+    return;
+  }
+  selectionHistory.push(bvh->get_root());
+
+  // The BVH4 doesn't follow refits; the next render builds a new one.
+  delete bvh4;
+  bvh4 = NULL;
+
+  // The flattened arrays are refit whenever they exist, as the C++
+  // renderer traces them even when the device buffers are not current.
+  if (!kernelBVH.empty()) {
+    timer.start();
+    bvh->kernel_refit(kernelBVH, kernelPrimitives, &dirtyNodes, &dirtyPrimitives);
+    timer.stop();
+    fprintf(stdout, "[PathTracer] %lu of %lu nodes and %lu of %lu primitives changed (%.4f sec)\n",
+            dirtyNodes.count, kernelBVH.size(),
+            dirtyPrimitives.count, kernelPrimitives.size(), timer.duration());
+  }
+}
+
 void PathTracer::visualize_accel() const {
 
   glPushAttrib(GL_ENABLE_BIT);
@@ -628,7 +1196,7 @@ void PathTracer::visualize_cell() const {
 
 void PathTracer::key_press(int key) {
 
-  BVHNode *current = selectionHistory.top();
+  BVHNode *current = selectionHistory.empty() ? NULL : selectionHistory.top();
   switch (key) {
   case ']':
       ns_aa *=2;
@@ -684,17 +1252,17 @@ void PathTracer::key_press(int key) {
       fprintf(stdout, "[PathTracer] Aperture decreased to %f.\n", camera->lensRadius);
       break;
   case KEYBOARD_UP:
-      if (current != bvh->get_root()) {
+      if (current && current != bvh->get_root()) {
           selectionHistory.pop();
       }
       break;
   case KEYBOARD_LEFT:
-      if (current->l) {
+      if (current && current->l) {
           selectionHistory.push(current->l);
       }
       break;
   case KEYBOARD_RIGHT:
-      if (current->l) {
+      if (current && current->r) {
           selectionHistory.push(current->r);
       }
       break;
@@ -728,13 +1296,26 @@ void PathTracer::raytrace_tile(int tile_x, int tile_y,
   size_t tile_idx_y = tile_y / imageTileSize;
   size_t num_samples_tile = tile_samples[tile_idx_x + tile_idx_y * num_tiles_w];
 
-  for (size_t y = tile_start_y; y < tile_end_y; y++) {
+  // Packets take a small block of pixels at a time, streams the whole tile.
+  size_t block_size = streamTrace ? max(tile_w, tile_h) : PIXEL_BLOCK_SIZE;
+  vector<PixelSamples> block;
+  for (size_t block_y = tile_start_y; block_y < tile_end_y; block_y += block_size) {
     if (!continueRaytracing) return;
-    for (size_t x = tile_start_x; x < tile_end_x; x++) {
-      // TODO: 4.0
-      // Change from false to true to enable thin lens
-      Spectrum s = raytrace_pixel(x, y, false);
-      sampleBuffer.update_pixel(s, x, y);
+    for (size_t block_x = tile_start_x; block_x < tile_end_x; block_x += block_size) {
+      block.clear();
+      for (size_t y = block_y; y < min(block_y + block_size, tile_end_y); y++) {
+        for (size_t x = block_x; x < min(block_x + block_size, tile_end_x); x++) {
+          block.push_back(PixelSamples(x, y));
+        }
+      }
+      if (streamTrace) {
+        raytrace_stream(block.data(), block.size());
+      } else {
+        raytrace_pixels(block.data(), block.size());
+      }
+      for (const PixelSamples& pixel : block) {
+        sampleBuffer.update_pixel(pixel.total / pixel.num_samples, pixel.x, pixel.y);
+      }
     }
   }
 
@@ -796,8 +1377,11 @@ void PathTracer::worker_thread() {
   if (continueRaytracing && workerDoneCount == numWorkerThreads) {
     timer.stop();
     if (!render_silent)  fprintf(stdout, "\r[PathTracer] Rendering... 100%%! (%.4fs)\n", timer.duration());
-    if (!render_silent)  fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
-    if (!render_silent)  fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    // Only the host BVH counts its rays.
+    if (bvh && bvh->total_rays > 0) {
+      if (!render_silent)  fprintf(stdout, "[PathTracer] BVH traced %llu rays.\n", bvh->total_rays);
+      if (!render_silent)  fprintf(stdout, "[PathTracer] Averaged %f intersection tests per ray.\n", (((double)bvh->total_isects)/bvh->total_rays));
+    }
 
     lock_guard<std::mutex> lk(m_done);
     state = DONE;
@@ -9,6 +9,7 @@
 #include <atomic>
 #include <mutex>
 #include <condition_variable>
+#include <future>
 #include <vector>
 #include <algorithm>
 
@@ -17,6 +18,11 @@
 #include "CGL/timer.h"
 
 #include "bvh.h"
+#include "bvh4.h"
+#include "bvh_stats.h"
+#include "flat_bvh.h"
+#include "lbvh.h"
+#include "scene_cache.h"
 #include "camera.h"
 #include "sampler.h"
 #include "image.h"
@@ -53,6 +59,35 @@ struct WorkItem {
 
 };
 
+/**
+ * Running estimate of a pixel while it is adaptively sampled.
+ */
+struct PixelSamples {
+
+  PixelSamples(size_t x, size_t y)
+      : x(x), y(y), s1(0), s2(0), num_samples(0), done(false) { }
+
+  size_t x;
+  size_t y;
+  Spectrum total;
+  double s1, s2;    ///< sums of the sample illuminances and their squares
+  int num_samples;
+  bool done;        ///< converged, or out of samples
+
+};
+
+/**
+ * A path traced by the stream renderer: the pixel it samples and what the
+ * light its next ray brings back is worth to that pixel.
+ */
+struct StreamPath {
+
+  size_t pixel;         ///< index of its PixelSamples
+  Spectrum throughput;  ///< product of the bsdf weights so far
+  bool add_emission;    ///< count the emission of the next hit, after a delta bsdf
+
+};
+
 /**
  * A pathtracer with BVH accelerator and BVH visualization capabilities.
  * It is always in exactly one of the following states:
@@ -82,7 +117,10 @@ class PathTracer {
              bool direct_hemisphere_sample = false,
              string filename = "",
              double lensRadius = 0.25,
-             double focalDistance = 4.7);
+             double focalDistance = 4.7,
+             const StaticScene::BVHBuildParams& bvh_params =
+                 StaticScene::BVHBuildParams(),
+             bool device_bvh = false);
 
   /**
    * Destructor.
@@ -94,11 +132,96 @@ class PathTracer {
    * If in the INIT state, configures the pathtracer to use the given scene. If
    * configuration is done, transitions to the READY state.
    * This DOES take ownership of the scene, and therefore deletes it if a new
-   * scene is later passed in.
+   * scene is later passed in. Passing in the current scene again after its
+   * primitives moved refits the BVH instead of rebuilding it.
    * \param scene pointer to the new scene to be rendered
    */
   void set_scene(Scene* scene);
 
+  /**
+   * Whether set_scene would take a scene now, i.e. the pathtracer is in
+   * the INIT state.
+   */
+  bool can_set_scene() const { return state == INIT; }
+
+  /**
+   * If in the INIT state, configures the pathtracer to render a flattened
+   * scene from a cache instead of a Scene. The BVH can't be visualized in
+   * this case. This DOES NOT take ownership of the cache, which must stay
+   * open while rendering.
+   * \param cache an open scene cache
+   */
+  void set_scene_cache(const SceneCache* cache);
+
+  /**
+   * Write the flattened current scene to a cache file.
+   * \param path cache file to write
+   * \param key key of the scene, see SceneCache::make_key
+   * \param view camera and bounds to store along with the scene
+   * \return true on success
+   */
+  bool save_scene_cache(const std::string& path, uint64_t key,
+                        const SceneCacheView& view);
+
+  /**
+   * Write the stats of the host and flattened BVH to this file as JSON
+   * whenever the BVH is flattened.
+   * \param path JSON file to write, or empty to not write one
+   */
+  void set_stats_file(const std::string& path) { statsFile = path; }
+
+  /**
+   * Tune the BVH build parameters for a backend before the BVH is built,
+   * see BVHTuner. Tuning happens once per pathtracer.
+   * \param backend "cl" to time the OpenCL kernel, "cpu" to time the C++
+   *        traversal, or empty to build with the given parameters
+   */
+  void set_tuning(const std::string& backend) { tuneBackend = backend; }
+
+  /**
+   * Choose what the C++ renderer traces.
+   * \param accel "flat" for the flattened BVH the OpenCL kernel takes, or
+   *        "bvh4" for a 4-wide SIMD BVH built from the host BVH
+   */
+  void set_cpu_accel(const std::string& accel) { cpuAccel = accel; }
+
+  /**
+   * Trace the rays of a tile in streams, one bounce at a time, instead of
+   * one path at a time. See raytrace_stream.
+   */
+  void set_stream_trace(bool stream) { streamTrace = stream; }
+
+  /**
+   * Render with the C++ path tracer on the worker threads instead of with
+   * the OpenCL kernel.
+   */
+  void set_cpu_render(bool cpu) { cpuRender = cpu; }
+
+  /**
+   * Free the host copies of the scene (the scene objects, BVHs and
+   * flattened arrays) once the device has them, before rendering. Only for
+   * a single render on the device, as nothing is left to render again or
+   * to trace on the CPU.
+   */
+  void set_lean(bool lean) { this->lean = lean; }
+
+  /**
+   * Read back every BVH built on the device and check it before rendering
+   * with it; a BVH that fails falls back to the host builder.
+   */
+  void set_validate_device_bvh(bool validate) { validateDeviceBVH = validate; }
+
+  /**
+   * Parameters the BVH is built with, tuned ones once tuning is done.
+   */
+  const StaticScene::BVHBuildParams& get_bvh_params() const { return bvh_params; }
+
+  /**
+   * Change the BVH build parameters. Takes effect the next time the BVH is
+   * built.
+   */
+  void set_bvh_params(const StaticScene::BVHBuildParams& params) { bvh_params = params; }
+
   /**
    * If in the INIT state, configures the pathtracer to use the given camera. If
    * configuration is done, transitions to the READY state.
@@ -132,6 +255,8 @@ class PathTracer {
 
   /**
    * If the pathtracer is in READY, delete all internal data, transition to INIT.
+   * The BVH and device buffers of the current scene are kept, so that
+   * set_scene can refit them if it is handed the same scene again.
    */
   void clear();
 
@@ -175,11 +300,146 @@ class PathTracer {
   bool has_valid_configuration();
   void init_open_cl(cl_device_type device_type);
 
+  /**
+   * Compile the path tracing kernel. init_open_cl runs this on a thread of
+   * its own, so that the scene loads while the kernel compiles;
+   * wait_for_kernel must be called before pathtracePixel is used.
+   */
+  void build_kernel();
+  void wait_for_kernel();
+
   /**
    * Build acceleration structures.
    */
   void build_accel();
 
+  /**
+   * Build the host BVH over the collected primitives. Only needed up front
+   * when the BVH is not built on the device.
+   */
+  void build_host_bvh();
+
+  /**
+   * Build the BVH of the collected primitives on the device into
+   * bvhBuffer and primitivesBuffer. Returns false, with nothing on the
+   * device, if an OpenCL call fails or the BVH is invalid.
+   */
+  bool build_device_bvh(cl::CommandQueue& commandQueue);
+
+  /**
+   * For a lean render, free the scene objects and BVHs once the scene is
+   * flattened, keeping the lights, which go up with every render; then
+   * the flattened arrays once they are on the device.
+   */
+  void release_host_scene();
+  void release_kernel_scene();
+
+  /**
+   * Update the BVH after the primitives of the current scene moved, and
+   * rebuild it if the refit tree has become too expensive to traverse.
+   */
+  void refit_accel();
+
+  /**
+   * Flatten the host BVH into the kernel arrays, which the C++ renderer
+   * then traverses too.
+   */
+  void flatten_accel();
+
+  /**
+   * Build what the C++ renderer traces, as chosen by cpuAccel, if it
+   * isn't up to date.
+   */
+  void prepare_cpu_accel();
+
+  /**
+   * Set up a cached scene for the C++ renderer: host BSDFs and lights made
+   * from the cached records, and a flat BVH over the cached arrays.
+   */
+  void prepare_cached_scene();
+
+  /**
+   * Ray - scene intersection for the C++ renderer, see BVHAccel::intersect.
+   */
+  bool intersect_scene(const Ray& r) const {
+    return bvh4 ? bvh4->intersect(r) : flatBVH.intersect(r);
+  }
+  bool intersect_scene(const Ray& r, StaticScene::Intersection* i) const {
+    return bvh4 ? bvh4->intersect(r, i) : flatBVH.intersect(r, i);
+  }
+
+  /**
+   * Ray - scene intersection for a packet of coherent rays, see
+   * FlatBVH::intersect. The BVH4 traces them one by one, as it is already
+   * wide for a single ray.
+   */
+  void intersect_scene(const Ray *rays, size_t count, bool *hits,
+                       StaticScene::Intersection *isects = NULL) const {
+    if (!bvh4) {
+      flatBVH.intersect(rays, count, hits, isects);
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      hits[i] = isects ? bvh4->intersect(rays[i], &isects[i])
+                       : bvh4->intersect(rays[i]);
+    }
+  }
+
+  /**
+   * Ray - scene intersection for a large, sorted set of rays, see
+   * FlatBVH::intersect_stream. The BVH4 traces them one by one.
+   */
+  void intersect_stream(const Ray *rays, size_t count, bool *hits,
+                        StaticScene::Intersection *isects = NULL) const {
+    if (!bvh4) {
+      flatBVH.intersect_stream(rays, count, hits, isects);
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      hits[i] = isects ? bvh4->intersect(rays[i], &isects[i])
+                       : bvh4->intersect(rays[i]);
+    }
+  }
+
+  /**
+   * Pick bvh_params by timing candidate trees on tuneBackend.
+   */
+  void tune_bvh();
+
+  /**
+   * Time a small render of the current camera view with the given BVH.
+   */
+  double time_kernel(BVHAccel& accel);
+
+  /**
+   * Lights of the scene, and of the scene cache if there is one, as the
+   * kernel takes them.
+   */
+  void collect_kernel_lights(std::vector<kernel_light_t>& kernel_lights);
+
+  /**
+   * Run pathtrace_pixel over a width x height image and wait for it.
+   * \return seconds the kernel took
+   */
+  double run_kernel(cl::CommandQueue& commandQueue, const cl::Buffer& outputBuffer,
+                    size_t width, size_t height, size_t samples,
+                    const cl::Buffer& bvh, const cl::Buffer& primitives,
+                    const cl::Buffer& lights, size_t num_lights,
+                    const cl::Buffer& bsdfs);
+
+  /**
+   * Print the stats of a flattened BVH and write them to statsFile.
+   */
+  void report_kernel_stats(const std::vector<kernel_bvh_node_t>& kernel_bvh,
+                           const std::vector<kernel_primitive_t>& kernel_primitives,
+                           const std::vector<kernel_bsdf_t>& kernel_bsdfs);
+
+  /**
+   * Make sure the flattened BVH, primitives and BSDFs are on the device,
+   * uploading only what changed since the last render if possible.
+   */
+  void upload_kernel_scene(cl::CommandQueue& commandQueue);
+
   /**
    * Visualize acceleration structures.
    */
@@ -193,7 +453,16 @@ class PathTracer {
   Spectrum estimate_direct_lighting_hemisphere(const Ray &r, const StaticScene::Intersection& isect);
   Spectrum estimate_direct_lighting_importance(const Ray &r, const StaticScene::Intersection& isect);
 
+  /**
+   * Sample every light from a hit, appending the shadow rays to cast and
+   * the light each brings if it isn't occluded, already divided by the
+   * number of samples of its light.
+   */
+  void sample_lights(const Ray &r, const StaticScene::Intersection& isect,
+                     std::vector<Ray>& casts, std::vector<Spectrum>& contributions);
+
   Spectrum est_radiance_global_illumination(const Ray &r); 
+  Spectrum est_radiance_global_illumination(const Ray &r, const StaticScene::Intersection *isect);
   Spectrum zero_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect);
   Spectrum one_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect);
   Spectrum at_least_one_bounce_radiance(const Ray &r, const StaticScene::Intersection& isect);
@@ -207,6 +476,42 @@ class PathTracer {
    */
   Spectrum raytrace_pixel(size_t x, size_t y, bool useThinLens);
 
+  /**
+   * Adaptively sample up to FlatBVH::PACKET_SIZE pixels together, tracing
+   * the camera rays of each round of samples as one packet.
+   */
+  void raytrace_pixels(PixelSamples *pixels, size_t count);
+
+  /**
+   * Adaptively sample any number of pixels together, breadth-first: every
+   * round of samples traces all camera rays as one stream, then all rays of
+   * the next bounce, and so on, with the shadow rays of each bounce in a
+   * stream of their own. Each stream is sorted before it is traced so that
+   * neighbouring rays take similar paths through the BVH.
+   */
+  void raytrace_stream(PixelSamples *pixels, size_t count);
+
+  /**
+   * Shade the hits of one bounce of raytrace_stream, adding what they emit
+   * and their hemisphere-sampled direct light to samples, and queueing the
+   * shadow rays of their light samples and the rays of the next bounce.
+   */
+  void shade_stream(const std::vector<Ray>& rays, const std::vector<StreamPath>& paths,
+                    const bool *hits, const StaticScene::Intersection *isects,
+                    bool camera_rays, std::vector<Spectrum>& samples,
+                    std::vector<Ray>& shadow_rays, std::vector<StreamPath>& shadow_paths,
+                    std::vector<Ray>& next_rays, std::vector<StreamPath>& next_paths);
+
+  /**
+   * Generate a camera ray through a random point of the pixel.
+   */
+  Ray generate_pixel_ray(size_t x, size_t y);
+
+  /**
+   * Add a sample to the estimate of a pixel and check for convergence.
+   */
+  void add_pixel_sample(PixelSamples& pixel, const Spectrum& sample);
+
   /**
    * Raytrace a tile of the scene and update the frame buffer. Is run
    * in a worker thread.
@@ -264,6 +569,39 @@ class PathTracer {
   // Components //
 
   BVHAccel* bvh;                 ///< BVH accelerator aggregate
+  StaticScene::BVHBuildParams bvh_params; ///< BVH build settings
+  std::vector<StaticScene::Primitive*> primitives; ///< all scene primitives
+  bool device_bvh;               ///< build the BVH on the OpenCL device
+  bool instanced;                ///< the scene has instances of shared meshes
+  LBVHBuilder* lbvhBuilder;      ///< device BVH builder, created on demand
+  bool validateDeviceBVH;        ///< check each device BVH before using it
+  StaticScene::BVHStats hostStats; ///< stats of bvh when it was built
+  std::string statsFile;         ///< where to write BVH stats as JSON
+  std::string tuneBackend;       ///< backend to tune bvh_params for, if any
+  bool bvhTuned;                 ///< bvh_params were tuned already
+
+  // Flattened scene as last uploaded, kept across renders so that a refit
+  // only has to send the nodes and primitives that changed.
+  std::vector<kernel_bvh_node_t> kernelBVH;
+  std::vector<kernel_primitive_t> kernelPrimitives;
+  std::vector<kernel_bsdf_t> kernelBSDFs;
+  std::vector<StaticScene::Primitive*> kernelSources; ///< per primitive record
+  StaticScene::FlatBVH flatBVH;  ///< C++ traversal of kernelBVH
+  std::string cpuAccel;          ///< what the C++ renderer traces
+  StaticScene::BVH4* bvh4;       ///< 4-wide BVH, if cpuAccel is "bvh4"
+  bool streamTrace;              ///< raytrace_tile uses raytrace_stream
+  bool cpuRender;                ///< render with worker_thread, not the kernel
+  bool lean;                     ///< free the host scene after uploading it
+  cl::Buffer bvhBuffer;
+  cl::Buffer primitivesBuffer;
+  cl::Buffer bsdfBuffer;
+  bool kernelSceneValid;         ///< device buffers match the host BVH
+  const SceneCache* sceneCache;  ///< flattened scene used instead of bvh
+  std::vector<BSDF*> cacheBSDFs; ///< host BSDF of every cached BSDF record
+  std::vector<StaticScene::SceneLight*> cacheLights; ///< host light of every
+                                                     ///< cached light record
+  StaticScene::DirtyRanges dirtyNodes;      ///< nodes changed by a refit
+  StaticScene::DirtyRanges dirtyPrimitives; ///< primitives changed by a refit
   EnvironmentLight *envLight;    ///< environment map
   Sampler2D* gridSampler;        ///< samples unit grid
   Sampler3D* hemisphereSampler;  ///< samples unit hemisphere
@@ -307,7 +645,9 @@ class PathTracer {
 
   double lensRadius, focalDistance;
   cl::Context clContext;
+  cl::Device clDevice;
   cl::Kernel pathtracePixel;
+  std::future<void> kernelBuild;  ///< compiles pathtracePixel, until waited on
   // cl::CommandQueue commandQueue;
 };
 
@@ -0,0 +1,282 @@
+#include "scene_cache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace CGL {
+
+// Bump whenever the layout of the file or of the kernel structs changes in a
+// way the struct sizes don't catch.
+static const uint32_t SCENE_CACHE_VERSION = 4;
+static const char SCENE_CACHE_MAGIC[8] = {'C', 'G', 'L', 'S', 'C', 'E', 'N', 'E'};
+
+// Arrays start on cache line boundaries.
+static const size_t SCENE_CACHE_ALIGNMENT = 64;
+
+struct SceneCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t node_size;
+  uint32_t primitive_size;
+  uint32_t bsdf_size;
+  uint32_t light_size;
+  uint32_t view_size;
+  uint64_t key;
+  uint64_t offsets[4];  ///< nodes, primitives, bsdfs, lights
+  uint64_t counts[4];
+  SceneCacheView view;
+};
+
+static const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t FNV_PRIME = 1099511628211ULL;
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+template <typename T>
+static uint64_t fnv1a(uint64_t hash, const T& value) {
+  return fnv1a(hash, &value, sizeof(T));
+}
+
+static size_t align(size_t offset) {
+  return (offset + SCENE_CACHE_ALIGNMENT - 1) / SCENE_CACHE_ALIGNMENT
+         * SCENE_CACHE_ALIGNMENT;
+}
+
+// Maps a whole file read-only. Without mmap the file is read into a buffer
+// instead. An empty file gives a NULL data pointer.
+static bool map_file(const std::string& path, void **data, size_t *size) {
+  *data = NULL;
+  *size = 0;
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    ::close(fd);
+    return false;
+  }
+  if (st.st_size > 0) {
+    void *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+      ::close(fd);
+      return false;
+    }
+    *data = file;
+    *size = st.st_size;
+  }
+  ::close(fd);
+  return true;
+#else
+  FILE *file = fopen(path.c_str(), "rb");
+  if (!file) return false;
+  long length = -1;
+  if (fseek(file, 0, SEEK_END) == 0) length = ftell(file);
+  if (length < 0 || fseek(file, 0, SEEK_SET) != 0) {
+    fclose(file);
+    return false;
+  }
+  if (length > 0) {
+    *data = malloc(length);
+    if (!*data || fread(*data, 1, length, file) != (size_t) length) {
+      free(*data);
+      *data = NULL;
+      fclose(file);
+      return false;
+    }
+    *size = length;
+  }
+  fclose(file);
+  return true;
+#endif
+}
+
+static void unmap_file(void *data, size_t size) {
+  if (!data) return;
+#ifndef _WIN32
+  munmap(data, size);
+#else
+  free(data);
+#endif
+}
+
+SceneCache::SceneCache()
+    : data(NULL), size(0), bvh_nodes(NULL), prims(NULL), bsdf_records(NULL),
+      light_records(NULL), bvh_nodes_count(0), prims_count(0),
+      bsdf_records_count(0), light_records_count(0) { }
+
+SceneCache::~SceneCache() {
+  close();
+}
+
+void SceneCache::close() {
+  unmap_file(data, size);
+  data = NULL;
+  size = 0;
+}
+
+bool SceneCache::make_key(const std::string& scene_path,
+                          const StaticScene::BVHBuildParams& params,
+                          bool instancing, uint64_t *key) {
+  uint64_t hash;
+  if (!hash_file(scene_path, &hash)) return false;
+  *key = make_key(hash, params, instancing);
+  return true;
+}
+
+bool SceneCache::hash_file(const std::string& path, uint64_t *hash) {
+  void *file;
+  size_t file_size;
+  if (!map_file(path, &file, &file_size)) return false;
+  *hash = fnv1a(FNV_OFFSET_BASIS, file, file_size);
+  unmap_file(file, file_size);
+  return true;
+}
+
+uint64_t SceneCache::make_key(uint64_t scene_hash,
+                              const StaticScene::BVHBuildParams& params,
+                              bool instancing) {
+  uint64_t hash = scene_hash;
+
+  // Everything that changes the tree, field by field so that struct padding
+  // doesn't end up in the key.
+  hash = fnv1a(hash, (uint64_t) params.max_leaf_size);
+  hash = fnv1a(hash, (uint64_t) params.num_buckets);
+  hash = fnv1a(hash, params.traversal_cost);
+  hash = fnv1a(hash, params.intersection_cost);
+  hash = fnv1a(hash, (uint8_t) params.spatial_splits);
+  if (params.spatial_splits) {
+    hash = fnv1a(hash, params.max_duplication);
+    hash = fnv1a(hash, params.spatial_split_alpha);
+  }
+  hash = fnv1a(hash, (uint32_t) params.layout);
+  hash = fnv1a(hash, (uint64_t) params.optimize_passes);
+
+  // Instancing changes the primitives and the tree above them.
+  hash = fnv1a(hash, (uint8_t) instancing);
+  return hash;
+}
+
+bool SceneCache::open(const std::string& path, uint64_t key) {
+  close();
+
+  if (!map_file(path, &data, &size)) return false;
+  if (size < sizeof(SceneCacheHeader)) {
+    close();
+    return false;
+  }
+
+  const SceneCacheHeader *header = (const SceneCacheHeader *) data;
+  if (memcmp(header->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) ||
+      header->version != SCENE_CACHE_VERSION ||
+      header->node_size != sizeof(kernel_bvh_node_t) ||
+      header->primitive_size != sizeof(kernel_primitive_t) ||
+      header->bsdf_size != sizeof(kernel_bsdf_t) ||
+      header->light_size != sizeof(kernel_light_t) ||
+      header->view_size != sizeof(SceneCacheView) ||
+      header->key != key) {
+    close();
+    return false;
+  }
+
+  const uint64_t sizes[4] = {
+    sizeof(kernel_bvh_node_t), sizeof(kernel_primitive_t),
+    sizeof(kernel_bsdf_t), sizeof(kernel_light_t)
+  };
+  for (int i = 0; i < 4; i++) {
+    if (header->offsets[i] > size ||
+        header->counts[i] > (size - header->offsets[i]) / sizes[i]) {
+      close();
+      return false;
+    }
+  }
+
+  const char *base = (const char *) data;
+  bvh_nodes = (const kernel_bvh_node_t *) (base + header->offsets[0]);
+  prims = (const kernel_primitive_t *) (base + header->offsets[1]);
+  bsdf_records = (const kernel_bsdf_t *) (base + header->offsets[2]);
+  light_records = (const kernel_light_t *) (base + header->offsets[3]);
+  bvh_nodes_count = header->counts[0];
+  prims_count = header->counts[1];
+  bsdf_records_count = header->counts[2];
+  light_records_count = header->counts[3];
+  return true;
+}
+
+const SceneCacheView& SceneCache::view() const {
+  return ((const SceneCacheHeader *) data)->view;
+}
+
+bool SceneCache::write(const std::string& path, uint64_t key,
+                       const SceneCacheView& view,
+                       const std::vector<kernel_bvh_node_t>& bvh,
+                       const std::vector<kernel_primitive_t>& primitives,
+                       const std::vector<kernel_bsdf_t>& bsdfs,
+                       const std::vector<kernel_light_t>& lights) {
+  SceneCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+  header.version = SCENE_CACHE_VERSION;
+  header.node_size = sizeof(kernel_bvh_node_t);
+  header.primitive_size = sizeof(kernel_primitive_t);
+  header.bsdf_size = sizeof(kernel_bsdf_t);
+  header.light_size = sizeof(kernel_light_t);
+  header.view_size = sizeof(SceneCacheView);
+  header.key = key;
+  header.view = view;
+
+  const void *arrays[4] = {
+    bvh.data(), primitives.data(), bsdfs.data(), lights.data()
+  };
+  size_t bytes[4] = {
+    bvh.size() * sizeof(kernel_bvh_node_t),
+    primitives.size() * sizeof(kernel_primitive_t),
+    bsdfs.size() * sizeof(kernel_bsdf_t),
+    lights.size() * sizeof(kernel_light_t)
+  };
+  header.counts[0] = bvh.size();
+  header.counts[1] = primitives.size();
+  header.counts[2] = bsdfs.size();
+  header.counts[3] = lights.size();
+  size_t offset = sizeof(header);
+  for (int i = 0; i < 4; i++) {
+    offset = align(offset);
+    header.offsets[i] = offset;
+    offset += bytes[i];
+  }
+
+  std::string tmp_path = path + ".tmp";
+  FILE *file = fopen(tmp_path.c_str(), "wb");
+  if (!file) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+  static const char zeros[SCENE_CACHE_ALIGNMENT] = {0};
+  size_t written = sizeof(header);
+  for (int i = 0; i < 4 && ok; i++) {
+    size_t padding = header.offsets[i] - written;
+    ok = fwrite(zeros, 1, padding, file) == padding &&
+         fwrite(arrays[i], 1, bytes[i], file) == bytes[i];
+    written = header.offsets[i] + bytes[i];
+  }
+  ok = (fclose(file) == 0) && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace CGL
@@ -0,0 +1,116 @@
+#ifndef CGL_SCENE_CACHE_H
+#define CGL_SCENE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "bvh.h"
+#include "kernel_types.h"
+
+namespace CGL {
+
+/**
+ * What the application needs besides the flattened arrays to set up the
+ * view of a cached scene: the scene camera, if the file has one, and the
+ * scene bounds the camera is placed around.
+ */
+struct SceneCacheView {
+  uint32_t has_camera;
+  float h_fov, v_fov, n_clip, f_clip;
+  double view_dir[3];
+  double bbox_min[3];
+  double bbox_max[3];
+};
+
+/**
+ * A flattened scene (BVH nodes, primitives, BSDFs and lights, exactly as
+ * pathtrace_pixel takes them) stored in a binary file.
+ * The file is keyed by a hash of the scene file and of the BVH build
+ * parameters, and also records a format version and the sizes of the kernel
+ * structs, so a stale or foreign cache is never used. A cache is read with
+ * mmap (or into a buffer on Windows): a hit costs no parsing, BVH build or
+ * flattening, and the arrays are copied to the device straight from the
+ * mapped pages.
+ */
+class SceneCache {
+ public:
+
+  SceneCache();
+  ~SceneCache();
+
+  /**
+   * Hash the contents of a scene file together with the BVH parameters.
+   * \param scene_path the COLLADA file the scene is loaded from
+   * \param params parameters the BVH is built with
+   * \param instancing whether shared meshes are instanced
+   * \param key receives the cache key
+   * \return false if the scene file can't be read
+   */
+  static bool make_key(const std::string& scene_path,
+                       const StaticScene::BVHBuildParams& params,
+                       bool instancing, uint64_t *key);
+
+  /**
+   * Same as above, for a scene file that was already hashed.
+   */
+  static uint64_t make_key(uint64_t scene_hash,
+                           const StaticScene::BVHBuildParams& params,
+                           bool instancing);
+
+  /**
+   * Hash the contents of a scene file.
+   * \return false if the file can't be read
+   */
+  static bool hash_file(const std::string& path, uint64_t *hash);
+
+  /**
+   * Map a cache file.
+   * \return true if the file exists, is complete and matches the key and the
+   *         kernel structs of this build
+   */
+  bool open(const std::string& path, uint64_t key);
+
+  /**
+   * Write a flattened scene to a cache file. The file is written next to
+   * path and renamed over it, so readers never see a partial cache.
+   * \return true on success
+   */
+  static bool write(const std::string& path, uint64_t key,
+                    const SceneCacheView& view,
+                    const std::vector<kernel_bvh_node_t>& bvh,
+                    const std::vector<kernel_primitive_t>& primitives,
+                    const std::vector<kernel_bsdf_t>& bsdfs,
+                    const std::vector<kernel_light_t>& lights);
+
+  const SceneCacheView& view() const;
+
+  const kernel_bvh_node_t *bvh() const { return bvh_nodes; }
+  const kernel_primitive_t *primitives() const { return prims; }
+  const kernel_bsdf_t *bsdfs() const { return bsdf_records; }
+  const kernel_light_t *lights() const { return light_records; }
+
+  size_t bvh_count() const { return bvh_nodes_count; }
+  size_t primitive_count() const { return prims_count; }
+  size_t bsdf_count() const { return bsdf_records_count; }
+  size_t light_count() const { return light_records_count; }
+
+ private:
+  void close();
+
+  void *data;   ///< start of the mapping (or buffer)
+  size_t size;  ///< length of the mapping
+
+  const kernel_bvh_node_t *bvh_nodes;
+  const kernel_primitive_t *prims;
+  const kernel_bsdf_t *bsdf_records;
+  const kernel_light_t *light_records;
+  size_t bvh_nodes_count;
+  size_t prims_count;
+  size_t bsdf_records_count;
+  size_t light_records_count;
+};
+
+}  // namespace CGL
+
+#endif  // CGL_SCENE_CACHE_H
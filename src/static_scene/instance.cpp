@@ -0,0 +1,139 @@
+#include "instance.h"
+
+#include <cstring>
+
+#include "GL/glew.h"
+
+using std::vector;
+
+namespace CGL { namespace StaticScene {
+
+// InstancedMesh //
+
+InstancedMesh::InstancedMesh(const Collada::PolymeshInfo& polymesh, BSDF* bsdf,
+                             const BVHBuildParams& params) {
+  mesh = new Mesh(polymesh, Matrix4x4::identity(), bsdf);
+  bvh = new BVHAccel(mesh->get_primitives(), params);
+}
+
+InstancedMesh::~InstancedMesh() {
+  delete bvh;
+  delete mesh;
+}
+
+static const uint64_t HASH_OFFSET_BASIS = 14695981039346656037ULL;
+static const uint64_t HASH_PRIME = 1099511628211ULL;
+
+// FNV-1a over 64-bit words rather than bytes; all the arrays hashed here
+// hold 8-byte values. The multiply only carries bits upward, so the high
+// half is folded back down after each word, or meshes whose coordinates
+// differ only in sign or exponent would collide.
+template <class T>
+static uint64_t hash_words(uint64_t hash, const vector<T>& values) {
+  static_assert(sizeof(T) % sizeof(uint64_t) == 0, "hashed in words");
+  const size_t words = values.size() * sizeof(T) / sizeof(uint64_t);
+  const unsigned char *data = reinterpret_cast<const unsigned char*>(values.data());
+  hash = (hash ^ (uint64_t) values.size()) * HASH_PRIME;
+  for (size_t i = 0; i < words; i++) {
+    uint64_t word;
+    memcpy(&word, data + i * sizeof(word), sizeof(word));
+    hash = (hash ^ word) * HASH_PRIME;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+uint64_t InstancedMesh::hash(const Collada::PolymeshInfo& polymesh) {
+  uint64_t hash = HASH_OFFSET_BASIS;
+  hash = hash_words(hash, polymesh.vertices);
+  hash = hash_words(hash, polymesh.polygon_offsets);
+  hash = hash_words(hash, polymesh.vertex_indices);
+  return hash;
+}
+
+bool InstancedMesh::same_geometry(const Collada::PolymeshInfo& a,
+                                  const Collada::PolymeshInfo& b) {
+  if (&a == &b) return true;
+  if (a.vertices.size() != b.vertices.size() ||
+      a.polygon_offsets != b.polygon_offsets ||
+      a.vertex_indices != b.vertex_indices) {
+    return false;
+  }
+  // Bitwise, as the hash sees them
+  return a.vertices.empty() ||
+         !memcmp(a.vertices.data(), b.vertices.data(),
+                 a.vertices.size() * sizeof(Vector3D));
+}
+
+// Instance //
+
+Instance::Instance(const InstancedMesh* mesh, const Matrix4x4& transform)
+    : mesh(mesh), object_to_world(transform),
+      world_to_object(transform.inv()) {
+  BBox local = mesh->get_bvh()->get_bbox();
+  if (local.empty()) return;
+  for (int corner = 0; corner < 8; corner++) {
+    Vector3D p((corner & 1) ? local.max.x : local.min.x,
+               (corner & 2) ? local.max.y : local.min.y,
+               (corner & 4) ? local.max.z : local.min.z);
+    bbox.expand((object_to_world * Vector4D(p, 1)).projectTo3D());
+  }
+}
+
+Ray Instance::to_object(const Ray& r) const {
+  Ray local((world_to_object * Vector4D(r.o, 1)).to3D(),
+            (world_to_object * Vector4D(r.d, 0)).to3D(), r.max_t, r.depth);
+  local.min_t = r.min_t;
+  return local;
+}
+
+bool Instance::intersect(const Ray& r) const {
+  Ray local = to_object(r);
+  if (!mesh->get_bvh()->intersect(local)) return false;
+  r.max_t = local.max_t;
+  return true;
+}
+
+bool Instance::intersect(const Ray& r, Intersection* i) const {
+  Ray local = to_object(r);
+  if (!mesh->get_bvh()->intersect(local, i)) return false;
+  r.max_t = local.max_t;
+  // Normals go with the inverse transpose of the transform.
+  const Vector3D& n = i->n;
+  Vector3D world;
+  for (int a = 0; a < 3; a++) {
+    world[a] = world_to_object(0, a) * n.x + world_to_object(1, a) * n.y +
+               world_to_object(2, a) * n.z;
+  }
+  i->n = world.unit();
+  return true;
+}
+
+void Instance::draw(const Color& c, float alpha) const {
+  glPushMatrix();
+  glMultMatrixd(&object_to_world(0, 0));
+  for (Primitive *p : mesh->get_bvh()->primitives) p->draw(c, alpha);
+  glPopMatrix();
+}
+
+void Instance::drawOutline(const Color& c, float alpha) const {
+  glPushMatrix();
+  glMultMatrixd(&object_to_world(0, 0));
+  for (Primitive *p : mesh->get_bvh()->primitives) p->drawOutline(c, alpha);
+  glPopMatrix();
+}
+
+void Instance::kernel_struct(kernel_primitive_t *kernel_primitive,
+                             std::vector<BSDF*>& /* bsdf_pointers */) {
+  kernel_primitive->type = KERNEL_PRIMITIVE_TYPE_INSTANCE;
+  kernel_instance_t *instance = &kernel_primitive->instance;
+  for (int row = 0; row < 3; row++) {
+    for (int col = 0; col < 4; col++) {
+      instance->world_to_object[row].s[col] = world_to_object(row, col);
+    }
+  }
+  instance->root = 0;
+}
+
+} // namespace StaticScene
+} // namespace CGL
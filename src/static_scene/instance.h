@@ -0,0 +1,139 @@
+#ifndef CGL_STATICSCENE_INSTANCE_H
+#define CGL_STATICSCENE_INSTANCE_H
+
+#include <memory>
+#include <stdint.h>
+
+#include "../bvh.h"
+#include "../collada/polymesh_info.h"
+#include "object.h"
+
+namespace CGL { namespace StaticScene {
+
+/**
+ * A mesh that several objects of a scene share. It is kept once, in its own
+ * space, together with a BVH over its triangles that is only built once.
+ * Instances place it in the world; when the scene is flattened for the
+ * kernel, the BVH of the mesh becomes the bottom level under the leaves of
+ * the instances.
+ */
+class InstancedMesh {
+ public:
+
+  /**
+   * Build the mesh from a polygon mesh, as Mesh does, but without moving it
+   * into world space, and its BVH.
+   */
+  InstancedMesh(const Collada::PolymeshInfo& polymesh, BSDF* bsdf,
+                const BVHBuildParams& params);
+
+  ~InstancedMesh();
+
+  BVHAccel* get_bvh() const { return bvh; }
+
+  BSDF* get_bsdf() const { return mesh->get_bsdf(); }
+
+  /**
+   * Hash of the vertices and polygons of a polygon mesh, for finding meshes
+   * that are the same; meshes with equal hashes still have to be compared
+   * with same_geometry.
+   */
+  static uint64_t hash(const Collada::PolymeshInfo& polymesh);
+
+  /**
+   * Whether two polygon meshes have the same vertices and polygons, so that
+   * one InstancedMesh can stand for both.
+   */
+  static bool same_geometry(const Collada::PolymeshInfo& a,
+                            const Collada::PolymeshInfo& b);
+
+ private:
+  InstancedMesh(const InstancedMesh&);
+  InstancedMesh& operator=(const InstancedMesh&);
+
+  Mesh* mesh;     ///< the triangles, in the space of the mesh
+  BVHAccel* bvh;  ///< BVH over the triangles of mesh
+};
+
+/**
+ * An InstancedMesh placed in the world by a transform. Rays are moved into
+ * the space of the mesh to be traced through its BVH, with their direction
+ * left unnormalized so that a hit is at the same t in both spaces.
+ */
+class Instance : public Primitive {
+ public:
+
+  Instance(const InstancedMesh* mesh, const Matrix4x4& transform);
+
+  /**
+   * Get the world space bounding box of the instance, which bounds the
+   * transformed box of the mesh.
+   */
+  BBox get_bbox() const { return bbox; }
+
+  bool intersect(const Ray& r) const;
+
+  /**
+   * Ray - Instance intersection 2.
+   * The intersection reports the triangle of the mesh that was hit, with
+   * the normal brought into world space.
+   */
+  bool intersect(const Ray& r, Intersection* i) const;
+
+  BSDF* get_bsdf() const { return mesh->get_bsdf(); }
+
+  /**
+   * Draw the triangles of the mesh with OpenGL, transformed (for
+   * visualizer)
+   */
+  void draw(const Color& c, float alpha) const;
+  void drawOutline(const Color& c, float alpha) const;
+
+  /**
+   * The kernel record of an instance holds its transform. The root of the
+   * BVH of the mesh is set by BVHAccel::kernel_struct, which appends that
+   * BVH to the flattened arrays, and is left at 0 here. The BSDFs are those
+   * of the mesh's triangles, which add them, so bsdf_pointers is not used.
+   */
+  void kernel_struct(kernel_primitive_t *kernel_primitive,
+                     std::vector<BSDF*>& bsdf_pointers);
+
+  const InstancedMesh* get_mesh() const { return mesh; }
+
+ private:
+
+  // The ray in the space of the mesh
+  Ray to_object(const Ray& r) const;
+
+  const InstancedMesh* mesh;
+  Matrix4x4 object_to_world;
+  Matrix4x4 world_to_object;
+  BBox bbox;
+};
+
+/**
+ * A scene object for one instance of a shared mesh, which the objects for
+ * the other instances keep alive too.
+ */
+class InstanceObject : public SceneObject {
+ public:
+
+  InstanceObject(const std::shared_ptr<InstancedMesh>& mesh,
+                 const Matrix4x4& transform)
+    : mesh(mesh), instance(mesh.get(), transform) { }
+
+  std::vector<Primitive*> get_primitives() const {
+    return std::vector<Primitive*>(1, const_cast<Instance*>(&instance));
+  }
+
+  BSDF* get_bsdf() const { return mesh->get_bsdf(); }
+
+ private:
+  std::shared_ptr<InstancedMesh> mesh;
+  Instance instance;
+};
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_STATICSCENE_INSTANCE_H
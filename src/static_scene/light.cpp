@@ -6,6 +6,28 @@
 
 namespace CGL { namespace StaticScene {
 
+SceneLight *SceneLight::from_kernel_struct(const kernel_light_t& kernel_light) {
+  const kernel_light_union_t& u = kernel_light.u;
+  switch (kernel_light.type) {
+    case KERNEL_LIGHT_TYPE_DIRECTIONAL:
+      return new DirectionalLight(kernelSpectrumToCGL(u.directional.radiance),
+                                  -kernelVectorToCGL(u.directional.dir_to_light));
+    case KERNEL_LIGHT_TYPE_HEMISPHERE:
+      return new InfiniteHemisphereLight(kernelSpectrumToCGL(u.hemisphere.radiance));
+    case KERNEL_LIGHT_TYPE_POINT:
+      return new PointLight(kernelSpectrumToCGL(u.point.radiance),
+                            kernelVectorToCGL(u.point.position));
+    case KERNEL_LIGHT_TYPE_AREA:
+      return new AreaLight(kernelSpectrumToCGL(u.area.radiance),
+                           kernelVectorToCGL(u.area.position),
+                           kernelVectorToCGL(u.area.direction),
+                           kernelVectorToCGL(u.area.dim_x),
+                           kernelVectorToCGL(u.area.dim_y));
+    default:
+      return NULL;
+  }
+}
+
 // Directional Light //
 
 DirectionalLight::DirectionalLight(const Spectrum& rad,
@@ -2,6 +2,7 @@
 #include "sphere.h"
 #include "triangle.h"
 
+#include <algorithm>
 #include <vector>
 #include <iostream>
 #include <unordered_map>
@@ -26,6 +27,7 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     vertexI++;
   }
 
+  num_vertices = vertexI;
   positions = new Vector3D[vertexI];
   normals   = new Vector3D[vertexI];
   for (int i = 0; i < vertexI; i++) {
@@ -33,26 +35,133 @@ Mesh::Mesh(const HalfedgeMesh& mesh, BSDF* bsdf) {
     normals[i]   = verts[i]->normal;
   }
 
+  // Faces of more than three sides are fanned from the vertex of their
+  // halfedge, the way the PolymeshInfo constructor below fans polygons, so
+  // both give the same triangles.
+  size_t num_triangles = 0;
+  for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
+    num_triangles += f->degree() - 2;
+  }
+  triangles.reset(num_triangles);
   for (FaceCIter f = mesh.facesBegin(); f != mesh.facesEnd(); f++) {
     HalfedgeCIter h = f->halfedge();
-    indices.push_back(vertexLabels[&*h->vertex()]);
-    indices.push_back(vertexLabels[&*h->next()->vertex()]);
-    indices.push_back(vertexLabels[&*h->next()->next()->vertex()]);
+    int a = vertexLabels[&*h->vertex()];
+    for (HalfedgeCIter e = h->next(); e->next() != h; e = e->next()) {
+      triangles.add(this, a, vertexLabels[&*e->vertex()],
+                    vertexLabels[&*e->next()->vertex()]);
+    }
   }
 
   this->bsdf = bsdf;
 
 }
 
+Mesh::Mesh(const Collada::PolymeshInfo& polymesh, const Matrix4x4& transform,
+           BSDF* bsdf) {
+
+  num_vertices = polymesh.vertices.size();
+  positions = new Vector3D[num_vertices];
+  normals   = new Vector3D[num_vertices];
+  for (size_t i = 0; i < num_vertices; i++) {
+    positions[i] = (transform * Vector4D(polymesh.vertices[i], 1)).projectTo3D();
+    normals[i]   = Vector3D();
+  }
+
+  const vector<size_t>& offsets = polymesh.polygon_offsets;
+  const vector<size_t>& indices = polymesh.vertex_indices;
+  size_t num_triangles = 0;
+  for (size_t p = 0; p < polymesh.num_polygons(); p++) {
+    size_t degree = offsets[p + 1] - offsets[p];
+    if (degree >= 3) num_triangles += degree - 2;
+  }
+
+  // Boundary edges are the ones whose reverse no polygon has. A vertex v on
+  // the boundary gets the boundary neighbour c with the boundary edge c -> v.
+  // The edges leaving each vertex are listed together to find reverses.
+  vector<size_t> first(num_vertices + 1, 0);
+  for (size_t i = 0; i < indices.size(); i++) first[indices[i] + 1]++;
+  for (size_t v = 0; v < num_vertices; v++) first[v + 1] += first[v];
+  vector<size_t> targets(indices.size());
+  vector<size_t> filled(first.begin(), first.end() - 1);
+  for (size_t p = 0; p < polymesh.num_polygons(); p++) {
+    for (size_t i = offsets[p]; i < offsets[p + 1]; i++) {
+      size_t j = i + 1 < offsets[p + 1] ? i + 1 : offsets[p];
+      targets[filled[indices[i]]++] = indices[j];
+    }
+  }
+  vector<size_t> boundary(num_vertices, num_vertices);
+  for (size_t a = 0; a < num_vertices; a++) {
+    for (size_t e = first[a]; e < first[a + 1]; e++) {
+      size_t b = targets[e];
+      const size_t *begin = &targets[0] + first[b];
+      const size_t *end = &targets[0] + first[b + 1];
+      if (std::find(begin, end, a) == end) boundary[b] = a;
+    }
+  }
+
+  // Sums over the corners of each vertex of the corner that follows it
+  vector<Vector3D> next_sums(num_vertices);
+  vector<size_t> degrees(num_vertices, 0);
+
+  triangles.reset(num_triangles);
+  for (size_t p = 0; p < polymesh.num_polygons(); p++) {
+    const size_t *corners = &indices[offsets[p]];
+    size_t degree = offsets[p + 1] - offsets[p];
+    if (degree < 3) continue;
+
+    // Each corner adds the area vector of the triangle it spans with the
+    // next two corners.
+    for (size_t i = 0; i < degree; i++) {
+      const Vector3D& pi = positions[corners[i]];
+      const Vector3D& pj = positions[corners[(i + 1) % degree]];
+      const Vector3D& pk = positions[corners[(i + 2) % degree]];
+      normals[corners[i]] += cross(pj - pi, pk - pi);
+      next_sums[corners[i]] += pj;
+      degrees[corners[i]]++;
+    }
+
+    // The fan starts at the last corner, which is where the halfedge build
+    // starts a face, so triangle meshes come out as they do from there.
+    for (size_t i = 0; i + 2 < degree; i++) {
+      triangles.add(this, corners[degree - 1], corners[i], corners[i + 1]);
+    }
+  }
+
+  // Vertex::computeNormal walks a boundary vertex v the other way, around
+  // its boundary neighbour c and through the boundary loop, adding
+  // cross(c - v, n - v) for each corner n that follows c. Renders have
+  // always used those normals, so they are kept.
+  for (size_t v = 0; v < num_vertices; v++) {
+    size_t c = boundary[v];
+    if (c == num_vertices) continue;
+    const Vector3D& pv = positions[v];
+    Vector3D next_sum = next_sums[c];
+    size_t count = degrees[c];
+    if (boundary[c] != num_vertices) {
+      next_sum += positions[boundary[c]];
+      count++;
+    }
+    normals[v] = cross(positions[c] - pv, next_sum - count * pv);
+  }
+
+  for (size_t i = 0; i < num_vertices; i++) {
+    normals[i].normalize();
+  }
+
+  this->bsdf = bsdf;
+
+}
+
+Mesh::~Mesh() {
+  delete[] positions;
+  delete[] normals;
+}
+
 vector<Primitive*> Mesh::get_primitives() const {
 
-  vector<Primitive*> primitives;
-  size_t num_triangles = indices.size() / 3;
-  for (size_t i = 0; i < num_triangles; ++i) {
-    Triangle* tri = new Triangle(this, indices[i * 3],
-                                       indices[i * 3 + 1],
-                                       indices[i * 3 + 2]);
-    primitives.push_back(tri);
+  vector<Primitive*> primitives(triangles.size());
+  for (size_t i = 0; i < triangles.size(); ++i) {
+    primitives[i] = const_cast<Triangle*>(&triangles[i]);
   }
   return primitives;
 }
@@ -61,6 +170,26 @@ BSDF* Mesh::get_bsdf() const {
   return bsdf;
 }
 
+bool Mesh::can_update_positions(const HalfedgeMesh& mesh) const {
+  return mesh.nVertices() == num_vertices;
+}
+
+bool Mesh::update_positions(const HalfedgeMesh& mesh) {
+
+  // Vertices are visited in the same order as in the constructor, so the
+  // labels still match as long as no vertex was added or removed.
+  if (!can_update_positions(mesh)) return false;
+
+  size_t i = 0;
+  for (VertexCIter it = mesh.verticesBegin(); it != mesh.verticesEnd(); it++) {
+    positions[i] = it->position;
+    normals[i]   = it->normal;
+    i++;
+  }
+  return true;
+
+}
+
 // Sphere object //
 
 SphereObject::SphereObject(const Vector3D& o, double r, BSDF* bsdf) {
@@ -68,12 +197,18 @@ SphereObject::SphereObject(const Vector3D& o, double r, BSDF* bsdf) {
   this->o = o;
   this->r = r;
   this->bsdf = bsdf;
+
+  spheres.reset(1);
+  spheres.add(this, o, r);
   
 }
 
+// Out of line, where Sphere is complete, so that the pool can destroy it.
+SphereObject::~SphereObject() { }
+
 std::vector<Primitive*> SphereObject::get_primitives() const {
   std::vector<Primitive*> primitives;
-  primitives.push_back(new Sphere(this,o,r));
+  primitives.push_back(const_cast<Sphere*>(&spheres[0]));
   return primitives;
 }
 
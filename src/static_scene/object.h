@@ -1,11 +1,16 @@
 #ifndef CGL_STATICSCENE_OBJECT_H
 #define CGL_STATICSCENE_OBJECT_H
 
+#include "../collada/polymesh_info.h"
 #include "../halfEdgeMesh.h"
 #include "scene.h"
+#include "primitive_pool.h"
 
 namespace CGL { namespace StaticScene {
 
+class Triangle;
+class Sphere;
+
 /**
  * A triangle mesh object.
  */
@@ -20,9 +25,27 @@ class Mesh : public SceneObject {
    */
   Mesh(const HalfedgeMesh& mesh, BSDF* bsdf);
 
+  /**
+   * Constructor.
+   * Construct a static mesh straight from a polygon mesh, for renders that
+   * never edit it, without building a halfedge mesh. The vertices are
+   * transformed into world space, the polygons are split into fans of
+   * triangles, and the vertex normals are the area weighted averages of the
+   * polygons around each vertex, as in HalfedgeMesh.
+   */
+  Mesh(const Collada::PolymeshInfo& polymesh, const Matrix4x4& transform,
+       BSDF* bsdf);
+
+  /**
+   * Destructor.
+   * Frees the vertex data and the triangles, which must no longer be used.
+   */
+  ~Mesh();
+
   /**
    * Get all the primitives (Triangle) in the mesh.
-   * Note that Triangle reference the mesh for the actual data.
+   * Note that Triangle reference the mesh for the actual data. The
+   * triangles are owned by the mesh and stored in one block.
    * \return all the primitives in the mesh
    */
   vector<Primitive*> get_primitives() const;
@@ -33,6 +56,22 @@ class Mesh : public SceneObject {
    */
   BSDF* get_bsdf() const;
 
+  /**
+   * Whether update_positions can bring this mesh up to date with the halfedge
+   * mesh it was built from, i.e. whether it still has as many vertices.
+   */
+  bool can_update_positions(const HalfedgeMesh& mesh) const;
+
+  /**
+   * Copy new vertex positions and normals from the halfedge mesh this mesh
+   * was built from. The triangles keep referring to the same arrays, so
+   * they see the new positions right away.
+   * \param mesh the same halfedge mesh, with unchanged connectivity
+   * \return false if the vertex count no longer matches, in which case
+   *         nothing is updated and the mesh has to be rebuilt
+   */
+  bool update_positions(const HalfedgeMesh& mesh);
+
   Vector3D *positions;  ///< position array
   Vector3D *normals;    ///< normal array
 
@@ -40,7 +79,9 @@ class Mesh : public SceneObject {
 
   BSDF* bsdf; ///< BSDF of surface material
 
-  vector<size_t> indices;  ///< triangles defined by indices
+  size_t num_vertices; ///< size of the position and normal arrays
+
+  PrimitivePool<Triangle> triangles; ///< triangles of the mesh
 
 };
 
@@ -56,9 +97,12 @@ class SphereObject : public SceneObject {
   */
   SphereObject(const Vector3D& o, double r, BSDF* bsdf);
 
+  ~SphereObject();
+
   /**
   * Get all the primitives (Sphere) in the sphere object.
-  * Note that Sphere reference the sphere object for the actual data.
+  * Note that Sphere reference the sphere object for the actual data. The
+  * sphere is owned by the sphere object.
   * \return all the primitives in the sphere object
   */
   std::vector<Primitive*> get_primitives() const;
@@ -76,6 +120,8 @@ private:
 
   BSDF* bsdf; ///< BSDF of the sphere objects' surface material
 
+  PrimitivePool<Sphere> spheres; ///< the one sphere primitive
+
 }; // class SphereObject
 
 
@@ -22,6 +22,25 @@ class Primitive {
    */
   virtual BBox get_bbox() const = 0;
 
+  /**
+   * Get the bounding box of the part of the primitive that lies within the
+   * slab lo <= p[axis] <= hi. Used for spatial splits when building a BVH.
+   * The default clips the bounding box of the whole primitive, which is
+   * conservative; primitives that can do better should override it.
+   * \param axis axis the slab is perpendicular to
+   * \param lo lower bound of the slab
+   * \param hi upper bound of the slab
+   * \return bounding box of the clipped primitive, empty if it misses
+   */
+  virtual BBox get_clipped_bbox(int axis, double lo, double hi) const {
+    BBox bb = get_bbox();
+    bb.min[axis] = std::max(bb.min[axis], lo);
+    bb.max[axis] = std::min(bb.max[axis], hi);
+    if (bb.min[axis] > bb.max[axis]) return BBox();
+    bb.extent = bb.max - bb.min;
+    return bb;
+  }
+
   /**
    * Ray - Primitive intersection.
    * Check if the given ray intersects with the primitive, no intersection
@@ -0,0 +1,75 @@
+#ifndef CGL_STATICSCENE_PRIMITIVE_POOL_H
+#define CGL_STATICSCENE_PRIMITIVE_POOL_H
+
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+namespace CGL { namespace StaticScene {
+
+/**
+ * Fixed-capacity storage for the primitives of one scene object.
+ * All primitives live in a single allocation, so that building a large
+ * mesh doesn't make one heap allocation per face, and they are destroyed
+ * together with the object that owns the pool. Pointers to the primitives
+ * stay valid for the lifetime of the pool.
+ */
+template <class T>
+class PrimitivePool {
+ public:
+
+  PrimitivePool() : data(NULL), count(0), capacity(0) { }
+
+  ~PrimitivePool() { clear(); }
+
+  /**
+   * Destroy all primitives and make room for a new set.
+   * \param n number of primitives that will be added
+   */
+  void reset(size_t n) {
+    clear();
+    if (n == 0) return;
+    data = static_cast<T*>(::operator new(n * sizeof(T)));
+    capacity = n;
+  }
+
+  /**
+   * Construct a primitive in the next free slot; there must be one.
+   */
+  template <class... Args>
+  T* add(Args&&... args) {
+    return new (data + count++) T(std::forward<Args>(args)...);
+  }
+
+  size_t size() const { return count; }
+
+  T& operator[](size_t i) { return data[i]; }
+  const T& operator[](size_t i) const { return data[i]; }
+
+  /**
+   * Bytes allocated for the primitives.
+   */
+  size_t memory() const { return capacity * sizeof(T); }
+
+ private:
+
+  PrimitivePool(const PrimitivePool&);
+  PrimitivePool& operator=(const PrimitivePool&);
+
+  void clear() {
+    for (size_t i = 0; i < count; i++) data[i].~T();
+    ::operator delete(data);
+    data = NULL;
+    count = capacity = 0;
+  }
+
+  T* data;          ///< storage for capacity primitives
+  size_t count;     ///< number of primitives constructed so far
+  size_t capacity;  ///< number of primitives the storage can hold
+
+};
+
+} // namespace StaticScene
+} // namespace CGL
+
+#endif // CGL_STATICSCENE_PRIMITIVE_POOL_H
@@ -14,6 +14,8 @@ namespace CGL { namespace StaticScene {
 class SceneObject {
  public:
 
+  virtual ~SceneObject() { }
+
   /**
    * Get all the primitives in the scene object.
    * \return a vector of all the primitives in the scene object
@@ -34,12 +36,21 @@ class SceneObject {
  */
 class SceneLight {
  public:
+  virtual ~SceneLight() { }
+
   virtual Spectrum sample_L(const Vector3D& p, Vector3D* wi,
                             float* distToLight, float* pdf) const = 0;
   virtual bool is_delta_light() const = 0;
 
   virtual void kernel_struct(kernel_light_t *kernel_light) = 0;
 
+  /**
+   * Device->Host struct conversion, for scenes that only exist as kernel
+   * records (e.g. a scene cache). Returns a new light, or NULL for a record
+   * of unknown type.
+   */
+  static SceneLight *from_kernel_struct(const kernel_light_t& kernel_light);
+
 };
 
 
@@ -52,6 +63,13 @@ struct Scene {
         const std::vector<SceneLight *>& lights)
     : objects(objects), lights(lights) { }
 
+  // The objects own their primitives, which go away with the scene.
+  // Lights may be shared (e.g. the path tracer's environment light), so
+  // they are left alone.
+  ~Scene() {
+    for (SceneObject *obj : objects) delete obj;
+  }
+
   // kept to make sure they don't get deleted, in case the
   //  primitives depend on them (e.g. Mesh Triangles).
   std::vector<SceneObject*> objects;
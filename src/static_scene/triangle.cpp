@@ -18,6 +18,32 @@ BBox Triangle::get_bbox() const {
 
 }
 
+BBox Triangle::get_clipped_bbox(int axis, double lo, double hi) const {
+
+  // Walk the edges of the triangle and keep the vertices inside the slab,
+  // plus the points where an edge crosses one of its planes.
+  const Vector3D* p[3] = { &mesh->positions[v1], &mesh->positions[v2],
+                           &mesh->positions[v3] };
+  BBox bb;
+  for (int i = 0; i < 3; i++) {
+    const Vector3D& a = *p[i];
+    const Vector3D& b = *p[(i + 1) % 3];
+    double da = a[axis], db = b[axis];
+    if (da >= lo && da <= hi) bb.expand(a);
+    if (da == db) continue;
+    double planes[2] = { lo, hi };
+    for (double plane : planes) {
+      if ((da < plane && db > plane) || (da > plane && db < plane)) {
+        Vector3D q = a + (b - a) * ((plane - da) / (db - da));
+        q[axis] = plane;
+        bb.expand(q);
+      }
+    }
+  }
+  return bb;
+
+}
+
 bool Triangle::intersect(const Ray& r) const {
 
   // TODO (Part 1.3):
@@ -32,7 +58,6 @@ bool Triangle::intersect(const Ray& r, Intersection *isect) const {
   // place, the Intersection data should be updated accordingly
 
   Vector3D p1(mesh->positions[v1]), p2(mesh->positions[v2]), p3(mesh->positions[v3]);
-  Vector3D n1(mesh->normals[v1]), n2(mesh->normals[v2]), n3(mesh->normals[v3]);
 
   Vector3D p1p2 = p2 - p1,
            p1p3 = p3 - p1,
@@ -59,17 +84,27 @@ bool Triangle::intersect(const Ray& r, Intersection *isect) const {
     return false;
   }
 
-  if (isect) {
-    isect->t = t;
-    isect->primitive = this;
-    isect->n = (1.0 - u - v) * n1 + u * n2 + v * n3;
-    isect->bsdf = get_bsdf();
-  }
+  if (isect) fill_intersection(t, u, v, isect);
 
   r.max_t = t;
   return true;
 }
 
+void Triangle::fill_intersection(double t, double u, double v,
+                                 Intersection *isect) const {
+  Vector3D n1(mesh->normals[v1]), n2(mesh->normals[v2]), n3(mesh->normals[v3]);
+  isect->t = t;
+  isect->primitive = this;
+  isect->n = (1.0 - u - v) * n1 + u * n2 + v * n3;
+  isect->bsdf = get_bsdf();
+}
+
+void Triangle::get_vertices(Vector3D* p1, Vector3D* p2, Vector3D* p3) const {
+  *p1 = mesh->positions[v1];
+  *p2 = mesh->positions[v2];
+  *p3 = mesh->positions[v3];
+}
+
 void Triangle::draw(const Color& c, float alpha) const {
   glColor4f(c.r, c.g, c.b, alpha);
   glBegin(GL_TRIANGLES);
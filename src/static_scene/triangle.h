@@ -32,6 +32,12 @@ namespace CGL { namespace StaticScene {
     */
   BBox get_bbox() const;
 
+  /**
+   * Get the bounding box of the part of the triangle within a slab.
+   * The triangle is clipped exactly against both planes of the slab.
+   */
+  BBox get_clipped_bbox(int axis, double lo, double hi) const;
+
    /**
     * Ray - Triangle intersection.
     * Check if the given ray intersects with the triangle, no intersection
@@ -54,6 +60,21 @@ namespace CGL { namespace StaticScene {
     */
   bool intersect(const Ray& r, Intersection* i) const;
 
+  /**
+   * Fill in the intersection information for a hit that was found
+   * elsewhere, such as by the BVH on its packed copy of the triangle.
+   * \param t time of intersection
+   * \param u barycentric coordinate of the second vertex
+   * \param v barycentric coordinate of the third vertex
+   * \param i address to store intersection info
+   */
+  void fill_intersection(double t, double u, double v, Intersection* i) const;
+
+  /**
+   * Get the positions of the three vertices.
+   */
+  void get_vertices(Vector3D* p1, Vector3D* p2, Vector3D* p3) const;
+
   /**
    * Get BSDF.
    * In the case of a triangle, the surface material BSDF is stored in 